@@ -0,0 +1,687 @@
+#include "ahci.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#include "estd/bits.h"
+#include "estd/print.h"
+#include "interrupts.h"
+#include "io.h"
+#include "klibc.h"
+#include "mm.h"
+#include "pci.h"
+#include "processor.h"
+#include "system.h"
+#include "timer.h"
+#include "units.h"
+
+// Reference: Serial ATA AHCI 1.3.1 Specification
+// https://www.intel.com/content/dam/www/public/us/en/documents/technical-specifications/serial-ata-ahci-spec-rev1-3-1.pdf
+
+// Physical regions per command, so that a request of (MAX_PRDS - 1) pages fits however
+// it's aligned
+static constexpr size_t MAX_PRDS = 64;
+
+// Each disk gets at most this many queue workers, however deep its command queue is. How
+// many commands are actually outstanding depends on the callers: ext2 reads a batch of
+// up to 32 missing file blocks at a time (which merging may turn into fewer commands),
+// and other threads can add their own reads while it waits.
+static constexpr size_t MAX_QUEUE_WORKERS = 8;
+
+// Iterations of ~1us to wait for the command engine to start or stop
+static constexpr size_t ENGINE_TIMEOUT = 500000;
+
+// How long to wait for a command to complete, in timer ticks, or in iterations of ~1us
+// when polling
+static constexpr uint64_t COMMAND_TIMEOUT = 500;
+static constexpr size_t COMMAND_TIMEOUT_POLLS = 5000000;
+
+// Iterations of ~1us to hold a COMRESET for (the spec's minimum is 1ms)
+static constexpr size_t COMRESET_DELAY = 1000;
+
+struct PortRegisters {
+    volatile uint32_t clb;   // Command list base address
+    volatile uint32_t clbu;  // ... upper 32 bits
+    volatile uint32_t fb;    // FIS base address
+    volatile uint32_t fbu;   // ... upper 32 bits
+    volatile uint32_t is;    // Interrupt status
+    volatile uint32_t ie;    // Interrupt enable
+    volatile uint32_t cmd;   // Command and status
+    volatile uint32_t _reserved0;
+    volatile uint32_t tfd;   // Task file data
+    volatile uint32_t sig;   // Signature
+    volatile uint32_t ssts;  // SATA status
+    volatile uint32_t sctl;  // SATA control
+    volatile uint32_t serr;  // SATA error
+    volatile uint32_t sact;  // SATA active (native command queuing tags)
+    volatile uint32_t ci;    // Command issue
+    volatile uint32_t sntf;
+    volatile uint32_t fbs;
+    volatile uint32_t _reserved1[15];
+};
+
+static_assert(sizeof(PortRegisters) == 0x80);
+static_assert(offsetof(PortRegisters, tfd) == 0x20);
+static_assert(offsetof(PortRegisters, ci) == 0x38);
+
+struct HBARegisters {
+    volatile uint32_t cap;  // Host capabilities
+    volatile uint32_t ghc;  // Global host control
+    volatile uint32_t is;   // Interrupt status, one bit per port
+    volatile uint32_t pi;   // Ports implemented
+    volatile uint32_t vs;   // Version
+    volatile uint32_t _unused[0x3B];
+    PortRegisters ports[32];
+};
+
+static_assert(offsetof(HBARegisters, ports) == 0x100);
+
+// HBA capabilities
+static constexpr uint32_t CAP_S64A = 1 << 31;  // 64-bit addressing
+static constexpr uint32_t CAP_SNCQ = 1 << 30;  // Native command queuing
+
+// Global host control
+static constexpr uint32_t GHC_IE = 1 << 1;   // Interrupt enable
+static constexpr uint32_t GHC_AE = 1 << 31;  // AHCI enable
+
+// Port command and status
+static constexpr uint32_t PORT_CMD_ST = 1 << 0;    // Start
+static constexpr uint32_t PORT_CMD_FRE = 1 << 4;   // FIS receive enable
+static constexpr uint32_t PORT_CMD_FR = 1 << 14;   // FIS receive running
+static constexpr uint32_t PORT_CMD_CR = 1 << 15;   // Command list running
+
+// Port interrupt status / enable
+static constexpr uint32_t PORT_IS_DHRS = 1 << 0;   // Device to host register FIS
+static constexpr uint32_t PORT_IS_PSS = 1 << 1;    // PIO setup FIS
+static constexpr uint32_t PORT_IS_DSS = 1 << 2;    // DMA setup FIS
+static constexpr uint32_t PORT_IS_SDBS = 1 << 3;   // Set device bits FIS (NCQ)
+static constexpr uint32_t PORT_IS_TFES = 1 << 30;  // Task file error
+static constexpr uint32_t PORT_INTERRUPTS =
+    PORT_IS_DHRS | PORT_IS_PSS | PORT_IS_DSS | PORT_IS_SDBS | PORT_IS_TFES;
+
+// Task file data
+static constexpr uint32_t TFD_ERR = 1 << 0;
+static constexpr uint32_t TFD_DRQ = 1 << 3;
+static constexpr uint32_t TFD_BSY = 1 << 7;
+
+static constexpr uint32_t SSTS_DET_PRESENT = 3;  // Device present, link established
+static constexpr uint32_t SATA_SIG_ATA = 0x00000101;
+
+enum AHCICommand : uint8_t {
+    ReadDMAExt = 0x25,
+    WriteDMAExt = 0x35,
+    ReadFPDMAQueued = 0x60,
+    WriteFPDMAQueued = 0x61,
+    Identify = 0xEC,
+};
+
+struct CommandHeader {
+    uint16_t flags;  // Command FIS length in dwords, plus the bits below
+    uint16_t prdtLength;
+    volatile uint32_t prdByteCount;
+    uint64_t commandTable;  // 128-byte aligned
+    uint32_t _reserved[4];
+};
+
+static_assert(sizeof(CommandHeader) == 32);
+
+static constexpr uint16_t HEADER_WRITE = 1 << 6;
+static constexpr uint16_t HEADER_PREFETCH = 1 << 7;
+
+struct PhysicalRegion {
+    uint64_t address;
+    uint32_t _reserved;
+    uint32_t byteCount;  // Bits 0-21: byte count - 1
+};
+
+static_assert(sizeof(PhysicalRegion) == 16);
+
+struct __attribute__((packed)) FISRegisterH2D {
+    uint8_t type;
+    uint8_t flags;
+    uint8_t command;
+    uint8_t featureLow;
+    uint8_t lba0;
+    uint8_t lba1;
+    uint8_t lba2;
+    uint8_t device;
+    uint8_t lba3;
+    uint8_t lba4;
+    uint8_t lba5;
+    uint8_t featureHigh;
+    uint8_t countLow;
+    uint8_t countHigh;
+    uint8_t icc;
+    uint8_t control;
+    uint32_t _reserved;
+};
+
+static_assert(sizeof(FISRegisterH2D) == 20);
+
+static constexpr uint8_t FIS_TYPE_REG_H2D = 0x27;
+static constexpr uint8_t FIS_FLAG_COMMAND = 1 << 7;
+static constexpr uint8_t DEVICE_LBA = 1 << 6;
+
+struct CommandTable {
+    uint8_t commandFIS[64];
+    uint8_t atapiCommand[16];
+    uint8_t _reserved[48];
+    PhysicalRegion prdt[MAX_PRDS];
+};
+
+static_assert(sizeof(CommandTable) % 128 == 0);
+
+// Layout of the per-port memory: the command list must be 1KiB-aligned, the received
+// FIS area 256-byte aligned, and each command table 128-byte aligned
+static constexpr size_t COMMAND_LIST_OFFSET = 0;
+static constexpr size_t RECEIVED_FIS_OFFSET = 32 * sizeof(CommandHeader);
+static constexpr size_t COMMAND_TABLES_OFFSET = RECEIVED_FIS_OFFSET + 2 * KiB;
+
+AHCIPort::AHCIPort(HBARegisters* hba, size_t portNumber)
+: _hba(hba),
+  _regs(&hba->ports[portNumber]),
+  _portNumber(portNumber),
+  _slotAvailable(new Blocker),
+  _completion(new Blocker) {}
+
+AHCIPort::~AHCIPort() {
+    if (_memoryPages) {
+        stopEngine();
+        mm.pageFree(_memory, _memoryPages);
+    }
+}
+
+bool AHCIPort::stopEngine() {
+    _regs->cmd = _regs->cmd & ~PORT_CMD_ST;
+    for (size_t i = 0; i < ENGINE_TIMEOUT && (_regs->cmd & PORT_CMD_CR); ++i) {
+        iowait();
+    }
+
+    _regs->cmd = _regs->cmd & ~PORT_CMD_FRE;
+    for (size_t i = 0; i < ENGINE_TIMEOUT && (_regs->cmd & PORT_CMD_FR); ++i) {
+        iowait();
+    }
+
+    if (_regs->cmd & (PORT_CMD_CR | PORT_CMD_FR)) {
+        println("ahci: port {}: timed out stopping command engine", _portNumber);
+        return false;
+    }
+
+    return true;
+}
+
+bool AHCIPort::startEngine() {
+    _regs->cmd = _regs->cmd | PORT_CMD_FRE;
+
+    // The device has to be idle before commands can be issued
+    for (size_t i = 0; i < ENGINE_TIMEOUT && (_regs->tfd & (TFD_BSY | TFD_DRQ)); ++i) {
+        iowait();
+    }
+
+    if (_regs->tfd & (TFD_BSY | TFD_DRQ)) {
+        println("ahci: port {}: device is busy", _portNumber);
+        return false;
+    }
+
+    _regs->cmd = _regs->cmd | PORT_CMD_ST;
+    return true;
+}
+
+bool AHCIPort::init() {
+    if (bitRange(_regs->ssts, 0, 4) != SSTS_DET_PRESENT) return false;
+
+    // TODO: support ATAPI devices
+    if (_regs->sig != SATA_SIG_ATA) return false;
+
+    if (!stopEngine()) return false;
+
+    uint32_t cap = _hba->cap;
+    size_t numCommandSlots = bitRange(cap, 8, 5) + 1;
+
+    _memoryPages = ceilDiv(COMMAND_TABLES_OFFSET + numCommandSlots * sizeof(CommandTable),
+                           PAGE_SIZE);
+    _memory = mm.pageAlloc(_memoryPages);
+
+    // Without 64-bit support, the controller can only address the first 4GiB
+    if (!(cap & CAP_S64A)) {
+        ASSERT(_memory.value + _memoryPages * PAGE_SIZE <= 4 * GiB);
+    }
+
+    uint8_t* memory = mm.physicalToVirtual(_memory).ptr<uint8_t>();
+    memset(memory, 0, _memoryPages * PAGE_SIZE);
+    _commandList = reinterpret_cast<CommandHeader*>(memory + COMMAND_LIST_OFFSET);
+    _commandTables = reinterpret_cast<CommandTable*>(memory + COMMAND_TABLES_OFFSET);
+
+    for (size_t i = 0; i < numCommandSlots; ++i) {
+        _commandList[i].commandTable = mm.virtualToPhysical(&_commandTables[i]).value;
+    }
+
+    PhysicalAddress commandList = _memory + COMMAND_LIST_OFFSET;
+    PhysicalAddress receivedFIS = _memory + RECEIVED_FIS_OFFSET;
+    _regs->clb = lowBits(commandList.value, 32);
+    _regs->clbu = highBits(commandList.value, 32);
+    _regs->fb = lowBits(receivedFIS.value, 32);
+    _regs->fbu = highBits(receivedFIS.value, 32);
+
+    // Clear any stale errors and interrupts
+    _regs->serr = 0xFFFFFFFF;
+    _regs->is = 0xFFFFFFFF;
+    _regs->ie = PORT_INTERRUPTS;
+
+    if (!startEngine()) return false;
+
+    // Only slot 0 until we know how deep the device's queue is
+    _freeSlots = 1;
+    if (!identify()) return false;
+
+    _freeSlots = _numSlots == 32 ? 0xFFFFFFFF : (1U << _numSlots) - 1;
+    return true;
+}
+
+bool AHCIPort::identify() {
+    uint16_t deviceInfo[SECTOR_SIZE / 2];
+
+    // The device writes the result by DMA, so it can't go straight to the stack, which
+    // may not be in the linear map (during boot, it isn't)
+    PhysicalAddress page = mm.pageAlloc();
+    if (!(_hba->cap & CAP_S64A)) {
+        ASSERT(page.value + PAGE_SIZE <= 4 * GiB);
+    }
+
+    uint8_t* buffer = mm.physicalToVirtual(page).ptr<uint8_t>();
+
+    {
+        SpinlockLocker locker(_lock);
+        _freeSlots &= ~1U;
+        buildCommand(0, Identify, false, buffer, sizeof(deviceInfo), 0, 0);
+        issueLocked(0);
+        bool success = waitLocked(0, false);
+        _freeSlots |= 1;
+
+        if (!success) {
+            mm.pageFree(page);
+            println("ahci: port {}: identify failed", _portNumber);
+            return false;
+        }
+    }
+
+    memcpy(deviceInfo, buffer, sizeof(deviceInfo));
+    mm.pageFree(page);
+
+    // Model name is a 40-byte ascii string with the bytes of each word swapped
+    for (size_t i = 0; i < 20; ++i) {
+        _modelName[2 * i] = highBits(deviceInfo[27 + i], 8);
+        _modelName[2 * i + 1] = lowBits(deviceInfo[27 + i], 8);
+    }
+
+    // Only 48-bit addressing is supported, since it's required by the commands we use
+    if (!checkBit(deviceInfo[83], 10)) {
+        println("ahci: port {}: drive does not support 48-bit LBA", _portNumber);
+        return false;
+    }
+
+    memcpy(&_numSectors, &deviceInfo[100], 8);
+
+    // Native command queuing needs support from both the controller and the drive
+    size_t numCommandSlots = bitRange(_hba->cap, 8, 5) + 1;
+    _ncq = (_hba->cap & CAP_SNCQ) && checkBit(deviceInfo[76], 8);
+    if (_ncq) {
+        size_t driveDepth = bitRange(deviceInfo[75], 0, 5) + 1;
+        _numSlots = min(numCommandSlots, driveDepth);
+    } else {
+        _numSlots = 1;
+    }
+
+    return true;
+}
+
+void AHCIPort::buildCommand(size_t slot, uint8_t command, bool write, uint8_t* buffer,
+                            size_t numBytes, uint64_t start, size_t count) {
+    CommandTable& table = _commandTables[slot];
+    memset(table.commandFIS, 0, sizeof(table.commandFIS));
+
+    FISRegisterH2D& fis = *reinterpret_cast<FISRegisterH2D*>(table.commandFIS);
+    fis.type = FIS_TYPE_REG_H2D;
+    fis.flags = FIS_FLAG_COMMAND;
+    fis.command = command;
+
+    if (command != Identify) {
+        fis.lba0 = bitRange(start, 0, 8);
+        fis.lba1 = bitRange(start, 8, 8);
+        fis.lba2 = bitRange(start, 16, 8);
+        fis.lba3 = bitRange(start, 24, 8);
+        fis.lba4 = bitRange(start, 32, 8);
+        fis.lba5 = bitRange(start, 40, 8);
+        fis.device = DEVICE_LBA;
+    }
+
+    if (command == ReadFPDMAQueued || command == WriteFPDMAQueued) {
+        // Queued commands carry the sector count in the features register, and the tag
+        // in the count register
+        fis.featureLow = lowBits(count, 8);
+        fis.featureHigh = bitRange(count, 8, 8);
+        fis.countLow = slot << 3;
+    } else if (command == ReadDMAExt || command == WriteDMAExt) {
+        fis.countLow = lowBits(count, 8);
+        fis.countHigh = bitRange(count, 8, 8);
+    }
+
+    // The buffer is virtually contiguous, but may not be physically contiguous, so add
+    // a region for each physically contiguous run
+    size_t n = 0;
+    uint8_t* ptr = buffer;
+    size_t remaining = numBytes;
+    while (remaining > 0) {
+        uint64_t pageOffset = reinterpret_cast<uint64_t>(ptr) % PAGE_SIZE;
+        size_t length = min(remaining, PAGE_SIZE - pageOffset);
+        PhysicalAddress physAddr = mm.virtualToPhysical(ptr);
+        ASSERT(physAddr.value != 0 && physAddr.value % 2 == 0);
+
+        PhysicalRegion* last = n > 0 ? &table.prdt[n - 1] : nullptr;
+        if (last && last->address + lowBits(last->byteCount, 22) + 1 == physAddr.value) {
+            last->byteCount += length;
+        } else {
+            ASSERT(n < MAX_PRDS);
+            table.prdt[n++] = {physAddr.value, 0, static_cast<uint32_t>(length - 1)};
+        }
+
+        ptr += length;
+        remaining -= length;
+    }
+
+    CommandHeader& header = _commandList[slot];
+    header.flags = sizeof(FISRegisterH2D) / 4 | (write ? HEADER_WRITE : HEADER_PREFETCH);
+    header.prdtLength = n;
+    header.prdByteCount = 0;
+}
+
+void AHCIPort::issueLocked(size_t slot) {
+    uint32_t bit = 1U << slot;
+    _issued |= bit;
+    _failed &= ~bit;
+
+    // Identify is only issued before queuing is enabled
+    if (_ncq) {
+        _regs->sact = bit;
+    }
+
+    _regs->ci = bit;
+}
+
+bool AHCIPort::resetLink() {
+    // Setting DET to 1 sends COMRESET to the device, until it's set back to 0
+    _regs->sctl = (_regs->sctl & ~0xFU) | 1;
+    for (size_t i = 0; i < COMRESET_DELAY; ++i) {
+        iowait();
+    }
+
+    _regs->sctl = _regs->sctl & ~0xFU;
+    auto linkUp = [this]() { return bitRange(_regs->ssts, 0, 4) == SSTS_DET_PRESENT; };
+    for (size_t i = 0; i < ENGINE_TIMEOUT && !linkUp(); ++i) {
+        iowait();
+    }
+
+    _regs->serr = 0xFFFFFFFF;
+    if (!linkUp()) {
+        println("ahci: port {}: link did not come back after reset", _portNumber);
+        return false;
+    }
+
+    return true;
+}
+
+void AHCIPort::recoverLocked() {
+    // Restarting the command engine clears the error and every outstanding command. A
+    // device which is still busy (e.g., with a command which timed out) has to be reset
+    // before the engine can start again.
+    stopEngine();
+    _regs->serr = 0xFFFFFFFF;
+    _regs->is = 0xFFFFFFFF;
+
+    if (_regs->tfd & (TFD_BSY | TFD_DRQ)) {
+        resetLink();
+    }
+
+    startEngine();
+}
+
+void AHCIPort::processCompletionsLocked() {
+    uint32_t status = _regs->is;
+    _regs->is = status;
+
+    if (status & PORT_IS_TFES) {
+        uint32_t tfd = _regs->tfd;
+        println("ahci: port {}: task file error (status {:X}, error {:X})", _portNumber,
+                lowBits(tfd, 8), bitRange(tfd, 8, 8));
+
+        // We can't tell which of the queued commands failed, so fail all of them
+        // TODO: read the NCQ error log and retry the others
+        _failed |= _issued;
+        _issued = 0;
+        recoverLocked();
+        return;
+    }
+
+    // Queued commands stay active until a set device bits FIS clears their tag, and
+    // other commands until the controller clears their issue bit
+    uint32_t active = _regs->sact | _regs->ci;
+    _issued &= active;
+}
+
+void AHCIPort::irqHandler() {
+    SpinlockLocker locker(_lock);
+    processCompletionsLocked();
+    sys.scheduler().wakeThreads(_completion);
+}
+
+bool AHCIPort::waitLocked(size_t slot, bool canSleep) {
+    uint32_t bit = 1U << slot;
+    uint64_t deadline = sys.timer().tickCount() + COMMAND_TIMEOUT;
+    size_t polls = 0;
+    while (_issued & bit) {
+        bool expired = canSleep ? sys.timer().tickCount() >= deadline
+                                : polls++ == COMMAND_TIMEOUT_POLLS;
+        if (expired) {
+            println("ahci: port {}: command timed out", _portNumber);
+
+            // Restarting the engine abandons every outstanding command, so all of them
+            // fail, and their waiters are woken to find out
+            _failed |= _issued;
+            _issued = 0;
+            recoverLocked();
+            sys.scheduler().wakeThreads(_completion);
+            break;
+        }
+
+        if (canSleep) {
+            // Woken either by a completion or by the timeout
+            uint64_t now = sys.timer().tickCount();
+            if (now < deadline) {
+                sys.timer().setTimeout(_completion, deadline - now);
+                sys.scheduler().sleepThread(_completion, &_lock);
+                sys.timer().cancelTimeout(_completion);
+            }
+        } else {
+            // Before the scheduler is running, poll instead
+            processCompletionsLocked();
+            if (_issued & bit) iowait();
+        }
+    }
+
+    bool success = !(_failed & bit);
+    _failed &= ~bit;
+    return success;
+}
+
+bool AHCIPort::transfer(bool write, uint8_t* buffer, uint64_t start, size_t count) {
+    ASSERT(start + count <= _numSectors);
+
+    uint8_t command;
+    if (_ncq) {
+        command = write ? WriteFPDMAQueued : ReadFPDMAQueued;
+    } else {
+        command = write ? WriteDMAExt : ReadDMAExt;
+    }
+
+    bool canSleep = _irqEnabled && Processor::interruptsEnabled() && !inIrq();
+    size_t maxSectors = (MAX_PRDS - 1) * PAGE_SIZE / SECTOR_SIZE;
+    bool success = true;
+
+    SpinlockLocker locker(_lock);
+    while (count > 0) {
+        // Issue as many pieces as there are free slots before waiting for any of them
+        uint32_t batch = 0;
+        while (count > 0) {
+            if (_freeSlots == 0) {
+                // Don't hold on to slots while waiting for more
+                if (batch != 0) break;
+
+                if (canSleep) {
+                    sys.scheduler().sleepThread(_slotAvailable, &_lock);
+                } else {
+                    processCompletionsLocked();
+                }
+
+                continue;
+            }
+
+            size_t slot = __builtin_ctz(_freeSlots);
+            _freeSlots &= ~(1U << slot);
+            batch |= 1U << slot;
+
+            size_t pieceSectors = min(count, maxSectors);
+            buildCommand(slot, command, write, buffer, pieceSectors * SECTOR_SIZE, start,
+                         pieceSectors);
+            issueLocked(slot);
+
+            buffer += pieceSectors * SECTOR_SIZE;
+            start += pieceSectors;
+            count -= pieceSectors;
+        }
+
+        while (batch != 0) {
+            size_t slot = __builtin_ctz(batch);
+            batch &= ~(1U << slot);
+
+            if (!waitLocked(slot, canSleep)) {
+                success = false;
+            }
+
+            _freeSlots |= 1U << slot;
+        }
+
+        sys.scheduler().wakeThreads(_slotAvailable);
+    }
+
+    return success;
+}
+
+bool AHCIPort::readSectors(void* dest, uint64_t start, size_t count) {
+    return transfer(false, static_cast<uint8_t*>(dest), start, count);
+}
+
+bool AHCIPort::writeSectors(const void* src, uint64_t start, size_t count) {
+    return transfer(true, static_cast<uint8_t*>(const_cast<void*>(src)), start, count);
+}
+
+estd::unique_ptr<AHCIController> AHCIController::create() {
+    PCIDevice* pciDevice = sys.pciDevices().findByClass(PCIDeviceClass::StorageSATA);
+
+    // Programming interface 1 is AHCI
+    if (!pciDevice || pciDevice->progIf() != 0x01) {
+        return {};
+    }
+
+    estd::unique_ptr<AHCIController> controller(new AHCIController(pciDevice));
+    if (!controller->init()) {
+        return {};
+    }
+
+    return controller;
+}
+
+AHCIController::AHCIController(PCIDevice* pciDevice) : _pciDevice(pciDevice) {}
+
+AHCIController::~AHCIController() = default;
+
+bool AHCIController::init() {
+    // The registers are memory-mapped at BAR5 (ABAR)
+    uint32_t bar5 = _pciDevice->bar5();
+    if (bitRange(bar5, 0, 1) != 0) {
+        println("ahci: ABAR is not memory-mapped");
+        return false;
+    }
+
+    PhysicalAddress abar = clearLowBits(bar5, 4);
+    _hba = mm.physicalToVirtual(abar).ptr<HBARegisters>();
+    _pciDevice->enableBusMastering();
+
+    _hba->ghc = _hba->ghc | GHC_AE;
+
+    static const char* names[] = {"sda", "sdb", "sdc", "sdd", "sde", "sdf", "sdg", "sdh"};
+    size_t numDisks = 0;
+
+    uint32_t implemented = _hba->pi;
+    for (size_t i = 0; i < 32; ++i) {
+        if (!checkBit(implemented, i)) continue;
+
+        estd::unique_ptr<AHCIPort> port(new AHCIPort(_hba, i));
+        if (!port->init()) continue;
+
+        println("ahci: port {}: {} ({} sectors, queue depth {}{})", i, port->modelName(),
+                port->numSectors(), port->queueDepth(), port->usesNCQ() ? ", NCQ" : "");
+
+        if (numDisks < sizeof(names) / sizeof(names[0])) {
+            detectPartitions(*port, names[numDisks++]);
+        }
+
+        _portByNumber[i] = port.get();
+        _ports.push_back(estd::move(port));
+    }
+
+    if (_ports.empty()) {
+        return false;
+    }
+
+    // Now that detection is finished, commands can complete by interrupt
+    uint8_t irqNumber = _pciDevice->interruptLine();
+    registerIrqHandler(irqNumber,
+                       [this](uint8_t irqNo) { return this->irqHandler(irqNo); });
+
+    for (auto& port : _ports) {
+        port->enableInterrupts();
+    }
+
+    _hba->is = 0xFFFFFFFF;
+    _hba->ghc = _hba->ghc | GHC_IE;
+    return true;
+}
+
+void AHCIController::detectPartitions(AHCIPort& port, const char* name) {
+    size_t depth = min(port.queueDepth(), MAX_QUEUE_WORKERS);
+    estd::unique_ptr<BlockQueue> queue(new BlockQueue(port, name, depth));
+    estd::unique_ptr<DiskPartitionDevice> partition = findFirstPartition(*queue);
+    if (!partition) return;
+
+    // TODO: support multiple partitions across drives
+    if (_rootPartition) return;
+
+    _rootQueue = estd::move(queue);
+    _rootPartition = estd::move(partition);
+}
+
+bool AHCIController::irqHandler(uint8_t irqNo) {
+    // The line may be shared with other devices, so there may be nothing for us to do
+    uint32_t pending = _hba->is;
+
+    for (size_t i = 0; i < 32; ++i) {
+        if (checkBit(pending, i) && _portByNumber[i]) {
+            _portByNumber[i]->irqHandler();
+        }
+    }
+
+    // Port interrupt status has to be cleared before the global status
+    _hba->is = pending;
+    endOfInterrupt(irqNo);
+    return pending != 0;
+}
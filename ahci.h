@@ -0,0 +1,102 @@
+// Driver for an AHCI SATA controller and the disks connected to it
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "address.h"
+#include "block_queue.h"
+#include "disk.h"
+#include "estd/memory.h"
+#include "estd/vector.h"
+#include "scheduler.h"
+#include "spinlock.h"
+
+class PCIDevice;
+struct HBARegisters;
+struct PortRegisters;
+struct CommandHeader;
+struct CommandTable;
+
+// A SATA disk attached to one port of the controller. Each command slot holds one
+// request, so with native command queuing, up to 32 can be outstanding at once;
+// otherwise, commands are issued one at a time.
+class AHCIPort : public DiskDevice {
+public:
+    AHCIPort(HBARegisters* hba, size_t portNumber);
+    ~AHCIPort();
+
+    bool init();
+
+    bool readSectors(void* dest, uint64_t start, size_t count) override;
+    bool writeSectors(const void* src, uint64_t start, size_t count) override;
+    size_t numSectors() const override { return _numSectors; }
+
+    const char* modelName() const { return _modelName; }
+    size_t queueDepth() const { return _numSlots; }
+    bool usesNCQ() const { return _ncq; }
+
+    void enableInterrupts() { _irqEnabled = true; }
+    void irqHandler();
+
+private:
+    bool startEngine();
+    bool stopEngine();
+    bool identify();
+
+    bool transfer(bool write, uint8_t* buffer, uint64_t start, size_t count);
+    void buildCommand(size_t slot, uint8_t command, bool write, uint8_t* buffer,
+                      size_t numBytes, uint64_t start, size_t count);
+    void issueLocked(size_t slot);
+    bool waitLocked(size_t slot, bool canSleep);
+    void processCompletionsLocked();
+    bool resetLink();
+    void recoverLocked();
+
+    HBARegisters* _hba;
+    PortRegisters* _regs;
+    size_t _portNumber;
+
+    char _modelName[41] = {0};
+    size_t _numSectors = 0;
+    bool _ncq = false;
+    size_t _numSlots = 1;
+    bool _irqEnabled = false;
+
+    // Command list, received FIS area and one command table for each slot
+    PhysicalAddress _memory;
+    size_t _memoryPages = 0;
+    CommandHeader* _commandList = nullptr;
+    CommandTable* _commandTables = nullptr;
+
+    Spinlock _lock;
+    uint32_t _freeSlots = 0;  // Bitmap
+    uint32_t _issued = 0;     // Bitmap of commands which haven't completed yet
+    uint32_t _failed = 0;     // Bitmap of completed commands which failed
+    estd::shared_ptr<Blocker> _slotAvailable;
+    estd::shared_ptr<Blocker> _completion;
+};
+
+class AHCIController {
+public:
+    // Returns nullptr if there's no AHCI controller
+    static estd::unique_ptr<AHCIController> create();
+    ~AHCIController();
+
+    DiskDevice* rootPartition() const { return _rootPartition.get(); }
+
+private:
+    AHCIController(PCIDevice* pciDevice);
+    bool init();
+    void detectPartitions(AHCIPort& port, const char* name);
+    bool irqHandler(uint8_t irqNo);
+
+    PCIDevice* _pciDevice;
+    HBARegisters* _hba = nullptr;
+    estd::vector<estd::unique_ptr<AHCIPort>> _ports;
+    AHCIPort* _portByNumber[32] = {};
+
+    // Requests to the disk holding the root partition go through a queue with one
+    // worker for each command slot
+    estd::unique_ptr<BlockQueue> _rootQueue;
+    estd::unique_ptr<DiskPartitionDevice> _rootPartition;
+};
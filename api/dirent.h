@@ -7,6 +7,11 @@
 extern "C" {
 #endif
 
+// Values of d_type (the same as the file types in ext2 directory entries)
+#define DT_UNKNOWN 0
+#define DT_REG 1
+#define DT_DIR 2
+
 struct __attribute__((packed)) dirent {
     uint32_t d_ino;
     uint16_t d_reclen;
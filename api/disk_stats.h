@@ -0,0 +1,30 @@
+// Per-device block I/O statistics (non-standard)
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct disk_stats {
+    char name[16];
+
+    uint64_t requests;    // Requests submitted to the queue
+    uint64_t merged;      // Requests which were combined with an adjacent request
+    uint64_t dispatches;  // Commands sent to the device
+    uint64_t errors;
+    uint64_t sectors_read;
+    uint64_t sectors_written;
+
+    uint32_t queue_depth;  // Requests waiting or in progress
+    uint32_t max_queue_depth;
+
+    // Time from submission to completion
+    uint64_t total_latency_ns;
+    uint64_t max_latency_ns;
+};
+
+#ifdef __cplusplus
+}
+#endif
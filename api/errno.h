@@ -4,20 +4,37 @@
 
 #define ENOENT 2            // No such file or directory
 #define EIO 5               // I/O error
+#define ENOEXEC 8           // Executable file format error
 #define EBADF 9             // Invalid file descriptor
+#define EBUSY 16            // Device or resource busy
 #define EINVAL 22           // Invalid argument
 #define EMFILE 24           // Too many open files
+#define EEXIST 17           // File exists
+#define EISDIR 21           // Is a directory
 #define ENOTDIR 20          // Not a directory
 #define EFBIG 27            // File too large
+#define ENOSPC 28           // No space left on device
+#define EROFS 30            // Read-only file system
 #define ENOMEM 12           // Out of memory
 #define ENAMETOOLONG 36     // File name too long
 #define ECHILD 10           // No child processes
 #define ENOSYS 38           // Function not implemented
 #define EAFNOSUPPORT 97     // Address family not supported
 #define EPROTONOSUPPORT 93  // Protocol not supported
+#define ENOPROTOOPT 92      // Protocol not available
 #define EPROTOTYPE 91       // Protocol wrong type for socket
 #define ENOTSOCK 88         // Socket operation on non-socket
 #define ECONNREFUSED 111    // Connection refused
 #define ENOTCONN 107        // Socket is not connected
 #define EPIPE 32            // Broken pipe
 #define EADDRINUSE 98       // Address already in use
+#define EADDRNOTAVAIL 99    // Address not available
+#define ENETUNREACH 101     // Network unreachable
+#define EISCONN 106         // Socket is connected
+#define EALREADY 114        // Connection already in progress
+#define EINPROGRESS 115     // Operation in progress
+#define EAGAIN 11           // Resource unavailable, try again
+#define EWOULDBLOCK EAGAIN  // Operation would block
+#define ENOBUFS 105         // No buffer space available
+#define ETIMEDOUT 110       // Connection timed out
+#define EFAULT 14           // Bad address
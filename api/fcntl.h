@@ -0,0 +1,19 @@
+// https://pubs.opengroup.org/onlinepubs/009695399/basedefs/fcntl.h.html
+#pragma once
+
+// File access modes for open
+#define O_RDONLY 0x0000
+#define O_WRONLY 0x0001
+#define O_RDWR 0x0002
+#define O_ACCMODE 0x0003
+
+// File creation and status flags for open
+#define O_CREAT 0x0040
+#define O_EXCL 0x0080
+#define O_TRUNC 0x0200
+#define O_APPEND 0x0400
+#define O_NONBLOCK 0x0800
+
+// Commands for fcntl
+#define F_GETFL 3
+#define F_SETFL 4
@@ -22,6 +22,20 @@ enum {
     SYS_bind,
     SYS_listen,
     SYS_accept,
+    SYS_fsync,
+    SYS_disk_stats,
+    SYS_readv,
+    SYS_writev,
+    SYS_sendfile,
+    SYS_epoll_create,
+    SYS_epoll_ctl,
+    SYS_epoll_wait,
+    SYS_fcntl,
+    SYS_pipe,
+    SYS_dup,
+    SYS_dup2,
+    SYS_clock_gettime,
+    SYS_setsockopt,
 
     SYS_COUNT,
 };
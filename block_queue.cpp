@@ -0,0 +1,350 @@
+#include "block_queue.h"
+
+#include <string.h>
+
+#include "estd/print.h"
+#include "interrupts.h"
+#include "klibc.h"
+#include "mm.h"
+#include "processor.h"
+#include "system.h"
+#include "thread.h"
+#include "timer.h"
+#include "units.h"
+
+static constexpr size_t MAX_QUEUES = 8;
+
+// We don't have static initialization, so the registry is zero-initialized in bss
+static BlockQueue* s_queues[MAX_QUEUES];
+static size_t s_numQueues;
+
+BlockQueue::BlockQueue(DiskDevice& device, const char* name, size_t depth)
+: _device(device),
+  _name(name),
+  _depth(depth),
+  _workAvailable(new Blocker),
+  _completion(new Blocker) {
+    ASSERT(depth > 0);
+    ASSERT(s_numQueues < MAX_QUEUES);
+    s_queues[s_numQueues++] = this;
+}
+
+BlockQueue::~BlockQueue() {
+    // The worker threads run forever, so queues are never destroyed once they've started
+    ASSERT(_workers.empty());
+
+    for (size_t i = 0; i < s_numQueues; ++i) {
+        if (s_queues[i] == this) {
+            s_queues[i] = s_queues[--s_numQueues];
+            break;
+        }
+    }
+}
+
+size_t BlockQueue::count() { return s_numQueues; }
+
+BlockQueue* BlockQueue::get(size_t index) {
+    if (index >= s_numQueues) return nullptr;
+    return s_queues[index];
+}
+
+bool BlockQueue::canQueue() const {
+    // Waiting for the worker requires the scheduler, and the worker itself needs
+    // interrupts to finish commands
+    return Processor::interruptsEnabled() && !inIrq();
+}
+
+void BlockQueue::startWorker() {
+    SpinlockLocker locker(_lock);
+    if (!_workers.empty()) return;
+
+    for (size_t i = 0; i < _depth; ++i) {
+        Worker* worker = new Worker;
+        worker->queue = this;
+        worker->mergeBuffer = mm.pageAlloc(MAX_MERGE_SECTORS * SECTOR_SIZE / PAGE_SIZE);
+        worker->thread = Thread::createKernelThread(bit_cast<uint64_t>(&workerThread),
+                                                    bit_cast<uint64_t>(worker));
+        _workers.push_back(estd::unique_ptr<Worker>(worker));
+        sys.scheduler().startThread(worker->thread.get());
+    }
+}
+
+void BlockQueue::enqueueLocked(BlockRequest& request) {
+    request.done = false;
+    request.success = false;
+    request.submitTime = Processor::rdtsc();
+    _pending.push_back(&request);
+
+    ++_requests;
+    _maxDepth = max(_maxDepth, static_cast<uint32_t>(_pending.size() + _inFlight));
+
+    sys.scheduler().wakeThreads(_workAvailable);
+}
+
+void BlockQueue::performDirect(BlockRequest& request) {
+    BlockRequest* batch[] = {&request};
+
+    {
+        SpinlockLocker locker(_lock);
+
+        // No worker can be part-way through a command, since it would be racing us for
+        // the device
+        ASSERT(_inFlight == 0);
+
+        request.submitTime = Processor::rdtsc();
+        ++_requests;
+        recordDispatchLocked(batch, 1);
+    }
+
+    request.success = dispatch(batch, 1, nullptr);
+
+    SpinlockLocker locker(_lock);
+    recordCompletionLocked(request, Processor::rdtsc());
+    request.done = true;
+}
+
+bool BlockQueue::transferBatch(BlockRequest* requests, size_t count) {
+    bool success = true;
+
+    if (!canQueue()) {
+        for (size_t i = 0; i < count; ++i) {
+            performDirect(requests[i]);
+            success = success && requests[i].success;
+        }
+
+        return success;
+    }
+
+    startWorker();
+
+    // All of them are pending at once, so that they can be sorted and merged
+    SpinlockLocker locker(_lock);
+    for (size_t i = 0; i < count; ++i) {
+        enqueueLocked(requests[i]);
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        while (!requests[i].done) {
+            sys.scheduler().sleepThread(_completion, &_lock);
+        }
+
+        success = success && requests[i].success;
+    }
+
+    return success;
+}
+
+bool BlockQueue::readSectors(void* dest, uint64_t start, size_t count) {
+    BlockRequest request;
+    request.start = start;
+    request.count = count;
+    request.buffer = dest;
+    return transferBatch(&request, 1);
+}
+
+bool BlockQueue::writeSectors(const void* src, uint64_t start, size_t count) {
+    BlockRequest request;
+    request.write = true;
+    request.start = start;
+    request.count = count;
+    request.buffer = const_cast<void*>(src);
+    return transferBatch(&request, 1);
+}
+
+size_t BlockQueue::takeBatch(BlockRequest** batch) {
+    ASSERT(!_pending.empty());
+
+    // Starvation guard: the oldest request goes first if it has waited too long
+    uint64_t now = Processor::rdtsc();
+    uint64_t maxWait = sys.timer().tscPerTick() * MAX_WAIT_TICKS;
+    size_t first = 0;
+    bool expired = false;
+    if (maxWait != 0) {
+        for (size_t i = 0; i < _pending.size(); ++i) {
+            if (now - _pending[i]->submitTime > maxWait &&
+                (!expired || _pending[i]->submitTime < _pending[first]->submitTime)) {
+                first = i;
+                expired = true;
+            }
+        }
+    }
+
+    // C-LOOK: the lowest sector at or after the head, or else the lowest overall
+    if (!expired) {
+        bool found = false;
+        size_t lowest = 0;
+        for (size_t i = 0; i < _pending.size(); ++i) {
+            uint64_t start = _pending[i]->start;
+            if (start >= _headPosition &&
+                (!found || start < _pending[first]->start)) {
+                first = i;
+                found = true;
+            }
+
+            if (start < _pending[lowest]->start) {
+                lowest = i;
+            }
+        }
+
+        if (!found) {
+            first = lowest;
+        }
+    }
+
+    size_t count = 0;
+    batch[count++] = _pending[first];
+    _pending[first] = _pending.back();
+    _pending.pop_back();
+
+    // Extend the batch with requests which continue exactly where it ends
+    bool write = batch[0]->write;
+    uint64_t end = batch[0]->start + batch[0]->count;
+    size_t numSectors = batch[0]->count;
+    bool extended = true;
+    while (extended && count < MAX_MERGE_REQUESTS) {
+        extended = false;
+        for (size_t i = 0; i < _pending.size(); ++i) {
+            BlockRequest* request = _pending[i];
+            if (request->write != write || request->start != end ||
+                numSectors + request->count > MAX_MERGE_SECTORS) {
+                continue;
+            }
+
+            batch[count++] = request;
+            end += request->count;
+            numSectors += request->count;
+
+            _pending[i] = _pending.back();
+            _pending.pop_back();
+            extended = true;
+            break;
+        }
+    }
+
+    _headPosition = end;
+    return count;
+}
+
+void BlockQueue::recordDispatchLocked(BlockRequest** batch, size_t count) {
+    ++_dispatches;
+    _merged += count - 1;
+
+    for (size_t i = 0; i < count; ++i) {
+        if (batch[i]->write) {
+            _sectorsWritten += batch[i]->count;
+        } else {
+            _sectorsRead += batch[i]->count;
+        }
+    }
+}
+
+bool BlockQueue::dispatch(BlockRequest** batch, size_t count, uint8_t* mergeBuffer) {
+    BlockRequest& first = *batch[0];
+
+    size_t numSectors = 0;
+    for (size_t i = 0; i < count; ++i) {
+        numSectors += batch[i]->count;
+    }
+
+    if (count == 1) {
+        if (first.write) {
+            return _device.writeSectors(first.buffer, first.start, first.count);
+        } else {
+            return _device.readSectors(first.buffer, first.start, first.count);
+        }
+    }
+
+    // Merged requests go through the staging buffer
+    uint8_t* buffer = mergeBuffer;
+
+    if (first.write) {
+        uint8_t* ptr = buffer;
+        for (size_t i = 0; i < count; ++i) {
+            memcpy(ptr, batch[i]->buffer, batch[i]->count * SECTOR_SIZE);
+            ptr += batch[i]->count * SECTOR_SIZE;
+        }
+
+        return _device.writeSectors(buffer, first.start, numSectors);
+    }
+
+    if (!_device.readSectors(buffer, first.start, numSectors)) {
+        return false;
+    }
+
+    uint8_t* ptr = buffer;
+    for (size_t i = 0; i < count; ++i) {
+        memcpy(batch[i]->buffer, ptr, batch[i]->count * SECTOR_SIZE);
+        ptr += batch[i]->count * SECTOR_SIZE;
+    }
+
+    return true;
+}
+
+void BlockQueue::recordCompletionLocked(BlockRequest& request, uint64_t now) {
+    uint64_t latency = now - request.submitTime;
+    _totalLatency += latency;
+    _maxLatency = max(_maxLatency, latency);
+
+    if (!request.success) {
+        ++_errors;
+    }
+}
+
+void BlockQueue::workerThread(Worker* worker) { worker->queue->run(*worker); }
+
+void BlockQueue::run(Worker& worker) {
+    uint8_t* mergeBuffer = mm.physicalToVirtual(worker.mergeBuffer).ptr<uint8_t>();
+    BlockRequest* batch[MAX_MERGE_REQUESTS];
+
+    while (true) {
+        size_t count;
+        {
+            SpinlockLocker locker(_lock);
+            while (_pending.empty()) {
+                sys.scheduler().sleepThread(_workAvailable, &_lock);
+            }
+
+            count = takeBatch(batch);
+            recordDispatchLocked(batch, count);
+            _inFlight += count;
+        }
+
+        bool success = dispatch(batch, count, mergeBuffer);
+        if (!success) {
+            println("{}: failed to {} sectors {}-{}", _name,
+                    batch[0]->write ? "write" : "read", batch[0]->start,
+                    batch[0]->start + batch[0]->count - 1);
+        }
+
+        // Waiters may free their requests as soon as the lock is released
+        SpinlockLocker locker(_lock);
+        uint64_t now = Processor::rdtsc();
+        for (size_t i = 0; i < count; ++i) {
+            BlockRequest& request = *batch[i];
+            request.success = success;
+            recordCompletionLocked(request, now);
+            request.done = true;
+        }
+
+        _inFlight -= count;
+        sys.scheduler().wakeThreads(_completion);
+    }
+}
+
+void BlockQueue::getStats(struct disk_stats& stats) {
+    SpinlockLocker locker(_lock);
+
+    memset(&stats, 0, sizeof(stats));
+    strncpy(stats.name, _name, sizeof(stats.name) - 1);
+
+    stats.requests = _requests;
+    stats.merged = _merged;
+    stats.dispatches = _dispatches;
+    stats.errors = _errors;
+    stats.sectors_read = _sectorsRead;
+    stats.sectors_written = _sectorsWritten;
+    stats.queue_depth = _pending.size() + _inFlight;
+    stats.max_queue_depth = _maxDepth;
+    stats.total_latency_ns = sys.timer().tscToNanoseconds(_totalLatency);
+    stats.max_latency_ns = sys.timer().tscToNanoseconds(_maxLatency);
+}
@@ -0,0 +1,93 @@
+// Request queue for a block device, which reorders and merges concurrent requests
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "address.h"
+#include "api/disk_stats.h"
+#include "disk.h"
+#include "estd/memory.h"
+#include "estd/vector.h"
+#include "scheduler.h"
+#include "spinlock.h"
+
+struct Thread;
+
+// Sits in front of a disk device and funnels all access to it through worker threads,
+// one for each command the device can have outstanding at once. Pending requests are
+// dispatched in C-LOOK order (ascending sector, wrapping around to the lowest), except
+// that a request which has waited too long is served next regardless of position.
+// Adjacent requests in the same direction are merged into a single command.
+//
+// Callers always wait for their requests to complete: there's no asynchronous
+// submission. Requests come from concurrent callers, and from batches (see ext2's block
+// fetching), which keep more than one request pending at a time.
+//
+// Before the scheduler is running (or with interrupts disabled), requests are performed
+// immediately on the calling thread instead.
+class BlockQueue : public DiskDevice {
+public:
+    BlockQueue(DiskDevice& device, const char* name, size_t depth = 1);
+    ~BlockQueue();
+
+    // Each of these queues its requests and waits for them to complete
+    bool readSectors(void* dest, uint64_t start, size_t count) override;
+    bool writeSectors(const void* src, uint64_t start, size_t count) override;
+    bool transferBatch(BlockRequest* requests, size_t count) override;
+    size_t numSectors() const override { return _device.numSectors(); }
+
+    void getStats(struct disk_stats& stats);
+
+    // Registry of every queue, for reporting statistics
+    static size_t count();
+    static BlockQueue* get(size_t index);
+
+private:
+    static constexpr size_t MAX_MERGE_SECTORS = 256;
+    static constexpr size_t MAX_MERGE_REQUESTS = 32;
+
+    // Requests older than this are served before any others
+    static constexpr uint64_t MAX_WAIT_TICKS = 50;
+
+    struct Worker {
+        BlockQueue* queue;
+        PhysicalAddress mergeBuffer;  // Staging area for merged requests
+        estd::unique_ptr<Thread> thread;
+    };
+
+    static void workerThread(Worker* worker);
+    void run(Worker& worker);
+
+    bool canQueue() const;
+    void startWorker();
+    void enqueueLocked(BlockRequest& request);
+    void performDirect(BlockRequest& request);
+    size_t takeBatch(BlockRequest** batch);
+    void recordDispatchLocked(BlockRequest** batch, size_t count);
+    bool dispatch(BlockRequest** batch, size_t count, uint8_t* mergeBuffer);
+    void recordCompletionLocked(BlockRequest& request, uint64_t now);
+
+    DiskDevice& _device;
+    const char* _name;
+    size_t _depth;
+
+    Spinlock _lock;
+    estd::vector<BlockRequest*> _pending;
+    size_t _inFlight = 0;
+    uint64_t _headPosition = 0;
+
+    estd::shared_ptr<Blocker> _workAvailable;
+    estd::shared_ptr<Blocker> _completion;
+    estd::vector<estd::unique_ptr<Worker>> _workers;
+
+    // Statistics (latencies in TSC cycles)
+    uint64_t _requests = 0;
+    uint64_t _merged = 0;
+    uint64_t _dispatches = 0;
+    uint64_t _errors = 0;
+    uint64_t _sectorsRead = 0;
+    uint64_t _sectorsWritten = 0;
+    uint32_t _maxDepth = 0;
+    uint64_t _totalLatency = 0;
+    uint64_t _maxLatency = 0;
+};
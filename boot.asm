@@ -154,9 +154,11 @@ main:
     mov ds, ax
     lgdt [GDT.pointer]
 
-    ; Activate long mode by enabling paging and entering protected mode at the same time
+    ; Activate long mode by enabling paging and entering protected mode at the same time.
+    ; Also set WP (write protect), so that the kernel can't write to read-only user pages
+    ; (e.g., text shared between processes) on a process's behalf.
     mov ebx, cr0
-    or ebx, 0x80000001
+    or ebx, 0x80010001
     mov cr0, ebx
 
     ; Far jump to clear the instruction pipeline and load cs with the correct selector
@@ -225,7 +227,9 @@ driveNumber:
     db 0
 
 ; Disk address packet structure describing how to load the kernel. The starting LBA
-; and size in sectors are filled in when the disk image is created
+; and size in sectors are filled in when the disk image is created. The size also covers
+; the initramfs archive, which is stored right after the kernel and so ends up right
+; after it in memory.
 dap:
     db 0x10                    ; size of this structure (16 bytes)
     db 0                       ; always zero
@@ -0,0 +1,63 @@
+#include "disk.h"
+
+#include <string.h>
+
+#include "estd/buffer.h"
+#include "estd/print.h"
+#include "units.h"
+
+struct __attribute__((packed)) PartitionEntry {
+    uint8_t status;
+    uint8_t startHead;
+    uint8_t startSector : 6;
+    uint8_t startCylinderHigh : 2;
+    uint8_t startCylinderLow;
+    uint8_t partitionType;
+    uint8_t endHead;
+    uint8_t endSector : 6;
+    uint8_t endCylinderHigh : 2;
+    uint8_t endCylinderLow;
+    uint32_t lbaStart;
+    uint32_t numSectors;
+};
+
+static_assert(sizeof(PartitionEntry) == 16);
+
+bool DiskDevice::transferBatch(BlockRequest* requests, size_t count) {
+    bool success = true;
+    for (size_t i = 0; i < count; ++i) {
+        BlockRequest& request = requests[i];
+        if (request.write) {
+            request.success = writeSectors(request.buffer, request.start, request.count);
+        } else {
+            request.success = readSectors(request.buffer, request.start, request.count);
+        }
+
+        request.done = true;
+        success = success && request.success;
+    }
+
+    return success;
+}
+
+estd::unique_ptr<DiskPartitionDevice> findFirstPartition(DiskDevice& disk) {
+    Buffer firstSector(SECTOR_SIZE);
+    if (!disk.readSectors(firstSector.get(), 0, 1)) {
+        println("can't read first sector of disk");
+        return {};
+    }
+
+    PartitionEntry partitionTable[4];
+    memcpy(&partitionTable[0], &firstSector[0x1BE], sizeof(partitionTable));
+
+    for (size_t i = 0; i < 4; ++i) {
+        auto& entry = partitionTable[i];
+        if (entry.partitionType == 0) continue;
+
+        // TODO: support multiple partitions
+        return estd::unique_ptr(
+            new DiskPartitionDevice(disk, entry.lbaStart, entry.numSectors));
+    }
+
+    return {};
+}
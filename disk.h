@@ -3,12 +3,37 @@
 #include <stdint.h>
 
 #include "estd/assertions.h"
+#include "estd/memory.h"
+
+class BlockQueue;
+
+// A single read or write, as part of a batch (see DiskDevice::transferBatch)
+struct BlockRequest {
+    bool write = false;
+    uint64_t start = 0;
+    size_t count = 0;
+    void* buffer = nullptr;
+
+    // Set when the request completes
+    bool success = false;
+    bool done = false;
+
+private:
+    friend class BlockQueue;
+    uint64_t submitTime = 0;
+};
 
 class DiskDevice {
 public:
     virtual ~DiskDevice() = default;
     virtual bool readSectors(void* dest, uint64_t start, size_t count) = 0;
+    virtual bool writeSectors(const void* src, uint64_t start, size_t count) = 0;
     virtual size_t numSectors() const = 0;
+
+    // Carries out several independent requests, which the device may reorder or combine,
+    // and returns once all of them have finished. Returns false if any of them failed.
+    // By default, they're performed one at a time, in order.
+    virtual bool transferBatch(BlockRequest* requests, size_t count);
 };
 
 class DiskPartitionDevice : public DiskDevice {
@@ -23,10 +48,34 @@ public:
         return _parent.readSectors(dest, _partitionStart + start, count);
     }
 
+    bool writeSectors(const void* src, uint64_t start, size_t count) override {
+        ASSERT(start + count <= _numSectors);
+        return _parent.writeSectors(src, _partitionStart + start, count);
+    }
+
     size_t numSectors() const override { return _numSectors; }
 
+    bool transferBatch(BlockRequest* requests, size_t count) override {
+        for (size_t i = 0; i < count; ++i) {
+            ASSERT(requests[i].start + requests[i].count <= _numSectors);
+            requests[i].start += _partitionStart;
+        }
+
+        bool success = _parent.transferBatch(requests, count);
+
+        for (size_t i = 0; i < count; ++i) {
+            requests[i].start -= _partitionStart;
+        }
+
+        return success;
+    }
+
 private:
     DiskDevice& _parent;
     uint64_t _partitionStart;
     size_t _numSectors;
 };
+
+// Reads the MBR partition table of a disk and returns the first partition, or nullptr if
+// there are none
+estd::unique_ptr<DiskPartitionDevice> findFirstPartition(DiskDevice& disk);
@@ -3,15 +3,16 @@
 #include <string.h>
 
 #include "estd/bits.h"
-#include "estd/buffer.h"
 #include "estd/new.h"  // IWYU pragma: keep
 #include "estd/print.h"
 #include "interrupts.h"
 #include "io.h"
+#include "klibc.h"
 #include "mm.h"
 #include "net/ethernet.h"
 #include "panic.h"
 #include "system.h"
+#include "thread.h"
 
 struct E1000Device::RegisterSpace {
     volatile uint32_t ctrl;
@@ -52,7 +53,11 @@ struct E1000Device::RegisterSpace {
     alignas(8) volatile uint32_t tdh;
     alignas(8) volatile uint32_t tdt;
 
-    volatile uint32_t _unused6[0x6F9];
+    volatile uint32_t _unused6[0x5F9];
+
+    volatile uint32_t rxcsum;
+
+    volatile uint32_t _unused7[0xFF];
 
     volatile uint32_t ral;
     volatile uint32_t rah;
@@ -87,6 +92,8 @@ void E1000Device::staticAssert<E1000Device::RegisterSpace>() {
     static_assert(offsetof(RegisterSpace, tdh) == 0x03810);
     static_assert(offsetof(RegisterSpace, tdt) == 0x03818);
 
+    static_assert(offsetof(RegisterSpace, rxcsum) == 0x5000);
+
     static_assert(offsetof(RegisterSpace, ral) == 0x5400);
     static_assert(offsetof(RegisterSpace, rah) == 0x5404);
 }
@@ -124,12 +131,18 @@ enum : uint32_t {
 
     RCTL_EN = 1 << 1,
     RCTL_BSIZE_SHIFT = 16,
-    RCTL_BSEX = 1 << 25,
-    RCTL_BSIZE_4096 = (3 << RCTL_BSIZE_SHIFT) | RCTL_BSEX,
+    RCTL_BSIZE_2048 = 0 << RCTL_BSIZE_SHIFT,
     RCTL_BAM = 1 << 15,
+
+    RXCSUM_IPOFLD = 1 << 8,
+    RXCSUM_TUOFLD = 1 << 9,
 };
 
-// Legacy transmit descriptor layout
+// Interrupts which mean that there are received packets to handle
+static constexpr uint32_t IMS_RX_PACKETS = IMS_RXT | IMS_RXO | IMS_RXDMT;
+
+// Transmit data descriptor layout (the extended format, which can request checksum
+// offloads). Context descriptors share the ring, and have the status in the same place.
 struct E1000Device::TransmitDescriptor {
 public:
     PhysicalAddress bufferAddress;
@@ -138,8 +151,19 @@ public:
     void clearFlags() { flags = 0; }
     void setLength(uint16_t value) { flags = setBitRange(flags, 0, 16, value); }
     void setEndOfPacket() { setCmd(setBit(cmd(), 0)); }
+    void setInsertFcs() { setCmd(setBit(cmd(), 1)); }
     void setReportStatus() { setCmd(setBit(cmd(), 3)); }
 
+    // Data descriptor type
+    void setExtended() {
+        flags = setBitRange(flags, 20, 4, 1);
+        setCmd(setBit(cmd(), 5));
+    }
+
+    // Only read from the first descriptor of a packet
+    void setInsertIpChecksum() { setOptions(setBit(options(), 0)); }
+    void setInsertTcpChecksum() { setOptions(setBit(options(), 1)); }
+
     bool descriptorDone() { return checkBit(status(), 0); }
     bool excessCollisions() { return checkBit(status(), 1); }
     bool lateCollision() { return checkBit(status(), 2); }
@@ -147,9 +171,14 @@ public:
 private:
     void setCmd(uint8_t value) { flags = setBitRange(flags, 24, 8, value); }
 
+    void setOptions(uint8_t value) { flags = setBitRange(flags, 40, 8, value); }
+
     uint16_t length() { return lowBits(flags, 16); }
     uint8_t cmd() { return bitRange(flags, 24, 8); }
-    uint8_t status() { return bitRange(flags, 32, 4); }
+    uint8_t options() { return bitRange(flags, 40, 8); }
+
+    // Written by the device, so it has to be read from memory every time
+    uint8_t status() { return bitRange(*const_cast<volatile uint64_t*>(&flags), 32, 4); }
 
     friend void E1000Device::staticAssert<E1000Device::TransmitDescriptor>();
 };
@@ -161,6 +190,45 @@ void E1000Device::staticAssert<E1000Device::TransmitDescriptor>() {
     static_assert(offsetof(TransmitDescriptor, flags) == 0x08);
 }
 
+// Tells the device where the headers are, for the checksum offloads of the data
+// descriptors which follow it
+struct E1000Device::ContextDescriptor {
+public:
+    ContextDescriptor(uint8_t ipStart, uint8_t tcpStart)
+    : ipcss(ipStart),
+      ipcso(ipStart + PacketBuffer::IP_CHECKSUM_OFFSET),
+      ipcse(tcpStart - 1),
+      tucss(tcpStart),
+      tucso(tcpStart + PacketBuffer::TCP_CHECKSUM_OFFSET) {}
+
+    void setReportStatus() { setCmd(setBit(cmd(), 3)); }
+
+private:
+    uint8_t ipcss;       // start of the IP header
+    uint8_t ipcso;       // IP checksum field
+    uint16_t ipcse;      // last byte of the IP header
+    uint8_t tucss;       // start of the TCP header
+    uint8_t tucso;       // TCP checksum field
+    uint16_t tucse = 0;  // last byte summed for TCP (zero for the end of the packet)
+
+    // Descriptor type 0 (context), extended format, TCP over IPv4
+    uint32_t lengthAndCmd = 0b00100011 << 24;
+    uint32_t statusAndSegmentation = 0;
+
+    void setCmd(uint8_t value) { lengthAndCmd = setBitRange(lengthAndCmd, 24, 8, value); }
+    uint8_t cmd() { return bitRange(lengthAndCmd, 24, 8); }
+
+    friend void E1000Device::staticAssert<E1000Device::ContextDescriptor>();
+};
+
+template <>
+void E1000Device::staticAssert<E1000Device::ContextDescriptor>() {
+    static_assert(sizeof(ContextDescriptor) == 16);
+    static_assert(offsetof(ContextDescriptor, tucss) == 0x04);
+    static_assert(offsetof(ContextDescriptor, lengthAndCmd) == 0x08);
+    static_assert(offsetof(ContextDescriptor, statusAndSegmentation) == 0x0C);
+}
+
 struct E1000Device::ReceiveDescriptor {
 public:
     PhysicalAddress bufferAddress;
@@ -174,6 +242,21 @@ public:
     bool descriptorDone() { return checkBit(status(), 0); }
     bool endOfPacket() { return checkBit(status(), 1); }
 
+    // Checksums which the device checked and found to be correct
+    uint8_t verifiedChecksums() {
+        if (checkBit(status(), 2)) return 0;
+
+        uint8_t result = 0;
+        if (checkBit(status(), 6) && !checkBit(errors(), 6)) {
+            result |= PacketBuffer::CHECKSUM_IP;
+        }
+        if (checkBit(status(), 5) && !checkBit(errors(), 5)) {
+            result |= PacketBuffer::CHECKSUM_TCP;
+        }
+
+        return result;
+    }
+
 private:
     uint8_t status() { return bitRange(flags, 32, 8); }
 
@@ -207,6 +290,7 @@ E1000Device::E1000Device() {
     initIrq();
     initTxRing();
     initRxRing();
+    setInterruptRate(DEFAULT_INTERRUPT_RATE);
 
     println("e1000: init complete");
 }
@@ -272,19 +356,38 @@ uint16_t E1000Device::readEEPROM(uint8_t addr) {
     }
 }
 
-void E1000Device::irqHandler(uint8_t irqNo) {
+bool E1000Device::irqHandler(uint8_t irqNo) {
     uint32_t cause = _regs->icr;
 
-    if (cause & IMR_RXT) {
-        flushRx();
+    if (cause & IMR_TXDW) {
+        SpinlockLocker locker(_txLock);
+        reclaimTx();
+    }
+
+    bool scheduled = false;
+    if (cause & IMS_RX_PACKETS) {
+        if (_rxThread) {
+            // Leave the packets to the poll thread, and stop receive interrupts until
+            // it has caught up. This has to be noted even if they're already masked,
+            // because reading icr has cleared the cause.
+            SpinlockLocker locker(_rxLock);
+            _regs->imc = IMS_RX_PACKETS;
+            _rxScheduled = true;
+            sys.scheduler().wakeThreads(_rxBlocker);
+            scheduled = true;
+        } else {
+            flushRx(_rxDescCount);
+        }
     }
 
     endOfInterrupt(irqNo);
+    return scheduled;
 }
 
 void E1000Device::initIrq() {
     // Register the IRQ handler for the device
-    registerIrqHandler(_irqNumber, [this](uint8_t irqNo) { this->irqHandler(irqNo); });
+    registerIrqHandler(_irqNumber,
+                       [this](uint8_t irqNo) { return this->irqHandler(irqNo); });
 }
 
 void E1000Device::initTxRing() {
@@ -294,6 +397,7 @@ void E1000Device::initTxRing() {
     void* txDescAddr = mm.physicalToVirtual(_txDescBase);
     _txDescCount = PAGE_SIZE / sizeof(TransmitDescriptor);
     _txRing = new (txDescAddr) TransmitDescriptor[_txDescCount];
+    _txPackets = estd::vector<PacketBuffer*>(_txDescCount, nullptr);
 
     // Tell the device the location and size of the tx ring
     _regs->tdbal = lowBits(_txDescBase.value, 32);
@@ -306,31 +410,95 @@ void E1000Device::initTxRing() {
     _regs->tctl = _regs->tctl | TCTL_EN;
 }
 
-void E1000Device::sendPacket(uint8_t* buffer, size_t length) {
-    size_t idx = _regs->tdt;
-    size_t nextIdx = (idx + 1) % _txDescCount;
+// Returns the packets which the device has finished sending to the pool, and their
+// descriptors to the ring. The caller must hold _txLock.
+void E1000Device::reclaimTx() {
+    ASSERT(_txLock.isLocked());
 
-    // Wait for at least one descriptor to become available
-    while (_regs->tdh == nextIdx) {
-        iowait();
+    while (_txClean != _txTail && _txRing[_txClean].descriptorDone()) {
+        delete _txPackets[_txClean];
+        _txPackets[_txClean] = nullptr;
+        _txClean = (_txClean + 1) % _txDescCount;
     }
+}
+
+// Descriptors which can be filled before catching up with the device. One is always
+// left empty, so that a full ring can be told apart from an empty one.
+size_t E1000Device::txFreeDescriptors() const {
+    size_t used = (_txTail + _txDescCount - _txClean) % _txDescCount;
+    return _txDescCount - 1 - used;
+}
 
-    // Set up the next descriptor in the ring to point to the packet
-    _txRing[idx].bufferAddress = mm.virtualToPhysical(buffer);
+// Fills the next descriptor to send one buffer, and returns its index
+size_t E1000Device::queueTx(PhysicalAddress address, size_t length) {
+    size_t idx = _txTail;
+    _txRing[idx].bufferAddress = address;
     _txRing[idx].clearFlags();
+    _txRing[idx].setExtended();
     _txRing[idx].setLength(length);
-    _txRing[idx].setEndOfPacket();
+    _txRing[idx].setInsertFcs();
     _txRing[idx].setReportStatus();
 
-    // Increment the tail pointer to tell the device to start transmitting
-    _regs->tdt = nextIdx;
+    _txTail = (idx + 1) % _txDescCount;
+    return idx;
+}
+
+// Queues the packet and returns without waiting for it to be sent. Completed descriptors
+// are reclaimed by the TXDW interrupt, or here if the ring fills up first.
+void E1000Device::sendPacket(estd::unique_ptr<PacketBuffer> packet) {
+    SpinlockLocker locker(_txLock);
+
+    // Checksum offloads need a context descriptor with the header offsets, but only
+    // when they differ from the previous packet's, which they rarely do
+    uint8_t checksums = packet->checksums();
+    uint8_t ipStart = _txIpStart;
+    uint8_t tcpStart = _txTcpStart;
+    if (checksums) {
+        ipStart = packet->networkHeader() - packet->data();
+        tcpStart = packet->transportHeader() - packet->data();
+    }
+
+    bool newContext = (ipStart != _txIpStart || tcpStart != _txTcpStart);
+    size_t needed = 1 + packet->hasFragment() + newContext;
+
+    // We may be called with other spinlocks held, or from an irq handler, so we can't
+    // sleep until there's room
+    while (txFreeDescriptors() < needed) {
+        reclaimTx();
+        if (txFreeDescriptors() >= needed) break;
 
-    // Wait for the packet to be sent by the device
-    while (_regs->tdh != _regs->tdt) {
         iowait();
     }
 
-    ASSERT(_txRing[idx].descriptorDone());
+    if (newContext) {
+        auto context = new (&_txRing[_txTail]) ContextDescriptor(ipStart, tcpStart);
+        context->setReportStatus();
+        _txTail = (_txTail + 1) % _txDescCount;
+        _txIpStart = ipStart;
+        _txTcpStart = tcpStart;
+    }
+
+    // The headers and the fragment (if any) are gathered from separate buffers
+    size_t first = queueTx(packet->physicalAddress(), packet->length());
+    size_t last = first;
+    if (packet->hasFragment()) {
+        last = queueTx(packet->fragmentPhysicalAddress(), packet->fragmentLength());
+    }
+
+    _txRing[last].setEndOfPacket();
+    if (checksums & PacketBuffer::CHECKSUM_IP) _txRing[first].setInsertIpChecksum();
+    if (checksums & PacketBuffer::CHECKSUM_TCP) _txRing[first].setInsertTcpChecksum();
+    _txPackets[last] = packet.release();
+
+    // Move the tail pointer to tell the device to start transmitting. The descriptors
+    // have to be in memory before the device can see them.
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    _regs->tdt = _txTail;
+}
+
+void E1000Device::setInterruptRate(uint32_t perSecond) {
+    // In units of 256ns between interrupts
+    _regs->itr = perSecond ? 1000000000 / (perSecond * 256) : 0;
 }
 
 void E1000Device::initRxRing() {
@@ -348,22 +516,27 @@ void E1000Device::initRxRing() {
     _regs->rdh = 0;
     _regs->rdt = 0;
 
-    // Allocate receive buffers for each descriptor and fill the ring
-    PhysicalAddress packetsBase = mm.pageAlloc(_rxDescCount);
+    // Give each descriptor a packet buffer to receive into
+    _rxPackets = estd::vector<PacketBuffer*>(_rxDescCount, nullptr);
     for (size_t i = 0; i < _rxDescCount; i++) {
-        _rxRing[i].bufferAddress = packetsBase + i * PAGE_SIZE;
-        _rxRing[i].clearFlags();
+        bool success = refillRx(i);
+        ASSERT(success);
     }
 
-    // Enable receive, set the buffer size, and accept broadcast packets
-    _regs->rctl = _regs->rctl | RCTL_EN | RCTL_BSIZE_4096 | RCTL_BAM;
+    // Enable receive, set the buffer size, and accept broadcast packets. Long packets
+    // aren't enabled, so the device never writes more than a maximum-sized frame into a
+    // buffer, even though a packet buffer has a little less than 2 KiB of space.
+    _regs->rctl = _regs->rctl | RCTL_EN | RCTL_BSIZE_2048 | RCTL_BAM;
 
-    // Disable the packet timer
+    // Disable the packet timer: the interrupt rate is limited by itr instead
     _regs->rdtr = 0;
 
-    // Unmask receive interrupts
+    // Have the device check IP and TCP checksums
+    _regs->rxcsum = RXCSUM_IPOFLD | RXCSUM_TUOFLD;
+
+    // Unmask receive and transmit-complete interrupts
     _regs->imc = ~(uint32_t)1;
-    _regs->ims = IMS_RXT | IMS_RXO | IMS_RXDMT | IMS_RXSEQ | IMS_LSC;
+    _regs->ims = IMS_RXT | IMS_RXO | IMS_RXDMT | IMS_RXSEQ | IMS_LSC | IMS_TXDW;
 
     // Clear the interrupt cause register
     (void)_regs->imc;
@@ -372,24 +545,96 @@ void E1000Device::initRxRing() {
     _regs->rdt = _rxDescCount - 1;
 }
 
-void E1000Device::flushRx() {
+// Attaches an empty packet buffer (from the reserve if need be) to a receive descriptor,
+// unless the pool is exhausted
+bool E1000Device::refillRx(size_t idx) {
+    auto packet = PacketBuffer::createReserved(0);
+    if (!packet) return false;
+    ASSERT(packet->tailroom() >= MAX_FRAME_SIZE);
+
+    _rxRing[idx].bufferAddress = packet->physicalAddress();
+    _rxRing[idx].clearFlags();
+    _rxPackets[idx] = packet.release();
+    return true;
+}
+
+// Handles at most budget packets from the rx ring, and returns the number handled. The
+// device receives straight into packet buffers, which are passed up the stack as they
+// are, and replaced in the ring by fresh ones from the pool.
+size_t E1000Device::flushRx(size_t budget) {
     size_t idx = (_regs->rdt + 1) % _rxDescCount;
 
-    while (_regs->rdh != idx) {
+    size_t count = 0;
+    while (count < budget && _regs->rdh != idx) {
         ASSERT(_rxRing[idx].descriptorDone());
         ASSERT(_rxRing[idx].endOfPacket());
 
-        // Copy the data out of the static packet buffer
-        Buffer buffer(_rxRing[idx].length());
-        void* descBuffer = mm.physicalToVirtual(_rxRing[idx].bufferAddress);
-        memcpy(buffer.get(), descBuffer, buffer.size());
+        // The descriptor has to be read before the data which the device wrote
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        PacketBuffer* received = _rxPackets[idx];
+        size_t length = _rxRing[idx].length();
+        uint8_t checksums = _rxRing[idx].verifiedChecksums();
+
+        // Make the descriptor available to the hardware again. If there's no fresh buffer
+        // to give it, the packet is dropped, and its buffer goes back in the ring.
+        bool refilled = refillRx(idx);
+        if (!refilled) {
+            _rxRing[idx].clearFlags();
+        }
 
-        // Make the descriptor available to the hardware again
-        _rxRing[idx].clearFlags();
         _regs->rdt = idx;
 
-        ethRecv(this, buffer.get(), buffer.size());
+        if (refilled) {
+            estd::unique_ptr<PacketBuffer> packet(received);
+            packet->put(length);
+            packet->addChecksums(checksums);
+            ethRecv(this, estd::move(packet));
+        }
 
         idx = (idx + 1) % _rxDescCount;
+        ++count;
+    }
+
+    return count;
+}
+
+void E1000Device::startPolling() {
+    _rxBlocker.assign(new Blocker);
+    _rxThread = Thread::createKernelThread(bit_cast<uint64_t>(&rxThread),
+                                           bit_cast<uint64_t>(this));
+    sys.scheduler().startThread(_rxThread.get());
+}
+
+void E1000Device::rxThread(E1000Device* device) { device->pollRx(); }
+
+void E1000Device::pollRx() {
+    while (true) {
+        {
+            SpinlockLocker locker(_rxLock);
+            while (!_rxScheduled) {
+                sys.scheduler().sleepThread(_rxBlocker, &_rxLock);
+            }
+
+            // Cleared before polling, so that a packet which arrives during the pass
+            // (and whose cause is cleared by a transmit interrupt) isn't missed
+            _rxScheduled = false;
+        }
+
+        // Receive interrupts stay masked while the ring keeps filling faster than one
+        // budget per pass, and other threads get to run between passes
+        if (flushRx(RX_BUDGET) == RX_BUDGET) {
+            {
+                SpinlockLocker locker(_rxLock);
+                _rxScheduled = true;
+            }
+
+            sys.scheduler().preempt();
+            continue;
+        }
+
+        // Caught up. A packet which arrived after the last check of the ring has set its
+        // cause bit, so it raises an interrupt as soon as it's unmasked.
+        SpinlockLocker locker(_rxLock);
+        _regs->ims = IMS_RX_PACKETS;
     }
 }
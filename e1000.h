@@ -2,18 +2,33 @@
 #pragma once
 
 #include "address.h"
+#include "estd/memory.h"
+#include "estd/vector.h"
 #include "net/ethernet.h"
 #include "net/ip.h"
 #include "net/network_interface.h"
 #include "pci.h"
+#include "scheduler.h"
+#include "spinlock.h"
 
+struct Thread;
 struct TrapRegisters;
 
 class E1000Device : public NetworkInterface {
 public:
     E1000Device();
 
-    void sendPacket(uint8_t* buffer, size_t length) override;
+    uint32_t features() const override {
+        return FEATURE_TX_CHECKSUM | FEATURE_SCATTER_GATHER;
+    }
+
+    void sendPacket(estd::unique_ptr<PacketBuffer> packet) override;
+    void startPolling() override;
+
+    // Limits the rate of interrupts, so that each one handles a batch of packets under
+    // load (zero for no limit)
+    static constexpr uint32_t DEFAULT_INTERRUPT_RATE = 8000;
+    void setInterruptRate(uint32_t perSecond);
 
 private:
     template <typename T>
@@ -21,24 +36,54 @@ private:
 
     struct RegisterSpace;
     struct TransmitDescriptor;
+    struct ContextDescriptor;
     struct ReceiveDescriptor;
 
     PCIDevice* _pciDev;
     RegisterSpace* _regs;
     uint8_t _irqNumber;
 
-    // Transmit descriptor ring
+    // Transmit descriptor ring. Descriptors from _txClean up to (but not including)
+    // _txTail belong to the device. The last descriptor of each packet holds the packet
+    // in _txPackets until the device reports that it's done with it.
+    Spinlock _txLock;
     PhysicalAddress _txDescBase;
     TransmitDescriptor* _txRing;
     size_t _txDescCount;
+    size_t _txTail = 0;
+    size_t _txClean = 0;
+    estd::vector<PacketBuffer*> _txPackets;
+
+    // Header offsets in the most recent context descriptor
+    uint8_t _txIpStart = 0;
+    uint8_t _txTcpStart = 0;
 
-    // Receive descriptor ring
+    // Receive descriptor ring. Each descriptor owns the packet in _rxPackets which the
+    // device receives into.
+    static constexpr size_t MAX_FRAME_SIZE = 1522;
     PhysicalAddress _rxDescBase;
     ReceiveDescriptor* _rxRing;
     size_t _rxDescCount;
+    estd::vector<PacketBuffer*> _rxPackets;
+
+    // Received packets are handled by _rxThread rather than by the irq handler. The
+    // handler masks receive interrupts and sets _rxScheduled, and the thread then handles
+    // at most RX_BUDGET packets at a time until the ring is empty, before unmasking them.
+    static constexpr size_t RX_BUDGET = 64;
+    Spinlock _rxLock;
+    bool _rxScheduled = false;
+    estd::shared_ptr<Blocker> _rxBlocker;
+    estd::unique_ptr<Thread> _rxThread;
+
+    bool irqHandler(uint8_t irqNo);
+    void reclaimTx();
+    size_t txFreeDescriptors() const;
+    size_t queueTx(PhysicalAddress address, size_t length);
+    bool refillRx(size_t idx);
+    size_t flushRx(size_t budget);
 
-    void irqHandler(uint8_t irqNo);
-    void flushRx();
+    static void rxThread(E1000Device* device);
+    void pollRx();
 
     void initPCI();
     void resetDevice();
@@ -0,0 +1,81 @@
+// ELF64 file format structures, for loading user-mode executables
+// Reference: https://refspecs.linuxfoundation.org/elf/gabi4+/contents.html
+#pragma once
+#include <stdint.h>
+
+namespace elf {
+
+// e_ident
+static constexpr uint8_t MAGIC[4] = {0x7F, 'E', 'L', 'F'};
+static constexpr uint8_t CLASS_64 = 2;
+static constexpr uint8_t DATA_LITTLE_ENDIAN = 1;
+static constexpr uint8_t CURRENT_VERSION = 1;
+
+enum Type : uint16_t {
+    ET_NONE = 0,
+    ET_REL = 1,
+    ET_EXEC = 2,
+    ET_DYN = 3,
+    ET_CORE = 4,
+};
+
+enum Machine : uint16_t {
+    EM_X86_64 = 62,
+};
+
+struct __attribute__((packed)) FileHeader {
+    uint8_t ident_magic[4];
+    uint8_t ident_class;
+    uint8_t ident_data;
+    uint8_t ident_version;
+    uint8_t ident_osabi;
+    uint8_t ident_abiversion;
+    uint8_t ident_pad[7];
+    Type type;
+    Machine machine;
+    uint32_t version;
+    uint64_t entry;
+    uint64_t phoff;
+    uint64_t shoff;
+    uint32_t flags;
+    uint16_t ehsize;
+    uint16_t phentsize;
+    uint16_t phnum;
+    uint16_t shentsize;
+    uint16_t shnum;
+    uint16_t shstrndx;
+};
+
+static_assert(sizeof(FileHeader) == 64);
+
+enum SegmentType : uint32_t {
+    PT_NULL = 0,
+    PT_LOAD = 1,
+    PT_DYNAMIC = 2,
+    PT_INTERP = 3,
+    PT_NOTE = 4,
+    PT_SHLIB = 5,
+    PT_PHDR = 6,
+    PT_TLS = 7,
+};
+
+enum SegmentFlags : uint32_t {
+    PF_X = 1,
+    PF_W = 2,
+    PF_R = 4,
+};
+
+struct __attribute__((packed)) ProgramHeader {
+    SegmentType type;
+    uint32_t flags;
+    uint64_t offset;
+    uint64_t vaddr;
+    uint64_t paddr;
+    uint64_t filesz;
+    uint64_t memsz;
+    uint64_t align;
+};
+
+static_assert(sizeof(ProgramHeader) == 56);
+
+}  // namespace elf
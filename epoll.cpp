@@ -0,0 +1,172 @@
+#include "epoll.h"
+
+#include "api/errno.h"
+#include "system.h"
+#include "timer.h"
+
+EpollFile::EpollFile() : _blocker(new Blocker) {}
+
+EpollFile::~EpollFile() {
+    for (auto& entry : _entries) {
+        for (auto& blocker : entry->blockers) {
+            sys.scheduler().unwatch(blocker, &entry->watcher);
+        }
+    }
+}
+
+size_t EpollFile::find(int fd, const File* file) const {
+    for (size_t i = 0; i < _entries.size(); ++i) {
+        if (_entries[i]->fd == fd && _entries[i]->file.get() == file) {
+            return i;
+        }
+    }
+
+    return _entries.size();
+}
+
+int EpollFile::add(int fd, const estd::shared_ptr<File>& file, const epoll_event& event) {
+    // Nesting epoll instances isn't supported
+    if (file->isEpoll()) {
+        return -EINVAL;
+    }
+
+    SpinlockLocker locker(_lock);
+
+    if (find(fd, file.get()) != _entries.size()) {
+        return -EEXIST;
+    }
+
+    estd::unique_ptr<Entry> entry(new Entry);
+    entry->fd = fd;
+    entry->file = file;
+    entry->events = event.events;
+    entry->data = event.data;
+    entry->watcher.blocker = _blocker;
+
+    // Check the initial state on the next wait
+    entry->watcher.triggered = true;
+
+    file->pollBlockers(entry->blockers);
+    for (auto& blocker : entry->blockers) {
+        sys.scheduler().watch(blocker, &entry->watcher);
+    }
+
+    _entries.push_back(estd::move(entry));
+
+    // Let current waiters see the new entry
+    sys.scheduler().wakeThreads(_blocker);
+    return 0;
+}
+
+int EpollFile::modify(int fd, const File* file, const epoll_event& event) {
+    SpinlockLocker locker(_lock);
+
+    size_t i = find(fd, file);
+    if (i == _entries.size()) {
+        return -ENOENT;
+    }
+
+    // Re-arms a one-shot entry, and reports the current state again
+    _entries[i]->events = event.events;
+    _entries[i]->data = event.data;
+    _entries[i]->watcher.triggered = true;
+
+    sys.scheduler().wakeThreads(_blocker);
+    return 0;
+}
+
+int EpollFile::remove(int fd, const File* file) {
+    SpinlockLocker locker(_lock);
+
+    size_t i = find(fd, file);
+    if (i == _entries.size()) {
+        return -ENOENT;
+    }
+
+    Entry& entry = *_entries[i];
+    for (auto& blocker : entry.blockers) {
+        sys.scheduler().unwatch(blocker, &entry.watcher);
+    }
+
+    _entries[i] = estd::move(_entries.back());
+    _entries.pop_back();
+    return 0;
+}
+
+int EpollFile::collect(epoll_event* events, int maxEvents) {
+    ASSERT(_lock.isLocked());
+
+    // Watchers are only updated by the scheduler with interrupts disabled, and so can't
+    // change while we hold the lock
+    int count = 0;
+    for (size_t n = 0; n < _entries.size() && count < maxEvents; ++n) {
+        size_t i = (_nextScan + n) % _entries.size();
+        Entry& entry = *_entries[i];
+        if (!entry.watcher.triggered) continue;
+
+        // Disabled one-shot entry
+        if (entry.events == 0) {
+            entry.watcher.triggered = false;
+            continue;
+        }
+
+        uint32_t ready = entry.file->pollEvents() & (entry.events | EPOLLERR | EPOLLHUP);
+
+        // Readiness only changes with a wakeup, so there's no need to look at this entry
+        // again until the next one. Level-triggered entries which are ready stay
+        // triggered, to be reported by every wait until they aren't.
+        if (!ready || (entry.events & EPOLLET)) {
+            entry.watcher.triggered = false;
+        }
+
+        if (!ready) continue;
+
+        events[count].events = ready;
+        events[count].data = entry.data;
+        ++count;
+
+        if (entry.events & EPOLLONESHOT) {
+            entry.events = 0;
+        }
+
+        _nextScan = i + 1;
+    }
+
+    return count;
+}
+
+int EpollFile::wait(epoll_event* events, int maxEvents, int64_t timeout) {
+    uint64_t deadline = sys.timer().tickCount() + timeout;
+
+    SpinlockLocker locker(_lock);
+    ++_waiters;
+
+    int count;
+    bool timeoutSet = false;
+    while (true) {
+        count = collect(events, maxEvents);
+        if (count > 0 || timeout == 0) break;
+
+        if (timeout > 0) {
+            uint64_t now = sys.timer().tickCount();
+            if (now >= deadline) break;
+
+            if (!timeoutSet) {
+                sys.timer().setTimeout(_blocker, deadline - now);
+                timeoutSet = true;
+            }
+        }
+
+        // Nothing can be woken between collecting and going to sleep, because the lock
+        // keeps interrupts disabled until we're on the wait queue
+        sys.scheduler().sleepThread(_blocker, &_lock);
+    }
+
+    // Timeouts are shared by every waiter, so they can only be cancelled by the last
+    --_waiters;
+    if (_waiters == 0) {
+        sys.timer().cancelTimeout(_blocker);
+    }
+
+    return count;
+}
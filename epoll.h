@@ -0,0 +1,64 @@
+// Waiting for readiness on many files at once
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+
+#include "estd/memory.h"
+#include "estd/vector.h"
+#include "file.h"
+#include "scheduler.h"
+#include "spinlock.h"
+
+// The kernel object behind an epoll file descriptor. Each registered file has a watcher
+// on the blockers which signal its readiness changes (see File::pollBlockers), and a
+// wakeup of any of them marks the entry as triggered and wakes threads in wait(). Only
+// triggered entries are polled, so a wait over thousands of idle connections costs
+// little more than a wait over a few.
+//
+// Level-triggered entries stay triggered for as long as they're ready, while
+// edge-triggered (EPOLLET) entries are reported once per wakeup.
+class EpollFile : public File {
+public:
+    EpollFile();
+    ~EpollFile();
+
+    ssize_t read(OpenFileDescription&, void*, size_t) override { return -EINVAL; }
+    ssize_t write(OpenFileDescription&, const void*, size_t) override { return -EINVAL; }
+    bool isEpoll() const override { return true; }
+
+    // Implementations of the epoll_ctl operations. Files are identified by both their
+    // descriptor and the file itself, as the descriptor may be reused.
+    int add(int fd, const estd::shared_ptr<File>& file, const epoll_event& event);
+    int modify(int fd, const File* file, const epoll_event& event);
+    int remove(int fd, const File* file);
+
+    // Waits until at least one registered file is ready, or until timeout ticks have
+    // elapsed (forever if timeout is negative). Returns the number of events stored.
+    int wait(epoll_event* events, int maxEvents, int64_t timeout);
+
+private:
+    struct Entry {
+        int fd;
+        estd::shared_ptr<File> file;
+        uint32_t events;
+        epoll_data_t data;
+
+        BlockerWatcher watcher;
+        estd::vector<estd::shared_ptr<Blocker>> blockers;
+    };
+
+    size_t find(int fd, const File* file) const;
+    int collect(epoll_event* events, int maxEvents);
+
+    Spinlock _lock;
+    estd::vector<estd::unique_ptr<Entry>> _entries;
+
+    // Where the next scan for ready entries starts, so that every entry gets a turn even
+    // when maxEvents is small
+    size_t _nextScan = 0;
+
+    // Threads in wait() sleep on this
+    estd::shared_ptr<Blocker> _blocker;
+    size_t _waiters = 0;
+};
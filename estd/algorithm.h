@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "estd/utility.h"
+
+namespace estd {
+
+// Moves the element at root down until it's no less than its children, within the heap
+// made up of the first size elements
+template <typename T, typename Compare>
+void _sift_down(T* first, size_t root, size_t size, Compare& less) {
+    while (true) {
+        size_t largest = root;
+        size_t left = 2 * root + 1;
+        size_t right = left + 1;
+
+        if (left < size && less(first[largest], first[left])) largest = left;
+        if (right < size && less(first[largest], first[right])) largest = right;
+        if (largest == root) return;
+
+        swap(first[root], first[largest]);
+        root = largest;
+    }
+}
+
+// Sorts [first, last) in ascending order by less. Heapsort: O(n log n) even in the worst
+// case, and doesn't allocate, but isn't stable.
+template <typename T, typename Compare>
+void sort(T* first, T* last, Compare less) {
+    size_t size = last - first;
+    for (size_t i = size / 2; i > 0; --i) {
+        _sift_down(first, i - 1, size, less);
+    }
+
+    for (size_t end = size; end > 1; --end) {
+        swap(first[0], first[end - 1]);
+        _sift_down(first, 0, end - 1, less);
+    }
+}
+
+template <typename T>
+void sort(T* first, T* last) {
+    sort(first, last, [](const T& lhs, const T& rhs) { return lhs < rhs; });
+}
+
+}  // namespace estd
@@ -1,7 +1,10 @@
 #pragma once
 #include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 
 #include "estd/assertions.h"
+#include "estd/atomic.h"
 
 template <typename T, size_t N>
 class RingBuffer {
@@ -74,3 +77,90 @@ private:
     T* _head;
     T* _tail;
 };
+
+// Ring buffer for exactly one producer and one consumer, which may run concurrently
+// without a lock. The producer only writes _tail and the consumer only writes _head.
+// Each publishes its index with a release store after copying, and reads the other's
+// with an acquire load, so elements are always visible before the index which covers
+// them. Indices count up forever and are reduced modulo N on access.
+template <typename T, size_t N>
+class SpscRingBuffer {
+    static_assert((N & (N - 1)) == 0, "capacity must be a power of two");
+
+public:
+    SpscRingBuffer() = default;
+
+    // No copy / move
+    SpscRingBuffer(const SpscRingBuffer&) = delete;
+    SpscRingBuffer& operator=(const SpscRingBuffer&) = delete;
+
+    // Producer side. Copies as many elements as fit and returns how many that was. Sets
+    // wasEmpty if the consumer had drained everything before this call's elements were
+    // published, in which case it may be waiting for them.
+    size_t push(const T* src, size_t count, bool& wasEmpty) {
+        uint64_t tail = _tail.load();
+        size_t space = N - (tail - _head.load());
+        if (count > space) count = space;
+
+        wasEmpty = false;
+        if (count == 0) return 0;
+
+        copyIn(tail, src, count);
+        _tail.store(tail + count);
+
+        // Full barrier so that the load of _head can't be satisfied before the store to
+        // _tail is visible (the consumer does the same in reverse; see waitBarrier)
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        wasEmpty = (_head.load() == tail);
+        return count;
+    }
+
+    // Consumer side. Copies out as many elements as are available, up to count, and
+    // returns how many that was. Sets wasFull if the buffer was full until this call, in
+    // which case the producer may be waiting for space.
+    size_t pop(T* dest, size_t count, bool& wasFull) {
+        uint64_t head = _head.load();
+        size_t available = _tail.load() - head;
+        if (count > available) count = available;
+
+        wasFull = false;
+        if (count == 0) return 0;
+
+        copyOut(head, dest, count);
+        _head.store(head + count);
+
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        wasFull = (_tail.load() - head == N);
+        return count;
+    }
+
+    // Must be called by either side between deciding to sleep and checking the
+    // condition one last time, so that it pairs with the barrier in the other side's
+    // push or pop and no wakeup is lost
+    static void waitBarrier() { __atomic_thread_fence(__ATOMIC_SEQ_CST); }
+
+    size_t size() const { return _tail.load() - _head.load(); }
+    bool empty() const { return size() == 0; }
+    bool full() const { return size() == N; }
+    static constexpr size_t capacity() { return N; }
+
+private:
+    // Copies are split in two where they wrap around the end of the array
+    void copyIn(uint64_t index, const T* src, size_t count) {
+        size_t start = index & (N - 1);
+        size_t first = (count < N - start) ? count : N - start;
+        memcpy(&_data[start], src, first * sizeof(T));
+        memcpy(&_data[0], src + first, (count - first) * sizeof(T));
+    }
+
+    void copyOut(uint64_t index, T* dest, size_t count) {
+        size_t start = index & (N - 1);
+        size_t first = (count < N - start) ? count : N - start;
+        memcpy(dest, &_data[start], first * sizeof(T));
+        memcpy(dest + first, &_data[0], (count - first) * sizeof(T));
+    }
+
+    T _data[N];
+    AtomicInt _head = 0;
+    AtomicInt _tail = 0;
+};
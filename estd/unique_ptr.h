@@ -34,7 +34,7 @@ public:
     unique_ptr(unique_ptr&& other) : _ptr(other.release()) {}
 
     unique_ptr& operator=(unique_ptr&& other) {
-        _ptr = other.release();
+        assign(other.release());
         return *this;
     }
 
@@ -87,7 +87,7 @@ public:
     unique_ptr(unique_ptr&& other) : _ptr(other.release()) {}
 
     unique_ptr& operator=(unique_ptr&& other) {
-        _ptr = other.release();
+        assign(other.release());
         return *this;
     }
 
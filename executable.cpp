@@ -0,0 +1,274 @@
+#include "executable.h"
+
+#include <string.h>
+
+#include "api/fcntl.h"
+#include "elf.h"
+#include "estd/buffer.h"
+#include "estd/print.h"
+#include "file.h"
+#include "klibc.h"
+#include "mm.h"
+#include "page_map.h"
+#include "units.h"
+
+// pml4[0] is shared with the kernel, and user addresses must be in the lower half
+static constexpr uint64_t USER_SPACE_START = 512 * GiB;
+static constexpr uint64_t USER_SPACE_END = 1UL << 47;
+
+// Reads up to count bytes starting at offset, stopping early only at the end of the file
+static ssize_t readAt(File& file, OpenFileDescription& fd, uint64_t offset, uint8_t* dest,
+                      size_t count) {
+    fd.offset = offset;
+
+    size_t bytesRead = 0;
+    while (bytesRead < count) {
+        ssize_t result = file.read(fd, dest + bytesRead, count - bytesRead);
+        if (result < 0) {
+            return result;
+        } else if (result == 0) {
+            break;
+        }
+
+        bytesRead += result;
+    }
+
+    return bytesRead;
+}
+
+estd::shared_ptr<Executable> Executable::load(Location location, const FileInfo& info) {
+    estd::shared_ptr<File> file;
+    int result = location.fs->open(location.ino, O_RDONLY, file);
+    if (result < 0) {
+        println("exec: failed to open executable: {}", result);
+        return {};
+    }
+
+    auto fd = OpenFileDescription::create(file, O_RDONLY);
+
+    // The file and program headers must all be in the first page
+    Buffer header(PAGE_SIZE);
+    ssize_t headerSize = readAt(*file, *fd, 0, header.get(), PAGE_SIZE);
+    if (headerSize < 0) {
+        println("exec: failed to read executable: {}", headerSize);
+        return {};
+    }
+
+    estd::shared_ptr<Executable> executable(new Executable);
+    executable->_location = location;
+    executable->_version = info.version;
+    if (!executable->parse(header.get(), headerSize, info.size) ||
+        !executable->readPages(*file, *fd)) {
+        return {};
+    }
+
+    return executable;
+}
+
+Executable::~Executable() {
+    for (PhysicalAddress page : _pages) {
+        if (page.value != 0) {
+            mm.pageFree(page);
+        }
+    }
+}
+
+bool Executable::parse(const uint8_t* header, size_t headerSize, uint64_t fileSize) {
+    if (headerSize < sizeof(elf::FileHeader)) {
+        println("exec: not an ELF file");
+        return false;
+    }
+
+    elf::FileHeader fileHeader;
+    memcpy(&fileHeader, header, sizeof(fileHeader));
+
+    if (memcmp(fileHeader.ident_magic, elf::MAGIC, sizeof(elf::MAGIC)) != 0) {
+        println("exec: not an ELF file");
+        return false;
+    }
+
+    if (fileHeader.ident_class != elf::CLASS_64 ||
+        fileHeader.ident_data != elf::DATA_LITTLE_ENDIAN ||
+        fileHeader.ident_version != elf::CURRENT_VERSION ||
+        fileHeader.machine != elf::EM_X86_64) {
+        println("exec: not an x86-64 executable");
+        return false;
+    }
+
+    // Dynamic linking and position-independent executables aren't supported
+    if (fileHeader.type != elf::ET_EXEC) {
+        println("exec: unsupported ELF type {}", static_cast<uint16_t>(fileHeader.type));
+        return false;
+    }
+
+    if (fileHeader.phentsize != sizeof(elf::ProgramHeader) ||
+        fileHeader.phoff + fileHeader.phnum * sizeof(elf::ProgramHeader) > headerSize) {
+        println("exec: program headers must be in the first page");
+        return false;
+    }
+
+    bool entryFound = false;
+    uint64_t end = 0;
+    for (size_t i = 0; i < fileHeader.phnum; ++i) {
+        elf::ProgramHeader programHeader;
+        memcpy(&programHeader, header + fileHeader.phoff + i * sizeof(programHeader),
+               sizeof(programHeader));
+
+        if (programHeader.type != elf::PT_LOAD || programHeader.memsz == 0) {
+            continue;
+        }
+
+        Segment segment;
+        segment.start = programHeader.vaddr;
+        segment.memSize = programHeader.memsz;
+        segment.fileOffset = programHeader.offset;
+        segment.fileSize = programHeader.filesz;
+        segment.writable = programHeader.flags & elf::PF_W;
+        segment.executable = programHeader.flags & elf::PF_X;
+
+        // A page of memory can then be filled from a single page of the file
+        if (segment.start % PAGE_SIZE != segment.fileOffset % PAGE_SIZE) {
+            println("exec: segment {} isn't aligned", i);
+            return false;
+        }
+
+        if (segment.fileSize > segment.memSize ||
+            segment.fileOffset + segment.fileSize > fileSize) {
+            println("exec: segment {} is truncated", i);
+            return false;
+        }
+
+        if (segment.start < USER_SPACE_START || segment.memSize > USER_SPACE_END ||
+            segment.start > USER_SPACE_END - segment.memSize) {
+            println("exec: segment {} is outside of user space", i);
+            return false;
+        }
+
+        // Each page has a single set of permissions, so segments can't share one
+        uint64_t firstPage = roundDown(segment.start, PAGE_SIZE);
+        uint64_t lastPage = roundDown(segment.start + segment.memSize - 1, PAGE_SIZE);
+        for (const Segment& other : _segments) {
+            uint64_t otherFirst = roundDown(other.start, PAGE_SIZE);
+            uint64_t otherLast = roundDown(other.start + other.memSize - 1, PAGE_SIZE);
+            if (firstPage <= otherLast && otherFirst <= lastPage) {
+                println("exec: segment {} overlaps another segment", i);
+                return false;
+            }
+        }
+
+        if (segment.executable && fileHeader.entry >= segment.start &&
+            fileHeader.entry < segment.start + segment.memSize) {
+            entryFound = true;
+        }
+
+        end = max(end, roundUp(segment.start + segment.memSize, PAGE_SIZE));
+        _segments.push_back(segment);
+    }
+
+    if (!entryFound) {
+        println("exec: entry point isn't in an executable segment");
+        return false;
+    }
+
+    _entryPoint = fileHeader.entry;
+    _end = end;
+    return true;
+}
+
+bool Executable::readPages(File& file, OpenFileDescription& fd) {
+    for (const Segment& segment : _segments) {
+        if (segment.fileSize == 0) continue;
+
+        size_t firstPage = segment.fileOffset / PAGE_SIZE;
+        size_t lastPage = (segment.fileOffset + segment.fileSize - 1) / PAGE_SIZE;
+        while (_pages.size() <= lastPage) {
+            _pages.push_back(PhysicalAddress(0));
+        }
+
+        for (size_t i = firstPage; i <= lastPage; ++i) {
+            if (_pages[i].value != 0) continue;
+
+            // Freshly allocated pages are zeroed, which covers a short read at the end
+            _pages[i] = mm.pageAlloc();
+            uint8_t* dest = mm.physicalToVirtual(_pages[i]).ptr<uint8_t>();
+            ssize_t result = readAt(file, fd, i * PAGE_SIZE, dest, PAGE_SIZE);
+            if (result < 0) {
+                println("exec: failed to read executable: {}", result);
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+const Executable::Segment* Executable::findSegment(uint64_t pageStart) const {
+    for (size_t i = 0; i < _segments.size(); ++i) {
+        const Segment& segment = _segments[i];
+        if (pageStart + PAGE_SIZE > segment.start &&
+            pageStart < segment.start + segment.memSize) {
+            return &segment;
+        }
+    }
+
+    return nullptr;
+}
+
+bool Executable::overlapsReadOnly(uint64_t start, uint64_t end) const {
+    for (size_t i = 0; i < _segments.size(); ++i) {
+        const Segment& segment = _segments[i];
+        if (segment.writable) continue;
+
+        uint64_t segmentStart = roundDown(segment.start, PAGE_SIZE);
+        uint64_t segmentEnd = roundUp(segment.start + segment.memSize, PAGE_SIZE);
+        if (start < segmentEnd && end > segmentStart) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool Executable::mapPage(UserAddressSpace& addressSpace, VirtualAddress addr,
+                         estd::vector<PhysicalAddress>& privatePages) const {
+    uint64_t pageStart = addr.pageBase();
+    const Segment* segment = findSegment(pageStart);
+    if (!segment) {
+        return false;
+    }
+
+    uint64_t flags = 0;
+    if (segment->writable) flags |= PAGE_WRITABLE;
+    if (!segment->executable) flags |= PAGE_NO_EXECUTE;
+
+    // The part of this page which is inside of the segment, and the part of that which
+    // comes from the file
+    uint64_t start = max(pageStart, segment->start);
+    uint64_t end = min(pageStart + PAGE_SIZE, segment->start + segment->memSize);
+    uint64_t fileEnd = min(end, segment->start + segment->fileSize);
+
+    // Segments are aligned so that this page corresponds to a single page of the file
+    PhysicalAddress filePage;
+    if (start < fileEnd) {
+        uint64_t fileOffset = segment->fileOffset + (start - segment->start);
+        filePage = _pages[fileOffset / PAGE_SIZE];
+    }
+
+    // Read-only pages which come entirely from the file can be shared
+    if (!segment->writable && fileEnd == end) {
+        addressSpace.mapPage(pageStart, filePage, 0, flags);
+        return true;
+    }
+
+    // Everything else gets a private copy, with zeros past the end of the file data
+    PhysicalAddress page = mm.pageAlloc();
+    if (start < fileEnd) {
+        uint64_t offset = start - pageStart;
+        memcpy(mm.physicalToVirtual(page).ptr<uint8_t>() + offset,
+               mm.physicalToVirtual(filePage).ptr<uint8_t>() + offset, fileEnd - start);
+    }
+
+    privatePages.push_back(page);
+    addressSpace.mapPage(pageStart, page, 0, flags);
+    return true;
+}
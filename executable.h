@@ -0,0 +1,67 @@
+// Loading ELF executables into user address spaces
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "address.h"
+#include "estd/memory.h"
+#include "estd/vector.h"
+#include "fs/vfs.h"
+
+struct File;
+struct OpenFileDescription;
+class UserAddressSpace;
+
+// The loadable parts of an executable file, read into memory once and shared by every
+// process running it. Nothing is mapped up front: each page of a process's image is
+// mapped when it's first touched (see Process::handlePageFault). Read-only pages map the
+// cached file contents directly, so text is shared between instances of a program, while
+// writable pages get a private copy, and pages past the end of a segment's file data
+// (.bss) are zero-filled.
+class Executable {
+public:
+    // Returns nullptr (after printing the reason) if the file isn't a valid executable
+    static estd::shared_ptr<Executable> load(Location location, const FileInfo& info);
+    ~Executable();
+
+    Location location() const { return _location; }
+    uint64_t version() const { return _version; }
+
+    VirtualAddress entryPoint() const { return _entryPoint; }
+
+    // The page-aligned end of the highest segment
+    VirtualAddress end() const { return _end; }
+
+    // Maps the page containing addr, if it's in one of the segments. Pages which are
+    // allocated for this process alone are appended to privatePages.
+    bool mapPage(UserAddressSpace& addressSpace, VirtualAddress addr,
+                 estd::vector<PhysicalAddress>& privatePages) const;
+
+    // True if any of [start, end) is on a page of a read-only segment
+    bool overlapsReadOnly(uint64_t start, uint64_t end) const;
+
+private:
+    Executable() = default;
+
+    struct Segment {
+        uint64_t start;
+        uint64_t memSize;
+        uint64_t fileOffset;
+        uint64_t fileSize;
+        bool writable;
+        bool executable;
+    };
+
+    bool parse(const uint8_t* header, size_t headerSize, uint64_t fileSize);
+    bool readPages(File& file, OpenFileDescription& fd);
+    const Segment* findSegment(uint64_t pageStart) const;
+
+    Location _location;
+    uint64_t _version = 0;
+    VirtualAddress _entryPoint;
+    VirtualAddress _end;
+    estd::vector<Segment> _segments;
+
+    // The contents of each page of the file, or 0 for pages outside of every segment
+    estd::vector<PhysicalAddress> _pages;
+};
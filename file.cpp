@@ -1,6 +1,37 @@
 #include "file.h"
 
-estd::unique_ptr<OpenFileDescription> OpenFileDescription::create(
-    const estd::shared_ptr<File>& file) {
-    return estd::unique_ptr<OpenFileDescription>(new OpenFileDescription{file});
+estd::shared_ptr<OpenFileDescription> OpenFileDescription::create(
+    const estd::shared_ptr<File>& file, int flags) {
+    return estd::shared_ptr<OpenFileDescription>(new OpenFileDescription{file, 0, flags});
+}
+
+ssize_t File::readv(OpenFileDescription& fd, const iovec* iov, int iovcnt) {
+    ssize_t total = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+        ssize_t result = read(fd, iov[i].iov_base, iov[i].iov_len);
+        if (result < 0) {
+            // Report the error only if nothing was transferred
+            return total > 0 ? total : result;
+        }
+
+        total += result;
+        if (static_cast<size_t>(result) < iov[i].iov_len) break;
+    }
+
+    return total;
+}
+
+ssize_t File::writev(OpenFileDescription& fd, const iovec* iov, int iovcnt) {
+    ssize_t total = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+        ssize_t result = write(fd, iov[i].iov_base, iov[i].iov_len);
+        if (result < 0) {
+            return total > 0 ? total : result;
+        }
+
+        total += result;
+        if (static_cast<size_t>(result) < iov[i].iov_len) break;
+    }
+
+    return total;
 }
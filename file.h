@@ -1,20 +1,26 @@
 // Basic top-level definitions for dealing with files
 #pragma once
 #include <stddef.h>
+#include <sys/epoll.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include "api/errno.h"
 #include "estd/memory.h"
+#include "estd/vector.h"
 
+struct Blocker;
 struct File;
 
-// The kernel data structure that a usermode file descriptor points to
+// The kernel data structure that a usermode file descriptor points to. Shared by
+// descriptors duplicated with dup, and by the standard streams of launched processes.
 struct OpenFileDescription {
     estd::shared_ptr<File> file;
     off_t offset = 0;
+    int flags = 0;  // O_* flags from open
 
-    static estd::unique_ptr<OpenFileDescription> create(
-        const estd::shared_ptr<File>& file);
+    static estd::shared_ptr<OpenFileDescription> create(
+        const estd::shared_ptr<File>& file, int flags = 0);
 };
 
 namespace ext2 {
@@ -28,13 +34,39 @@ struct File {
 
     virtual ssize_t read(OpenFileDescription& fd, void* buffer, size_t count) = 0;
     virtual ssize_t write(OpenFileDescription& fd, const void* buffer, size_t count) = 0;
+
+    // Scatter/gather versions of read and write. By default, each buffer is transferred
+    // with a separate call, stopping early at the first short transfer.
+    virtual ssize_t readv(OpenFileDescription& fd, const iovec* iov, int iovcnt);
+    virtual ssize_t writev(OpenFileDescription& fd, const iovec* iov, int iovcnt);
+
     virtual ssize_t readDir(OpenFileDescription& /*fd*/, void* /*buffer*/,
                             size_t /*count*/) {
         return -ENOTDIR;
     }
 
+    // Writes count bytes of this file, starting at offset, to another file without a
+    // round trip through a generic read buffer. Returns the number of bytes written,
+    // or -EINVAL if this file doesn't support it (see sys_sendfile).
+    virtual ssize_t sendTo(uint64_t /*offset*/, size_t /*count*/, File& /*out*/,
+                           OpenFileDescription& /*outFd*/) {
+        return -EINVAL;
+    }
+
+    // Readiness for epoll: returns the EPOLL* events for which a call wouldn't block
+    // right now. Ordinary files are always ready.
+    virtual uint32_t pollEvents() { return EPOLLIN | EPOLLOUT; }
+
+    // Appends the blockers which are woken whenever the result of pollEvents() may have
+    // changed. Files which are always ready have none.
+    virtual void pollBlockers(estd::vector<estd::shared_ptr<Blocker>>& /*blockers*/) {}
+
+    // Writes any modified data to the underlying device
+    virtual int sync() { return -EINVAL; }
+
     virtual bool hasInode() const { return false; }
     virtual bool isSocket() const { return false; }
+    virtual bool isEpoll() const { return false; }
 
     virtual ext2::Inode* inode() { return nullptr; }
 };
@@ -0,0 +1,314 @@
+#include "fs/block_cache.h"
+
+#include <string.h>
+
+#include "estd/algorithm.h"
+#include "estd/print.h"
+#include "klibc.h"
+#include "mm.h"
+#include "units.h"
+
+BlockCache::BlockCache(DiskDevice& disk, size_t blockSize, size_t capacity)
+: _disk(disk),
+  _blockSize(blockSize),
+  _sectorsPerBlock(blockSize / SECTOR_SIZE),
+  _capacity(capacity),
+  _buckets(NUM_BUCKETS, -1) {
+    ASSERT(blockSize % SECTOR_SIZE == 0 && blockSize <= PAGE_SIZE);
+    _writeBuffer = mm.pageAlloc(MAX_WRITE_PAGES);
+}
+
+BlockCache::~BlockCache() {
+    for (PhysicalAddress page : _pages) {
+        mm.pageFree(page);
+    }
+
+    mm.pageFree(_writeBuffer, MAX_WRITE_PAGES);
+}
+
+size_t BlockCache::bucketFor(uint64_t key) const {
+    // Fibonacci hashing
+    return (key * 0x9E3779B97F4A7C15UL) >> (64 - BUCKET_BITS);
+}
+
+int32_t BlockCache::lookup(uint64_t key) const {
+    for (int32_t i = _buckets[bucketFor(key)]; i != -1; i = _entries[i].next) {
+        if (_entries[i].key == key) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+int32_t BlockCache::allocateEntry() {
+    // Carve another page into blocks if we've used all of the existing ones
+    if (_freeEntries.empty()) {
+        PhysicalAddress page = mm.pageAlloc();
+        _pages.push_back(page);
+
+        uint8_t* ptr = mm.physicalToVirtual(page).ptr<uint8_t>();
+        for (size_t offset = 0; offset < PAGE_SIZE; offset += _blockSize) {
+            _freeEntries.push_back(_entries.size());
+            _entries.push_back(Entry{0, ptr + offset, -1, -1, -1, 0, false, false});
+        }
+    }
+
+    int32_t index = _freeEntries.back();
+    _freeEntries.pop_back();
+    return index;
+}
+
+void BlockCache::link(int32_t index) {
+    Entry& entry = _entries[index];
+    size_t bucket = bucketFor(entry.key);
+    entry.next = _buckets[bucket];
+    _buckets[bucket] = index;
+}
+
+void BlockCache::unlink(int32_t index) {
+    size_t bucket = bucketFor(_entries[index].key);
+
+    if (_buckets[bucket] == index) {
+        _buckets[bucket] = _entries[index].next;
+        return;
+    }
+
+    for (int32_t i = _buckets[bucket]; i != -1; i = _entries[i].next) {
+        if (_entries[i].next == index) {
+            _entries[i].next = _entries[index].next;
+            return;
+        }
+    }
+
+    ASSERT(false);
+}
+
+// Moves a cached block to the front of the recency list
+void BlockCache::touch(int32_t index) {
+    if (_newest == index) return;
+
+    removeFromRecency(index);
+    addToRecency(index);
+}
+
+void BlockCache::addToRecency(int32_t index) {
+    Entry& entry = _entries[index];
+    entry.older = _newest;
+    entry.newer = -1;
+    (_newest != -1 ? _entries[_newest].newer : _oldest) = index;
+    _newest = index;
+}
+
+void BlockCache::removeFromRecency(int32_t index) {
+    Entry& entry = _entries[index];
+    (entry.newer != -1 ? _entries[entry.newer].older : _oldest) = entry.older;
+    (entry.older != -1 ? _entries[entry.older].newer : _newest) = entry.newer;
+    entry.newer = -1;
+    entry.older = -1;
+}
+
+void BlockCache::release(int32_t index) {
+    Entry& entry = _entries[index];
+    ASSERT(entry.inUse);
+
+    unlink(index);
+    removeFromRecency(index);
+
+    if (entry.dirty) {
+        --_dirtyCount;
+    }
+
+    entry.inUse = false;
+    entry.dirty = false;
+    --_usedCount;
+
+    // A pinned entry is reused once it's unpinned
+    if (entry.pins == 0) {
+        _freeEntries.push_back(index);
+    }
+}
+
+uint8_t* BlockCache::find(uint64_t key) {
+    int32_t index = lookup(key);
+    if (index == -1) {
+        return nullptr;
+    }
+
+    touch(index);
+    return _entries[index].data;
+}
+
+uint8_t* BlockCache::get(uint64_t key, bool read) {
+    if (uint8_t* data = find(key)) {
+        return data;
+    }
+
+    int32_t index = allocateEntry();
+    Entry& entry = _entries[index];
+
+    if (read && !(key & UNPLACED)) {
+        if (!_disk.readSectors(entry.data, key * _sectorsPerBlock, _sectorsPerBlock)) {
+            println("cache: failed to read block {}", key);
+            _freeEntries.push_back(index);
+            return nullptr;
+        }
+    } else {
+        memset(entry.data, 0, _blockSize);
+    }
+
+    addEntry(index, key);
+    return entry.data;
+}
+
+void BlockCache::insert(uint64_t key, const uint8_t* data) {
+    if (lookup(key) != -1) return;
+
+    int32_t index = allocateEntry();
+    memcpy(_entries[index].data, data, _blockSize);
+    addEntry(index, key);
+}
+
+void BlockCache::addEntry(int32_t index, uint64_t key) {
+    Entry& entry = _entries[index];
+    entry.key = key;
+    entry.inUse = true;
+    entry.dirty = false;
+    link(index);
+    addToRecency(index);
+    ++_usedCount;
+}
+
+void BlockCache::markDirty(uint64_t key) {
+    int32_t index = lookup(key);
+    ASSERT(index != -1);
+
+    if (!_entries[index].dirty) {
+        _entries[index].dirty = true;
+        ++_dirtyCount;
+    }
+}
+
+void BlockCache::rekey(uint64_t oldKey, uint64_t newKey) {
+    int32_t index = lookup(oldKey);
+    if (index == -1) return;
+
+    // Anything cached under the new key is stale
+    discard(newKey);
+    ++_generation;
+
+    unlink(index);
+    _entries[index].key = newKey;
+    link(index);
+}
+
+void BlockCache::discard(uint64_t key) {
+    ++_generation;
+
+    int32_t index = lookup(key);
+    if (index != -1) {
+        release(index);
+    }
+}
+
+const uint8_t* BlockCache::pin(uint64_t key, int32_t& handle) {
+    handle = lookup(key);
+    if (handle == -1) {
+        return nullptr;
+    }
+
+    touch(handle);
+    Entry& entry = _entries[handle];
+    ++entry.pins;
+    return entry.data;
+}
+
+void BlockCache::unpin(int32_t handle) {
+    Entry& entry = _entries[handle];
+    ASSERT(entry.pins > 0);
+
+    if (--entry.pins == 0 && !entry.inUse) {
+        _freeEntries.push_back(handle);
+    }
+}
+
+bool BlockCache::writeRun(int32_t* indices, size_t count) {
+    uint64_t lba = _entries[indices[0]].key * _sectorsPerBlock;
+    size_t numSectors = count * _sectorsPerBlock;
+
+    bool success;
+    if (count == 1) {
+        success = _disk.writeSectors(_entries[indices[0]].data, lba, numSectors);
+    } else {
+        uint8_t* buffer = mm.physicalToVirtual(_writeBuffer).ptr<uint8_t>();
+        for (size_t i = 0; i < count; ++i) {
+            memcpy(buffer + i * _blockSize, _entries[indices[i]].data, _blockSize);
+        }
+
+        success = _disk.writeSectors(buffer, lba, numSectors);
+    }
+
+    if (!success) {
+        println("cache: failed to write blocks {}-{}", _entries[indices[0]].key,
+                _entries[indices[0]].key + count - 1);
+        return false;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        _entries[indices[i]].dirty = false;
+        --_dirtyCount;
+    }
+
+    ++_generation;
+    return true;
+}
+
+bool BlockCache::flush() {
+    estd::vector<int32_t> dirty;
+    for (size_t i = 0; i < _entries.size(); ++i) {
+        const Entry& entry = _entries[i];
+        if (entry.inUse && entry.dirty && !(entry.key & UNPLACED)) {
+            dirty.push_back(i);
+        }
+    }
+
+    // Sort by block number
+    estd::sort(dirty.begin(), dirty.end(), [this](int32_t lhs, int32_t rhs) {
+        return _entries[lhs].key < _entries[rhs].key;
+    });
+
+    // Write each run of adjacent blocks with a single request
+    size_t maxRun = MAX_WRITE_PAGES * PAGE_SIZE / _blockSize;
+    bool success = true;
+    size_t i = 0;
+    while (i < dirty.size()) {
+        size_t runLength = 1;
+        while (i + runLength < dirty.size() && runLength < maxRun &&
+               _entries[dirty[i + runLength]].key ==
+                   _entries[dirty[i]].key + runLength) {
+            ++runLength;
+        }
+
+        if (!writeRun(&dirty[i], runLength)) {
+            success = false;
+        }
+
+        i += runLength;
+    }
+
+    return success;
+}
+
+void BlockCache::trim() {
+    // One pass from the least-recently used end, past any dirty or pinned blocks
+    int32_t index = _oldest;
+    while (_usedCount > _capacity && index != -1) {
+        const Entry& entry = _entries[index];
+        int32_t newer = entry.newer;
+        if (!entry.dirty && entry.pins == 0) {
+            release(index);
+        }
+
+        index = newer;
+    }
+}
@@ -0,0 +1,119 @@
+// Write-back cache of filesystem blocks
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "address.h"
+#include "disk.h"
+#include "estd/vector.h"
+
+// Holds the contents of recently-used disk blocks in memory, along with modified blocks
+// until they're flushed. Blocks are identified by a 64-bit key, which is the block number
+// for blocks with a location on disk. Keys with the UNPLACED bit set name blocks which
+// don't have a location yet (see delayed allocation in ext2), and which are renamed by
+// rekey() once they're given one.
+//
+// Not thread-safe: the owner is responsible for serializing access.
+class BlockCache {
+public:
+    static constexpr uint64_t UNPLACED = 1UL << 63;
+
+    static uint64_t unplacedKey(uint32_t owner, uint32_t index) {
+        return UNPLACED | (static_cast<uint64_t>(owner) << 32) | index;
+    }
+
+    BlockCache(DiskDevice& disk, size_t blockSize, size_t capacity);
+    ~BlockCache();
+
+    // Returns the cached contents of a block. If it isn't cached yet, it's read from disk
+    // if read is true (and the block isn't unplaced), or zero-filled otherwise. Returns
+    // nullptr on I/O error. The pointer remains valid until the next call to trim().
+    uint8_t* get(uint64_t key, bool read = true);
+
+    // Returns the cached contents of a block, or nullptr if it isn't cached
+    uint8_t* find(uint64_t key);
+
+    // Adds a clean block which was read from disk by the caller, unless it's cached
+    // already, in which case the cached copy is kept
+    void insert(uint64_t key, const uint8_t* data);
+
+    // Changes whenever a block is written to disk or changes location, after which data
+    // read from disk before then may be stale
+    uint64_t generation() const { return _generation; }
+
+    void markDirty(uint64_t key);
+    void rekey(uint64_t oldKey, uint64_t newKey);
+
+    // Drops a block from the cache, even if it's dirty
+    void discard(uint64_t key);
+
+    // Keeps a cached block's memory from being evicted or reused until it's unpinned, so
+    // that the owner can read it without holding its lock. Returns the block's contents
+    // (or nullptr if it isn't cached), and sets handle, which identifies the block for
+    // unpin even if it's rekeyed or discarded in the meantime.
+    const uint8_t* pin(uint64_t key, int32_t& handle);
+    void unpin(int32_t handle);
+
+    // Writes every dirty block with a location on disk, in ascending order, coalescing
+    // runs of adjacent blocks into a single request
+    bool flush();
+
+    // Evicts clean blocks, least-recently used first, until the cache is within its
+    // capacity again. Dirty and pinned blocks are never evicted.
+    void trim();
+
+    size_t capacity() const { return _capacity; }
+    size_t dirtyCount() const { return _dirtyCount; }
+
+private:
+    struct Entry {
+        uint64_t key;
+        uint8_t* data;
+        int32_t next;  // Next entry in the same hash bucket, or -1
+
+        // Neighbours in the recency list, or -1 at either end
+        int32_t newer;
+        int32_t older;
+
+        uint32_t pins;
+        bool inUse;
+        bool dirty;
+    };
+
+    static constexpr size_t BUCKET_BITS = 10;
+    static constexpr size_t NUM_BUCKETS = 1 << BUCKET_BITS;
+    static constexpr size_t MAX_WRITE_PAGES = 16;
+
+    size_t bucketFor(uint64_t key) const;
+    int32_t lookup(uint64_t key) const;
+    int32_t allocateEntry();
+    void addEntry(int32_t index, uint64_t key);
+    void link(int32_t index);
+    void unlink(int32_t index);
+    void touch(int32_t index);
+    void addToRecency(int32_t index);
+    void removeFromRecency(int32_t index);
+    void release(int32_t index);
+    bool writeRun(int32_t* indices, size_t count);
+
+    DiskDevice& _disk;
+    size_t _blockSize;
+    size_t _sectorsPerBlock;
+    size_t _capacity;
+
+    estd::vector<Entry> _entries;
+    estd::vector<int32_t> _buckets;
+    estd::vector<int32_t> _freeEntries;
+    estd::vector<PhysicalAddress> _pages;
+    size_t _usedCount = 0;
+    size_t _dirtyCount = 0;
+
+    // Every cached block, from the most recently used to the least
+    int32_t _newest = -1;
+    int32_t _oldest = -1;
+
+    uint64_t _generation = 0;
+
+    // Staging area for coalesced writes
+    PhysicalAddress _writeBuffer;
+};
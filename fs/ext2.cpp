@@ -3,15 +3,37 @@
 #include <string.h>
 
 #include "api/errno.h"
+#include "api/fcntl.h"
 #include "estd/print.h"
+#include "fs/ext2_file.h"
+#include "fs/ext2_hash.h"
 #include "klibc.h"
+#include "mm.h"
+#include "scheduler.h"
+#include "system.h"
+#include "thread.h"
+#include "timer.h"
 #include "units.h"
 
+// Memory used to cache filesystem blocks
+static constexpr size_t BLOCK_CACHE_SIZE = 1 * MiB;
+
+// How often (in timer ticks) the write-back thread flushes modified data
+static constexpr uint64_t WRITEBACK_INTERVAL = 500;
+
+// Most file blocks read from disk in a single batch
+static constexpr uint32_t MAX_FETCH_BLOCKS = 32;
+
 size_t Ext2FileSystem::blockSize() const { return 1024UL << _superBlock->log_block_size; }
 size_t Ext2FileSystem::numBlockGroups() const {
     return ceilDiv(_superBlock->blocks_count, _superBlock->blocks_per_group);
 }
 size_t Ext2FileSystem::sectorsPerBlock() const { return blockSize() / SECTOR_SIZE; }
+size_t Ext2FileSystem::entriesPerBlock() const { return blockSize() / sizeof(uint32_t); }
+size_t Ext2FileSystem::maxFileBlocks() const {
+    // We don't support triply-indirect blocks
+    return 12 + entriesPerBlock() + entriesPerBlock() * entriesPerBlock();
+}
 
 bool Ext2FileSystem::readSuperBlock() {
     // The ext2 superblock is always 1024 bytes (2 sectors) at LBA 2 (offset
@@ -52,375 +74,1830 @@ bool Ext2FileSystem::readSuperBlock() {
         return false;
     }
 
+    if (blockSize() > PAGE_SIZE) {
+        println("ext2: unsupported block size: {}", blockSize());
+        return false;
+    }
+
     return true;
 }
 
-bool Ext2FileSystem::readBlockGroupDescriptorTable() {
+uint32_t Ext2FileSystem::blockGroupDescriptorTableBlock() const {
     // Starts on the first block following the superblock
-    size_t blockId = _superBlock->log_block_size == 0 ? 2 : 1;
+    return _superBlock->log_block_size == 0 ? 2 : 1;
+}
 
+bool Ext2FileSystem::readBlockGroupDescriptorTable() {
     _blockGroups.assign(new ext2::BlockGroupDescriptor[numBlockGroups()]);
 
     size_t numBytes = numBlockGroups() * sizeof(ext2::BlockGroupDescriptor);
-    if (!readRange(_blockGroups.get(), blockId, numBytes)) {
+    if (!readRange(_blockGroups.get(), blockGroupDescriptorTableBlock(), numBytes)) {
         return false;
     }
 
     return true;
 }
 
-estd::unique_ptr<ext2::Inode> Ext2FileSystem::readInode(uint32_t ino) {
-    uint32_t blockGroup = (ino - 1) / _superBlock->inodes_per_group;
-    uint32_t index = (ino - 1) % _superBlock->inodes_per_group;
-
-    uint32_t blockId = _blockGroups[blockGroup].inode_table;
-    uint32_t offset = index * _superBlock->inode_size;
-
-    estd::unique_ptr<ext2::Inode> inode(new ext2::Inode);
-    if (!readRange(inode.get(), blockId, sizeof(ext2::Inode), offset)) {
-        return {};
+bool Ext2FileSystem::readBlock(void* dest, uint32_t blockId) {
+    uint8_t* data = _cache->get(blockId);
+    if (!data) {
+        return false;
     }
 
-    return inode;
+    memcpy(dest, data, blockSize());
+    return true;
 }
 
-bool Ext2FileSystem::readFullFile(const ext2::Inode& inode, uint8_t* dest) {
-    size_t numBlocks = ceilDiv(inode.size(), blockSize());
-
-    size_t blocksRemaining = numBlocks;
-    size_t bytesRemaining = inode.size();
-
-    // Direct blocks
-    for (size_t i = 0; i < 12; ++i) {
-        ASSERT((bytesRemaining <= blockSize()) == (blocksRemaining == 1));
+bool Ext2FileSystem::readRange(void* dest, uint32_t blockId, uint32_t numBytes,
+                               uint32_t offset) {
+    blockId += offset / blockSize();
+    offset %= blockSize();
 
-        if (!readBlock(dest, inode.block[i], bytesRemaining)) {
+    uint8_t* out = static_cast<uint8_t*>(dest);
+    while (numBytes > 0) {
+        uint8_t* data = _cache->get(blockId);
+        if (!data) {
             return false;
         }
 
-        --blocksRemaining;
+        uint32_t chunk = min<uint32_t>(numBytes, blockSize() - offset);
+        memcpy(out, data + offset, chunk);
 
-        if (blocksRemaining == 0) {
-            return true;
-        }
-
-        dest += blockSize();
-        bytesRemaining -= blockSize();
+        out += chunk;
+        numBytes -= chunk;
+        offset = 0;
+        ++blockId;
     }
 
-    // Indirect blocks
-    size_t entriesPerBlock = blockSize() / sizeof(uint32_t);
-    estd::unique_ptr<uint32_t[]> indBlock(new uint32_t[entriesPerBlock]);
-    if (!readBlock(indBlock.get(), inode.block[12])) {
-        return false;
-    }
+    return true;
+}
 
-    for (size_t i = 0; i < entriesPerBlock; ++i) {
-        ASSERT((bytesRemaining <= blockSize()) == (blocksRemaining == 1));
+bool Ext2FileSystem::writeRange(const void* src, uint32_t blockId, uint32_t numBytes,
+                                uint32_t offset) {
+    blockId += offset / blockSize();
+    offset %= blockSize();
 
-        if (!readBlock(dest, indBlock[i], bytesRemaining)) {
+    const uint8_t* in = static_cast<const uint8_t*>(src);
+    while (numBytes > 0) {
+        uint32_t chunk = min<uint32_t>(numBytes, blockSize() - offset);
+
+        // No need to read a block which is about to be overwritten completely
+        uint8_t* data = _cache->get(blockId, chunk < blockSize());
+        if (!data) {
             return false;
         }
 
-        --blocksRemaining;
-
-        if (blocksRemaining == 0) {
-            return true;
-        }
+        memcpy(data + offset, in, chunk);
+        _cache->markDirty(blockId);
 
-        dest += blockSize();
-        bytesRemaining -= blockSize();
+        in += chunk;
+        numBytes -= chunk;
+        offset = 0;
+        ++blockId;
     }
 
-    // TODO: support doubly-indirect and triply-indirect blocks
-    println("ext2: doubly- and triply-indirect blocks are unsupported");
-    return false;
+    return true;
 }
 
-ssize_t Ext2FileSystem::readFromFile(const ext2::Inode& inode, uint8_t* dest,
-                                     uint32_t size, uint32_t offset) {
-    // Clip the read at the end of the file
-    if (offset > inode.size()) {
-        return 0;
-    } else if (size > inode.size() - offset) {
-        size = inode.size() - offset;
-    }
-
-    // TODO: this is insanely inefficient, should read only what's needed
-    size_t numBlocks = ceilDiv(inode.size(), blockSize());
+//// Inodes
 
-    Buffer buffer(numBlocks * blockSize());
-    if (!readFullFile(inode, buffer.get())) return -EIO;
+Ext2Inode* Ext2FileSystem::findOpenInode(uint32_t ino) {
+    for (auto& inode : _openInodes) {
+        if (inode->ino == ino) {
+            return inode.get();
+        }
+    }
 
-    memcpy(dest, &buffer[offset], size);
-    return size;
+    return nullptr;
 }
 
-bool Ext2FileSystem::readBlock(void* dest, uint32_t blockId) {
-    size_t lba = blockId * sectorsPerBlock();
-    size_t numSectors = sectorsPerBlock();
-
-    if (!_disk.readSectors(dest, lba, numSectors)) {
+bool Ext2FileSystem::inodeLocation(uint32_t ino, uint32_t& blockId, uint32_t& offset) {
+    if (ino == 0 || ino > _superBlock->inodes_count) {
         return false;
     }
 
+    uint32_t blockGroup = (ino - 1) / _superBlock->inodes_per_group;
+    uint32_t index = (ino - 1) % _superBlock->inodes_per_group;
+    uint32_t byteOffset = index * _superBlock->inode_size;
+
+    blockId = _blockGroups[blockGroup].inode_table + byteOffset / blockSize();
+    offset = byteOffset % blockSize();
     return true;
 }
 
-bool Ext2FileSystem::readBlock(void* dest, uint32_t blockId, uint32_t maxBytes) {
-    if (maxBytes >= blockSize()) {
-        return readBlock(dest, blockId);
+estd::unique_ptr<ext2::Inode> Ext2FileSystem::readInodeLocked(uint32_t ino) {
+    estd::unique_ptr<ext2::Inode> inode(new ext2::Inode);
+
+    // The in-memory copy may have changes which haven't been written yet
+    if (Ext2Inode* openInode = findOpenInode(ino)) {
+        *inode = openInode->data;
+        return inode;
     }
 
-    Buffer buffer(blockSize());
-    if (!readBlock(buffer.get(), blockId)) {
-        return false;
+    uint32_t blockId, offset;
+    if (!inodeLocation(ino, blockId, offset)) {
+        return {};
     }
 
-    memcpy(dest, buffer.get(), maxBytes);
-    return true;
+    if (!readRange(inode.get(), blockId, sizeof(ext2::Inode), offset)) {
+        return {};
+    }
+
+    return inode;
 }
 
-bool Ext2FileSystem::readRange(void* dest, uint32_t blockId, uint32_t numBytes,
-                               uint32_t offset) {
-    size_t lba = blockId * sectorsPerBlock();
-    size_t numSectors = ceilDiv(offset + numBytes, SECTOR_SIZE);
+estd::unique_ptr<ext2::Inode> Ext2FileSystem::readInode(uint32_t ino) {
+    MutexLocker locker(_lock);
+    auto inode = readInodeLocked(ino);
+    finishOperation();
+    return inode;
+}
 
-    if (offset >= SECTOR_SIZE) {
-        size_t skipSectors = offset / SECTOR_SIZE;
-        lba += skipSectors;
-        numSectors -= skipSectors;
-        offset -= skipSectors * SECTOR_SIZE;
+estd::shared_ptr<Ext2Inode> Ext2FileSystem::getInodeLocked(uint32_t ino) {
+    for (auto& inode : _openInodes) {
+        if (inode->ino == ino) {
+            return inode;
+        }
     }
 
-    Buffer buffer(numSectors * SECTOR_SIZE);
-    if (!_disk.readSectors(buffer.get(), lba, numSectors)) {
-        return false;
+    auto data = readInodeLocked(ino);
+    if (!data) {
+        return {};
     }
 
-    memcpy(dest, &buffer[offset], numBytes);
-    return true;
+    estd::shared_ptr<Ext2Inode> inode(new Ext2Inode(ino, *data));
+    inode->version = ++_lastVersion;
+    _openInodes.push_back(inode);
+    return inode;
 }
 
-bool Ext2FileSystem::init() {
-    if (!readSuperBlock()) {
-        println("ext2: error while reading superblock");
-        return false;
-    }
+estd::shared_ptr<Ext2Inode> Ext2FileSystem::getInode(uint32_t ino) {
+    MutexLocker locker(_lock);
+    auto inode = getInodeLocked(ino);
+    finishOperation();
+    return inode;
+}
 
-    if (!readBlockGroupDescriptorTable()) {
-        println("ext2: error while reading block group descriptor table");
+bool Ext2FileSystem::writeInode(Ext2Inode& inode) {
+    uint32_t blockId, offset;
+    if (!inodeLocation(inode.ino, blockId, offset)) {
         return false;
     }
 
-    _rootInode = readInode(ext2::ROOT_INO);
-    if (!_rootInode) {
-        println("ext2: error while reading root directory inode");
+    if (!writeRange(&inode.data, blockId, sizeof(ext2::Inode), offset)) {
         return false;
     }
 
-    if (!_rootInode->isDirectory()) {
-        println("ext2: root directory is not a directory");
-        return false;
-    }
+    inode.dirty = false;
+    return true;
+}
 
-    _rootDir = Buffer(_rootInode->size());
-    ASSERT(_rootInode->size() % blockSize() == 0);
-    if (!readFullFile(*_rootInode, _rootDir.get())) {
-        println("ext2: failed to read root directory");
-        return false;
+uint32_t Ext2FileSystem::allocateInode(uint32_t preferredGroup) {
+    uint32_t inodesPerGroup = _superBlock->inodes_per_group;
+
+    for (size_t i = 0; i < numBlockGroups(); ++i) {
+        uint32_t group = (preferredGroup + i) % numBlockGroups();
+        if (_blockGroups[group].free_inodes_count == 0) continue;
+
+        uint32_t bitmapBlock = _blockGroups[group].inode_bitmap;
+        uint8_t* bitmap = _cache->get(bitmapBlock);
+        if (!bitmap) {
+            return 0;
+        }
+
+        for (uint32_t bit = 0; bit < inodesPerGroup; ++bit) {
+            uint32_t ino = group * inodesPerGroup + bit + 1;
+            if (ino < _superBlock->first_ino) continue;
+            if (checkBit(bitmap[bit / 8], bit % 8)) continue;
+
+            bitmap[bit / 8] |= 1 << (bit % 8);
+            _cache->markDirty(bitmapBlock);
+
+            --_blockGroups[group].free_inodes_count;
+            --_superBlock->free_inodes_count;
+            _metadataDirty = true;
+            return ino;
+        }
     }
 
-    println("ext2: init complete");
-    return true;
+    return 0;
 }
 
-uint32_t Ext2FileSystem::lookup(uint32_t cwdIno, const char* path) {
-    // TODO: check path pointer points to valid memory
+void Ext2FileSystem::freeInode(uint32_t ino) {
+    uint32_t group = (ino - 1) / _superBlock->inodes_per_group;
+    uint32_t bit = (ino - 1) % _superBlock->inodes_per_group;
 
-    // If the path is absolute, start at the root directory rather than the cwd
-    uint32_t currentIno;
-    if (path[0] == '/') {
-        currentIno = ext2::ROOT_INO;
-    } else {
-        currentIno = cwdIno;
+    uint32_t bitmapBlock = _blockGroups[group].inode_bitmap;
+    uint8_t* bitmap = _cache->get(bitmapBlock);
+    if (!bitmap) {
+        println("ext2: failed to free inode {}", ino);
+        return;
     }
 
-    estd::unique_ptr<ext2::Inode> current = readInode(currentIno);
+    bitmap[bit / 8] &= ~(1 << (bit % 8));
+    _cache->markDirty(bitmapBlock);
 
-    const char* p = path;
-    while (true) {
-        while (*p == '/') {
-            ++p;
-        }
+    ++_blockGroups[group].free_inodes_count;
+    ++_superBlock->free_inodes_count;
+    _metadataDirty = true;
+}
 
-        // If we've reached the end of the path, we're done
-        if (*p == '\0') {
-            return currentIno;
-        }
+//// Block allocation
+
+uint32_t Ext2FileSystem::groupOfBlock(uint32_t blockId) const {
+    return (blockId - _superBlock->first_data_block) / _superBlock->blocks_per_group;
+}
 
-        // Find the next component of the path
-        const char* next = strchr(p, '/');
-        if (!next) {
-            next = p + strlen(p);
+bool Ext2FileSystem::isReserved(uint32_t blockId, const Ext2Inode* owner) {
+    for (auto& inode : _openInodes) {
+        if (inode.get() == owner) continue;
+
+        if (blockId >= inode->reservationStart &&
+            blockId - inode->reservationStart < inode->reservationCount) {
+            return true;
         }
+    }
 
-        // Make sure that current location is a directory
-        if (!current->isDirectory()) {
-            return ext2::BAD_INO;
+    return false;
+}
+
+uint32_t Ext2FileSystem::claimRun(uint32_t start, uint32_t maxCount,
+                                  const Ext2Inode* owner) {
+    // Marks free blocks as used, starting at start, until reaching maxCount blocks, a
+    // block which is used or reserved by another file, or the end of the block group
+    uint32_t group = groupOfBlock(start);
+    uint32_t groupStart =
+        _superBlock->first_data_block + group * _superBlock->blocks_per_group;
+    uint32_t groupEnd =
+        min(groupStart + _superBlock->blocks_per_group, _superBlock->blocks_count);
+
+    uint32_t bitmapBlock = _blockGroups[group].block_bitmap;
+    uint8_t* bitmap = _cache->get(bitmapBlock);
+    if (!bitmap) {
+        return 0;
+    }
+
+    uint32_t count = 0;
+    while (count < maxCount && start + count < groupEnd) {
+        uint32_t bit = start + count - groupStart;
+        if (checkBit(bitmap[bit / 8], bit % 8) || isReserved(start + count, owner)) {
+            break;
         }
 
-        Buffer dirBuffer(current->size());
-        if (!readFullFile(*current, dirBuffer.get())) {
-            println("ext2: corrupt filesystem when looking up '{}'", path);
-            return ext2::BAD_INO;
+        bitmap[bit / 8] |= 1 << (bit % 8);
+        ++count;
+    }
+
+    if (count > 0) {
+        _cache->markDirty(bitmapBlock);
+        _blockGroups[group].free_blocks_count -= count;
+        _superBlock->free_blocks_count -= count;
+        _metadataDirty = true;
+    }
+
+    return count;
+}
+
+uint32_t Ext2FileSystem::allocateBlocks(uint32_t goal, uint32_t maxCount, uint32_t& count,
+                                        const Ext2Inode* owner) {
+    if (goal < _superBlock->first_data_block || goal >= _superBlock->blocks_count) {
+        goal = _superBlock->first_data_block;
+    }
+
+    // Search forward from the goal, wrapping around to the blocks before it in the same
+    // group at the end
+    uint32_t startGroup = groupOfBlock(goal);
+    for (size_t i = 0; i <= numBlockGroups(); ++i) {
+        uint32_t group = (startGroup + i) % numBlockGroups();
+        if (_blockGroups[group].free_blocks_count == 0) continue;
+
+        uint32_t groupStart =
+            _superBlock->first_data_block + group * _superBlock->blocks_per_group;
+        uint32_t groupEnd =
+            min(groupStart + _superBlock->blocks_per_group, _superBlock->blocks_count);
+
+        uint8_t* bitmap = _cache->get(_blockGroups[group].block_bitmap);
+        if (!bitmap) {
+            count = 0;
+            return 0;
         }
 
-        // Search for the next component in the current directory
-        ext2::DirectoryEntry* foundEntry = nullptr;
-        uint64_t offset = 0;
-        while (offset < current->size()) {
-            ext2::DirectoryEntry* dirEntry =
-                reinterpret_cast<ext2::DirectoryEntry*>(&dirBuffer[offset]);
+        uint32_t block = (i == 0) ? goal : groupStart;
+        while (block < groupEnd) {
+            uint32_t bit = block - groupStart;
 
-            if (dirEntry->name_len == next - p &&
-                strncmp(p, dirEntry->name, next - p) == 0) {
-                foundEntry = dirEntry;
-                break;
+            // Skip over full bytes of the bitmap
+            if (bit % 8 == 0 && bitmap[bit / 8] == 0xFF) {
+                block += 8;
+                continue;
             }
 
-            offset += dirEntry->rec_len;
+            if (!checkBit(bitmap[bit / 8], bit % 8) && !isReserved(block, owner)) {
+                count = claimRun(block, maxCount, owner);
+                ASSERT(count > 0);
+                return block;
+            }
+
+            ++block;
         }
+    }
 
-        if (!foundEntry) {
-            return ext2::BAD_INO;
+    // The only free blocks left may be reserved for other files, so give up the
+    // reservations and try again
+    bool anyReserved = false;
+    for (auto& inode : _openInodes) {
+        if (inode->reservationCount > 0) {
+            inode->reservationCount = 0;
+            anyReserved = true;
         }
+    }
 
-        // Load the inode for the next component
-        currentIno = foundEntry->inode;
-        current = readInode(currentIno);
-        if (!current) {
-            println("ext2: corrupt filesystem when looking up '{}'", path);
-            return ext2::BAD_INO;
+    if (anyReserved) {
+        return allocateBlocks(goal, maxCount, count, owner);
+    }
+
+    count = 0;
+    return 0;
+}
+
+void Ext2FileSystem::reserveWindow(Ext2Inode& inode, uint32_t start) {
+    inode.reservationStart = start;
+    inode.reservationCount = 0;
+
+    if (start >= _superBlock->blocks_count) return;
+
+    uint32_t group = groupOfBlock(start);
+    uint32_t groupStart =
+        _superBlock->first_data_block + group * _superBlock->blocks_per_group;
+    uint32_t groupEnd =
+        min(groupStart + _superBlock->blocks_per_group, _superBlock->blocks_count);
+
+    uint8_t* bitmap = _cache->get(_blockGroups[group].block_bitmap);
+    if (!bitmap) return;
+
+    uint32_t count = 0;
+    while (count < inode.reservationWindow && start + count < groupEnd) {
+        uint32_t bit = start + count - groupStart;
+        if (checkBit(bitmap[bit / 8], bit % 8) || isReserved(start + count, &inode)) {
+            break;
         }
 
-        p = next;
+        ++count;
     }
+
+    inode.reservationCount = count;
 }
 
-static int prependString(char* dest, const char* src, size_t srcLength, size_t n) {
-    size_t destLen = strlen(dest);
-    if (srcLength + destLen + 1 > n) {
-        return -ENAMETOOLONG;
+uint32_t Ext2FileSystem::allocateDataBlocks(Ext2Inode& inode, uint32_t goal,
+                                            uint32_t maxCount, uint32_t& count) {
+    // If this allocation picks up where the last one left off, continue into the
+    // file's reservation window
+    if (inode.reservationCount > 0 && goal == inode.reservationStart) {
+        count = claimRun(goal, min(maxCount, inode.reservationCount), &inode);
+        if (count > 0) {
+            inode.reservationStart += count;
+            inode.reservationCount -= count;
+
+            // The file is being written sequentially, so reserve a larger window next
+            if (inode.reservationCount == 0) {
+                inode.reservationWindow =
+                    min(2 * inode.reservationWindow, Ext2Inode::MAX_RESERVATION);
+                reserveWindow(inode, goal + count);
+            }
+
+            return goal;
+        }
+    } else {
+        inode.reservationWindow = Ext2Inode::MIN_RESERVATION;
     }
 
-    memmove(dest + srcLength, dest, destLen + 1);
-    memcpy(dest, src, srcLength);
-    return 0;
+    // Otherwise, allocate somewhere new, and reserve the blocks which follow it
+    uint32_t start = allocateBlocks(goal, maxCount, count, &inode);
+    if (start == 0) {
+        return 0;
+    }
+
+    reserveWindow(inode, start + count);
+    return start;
 }
 
-uint32_t Ext2FileSystem::getParent(const ext2::Inode& inode) {
-    ASSERT(inode.isDirectory());
+void Ext2FileSystem::freeBlock(uint32_t blockId) {
+    uint32_t group = groupOfBlock(blockId);
+    uint32_t bit =
+        blockId - _superBlock->first_data_block - group * _superBlock->blocks_per_group;
 
-    // Read the contents of the current directory
-    Buffer dirBuffer(inode.size());
-    if (!readFullFile(inode, dirBuffer.get())) {
-        return -1;
+    uint32_t bitmapBlock = _blockGroups[group].block_bitmap;
+    uint8_t* bitmap = _cache->get(bitmapBlock);
+    if (!bitmap) {
+        println("ext2: failed to free block {}", blockId);
+        return;
     }
 
-    // Search for the parent directory ".."
-    uint64_t offset = 0;
-    while (offset < inode.size()) {
-        ext2::DirectoryEntry* dirEntry =
-            reinterpret_cast<ext2::DirectoryEntry*>(&dirBuffer[offset]);
+    if (!checkBit(bitmap[bit / 8], bit % 8)) {
+        println("ext2: freeing block {}, which is already free", blockId);
+        return;
+    }
 
-        if (dirEntry->name_len == 2 &&
-            strncmp(dirEntry->name, "..", dirEntry->name_len) == 0) {
-            return dirEntry->inode;
-        }
+    bitmap[bit / 8] &= ~(1 << (bit % 8));
+    _cache->markDirty(bitmapBlock);
 
-        offset += dirEntry->rec_len;
+    ++_blockGroups[group].free_blocks_count;
+    ++_superBlock->free_blocks_count;
+    _metadataDirty = true;
+
+    // Any modifications to the old contents no longer matter
+    _cache->discard(blockId);
+}
+
+bool Ext2FileSystem::reserveDelayedBlock() {
+    // A delayed block is counted against the free space as soon as it's written, so that
+    // allocating it later can't fail. Some extra space is held back for the indirect
+    // blocks which might be needed to map it.
+    uint32_t metadataReserve = _delayedBlockCount / entriesPerBlock() + 2;
+    if (_superBlock->free_blocks_count < _delayedBlockCount + metadataReserve + 1) {
+        return false;
     }
 
-    return ext2::BAD_INO;
+    ++_delayedBlockCount;
+    return true;
 }
 
-int Ext2FileSystem::getPath(uint32_t ino, char* path, size_t pathSize) {
-    if (pathSize == 0) {
-        return -EINVAL;
+uint32_t Ext2FileSystem::allocationGoal(Ext2Inode& inode, uint32_t fileBlock) {
+    // Place the block immediately after the previous block of the file
+    if (fileBlock > 0) {
+        uint32_t prevBlock = mapFileBlock(inode.data, fileBlock - 1);
+        if (prevBlock != 0) {
+            return prevBlock + 1;
+        }
     }
 
-    path[0] = '\0';
+    if (inode.reservationCount > 0) {
+        return inode.reservationStart;
+    }
 
-    if (ino == ext2::ROOT_INO) {
-        return prependString(path, "/", 1, pathSize);
+    // Otherwise, start in the block group which holds the inode
+    uint32_t group = (inode.ino - 1) / _superBlock->inodes_per_group;
+    return _superBlock->first_data_block + group * _superBlock->blocks_per_group;
+}
+
+uint32_t Ext2FileSystem::allocateIndirectBlock(Ext2Inode& inode, uint32_t goal) {
+    uint32_t count;
+    uint32_t blockId = allocateBlocks(goal, 1, count, nullptr);
+    if (blockId == 0) {
+        return 0;
     }
 
-    estd::unique_ptr<ext2::Inode> inode = readInode(ino);
-    if (!inode) {
-        return -EIO;
+    uint8_t* data = _cache->get(blockId, false);
+    memset(data, 0, blockSize());
+    _cache->markDirty(blockId);
+
+    inode.data.blocks += sectorsPerBlock();
+    return blockId;
+}
+
+bool Ext2FileSystem::setFileBlock(Ext2Inode& inode, uint32_t fileBlock, uint32_t blockId) {
+    ext2::Inode& data = inode.data;
+    inode.dirty = true;
+
+    // Direct blocks
+    if (fileBlock < 12) {
+        data.block[fileBlock] = blockId;
+        return true;
     }
 
-    uint32_t currentIno = ino;
-    while (true) {
-        if (!inode->isDirectory()) {
-            return -ENOTDIR;
+    fileBlock -= 12;
+
+    // Find (or create) the indirect block which maps this file block
+    uint32_t indBlockId;
+    uint32_t index;
+    if (fileBlock < entriesPerBlock()) {
+        if (data.block[12] == 0) {
+            data.block[12] = allocateIndirectBlock(inode, blockId);
+            if (data.block[12] == 0) return false;
         }
 
-        uint32_t parentIno = getParent(*inode);
-        if (parentIno == ext2::BAD_INO) {
-            return -EIO;
+        indBlockId = data.block[12];
+        index = fileBlock;
+    } else {
+        fileBlock -= entriesPerBlock();
+        if (fileBlock >= entriesPerBlock() * entriesPerBlock()) {
+            println("ext2: triply-indirect blocks are unsupported");
+            return false;
         }
 
-        estd::unique_ptr<ext2::Inode> parent = readInode(parentIno);
-        if (!parent) {
-            return -EIO;
+        if (data.block[13] == 0) {
+            data.block[13] = allocateIndirectBlock(inode, blockId);
+            if (data.block[13] == 0) return false;
         }
 
-        // Search the parent directory for an entry pointing to currentIno
-        Buffer dirBuffer(parent->size());
-        if (!readFullFile(*parent, dirBuffer.get())) {
-            return -EIO;
+        uint32_t slot = fileBlock / entriesPerBlock();
+        uint32_t* dindBlock = reinterpret_cast<uint32_t*>(_cache->get(data.block[13]));
+        if (!dindBlock) return false;
+
+        if (dindBlock[slot] == 0) {
+            uint32_t newBlockId = allocateIndirectBlock(inode, blockId);
+            if (newBlockId == 0) return false;
+
+            dindBlock[slot] = newBlockId;
+            _cache->markDirty(data.block[13]);
         }
 
-        ext2::DirectoryEntry* foundEntry = nullptr;
-        uint64_t offset = 0;
-        while (offset < parent->size()) {
-            ext2::DirectoryEntry* dirEntry =
-                reinterpret_cast<ext2::DirectoryEntry*>(&dirBuffer[offset]);
+        indBlockId = dindBlock[slot];
+        index = fileBlock % entriesPerBlock();
+    }
 
-            if (dirEntry->inode == currentIno) {
-                foundEntry = dirEntry;
+    uint32_t* indBlock = reinterpret_cast<uint32_t*>(_cache->get(indBlockId));
+    if (!indBlock) return false;
+
+    indBlock[index] = blockId;
+    _cache->markDirty(indBlockId);
+    return true;
+}
+
+bool Ext2FileSystem::allocateDelayedBlocks(Ext2Inode& inode) {
+    auto& blocks = inode.delayedBlocks;
+
+    bool success = true;
+    size_t done = 0;
+    while (done < blocks.size()) {
+        // Allocate each run of consecutive file blocks together, so that it ends up
+        // contiguous on disk if at all possible
+        uint32_t fileBlock = blocks[done];
+        size_t runLength = 1;
+        while (done + runLength < blocks.size() &&
+               blocks[done + runLength] == fileBlock + runLength) {
+            ++runLength;
+        }
+
+        uint32_t count;
+        uint32_t start = allocateDataBlocks(inode, allocationGoal(inode, fileBlock),
+                                            runLength, count);
+        if (start == 0) {
+            println("ext2: no space to allocate delayed blocks of inode {}", inode.ino);
+            success = false;
+            break;
+        }
+
+        for (uint32_t i = 0; i < count; ++i) {
+            if (!setFileBlock(inode, fileBlock + i, start + i)) {
+                println("ext2: failed to map block {} of inode {}", fileBlock + i,
+                        inode.ino);
+
+                for (uint32_t j = i; j < count; ++j) {
+                    freeBlock(start + j);
+                }
+
+                count = i;
+                success = false;
                 break;
             }
 
-            offset += dirEntry->rec_len;
+            _cache->rekey(BlockCache::unplacedKey(inode.ino, fileBlock + i), start + i);
         }
 
-        if (!foundEntry) {
-            return -ENOENT;
+        inode.data.blocks += count * sectorsPerBlock();
+        _delayedBlockCount -= count;
+        done += count;
+
+        if (!success) break;
+    }
+
+    // Forget the blocks which now have a location
+    if (done == blocks.size()) {
+        blocks.clear();
+    } else if (done > 0) {
+        estd::vector<uint32_t> remaining;
+        for (size_t i = done; i < blocks.size(); ++i) {
+            remaining.push_back(blocks[i]);
         }
 
-        // Add the name of the current directory to the beginning of the path, preceded by
-        // a forward slash
-        if (prependString(path, foundEntry->name, foundEntry->name_len, pathSize) < 0) {
-            return -ENAMETOOLONG;
+        blocks = estd::move(remaining);
+    }
+
+    return success;
+}
+
+void Ext2FileSystem::freeFileBlocks(Ext2Inode& inode) {
+    ext2::Inode& data = inode.data;
+
+    // Drop data which was never given a location
+    for (uint32_t fileBlock : inode.delayedBlocks) {
+        _cache->discard(BlockCache::unplacedKey(inode.ino, fileBlock));
+    }
+
+    _delayedBlockCount -= inode.delayedBlocks.size();
+    inode.delayedBlocks.clear();
+
+    // Direct blocks
+    for (size_t i = 0; i < 12; ++i) {
+        if (data.block[i] != 0) {
+            freeBlock(data.block[i]);
         }
+    }
 
-        if (prependString(path, "/", 1, pathSize) < 0) {
-            return -ENAMETOOLONG;
+    // Indirect blocks. Each indirect block is copied out of the cache first, because
+    // freeing blocks can recycle cache memory.
+    Buffer indBlock(blockSize());
+    auto freeIndirect = [&](uint32_t blockId) {
+        if (!readBlock(indBlock.get(), blockId)) {
+            println("ext2: failed to read indirect block {}", blockId);
+            return;
         }
 
-        // Terminate once we reach the root directory
-        if (parentIno == ext2::ROOT_INO) {
-            return 0;
+        auto entries = reinterpret_cast<uint32_t*>(indBlock.get());
+        for (size_t i = 0; i < entriesPerBlock(); ++i) {
+            if (entries[i] != 0) {
+                freeBlock(entries[i]);
+            }
         }
 
-        currentIno = parentIno;
+        freeBlock(blockId);
+    };
+
+    if (data.block[12] != 0) {
+        freeIndirect(data.block[12]);
+    }
+
+    if (data.block[13] != 0) {
+        Buffer dindBlock(blockSize());
+        if (readBlock(dindBlock.get(), data.block[13])) {
+            auto entries = reinterpret_cast<uint32_t*>(dindBlock.get());
+            for (size_t i = 0; i < entriesPerBlock(); ++i) {
+                if (entries[i] != 0) {
+                    freeIndirect(entries[i]);
+                }
+            }
+
+            freeBlock(data.block[13]);
+        } else {
+            println("ext2: failed to read indirect block {}", (uint32_t)data.block[13]);
+        }
+    }
+
+    if (data.block[14] != 0) {
+        println("ext2: triply-indirect blocks are unsupported, leaking them");
+    }
+
+    memset(data.block, 0, sizeof(data.block));
+    data.blocks = 0;
+    data.size32 = 0;
+    data.dir_acl = 0;
+    inode.reservationCount = 0;
+    inode.dirty = true;
+}
+
+uint32_t Ext2FileSystem::mapFileBlock(const ext2::Inode& inode, uint32_t fileBlock) {
+    // Direct blocks
+    if (fileBlock < 12) {
+        return inode.block[fileBlock];
+    }
+
+    fileBlock -= 12;
+
+    // Indirect blocks
+    uint32_t blockId;
+    if (fileBlock < entriesPerBlock()) {
+        if (inode.block[12] == 0) return 0;
+
+        if (!readRange(&blockId, inode.block[12], sizeof(uint32_t),
+                       fileBlock * sizeof(uint32_t))) {
+            return 0;
+        }
+
+        return blockId;
+    }
+
+    fileBlock -= entriesPerBlock();
+
+    // Doubly-indirect blocks
+    if (fileBlock < entriesPerBlock() * entriesPerBlock()) {
+        if (inode.block[13] == 0) return 0;
+
+        uint32_t indBlockId;
+        if (!readRange(&indBlockId, inode.block[13], sizeof(uint32_t),
+                       (fileBlock / entriesPerBlock()) * sizeof(uint32_t))) {
+            return 0;
+        }
+
+        if (indBlockId == 0) return 0;
+
+        if (!readRange(&blockId, indBlockId, sizeof(uint32_t),
+                       (fileBlock % entriesPerBlock()) * sizeof(uint32_t))) {
+            return 0;
+        }
+
+        return blockId;
+    }
+
+    // TODO: support triply-indirect blocks
+    println("ext2: triply-indirect blocks are unsupported");
+    return 0;
+}
+
+bool Ext2FileSystem::readFileBlock(void* dest, const ext2::Inode& inode,
+                                   uint32_t fileBlock) {
+    uint32_t blockId = mapFileBlock(inode, fileBlock);
+    if (blockId == 0) {
+        return false;
+    }
+
+    return readBlock(dest, blockId);
+}
+
+//// File data
+
+bool Ext2FileSystem::readFileRange(const ext2::Inode& inode, uint32_t ino, uint8_t* dest,
+                                   uint32_t size, uint32_t offset) {
+    uint32_t fileBlock = offset / blockSize();
+    uint32_t blockOffset = offset % blockSize();
+
+    while (size > 0) {
+        uint32_t chunk = min<uint32_t>(size, blockSize() - blockOffset);
+
+        // Blocks which haven't been allocated yet only exist in the cache, and holes in
+        // the file read as zeros
+        const uint8_t* data;
+        uint32_t blockId = mapFileBlock(inode, fileBlock);
+        if (blockId != 0) {
+            data = _cache->get(blockId);
+            if (!data) {
+                return false;
+            }
+        } else {
+            data = _cache->find(BlockCache::unplacedKey(ino, fileBlock));
+        }
+
+        if (data) {
+            memcpy(dest, data + blockOffset, chunk);
+        } else {
+            memset(dest, 0, chunk);
+        }
+
+        dest += chunk;
+        size -= chunk;
+        blockOffset = 0;
+        ++fileBlock;
+    }
+
+    return true;
+}
+
+void Ext2FileSystem::fetchFileBlocks(Ext2Inode& inode, uint32_t fileBlock,
+                                     uint32_t count) {
+    ASSERT(_lock.isLocked());
+    ASSERT(count <= MAX_FETCH_BLOCKS);
+
+    uint32_t blockIds[MAX_FETCH_BLOCKS];
+    size_t numBlocks = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t blockId = mapFileBlock(inode.data, fileBlock + i);
+        if (blockId != 0 && !_cache->find(blockId)) {
+            blockIds[numBlocks++] = blockId;
+        }
+    }
+
+    if (numBlocks == 0) return;
+
+    size_t numPages = ceilDiv(numBlocks * blockSize(), PAGE_SIZE);
+    PhysicalAddress staging = mm.pageAlloc(numPages);
+    uint8_t* buffer = mm.physicalToVirtual(staging).ptr<uint8_t>();
+
+    BlockRequest requests[MAX_FETCH_BLOCKS];
+    for (size_t i = 0; i < numBlocks; ++i) {
+        requests[i].start = uint64_t(blockIds[i]) * sectorsPerBlock();
+        requests[i].count = sectorsPerBlock();
+        requests[i].buffer = buffer + i * blockSize();
+    }
+
+    // The disk is read without the filesystem lock, so that other threads can queue their
+    // own requests in the meantime. Anything written to disk while we were waiting makes
+    // what we read suspect, in which case the blocks are simply read again (under the
+    // lock) by the caller.
+    uint64_t generation = _cache->generation();
+    _lock.unlock();
+    _disk.transferBatch(requests, numBlocks);
+    _lock.lock();
+
+    if (_cache->generation() == generation) {
+        for (size_t i = 0; i < numBlocks; ++i) {
+            if (requests[i].success) {
+                _cache->insert(blockIds[i], buffer + i * blockSize());
+            }
+        }
+    }
+
+    mm.pageFree(staging, numPages);
+}
+
+bool Ext2FileSystem::readFileData(Ext2Inode& inode, uint8_t* dest, uint32_t size,
+                                  uint32_t offset) {
+    while (size > 0) {
+        // Read up to the end of the current batch of blocks
+        uint32_t fileBlock = offset / blockSize();
+        uint32_t batchEnd = (fileBlock + MAX_FETCH_BLOCKS) * blockSize();
+        uint32_t chunk = min<uint32_t>(size, batchEnd - offset);
+        uint32_t count = ceilDiv(offset % blockSize() + chunk, blockSize());
+
+        fetchFileBlocks(inode, fileBlock, count);
+        if (!readFileRange(inode.data, inode.ino, dest, chunk, offset)) {
+            return false;
+        }
+
+        dest += chunk;
+        size -= chunk;
+        offset += chunk;
+    }
+
+    return true;
+}
+
+bool Ext2FileSystem::readFullFile(Ext2Inode& inode, uint8_t* dest) {
+    MutexLocker locker(_lock);
+    bool success = readFileData(inode, dest, inode.data.size(), 0);
+    finishOperation();
+    return success;
+}
+
+ssize_t Ext2FileSystem::readFromFile(Ext2Inode& inode, uint8_t* dest, uint32_t size,
+                                     uint32_t offset) {
+    MutexLocker locker(_lock);
+
+    // Clip the read at the end of the file (which may leave nothing to read)
+    if (offset > inode.data.size()) {
+        size = 0;
+    } else if (size > inode.data.size() - offset) {
+        size = inode.data.size() - offset;
+    }
+
+    bool success = readFileData(inode, dest, size, offset);
+    finishOperation();
+    return success ? size : -EIO;
+}
+
+ssize_t Ext2FileSystem::sendFromFile(Ext2Inode& inode, File& out,
+                                     OpenFileDescription& outFd, uint32_t size,
+                                     uint32_t offset) {
+    // Holes in the file are sent from here
+    static const uint8_t zeroBlock[PAGE_SIZE] = {};
+
+    // Each block is handed to out straight from the cache, with the filesystem unlocked,
+    // since out may block for as long as its reader likes (e.g., a TCP peer which stops
+    // reading). The block is pinned meanwhile, so that it can't be evicted or reused.
+    ssize_t sent = 0;
+    while (size > 0) {
+        _lock.lock();
+
+        // Read ahead a batch of blocks at a time, like readFileData
+        uint32_t fileBlock = offset / blockSize();
+        uint32_t blockOffset = offset % blockSize();
+        uint32_t blockId = mapFileBlock(inode.data, fileBlock);
+        if (blockId != 0 && !_cache->find(blockId)) {
+            uint32_t count = ceilDiv<uint64_t>(blockOffset + size, blockSize());
+            fetchFileBlocks(inode, fileBlock, min(count, MAX_FETCH_BLOCKS));
+            blockId = mapFileBlock(inode.data, fileBlock);
+        }
+
+        // Clip at the end of the block, and at the end of the file, which may move
+        // between blocks
+        uint32_t chunk = 0;
+        if (offset < inode.data.size()) {
+            chunk = min(size, static_cast<uint32_t>(blockSize()) - blockOffset);
+            chunk = min<uint64_t>(chunk, inode.data.size() - offset);
+        }
+
+        // Blocks which haven't been allocated yet only exist in the cache
+        const uint8_t* data = zeroBlock;
+        int32_t handle = -1;
+        bool success = true;
+        if (chunk > 0 && blockId != 0) {
+            success = _cache->get(blockId) != nullptr;
+            if (success) data = _cache->pin(blockId, handle);
+        } else if (chunk > 0) {
+            uint64_t key = BlockCache::unplacedKey(inode.ino, fileBlock);
+            if (const uint8_t* cached = _cache->pin(key, handle)) data = cached;
+        }
+
+        finishOperation();
+        _lock.unlock();
+
+        if (!success) {
+            sent = sent > 0 ? sent : -EIO;
+            break;
+        } else if (chunk == 0) {
+            break;
+        }
+
+        const uint8_t* src = handle != -1 ? data + blockOffset : data;
+        ssize_t result = out.write(outFd, src, chunk);
+
+        if (handle != -1) {
+            MutexLocker locker(_lock);
+            _cache->unpin(handle);
+        }
+
+        if (result < 0) {
+            sent = sent > 0 ? sent : result;
+            break;
+        }
+
+        sent += result;
+        if (static_cast<uint32_t>(result) < chunk) break;
+
+        size -= chunk;
+        offset += chunk;
+    }
+
+    return sent;
+}
+
+ssize_t Ext2FileSystem::writeToFile(Ext2Inode& inode, const uint8_t* src, uint32_t size,
+                                    uint32_t offset) {
+    MutexLocker locker(_lock);
+
+    if (!_writable) {
+        return -EROFS;
+    }
+
+    // Large files (size_high) aren't supported
+    uint64_t end = static_cast<uint64_t>(offset) + size;
+    if (end > UINT32_MAX || ceilDiv(end, blockSize()) > maxFileBlocks()) {
+        return -EFBIG;
+    }
+
+    inode.version = ++_lastVersion;
+
+    uint32_t fileBlock = offset / blockSize();
+    uint32_t blockOffset = offset % blockSize();
+
+    int error = 0;
+    uint32_t remaining = size;
+    while (remaining > 0) {
+        uint32_t chunk = min<uint32_t>(remaining, blockSize() - blockOffset);
+        bool wholeBlock = (chunk == blockSize());
+
+        uint64_t key;
+        uint8_t* data;
+        uint32_t blockId = mapFileBlock(inode.data, fileBlock);
+        if (blockId != 0) {
+            key = blockId;
+            data = _cache->get(key, !wholeBlock);
+        } else {
+            // Delayed allocation: the block is only given a location on disk when it's
+            // flushed, so that a file written in pieces can still be placed contiguously
+            key = BlockCache::unplacedKey(inode.ino, fileBlock);
+            data = _cache->find(key);
+            if (!data) {
+                if (!reserveDelayedBlock()) {
+                    error = -ENOSPC;
+                    break;
+                }
+
+                data = _cache->get(key, false);
+
+                // Keep the list sorted. Files are usually written in order, so the new
+                // block nearly always belongs at the end.
+                auto& blocks = inode.delayedBlocks;
+                blocks.push_back(fileBlock);
+                for (size_t i = blocks.size() - 1; i > 0 && blocks[i - 1] > blocks[i]; --i) {
+                    uint32_t tmp = blocks[i - 1];
+                    blocks[i - 1] = blocks[i];
+                    blocks[i] = tmp;
+                }
+            }
+        }
+
+        if (!data) {
+            error = -EIO;
+            break;
+        }
+
+        memcpy(data + blockOffset, src, chunk);
+        _cache->markDirty(key);
+
+        src += chunk;
+        remaining -= chunk;
+        blockOffset = 0;
+        ++fileBlock;
+    }
+
+    uint32_t written = size - remaining;
+    if (offset + written > inode.data.size32) {
+        inode.data.size32 = offset + written;
+        inode.dirty = true;
+    }
+
+    // Don't let modified blocks take over the cache
+    if (_cache->dirtyCount() >= _cache->capacity() / 2) {
+        syncLocked();
+    }
+
+    finishOperation();
+
+    // Report a short write if some of the data made it
+    if (written == 0 && error < 0) {
+        return error;
+    }
+
+    return written;
+}
+
+//// Directories
+
+// In-memory hash table over the entries of a directory which doesn't have an on-disk
+// htree index, built the first time the directory is searched
+struct Ext2FileSystem::DirectoryIndex {
+    struct Slot {
+        uint32_t hash;
+        uint32_t ino;  // Zero marks an empty slot
+        uint32_t nameOffset;
+        uint32_t nameLen;
+    };
+
+    uint32_t dirIno;
+    uint32_t mtime;
+    uint64_t size;
+    uint64_t lastUsed = 0;
+
+    // Open addressing with linear probing. The number of slots is a power of two and at
+    // least twice the number of entries, so probe sequences stay short and always end.
+    estd::vector<Slot> slots;
+    Buffer names;
+
+    // FNV-1a
+    static uint32_t hashName(const char* name, size_t nameLen) {
+        uint32_t hash = 2166136261U;
+        for (size_t i = 0; i < nameLen; ++i) {
+            hash ^= (uint8_t)name[i];
+            hash *= 16777619U;
+        }
+
+        return hash;
+    }
+
+    void insert(const char* name, size_t nameLen, uint32_t ino, uint32_t nameOffset) {
+        uint32_t hash = hashName(name, nameLen);
+        size_t mask = slots.size() - 1;
+
+        size_t i = hash & mask;
+        while (slots[i].ino != 0) {
+            i = (i + 1) & mask;
+        }
+
+        memcpy(&names[nameOffset], name, nameLen);
+        slots[i] = {hash, ino, nameOffset, (uint32_t)nameLen};
+    }
+
+    uint32_t find(const char* name, size_t nameLen) const {
+        uint32_t hash = hashName(name, nameLen);
+        size_t mask = slots.size() - 1;
+
+        for (size_t i = hash & mask; slots[i].ino != 0; i = (i + 1) & mask) {
+            const Slot& slot = slots[i];
+            if (slot.hash == hash && slot.nameLen == nameLen &&
+                memcmp(&names.get()[slot.nameOffset], name, nameLen) == 0) {
+                return slot.ino;
+            }
+        }
+
+        return ext2::BAD_INO;
+    }
+};
+
+bool Ext2FileSystem::searchBlock(const uint8_t* block, const char* name, size_t nameLen,
+                                 uint32_t& ino) {
+    size_t offset = 0;
+    while (offset + sizeof(ext2::DirectoryEntry) <= blockSize()) {
+        auto dirEntry = reinterpret_cast<const ext2::DirectoryEntry*>(&block[offset]);
+        if (dirEntry->rec_len < sizeof(ext2::DirectoryEntry)) {
+            break;
+        }
+
+        if (dirEntry->inode != 0 && dirEntry->name_len == nameLen &&
+            strncmp(name, dirEntry->name, nameLen) == 0) {
+            ino = dirEntry->inode;
+            return true;
+        }
+
+        offset += dirEntry->rec_len;
+    }
+
+    return false;
+}
+
+bool Ext2FileSystem::lookupDotEntry(const ext2::Inode& dir, bool parent, uint32_t& ino) {
+    // "." and ".." are always the first two entries of the first block, including in
+    // directories with an htree index, where they're the only entries in that block
+    Buffer block(blockSize());
+    if (!readFileBlock(block.get(), dir, 0)) {
+        return false;
+    }
+
+    auto dot = reinterpret_cast<ext2::DirectoryEntry*>(&block[0]);
+    if (dot->name_len != 1 || dot->name[0] != '.' ||
+        dot->rec_len + sizeof(ext2::DirectoryEntry) + 2 > blockSize()) {
+        return false;
+    }
+
+    if (!parent) {
+        ino = dot->inode;
+        return true;
+    }
+
+    auto dotDot = reinterpret_cast<ext2::DirectoryEntry*>(&block[dot->rec_len]);
+    if (dotDot->name_len != 2 || strncmp(dotDot->name, "..", 2) != 0) {
+        return false;
+    }
+
+    ino = dotDot->inode;
+    return true;
+}
+
+bool Ext2FileSystem::lookupHashTree(const ext2::Inode& dir, const char* name,
+                                    size_t nameLen, uint32_t& ino) {
+    Buffer node(blockSize());
+    if (!readFileBlock(node.get(), dir, 0)) {
+        return false;
+    }
+
+    // The root info follows the fake "." and ".." entries, which are 12 bytes each
+    constexpr size_t rootInfoOffset = 24;
+    auto dot = reinterpret_cast<ext2::DirectoryEntry*>(&node[0]);
+    auto info = reinterpret_cast<ext2::DxRootInfo*>(&node[rootInfoOffset]);
+    if (dot->rec_len != 12 || info->reserved_zero != 0 ||
+        info->info_length < sizeof(ext2::DxRootInfo) || info->indirect_levels > 1) {
+        println("ext2: unsupported htree root, falling back to a linear search");
+        return false;
+    }
+
+    // Filesystems created on a machine with unsigned char record that in the superblock,
+    // and use the unsigned variants of the hash functions
+    auto version = info->hash_version;
+    if (version <= ext2::DX_HASH_TEA &&
+        (_superBlock->flags & ext2::FLAGS_UNSIGNED_HASH)) {
+        version = static_cast<ext2::DxHashVersion>(version + 3);
+    }
+
+    uint32_t seed[4];
+    memcpy(seed, _superBlock->hash_seed, sizeof(seed));
+    uint32_t hash = ext2::dirHash(name, nameLen, version, seed);
+
+    // The entries of the node at each level (root, then interior node if there is one),
+    // and the position in each, so that a run of colliding hashes can be followed from
+    // one leaf into the next, even if that's under another interior node
+    ext2::DxEntry* entries[2];
+    size_t counts[2];
+    size_t indices[2];
+    size_t leafLevel = info->indirect_levels;
+
+    auto readNode = [&](size_t level, uint8_t* block, size_t offset) {
+        auto countLimit = reinterpret_cast<ext2::DxCountLimit*>(&block[offset]);
+        size_t count = countLimit->count;
+        if (count == 0 || count > countLimit->limit ||
+            offset + countLimit->limit * sizeof(ext2::DxEntry) > blockSize()) {
+            println("ext2: corrupt htree node, falling back to a linear search");
+            return false;
+        }
+
+        entries[level] = reinterpret_cast<ext2::DxEntry*>(&block[offset]);
+        counts[level] = count;
+        return true;
+    };
+
+    // Interior nodes start with a fake, empty directory entry
+    Buffer interior(blockSize());
+    auto readInterior = [&]() {
+        return readFileBlock(interior.get(), dir, entries[0][indices[0]].block) &&
+               readNode(1, interior.get(), sizeof(ext2::DirectoryEntry));
+    };
+
+    if (!readNode(0, node.get(), rootInfoOffset + info->info_length)) {
+        return false;
+    }
+
+    for (size_t level = 0; level <= leafLevel; ++level) {
+        // Find the last entry whose hash is <= the target. The first entry has no hash
+        // field and covers everything below the second.
+        size_t lo = 1, hi = counts[level];
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (entries[level][mid].hash > hash) {
+                hi = mid;
+            } else {
+                lo = mid + 1;
+            }
+        }
+
+        indices[level] = lo - 1;
+        if (level < leafLevel && !readInterior()) {
+            return false;
+        }
+    }
+
+    Buffer leaf(blockSize());
+    while (true) {
+        uint32_t leafBlock = entries[leafLevel][indices[leafLevel]].block;
+        if (!readFileBlock(leaf.get(), dir, leafBlock)) {
+            return false;
+        }
+
+        if (searchBlock(leaf.get(), name, nameLen, ino)) {
+            return true;
+        }
+
+        // Move to the next leaf, through the next entry at the lowest level which has
+        // one. If that entry begins with the same hash (which the index flags by setting
+        // the low bit), colliding names may have spilled over into it.
+        size_t level = leafLevel + 1;
+        while (level > 0 && indices[level - 1] + 1 >= counts[level - 1]) {
+            --level;
+        }
+
+        if (level == 0) break;
+        --level;
+
+        ++indices[level];
+        if ((entries[level][indices[level]].hash & ~1U) != hash) break;
+
+        if (level < leafLevel) {
+            if (!readInterior()) return false;
+            indices[leafLevel] = 0;
+        }
+    }
+
+    ino = ext2::BAD_INO;
+    return true;
+}
+
+estd::unique_ptr<Ext2FileSystem::DirectoryIndex> Ext2FileSystem::buildDirectoryIndex(
+    const ext2::Inode& dir, uint32_t dirIno) {
+    Buffer dirBuffer(roundUp(dir.size(), blockSize()));
+    if (!readFileRange(dir, dirIno, dirBuffer.get(), dir.size(), 0)) {
+        return {};
+    }
+
+    // Count the entries and the total length of their names to size the index
+    size_t numEntries = 0;
+    size_t namesSize = 0;
+    uint64_t offset = 0;
+    while (offset + sizeof(ext2::DirectoryEntry) <= dir.size()) {
+        auto dirEntry = reinterpret_cast<ext2::DirectoryEntry*>(&dirBuffer[offset]);
+        if (dirEntry->rec_len < sizeof(ext2::DirectoryEntry)) {
+            println("ext2: corrupt directory entry in inode {}", dirIno);
+            return {};
+        }
+
+        if (dirEntry->inode != 0) {
+            ++numEntries;
+            namesSize += dirEntry->name_len;
+        }
+
+        offset += dirEntry->rec_len;
+    }
+
+    size_t numSlots = 8;
+    while (numSlots < 2 * numEntries) {
+        numSlots *= 2;
+    }
+
+    estd::unique_ptr<DirectoryIndex> index(new DirectoryIndex);
+    index->dirIno = dirIno;
+    index->mtime = dir.mtime;
+    index->size = dir.size();
+    index->slots = estd::vector<DirectoryIndex::Slot>(numSlots, DirectoryIndex::Slot{});
+    index->names = Buffer(namesSize);
+
+    size_t nameOffset = 0;
+    offset = 0;
+    while (offset + sizeof(ext2::DirectoryEntry) <= dir.size()) {
+        auto dirEntry = reinterpret_cast<ext2::DirectoryEntry*>(&dirBuffer[offset]);
+        if (dirEntry->inode != 0) {
+            index->insert(dirEntry->name, dirEntry->name_len, dirEntry->inode, nameOffset);
+            nameOffset += dirEntry->name_len;
+        }
+
+        offset += dirEntry->rec_len;
+    }
+
+    return index;
+}
+
+uint32_t Ext2FileSystem::lookupEntry(const ext2::Inode& dir, uint32_t dirIno,
+                                     const char* name, size_t nameLen) {
+    if ((nameLen == 1 && name[0] == '.') || (nameLen == 2 && strncmp(name, "..", 2) == 0)) {
+        uint32_t ino;
+        if (!lookupDotEntry(dir, nameLen == 2, ino)) {
+            return ext2::BAD_INO;
+        }
+
+        return ino;
+    }
+
+    // Use the on-disk index if there is one. It reads at most three blocks (root,
+    // interior node, leaf), no matter how large the directory is.
+    if ((_superBlock->feature_compat & ext2::FEATURE_COMPAT_DIR_INDEX) &&
+        (dir.flags & ext2::INDEX_FL)) {
+        uint32_t ino;
+        if (lookupHashTree(dir, name, nameLen, ino)) {
+            return ino;
+        }
+    }
+
+    // Otherwise, use (or build) the cached in-memory index for this directory
+    for (auto& index : _dirIndexCache) {
+        if (index->dirIno != dirIno) continue;
+
+        if (index->mtime == dir.mtime && index->size == dir.size()) {
+            index->lastUsed = ++_dirIndexClock;
+            return index->find(name, nameLen);
+        }
+
+        // Stale, so rebuild it below
+        break;
+    }
+
+    estd::unique_ptr<DirectoryIndex> index = buildDirectoryIndex(dir, dirIno);
+    if (!index) {
+        return ext2::BAD_INO;
+    }
+
+    uint32_t ino = index->find(name, nameLen);
+    index->lastUsed = ++_dirIndexClock;
+
+    // Replace a stale copy of this directory's index, or else evict the least recently
+    // used one if the cache is full
+    size_t victim = _dirIndexCache.size();
+    for (size_t i = 0; i < _dirIndexCache.size(); ++i) {
+        if (_dirIndexCache[i]->dirIno == dirIno) {
+            victim = i;
+            break;
+        }
+    }
+
+    if (victim == _dirIndexCache.size() && _dirIndexCache.size() >= MAX_CACHED_DIRECTORIES) {
+        victim = 0;
+        for (size_t i = 1; i < _dirIndexCache.size(); ++i) {
+            if (_dirIndexCache[i]->lastUsed < _dirIndexCache[victim]->lastUsed) {
+                victim = i;
+            }
+        }
+    }
+
+    if (victim < _dirIndexCache.size()) {
+        _dirIndexCache[victim].assign(index.release());
+    } else {
+        _dirIndexCache.push_back(estd::move(index));
+    }
+
+    return ino;
+}
+
+int Ext2FileSystem::truncate(Ext2Inode& inode) {
+    MutexLocker locker(_lock);
+
+    if (!_writable) {
+        return -EROFS;
+    }
+
+    freeFileBlocks(inode);
+    inode.version = ++_lastVersion;
+    finishOperation();
+    return 0;
+}
+
+uint32_t Ext2FileSystem::lookupChild(uint32_t dirIno, const char* name, size_t nameLen) {
+    MutexLocker locker(_lock);
+
+    // Make sure that the starting point is a directory
+    estd::unique_ptr<ext2::Inode> dir = readInodeLocked(dirIno);
+    if (!dir || !dir->isDirectory()) {
+        return NO_INO;
+    }
+
+    uint32_t ino = lookupEntry(*dir, dirIno, name, nameLen);
+    finishOperation();
+    return ino == ext2::BAD_INO ? NO_INO : ino;
+}
+
+int Ext2FileSystem::stat(uint32_t ino, FileInfo& info) {
+    MutexLocker locker(_lock);
+
+    // An open inode may have changes which haven't been written to the inode table yet
+    estd::shared_ptr<Ext2Inode> inode = getInodeLocked(ino);
+    if (!inode) {
+        return -EIO;
+    }
+
+    info.isDirectory = inode->data.isDirectory();
+    info.size = inode->data.size();
+    info.version = inode->version;
+    finishOperation();
+    return 0;
+}
+
+int Ext2FileSystem::open(uint32_t ino, int flags, estd::shared_ptr<File>& file) {
+    estd::shared_ptr<Ext2Inode> inode = getInode(ino);
+    if (!inode) {
+        return -EIO;
+    }
+
+    bool writable = (flags & O_ACCMODE) != O_RDONLY;
+    if (writable && inode->data.isDirectory()) {
+        return -EISDIR;
+    }
+
+    if (writable && (flags & O_TRUNC)) {
+        int result = truncate(*inode);
+        if (result < 0) {
+            return result;
+        }
+    }
+
+    file = estd::shared_ptr<File>(new Ext2File(*this, inode));
+    return 0;
+}
+
+static int prependString(char* dest, const char* src, size_t srcLength, size_t n) {
+    size_t destLen = strlen(dest);
+    if (srcLength + destLen + 1 > n) {
+        return -ENAMETOOLONG;
+    }
+
+    memmove(dest + srcLength, dest, destLen + 1);
+    memcpy(dest, src, srcLength);
+    return 0;
+}
+
+uint32_t Ext2FileSystem::getParent(const ext2::Inode& inode) {
+    ASSERT(inode.isDirectory());
+    MutexLocker locker(_lock);
+
+    uint32_t parentIno;
+    if (!lookupDotEntry(inode, true, parentIno)) {
+        parentIno = ext2::BAD_INO;
+    }
+
+    finishOperation();
+    return parentIno;
+}
+
+int Ext2FileSystem::getPath(uint32_t ino, char* path, size_t pathSize) {
+    if (pathSize == 0) {
+        return -EINVAL;
+    }
+
+    path[0] = '\0';
+
+    if (ino == ext2::ROOT_INO) {
+        return prependString(path, "/", 1, pathSize);
+    }
+
+    MutexLocker locker(_lock);
+
+    estd::unique_ptr<ext2::Inode> inode = readInodeLocked(ino);
+    if (!inode) {
+        return -EIO;
+    }
+
+    uint32_t currentIno = ino;
+    while (true) {
+        if (!inode->isDirectory()) {
+            return -ENOTDIR;
+        }
+
+        uint32_t parentIno;
+        if (!lookupDotEntry(*inode, true, parentIno)) {
+            return -EIO;
+        }
+
+        estd::unique_ptr<ext2::Inode> parent = readInodeLocked(parentIno);
+        if (!parent) {
+            return -EIO;
+        }
+
+        // Search the parent directory for an entry pointing to currentIno
+        Buffer dirBuffer(parent->size());
+        if (!readFileRange(*parent, parentIno, dirBuffer.get(), parent->size(), 0)) {
+            return -EIO;
+        }
+
+        ext2::DirectoryEntry* foundEntry = nullptr;
+        uint64_t offset = 0;
+        while (offset < parent->size()) {
+            ext2::DirectoryEntry* dirEntry =
+                reinterpret_cast<ext2::DirectoryEntry*>(&dirBuffer[offset]);
+
+            if (dirEntry->inode == currentIno) {
+                foundEntry = dirEntry;
+                break;
+            }
+
+            offset += dirEntry->rec_len;
+        }
+
+        if (!foundEntry) {
+            return -ENOENT;
+        }
+
+        // Add the name of the current directory to the beginning of the path, preceded by
+        // a forward slash
+        if (prependString(path, foundEntry->name, foundEntry->name_len, pathSize) < 0) {
+            return -ENAMETOOLONG;
+        }
+
+        if (prependString(path, "/", 1, pathSize) < 0) {
+            return -ENAMETOOLONG;
+        }
+
+        // Terminate once we reach the root directory
+        if (parentIno == ext2::ROOT_INO) {
+            finishOperation();
+            return 0;
+        }
+
+        currentIno = parentIno;
         inode = estd::move(parent);
     }
 }
 
+//// Modifying directories
+
+void Ext2FileSystem::invalidateDirectoryIndex(uint32_t dirIno) {
+    for (size_t i = 0; i < _dirIndexCache.size(); ++i) {
+        if (_dirIndexCache[i]->dirIno != dirIno) continue;
+
+        // Order doesn't matter, so fill the hole with the last entry
+        if (i + 1 != _dirIndexCache.size()) {
+            _dirIndexCache[i] = estd::move(_dirIndexCache.back());
+        }
+
+        _dirIndexCache.pop_back();
+        return;
+    }
+}
+
+int Ext2FileSystem::addDirectoryEntry(Ext2Inode& dir, const char* name, size_t nameLen,
+                                      uint32_t ino, uint8_t fileType) {
+    uint16_t needed = roundUp(sizeof(ext2::DirectoryEntry) + nameLen, 4);
+
+    // Look for an unused entry which is large enough, or an entry with enough slack at
+    // the end to split in two
+    ext2::DirectoryEntry* newEntry = nullptr;
+    uint32_t newBlockId = 0;
+    uint32_t numBlocks = dir.data.size() / blockSize();
+    for (uint32_t fileBlock = 0; fileBlock < numBlocks && !newEntry; ++fileBlock) {
+        uint32_t blockId = mapFileBlock(dir.data, fileBlock);
+        if (blockId == 0) continue;
+
+        uint8_t* block = _cache->get(blockId);
+        if (!block) {
+            return -EIO;
+        }
+
+        uint32_t offset = 0;
+        while (offset + sizeof(ext2::DirectoryEntry) <= blockSize()) {
+            auto entry = reinterpret_cast<ext2::DirectoryEntry*>(block + offset);
+            if (entry->rec_len < sizeof(ext2::DirectoryEntry) ||
+                offset + entry->rec_len > blockSize()) {
+                println("ext2: corrupt directory entry in inode {}", dir.ino);
+                return -EIO;
+            }
+
+            if (entry->inode == 0 && entry->rec_len >= needed) {
+                newEntry = entry;
+                newBlockId = blockId;
+                break;
+            }
+
+            uint16_t used = roundUp(sizeof(ext2::DirectoryEntry) + entry->name_len, 4);
+            if (entry->inode != 0 && entry->rec_len - used >= needed) {
+                newEntry = reinterpret_cast<ext2::DirectoryEntry*>(block + offset + used);
+                newEntry->rec_len = entry->rec_len - used;
+                entry->rec_len = used;
+                newBlockId = blockId;
+                break;
+            }
+
+            offset += entry->rec_len;
+        }
+    }
+
+    // Otherwise, add a new block to the end of the directory
+    if (!newEntry) {
+        uint32_t goal = numBlocks > 0 ? mapFileBlock(dir.data, numBlocks - 1) + 1 : 0;
+
+        uint32_t count;
+        newBlockId = allocateBlocks(goal, 1, count, nullptr);
+        if (newBlockId == 0) {
+            return -ENOSPC;
+        }
+
+        if (!setFileBlock(dir, numBlocks, newBlockId)) {
+            freeBlock(newBlockId);
+            return -EIO;
+        }
+
+        uint8_t* block = _cache->get(newBlockId, false);
+        newEntry = reinterpret_cast<ext2::DirectoryEntry*>(block);
+        newEntry->rec_len = blockSize();
+
+        dir.data.size32 += blockSize();
+        dir.data.blocks += sectorsPerBlock();
+    }
+
+    newEntry->inode = ino;
+    newEntry->name_len = nameLen;
+    newEntry->file_type = fileType;
+    memcpy(newEntry->name, name, nameLen);
+    _cache->markDirty(newBlockId);
+
+    // We don't maintain the hash tree, so drop it. Linux will fall back to a linear
+    // search, and e2fsck -D can rebuild it.
+    if (dir.data.flags & ext2::INDEX_FL) {
+        dir.data.flags &= ~ext2::INDEX_FL;
+    }
+
+    dir.dirty = true;
+    invalidateDirectoryIndex(dir.ino);
+    return 0;
+}
+
+int64_t Ext2FileSystem::createFile(uint32_t dirIno, const char* name, size_t nameLen) {
+    MutexLocker locker(_lock);
+
+    if (!_writable) {
+        return -EROFS;
+    }
+
+    if (nameLen == 0) {
+        return -EISDIR;
+    } else if (nameLen > 255) {
+        return -ENAMETOOLONG;
+    }
+
+    estd::shared_ptr<Ext2Inode> dir = getInodeLocked(dirIno);
+    if (!dir) {
+        return -EIO;
+    } else if (!dir->data.isDirectory()) {
+        return -ENOTDIR;
+    }
+
+    if (lookupEntry(dir->data, dirIno, name, nameLen) != ext2::BAD_INO) {
+        return -EEXIST;
+    }
+
+    // Keep the file near its directory
+    uint32_t ino = allocateInode((dirIno - 1) / _superBlock->inodes_per_group);
+    if (ino == 0) {
+        return -ENOSPC;
+    }
+
+    // Clear the whole slot in the inode table, which may be larger than ext2::Inode
+    uint32_t blockId, offset;
+    Buffer zeros(_superBlock->inode_size);
+    if (!inodeLocation(ino, blockId, offset) ||
+        !writeRange(zeros.get(), blockId, _superBlock->inode_size, offset)) {
+        freeInode(ino);
+        return -EIO;
+    }
+
+    ext2::Inode data;
+    memset(&data, 0, sizeof(data));
+    data.mode = static_cast<ext2::IMode>(ext2::S_IFREG | ext2::S_IRUSR | ext2::S_IWUSR |
+                                         ext2::S_IRGRP | ext2::S_IROTH);
+    data.links_count = 1;
+
+    estd::shared_ptr<Ext2Inode> inode(new Ext2Inode(ino, data));
+    inode->version = ++_lastVersion;
+    inode->dirty = true;
+    _openInodes.push_back(inode);
+
+    uint8_t fileType = (_superBlock->feature_incompat & ext2::FEATURE_INCOMPAT_FILETYPE)
+                           ? ext2::FT_REG_FILE
+                           : ext2::FT_UNKNOWN;
+
+    int result = addDirectoryEntry(*dir, name, nameLen, ino, fileType);
+    if (result < 0) {
+        _openInodes.pop_back();
+        freeInode(ino);
+        return result;
+    }
+
+    finishOperation();
+    return ino;
+}
+
+//// Write-back
+
+int Ext2FileSystem::syncLocked() {
+    int result = 0;
+
+    // Choose locations for delayed blocks first, since that modifies inodes and bitmaps
+    for (auto& inode : _openInodes) {
+        if (!inode->delayedBlocks.empty() && !allocateDelayedBlocks(*inode)) {
+            result = -EIO;
+        }
+    }
+
+    for (auto& inode : _openInodes) {
+        if (inode->dirty && !writeInode(*inode)) {
+            result = -EIO;
+        }
+    }
+
+    if (_metadataDirty) {
+        size_t numBytes = numBlockGroups() * sizeof(ext2::BlockGroupDescriptor);
+        if (!writeRange(_blockGroups.get(), blockGroupDescriptorTableBlock(), numBytes)) {
+            result = -EIO;
+        }
+
+        // Always at byte offset 1024
+        if (!writeRange(_superBlock.get(), 0, sizeof(ext2::SuperBlock), 1024)) {
+            result = -EIO;
+        }
+
+        _metadataDirty = false;
+    }
+
+    if (!_cache->flush()) {
+        result = -EIO;
+    }
+
+    // Forget inodes which aren't open anywhere else and have nothing left to write
+    estd::vector<estd::shared_ptr<Ext2Inode>> stillOpen;
+    for (auto& inode : _openInodes) {
+        if (inode.refCount() > 1 || inode->dirty || !inode->delayedBlocks.empty()) {
+            stillOpen.push_back(inode);
+        }
+    }
+
+    _openInodes = estd::move(stillOpen);
+    return result;
+}
+
+int Ext2FileSystem::sync() {
+    MutexLocker locker(_lock);
+    int result = syncLocked();
+    finishOperation();
+    return result;
+}
+
+void Ext2FileSystem::finishOperation() {
+    // Pointers into the cache are only used within a single operation, so this is the
+    // one place where blocks are evicted
+    _cache->trim();
+}
+
+static void writebackThread() {
+    while (true) {
+        sys.timer().sleep(WRITEBACK_INTERVAL);
+        sys.fs().sync();
+    }
+}
+
+void Ext2FileSystem::startWriteback() {
+    if (!_writable) return;
+
+    _writebackThread = Thread::createKernelThread(bit_cast<uint64_t>(&writebackThread));
+    sys.scheduler().startThread(_writebackThread.get());
+}
+
+bool Ext2FileSystem::init() {
+    if (!readSuperBlock()) {
+        println("ext2: error while reading superblock");
+        return false;
+    }
+
+    _cache.assign(new BlockCache(_disk, blockSize(), BLOCK_CACHE_SIZE / blockSize()));
+
+    if (!readBlockGroupDescriptorTable()) {
+        println("ext2: error while reading block group descriptor table");
+        return false;
+    }
+
+    _rootInode = readInodeLocked(ext2::ROOT_INO);
+    if (!_rootInode) {
+        println("ext2: error while reading root directory inode");
+        return false;
+    }
+
+    if (!_rootInode->isDirectory()) {
+        println("ext2: root directory is not a directory");
+        return false;
+    }
+
+    // Only features which don't affect the layout of anything we modify are safe to
+    // write with
+    uint32_t safeROCompat =
+        ext2::FEATURE_RO_COMPAT_SPARSE_SUPER | ext2::FEATURE_RO_COMPAT_LARGE_FILE;
+    _writable = !(_superBlock->feature_ro_compat & ~safeROCompat);
+    if (!_writable) {
+        println("ext2: unsupported read-only features, mounting read-only");
+    }
+
+    println("ext2: init complete");
+    return true;
+}
+
 estd::unique_ptr<Ext2FileSystem> Ext2FileSystem::create(DiskDevice& disk) {
     estd::unique_ptr<Ext2FileSystem> fs(new Ext2FileSystem(disk));
 
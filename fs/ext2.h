@@ -2,25 +2,79 @@
 #include "disk.h"
 #include "estd/buffer.h"
 #include "estd/memory.h"
+#include "estd/vector.h"
+#include "fs/block_cache.h"
 #include "fs/ext2_defs.h"  // IWYU pragma: export
+#include "fs/file_system.h"
+#include "mutex.h"
 #include "sys/types.h"
 
-class Ext2FileSystem {
+struct OpenFileDescription;
+struct Thread;
+
+// The in-memory copy of an inode, shared by every open file which refers to it
+struct Ext2Inode {
+    Ext2Inode(uint32_t ino, const ext2::Inode& data) : ino(ino), data(data) {}
+
+    uint32_t ino;
+    ext2::Inode data;
+
+    // Modified since it was last written to the inode table
+    bool dirty = false;
+
+    // See FileInfo::version. Assigned afresh whenever the inode is read from disk, since
+    // nothing about earlier versions is remembered.
+    uint64_t version = 0;
+
+    // File blocks which have been written, but not yet assigned a location on disk, in
+    // ascending order. Their contents are held in the block cache until the next flush.
+    estd::vector<uint32_t> delayedBlocks;
+
+    // Blocks following the last allocation which are set aside (in memory only) for
+    // this file, so that concurrent writers don't interleave their blocks. The window
+    // grows while the file is written sequentially.
+    static constexpr uint32_t MIN_RESERVATION = 8;
+    static constexpr uint32_t MAX_RESERVATION = 1024;
+    uint32_t reservationStart = 0;
+    uint32_t reservationCount = 0;
+    uint32_t reservationWindow = MIN_RESERVATION;
+};
+
+class Ext2FileSystem : public FileSystem {
 public:
     // Create using a static method because creation can fail
     static estd::unique_ptr<Ext2FileSystem> create(DiskDevice& disk);
     ~Ext2FileSystem();
 
+    // FileSystem interface
+    uint32_t rootIno() const override { return ext2::ROOT_INO; }
+    uint32_t lookupChild(uint32_t dirIno, const char* name, size_t nameLen) override;
+    int stat(uint32_t ino, FileInfo& info) override;
+    int getPath(uint32_t ino, char* path, size_t pathSize) override;
+    int64_t createFile(uint32_t dirIno, const char* name, size_t nameLen) override;
+    int open(uint32_t ino, int flags, estd::shared_ptr<File>& file) override;
+    int sync() override;
+
     // High-level interface
-    uint32_t lookup(uint32_t cwdIno, const char* path);
     uint32_t getParent(const ext2::Inode& inode);
-    int getPath(uint32_t ino, char* path, size_t pathSize);
-    bool readFullFile(const ext2::Inode& inode, uint8_t* dest);
-    ssize_t readFromFile(const ext2::Inode& inode, uint8_t* dest, uint32_t size,
+    bool readFullFile(Ext2Inode& inode, uint8_t* dest);
+    ssize_t readFromFile(Ext2Inode& inode, uint8_t* dest, uint32_t size,
                          uint32_t offset = 0);
+    ssize_t writeToFile(Ext2Inode& inode, const uint8_t* src, uint32_t size,
+                        uint32_t offset);
+
+    // Writes part of a file to out in bounded chunks, without holding the filesystem
+    // lock while out accepts each one
+    ssize_t sendFromFile(Ext2Inode& inode, File& out, OpenFileDescription& outFd,
+                         uint32_t size, uint32_t offset);
+    int truncate(Ext2Inode& inode);
+
+    // Starts a kernel thread which periodically flushes modified data to disk
+    void startWriteback();
 
     // Medium-level interface
     estd::unique_ptr<ext2::Inode> readInode(uint32_t ino);
+    estd::shared_ptr<Ext2Inode> getInode(uint32_t ino);
 
 private:
     Ext2FileSystem(DiskDevice& disk);
@@ -29,17 +83,97 @@ private:
     size_t blockSize() const;
     size_t numBlockGroups() const;
     size_t sectorsPerBlock() const;
+    size_t entriesPerBlock() const;
+    size_t maxFileBlocks() const;
 
     // Low-level interface
     bool readSuperBlock();
     bool readBlockGroupDescriptorTable();
+    uint32_t blockGroupDescriptorTableBlock() const;
     bool readBlock(void* dest, uint32_t blockId);
-    bool readBlock(void* dest, uint32_t blockId, uint32_t maxBytes);
     bool readRange(void* dest, uint32_t blockId, uint32_t numBytes, uint32_t offset = 0);
+    bool writeRange(const void* src, uint32_t blockId, uint32_t numBytes,
+                    uint32_t offset = 0);
+    uint32_t mapFileBlock(const ext2::Inode& inode, uint32_t fileBlock);
+    bool readFileBlock(void* dest, const ext2::Inode& inode, uint32_t fileBlock);
+    bool readFileRange(const ext2::Inode& inode, uint32_t ino, uint8_t* dest,
+                       uint32_t size, uint32_t offset);
+
+    // File data (the caller must hold _lock, which is dropped while reading from disk)
+    void fetchFileBlocks(Ext2Inode& inode, uint32_t fileBlock, uint32_t count);
+    bool readFileData(Ext2Inode& inode, uint8_t* dest, uint32_t size, uint32_t offset);
+
+    // Inodes (the caller must hold _lock)
+    estd::unique_ptr<ext2::Inode> readInodeLocked(uint32_t ino);
+    estd::shared_ptr<Ext2Inode> getInodeLocked(uint32_t ino);
+    Ext2Inode* findOpenInode(uint32_t ino);
+    bool inodeLocation(uint32_t ino, uint32_t& blockId, uint32_t& offset);
+    bool writeInode(Ext2Inode& inode);
+    uint32_t allocateInode(uint32_t preferredGroup);
+    void freeInode(uint32_t ino);
+
+    // Block allocation (the caller must hold _lock)
+    uint32_t groupOfBlock(uint32_t blockId) const;
+    bool isReserved(uint32_t blockId, const Ext2Inode* owner);
+    uint32_t claimRun(uint32_t start, uint32_t maxCount, const Ext2Inode* owner);
+    uint32_t allocateBlocks(uint32_t goal, uint32_t maxCount, uint32_t& count,
+                            const Ext2Inode* owner);
+    uint32_t allocateDataBlocks(Ext2Inode& inode, uint32_t goal, uint32_t maxCount,
+                                uint32_t& count);
+    void reserveWindow(Ext2Inode& inode, uint32_t start);
+    void freeBlock(uint32_t blockId);
+    bool reserveDelayedBlock();
+    uint32_t allocationGoal(Ext2Inode& inode, uint32_t fileBlock);
+    uint32_t allocateIndirectBlock(Ext2Inode& inode, uint32_t goal);
+    bool setFileBlock(Ext2Inode& inode, uint32_t fileBlock, uint32_t blockId);
+    bool allocateDelayedBlocks(Ext2Inode& inode);
+    void freeFileBlocks(Ext2Inode& inode);
+
+    // Directory lookups (the caller must hold _lock)
+    struct DirectoryIndex;
+    uint32_t lookupEntry(const ext2::Inode& dir, uint32_t dirIno, const char* name,
+                         size_t nameLen);
+    bool lookupDotEntry(const ext2::Inode& dir, bool parent, uint32_t& ino);
+    bool lookupHashTree(const ext2::Inode& dir, const char* name, size_t nameLen,
+                        uint32_t& ino);
+    bool searchBlock(const uint8_t* block, const char* name, size_t nameLen,
+                     uint32_t& ino);
+    estd::unique_ptr<DirectoryIndex> buildDirectoryIndex(const ext2::Inode& dir,
+                                                         uint32_t dirIno);
+    void invalidateDirectoryIndex(uint32_t dirIno);
+    int addDirectoryEntry(Ext2Inode& dir, const char* name, size_t nameLen, uint32_t ino,
+                          uint8_t fileType);
+
+    int syncLocked();
+    void finishOperation();
 
     DiskDevice& _disk;
+    Mutex _lock;
+
     estd::unique_ptr<ext2::SuperBlock> _superBlock;
     estd::unique_ptr<ext2::BlockGroupDescriptor[]> _blockGroups;
     estd::unique_ptr<ext2::Inode> _rootInode;
-    Buffer _rootDir;
+    estd::unique_ptr<BlockCache> _cache;
+
+    // False if the filesystem uses features which we can't maintain while writing
+    bool _writable = false;
+
+    // The superblock or block group descriptors have been modified
+    bool _metadataDirty = false;
+
+    // Blocks promised to delayed allocations, which can't be handed out otherwise
+    uint32_t _delayedBlockCount = 0;
+
+    // Source of Ext2Inode::version
+    uint64_t _lastVersion = 0;
+
+    // Inodes which are open, or have modifications which haven't been written yet
+    estd::vector<estd::shared_ptr<Ext2Inode>> _openInodes;
+
+    estd::unique_ptr<Thread> _writebackThread;
+
+    // Most recently used in-memory indices for directories without an on-disk htree
+    static constexpr size_t MAX_CACHED_DIRECTORIES = 16;
+    estd::vector<estd::unique_ptr<DirectoryIndex>> _dirIndexCache;
+    uint64_t _dirIndexClock = 0;
 };
@@ -53,6 +53,11 @@ enum SFeatureROCompat : uint32_t {
     FEATURE_RO_COMPAT_BTREE_DIR = 0x0004,
 };
 
+enum SFlags : uint32_t {
+    FLAGS_SIGNED_HASH = 0x0001,
+    FLAGS_UNSIGNED_HASH = 0x0002,
+};
+
 enum ReservedInodes : uint32_t {
     BAD_INO = 1,
     ROOT_INO = 2,
@@ -110,7 +115,9 @@ struct __attribute__((packed)) SuperBlock {
     uint8_t _padding[3];
     uint32_t default_mount_options;
     uint32_t first_meta_bg;
-    uint8_t unused[760];
+    uint8_t _unused1[88];
+    SFlags flags;
+    uint8_t unused[668];
 };
 
 static_assert(sizeof(SuperBlock) == 1024);
@@ -153,6 +160,18 @@ enum IMode : uint16_t {
     S_IXOTH = 0x0001,
 };
 
+enum IFlags : uint32_t {
+    SECRM_FL = 0x00000001,
+    UNRM_FL = 0x00000002,
+    COMPR_FL = 0x00000004,
+    SYNC_FL = 0x00000008,
+    IMMUTABLE_FL = 0x00000010,
+    APPEND_FL = 0x00000020,
+    NODUMP_FL = 0x00000040,
+    NOATIME_FL = 0x00000080,
+    INDEX_FL = 0x00001000,
+};
+
 struct __attribute__((packed)) Inode {
     IMode mode;
     uint16_t uid;
@@ -196,4 +215,52 @@ struct __attribute__((packed)) DirectoryEntry {
 
 static_assert(sizeof(DirectoryEntry) == 8);
 
+// Values of DirectoryEntry::file_type, if FEATURE_INCOMPAT_FILETYPE is set
+enum DirEntryType : uint8_t {
+    FT_UNKNOWN = 0,
+    FT_REG_FILE = 1,
+    FT_DIR = 2,
+    FT_CHRDEV = 3,
+    FT_BLKDEV = 4,
+    FT_FIFO = 5,
+    FT_SOCK = 6,
+    FT_SYMLINK = 7,
+};
+
+// Hashed directory index (htree)
+enum DxHashVersion : uint8_t {
+    DX_HASH_LEGACY = 0,
+    DX_HASH_HALF_MD4 = 1,
+    DX_HASH_TEA = 2,
+    DX_HASH_LEGACY_UNSIGNED = 3,
+    DX_HASH_HALF_MD4_UNSIGNED = 4,
+    DX_HASH_TEA_UNSIGNED = 5,
+};
+
+// Follows the fake "." and ".." entries at the start of the first directory block
+struct __attribute__((packed)) DxRootInfo {
+    uint32_t reserved_zero;
+    DxHashVersion hash_version;
+    uint8_t info_length;
+    uint8_t indirect_levels;
+    uint8_t unused_flags;
+};
+
+static_assert(sizeof(DxRootInfo) == 8);
+
+// The first entry of every index node overlays its hash field with the count and limit
+// of the node, and its hash is implicitly zero
+struct __attribute__((packed)) DxEntry {
+    uint32_t hash;
+    uint32_t block;
+};
+
+struct __attribute__((packed)) DxCountLimit {
+    uint16_t limit;
+    uint16_t count;
+};
+
+static_assert(sizeof(DxEntry) == 8);
+static_assert(sizeof(DxCountLimit) == 4);
+
 }  // namespace ext2
@@ -2,11 +2,13 @@
 
 #include "api/dirent.h"
 #include "api/errno.h"
+#include "api/fcntl.h"
 #include "estd/new.h"  // IWYU pragma: keep
 #include "estd/utility.h"
+#include "klibc.h"
 
-Ext2File::Ext2File(Ext2FileSystem& fs, estd::unique_ptr<ext2::Inode> inode)
-: _fs(fs), _inode(estd::move(inode)) {}
+Ext2File::Ext2File(Ext2FileSystem& fs, const estd::shared_ptr<Ext2Inode>& inode)
+: _fs(fs), _inode(inode) {}
 
 ssize_t Ext2File::read(OpenFileDescription& fd, void* buffer, size_t count) {
     ssize_t bytesRead =
@@ -19,21 +21,53 @@ ssize_t Ext2File::read(OpenFileDescription& fd, void* buffer, size_t count) {
     return bytesRead;
 }
 
-ssize_t Ext2File::write(OpenFileDescription& /*fd*/, const void* /*buffer*/,
-                        size_t /*count*/) {
-    // We don't have a writeable filesystem yet
-    return -EBADF;
+ssize_t Ext2File::write(OpenFileDescription& fd, const void* buffer, size_t count) {
+    if ((fd.flags & O_ACCMODE) == O_RDONLY) {
+        return -EBADF;
+    }
+
+    if (_inode->data.isDirectory()) {
+        return -EISDIR;
+    }
+
+    // TODO: file descriptor needs locking
+    if (fd.flags & O_APPEND) {
+        fd.offset = _inode->data.size();
+    }
+
+    count = min<size_t>(count, UINT32_MAX);
+    ssize_t bytesWritten = _fs.writeToFile(
+        *_inode, reinterpret_cast<const uint8_t*>(buffer), count, fd.offset);
+    if (bytesWritten > 0) {
+        fd.offset += bytesWritten;
+    }
+
+    return bytesWritten;
 }
 
+ssize_t Ext2File::sendTo(uint64_t offset, size_t count, File& out,
+                         OpenFileDescription& outFd) {
+    if (_inode->data.isDirectory()) {
+        return -EISDIR;
+    } else if (offset > UINT32_MAX) {
+        return 0;
+    }
+
+    count = min<size_t>(count, UINT32_MAX);
+    return _fs.sendFromFile(*_inode, out, outFd, count, offset);
+}
+
+int Ext2File::sync() { return _fs.sync(); }
+
 ssize_t Ext2File::readDir(OpenFileDescription& /*fd*/, void* buffer, size_t count) {
     // TODO: what should be done about fd.offset?
 
     // Make sure that current location is a directory
-    if ((_inode->mode & 0xF000) != ext2::S_IFDIR) {
+    if (!_inode->data.isDirectory()) {
         return -ENOTDIR;
     }
 
-    size_t size = _inode->size();
+    size_t size = _inode->data.size();
     Buffer dirBuffer(size);
     if (!_fs.readFullFile(*_inode, dirBuffer.get())) {
         return -EIO;
@@ -48,6 +82,12 @@ ssize_t Ext2File::readDir(OpenFileDescription& /*fd*/, void* buffer, size_t coun
         ext2::DirectoryEntry* dirEntry =
             reinterpret_cast<ext2::DirectoryEntry*>(&dirBuffer[inOffset]);
 
+        // Skip unused entries, including the fake entries at the start of htree nodes
+        if (dirEntry->inode == 0) {
+            inOffset += dirEntry->rec_len;
+            continue;
+        }
+
         size_t outEntrySize = sizeof(dirent) + dirEntry->name_len + 1;
         if (outOffset + outEntrySize > count) {
             // EINVAL tells the caller that the buffer was too small
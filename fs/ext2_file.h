@@ -6,16 +6,19 @@
 
 class Ext2File : public File {
 public:
-    Ext2File(Ext2FileSystem& fs, estd::unique_ptr<ext2::Inode> inode);
+    Ext2File(Ext2FileSystem& fs, const estd::shared_ptr<Ext2Inode>& inode);
 
     ssize_t read(OpenFileDescription& fd, void* buffer, size_t count) override;
     ssize_t write(OpenFileDescription& fd, const void* buffer, size_t count) override;
     ssize_t readDir(OpenFileDescription& fd, void* buffer, size_t count) override;
+    ssize_t sendTo(uint64_t offset, size_t count, File& out,
+                   OpenFileDescription& outFd) override;
+    int sync() override;
 
     bool hasInode() const override { return true; }
-    ext2::Inode* inode() override { return _inode.get(); }
+    ext2::Inode* inode() override { return &_inode->data; }
 
 private:
     Ext2FileSystem& _fs;
-    estd::unique_ptr<ext2::Inode> _inode;
+    estd::shared_ptr<Ext2Inode> _inode;
 };
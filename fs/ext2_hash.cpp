@@ -0,0 +1,170 @@
+#include "fs/ext2_hash.h"
+
+#include <string.h>
+#include <sys/types.h>
+
+namespace ext2 {
+
+static inline uint32_t rotl(uint32_t x, uint8_t s) { return (x << s) | (x >> (32 - s)); }
+
+// The original hash used by the htree patches, which is sensitive to the signedness of
+// char on the machine which created the filesystem
+static uint32_t legacyHash(const char* name, size_t len, bool isSigned) {
+    uint32_t hash0 = 0x12A3FE2D;
+    uint32_t hash1 = 0x37ABE8F9;
+
+    for (size_t i = 0; i < len; ++i) {
+        int c = isSigned ? (int)(int8_t)name[i] : (int)(uint8_t)name[i];
+        uint32_t hash = hash1 + (hash0 ^ (uint32_t)(c * 7152373));
+        if (hash & 0x80000000) hash -= 0x7FFFFFFF;
+
+        hash1 = hash0;
+        hash0 = hash;
+    }
+
+    return hash0 << 1;
+}
+
+// Packs up to 4 * num bytes of the name into num words, padding with a value derived
+// from the length of the name
+static void nameToWords(const char* name, size_t len, uint32_t* words, int num,
+                        bool isSigned) {
+    uint32_t pad = (uint32_t)len | ((uint32_t)len << 8);
+    pad |= pad << 16;
+
+    if (len > (size_t)num * 4) len = num * 4;
+
+    uint32_t value = pad;
+    for (size_t i = 0; i < len; ++i) {
+        int c = isSigned ? (int)(int8_t)name[i] : (int)(uint8_t)name[i];
+        value = (uint32_t)c + (value << 8);
+
+        if (i % 4 == 3) {
+            *words++ = value;
+            value = pad;
+            --num;
+        }
+    }
+
+    if (--num >= 0) *words++ = value;
+    while (--num >= 0) *words++ = pad;
+}
+
+// MD4 with the last round and half of the input dropped
+static void halfMd4Transform(uint32_t buf[4], const uint32_t in[8]) {
+    constexpr uint32_t K2 = 013240474631;
+    constexpr uint32_t K3 = 015666365641;
+
+    auto F = [](uint32_t x, uint32_t y, uint32_t z) { return z ^ (x & (y ^ z)); };
+    auto G = [](uint32_t x, uint32_t y, uint32_t z) { return (x & y) + ((x ^ y) & z); };
+    auto H = [](uint32_t x, uint32_t y, uint32_t z) { return x ^ y ^ z; };
+
+    uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+    // Round 1
+    a = rotl(a + F(b, c, d) + in[0], 3);
+    d = rotl(d + F(a, b, c) + in[1], 7);
+    c = rotl(c + F(d, a, b) + in[2], 11);
+    b = rotl(b + F(c, d, a) + in[3], 19);
+    a = rotl(a + F(b, c, d) + in[4], 3);
+    d = rotl(d + F(a, b, c) + in[5], 7);
+    c = rotl(c + F(d, a, b) + in[6], 11);
+    b = rotl(b + F(c, d, a) + in[7], 19);
+
+    // Round 2
+    a = rotl(a + G(b, c, d) + in[1] + K2, 3);
+    d = rotl(d + G(a, b, c) + in[3] + K2, 5);
+    c = rotl(c + G(d, a, b) + in[5] + K2, 9);
+    b = rotl(b + G(c, d, a) + in[7] + K2, 13);
+    a = rotl(a + G(b, c, d) + in[0] + K2, 3);
+    d = rotl(d + G(a, b, c) + in[2] + K2, 5);
+    c = rotl(c + G(d, a, b) + in[4] + K2, 9);
+    b = rotl(b + G(c, d, a) + in[6] + K2, 13);
+
+    // Round 3
+    a = rotl(a + H(b, c, d) + in[3] + K3, 3);
+    d = rotl(d + H(a, b, c) + in[7] + K3, 9);
+    c = rotl(c + H(d, a, b) + in[2] + K3, 11);
+    b = rotl(b + H(c, d, a) + in[6] + K3, 15);
+    a = rotl(a + H(b, c, d) + in[1] + K3, 3);
+    d = rotl(d + H(a, b, c) + in[5] + K3, 9);
+    c = rotl(c + H(d, a, b) + in[0] + K3, 11);
+    b = rotl(b + H(c, d, a) + in[4] + K3, 15);
+
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
+
+static void teaTransform(uint32_t buf[4], const uint32_t in[4]) {
+    constexpr uint32_t DELTA = 0x9E3779B9;
+
+    uint32_t sum = 0;
+    uint32_t b0 = buf[0], b1 = buf[1];
+    uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+
+    for (int i = 0; i < 16; ++i) {
+        sum += DELTA;
+        b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+        b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+    }
+
+    buf[0] += b0;
+    buf[1] += b1;
+}
+
+uint32_t dirHash(const char* name, size_t len, DxHashVersion version,
+                 const uint32_t seed[4]) {
+    uint32_t buf[4] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476};
+
+    // An all-zero seed means to use the default
+    if (seed[0] || seed[1] || seed[2] || seed[3]) {
+        memcpy(buf, seed, sizeof(buf));
+    }
+
+    bool isSigned = version < DX_HASH_LEGACY_UNSIGNED;
+
+    uint32_t hash;
+    uint32_t in[8];
+    switch (version) {
+        case DX_HASH_LEGACY:
+        case DX_HASH_LEGACY_UNSIGNED:
+            hash = legacyHash(name, len, isSigned);
+            break;
+
+        case DX_HASH_HALF_MD4:
+        case DX_HASH_HALF_MD4_UNSIGNED:
+            for (ssize_t remaining = len; remaining > 0; remaining -= 32, name += 32) {
+                nameToWords(name, remaining, in, 8, isSigned);
+                halfMd4Transform(buf, in);
+            }
+
+            hash = buf[1];
+            break;
+
+        case DX_HASH_TEA:
+        case DX_HASH_TEA_UNSIGNED:
+            for (ssize_t remaining = len; remaining > 0; remaining -= 16, name += 16) {
+                nameToWords(name, remaining, in, 4, isSigned);
+                teaTransform(buf, in);
+            }
+
+            hash = buf[0];
+            break;
+
+        default:
+            return 0;
+    }
+
+    hash &= ~1U;
+
+    // The largest hash value is reserved as an end-of-directory marker
+    if (hash == (0x7FFFFFFFU << 1)) {
+        hash = (0x7FFFFFFFU - 1) << 1;
+    }
+
+    return hash;
+}
+
+}  // namespace ext2
@@ -0,0 +1,16 @@
+// Directory entry hash functions used by the ext2 hashed directory index (htree)
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fs/ext2_defs.h"
+
+namespace ext2 {
+
+// Computes the major hash of a file name, as stored in the htree index nodes. The
+// low bit is always clear, since the index uses it to flag hash collisions which
+// continue into the next leaf block.
+uint32_t dirHash(const char* name, size_t len, DxHashVersion version,
+                 const uint32_t seed[4]);
+
+}  // namespace ext2
@@ -0,0 +1,48 @@
+// Interface to a filesystem which can be mounted into the directory tree
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "estd/memory.h"
+
+struct File;
+
+struct FileInfo {
+    bool isDirectory;
+    uint64_t size;
+
+    // Changes whenever the contents may have, so that anything derived from them can be
+    // cached
+    uint64_t version;
+};
+
+// Files are identified by inode numbers, which are only unique within one filesystem.
+// Path resolution is done a component at a time by the VFS, so that it can cross mount
+// points.
+class FileSystem {
+public:
+    // Never the number of a real inode
+    static constexpr uint32_t NO_INO = 0;
+
+    virtual ~FileSystem() = default;
+
+    virtual uint32_t rootIno() const = 0;
+
+    // Looks up a single name (which may be "." or "..") in a directory. Returns NO_INO
+    // if there's no such entry, or dirIno isn't a directory.
+    virtual uint32_t lookupChild(uint32_t dirIno, const char* name, size_t nameLen) = 0;
+
+    virtual int stat(uint32_t ino, FileInfo& info) = 0;
+
+    // The absolute path of a directory, relative to the root of this filesystem
+    virtual int getPath(uint32_t ino, char* path, size_t pathSize) = 0;
+
+    // Creates an empty regular file. Returns the new inode number, or a negative error
+    virtual int64_t createFile(uint32_t dirIno, const char* name, size_t nameLen) = 0;
+
+    // Opens an existing inode with the given O_* flags (truncating it for O_TRUNC)
+    virtual int open(uint32_t ino, int flags, estd::shared_ptr<File>& file) = 0;
+
+    // Writes all modified data and metadata to the underlying device
+    virtual int sync() { return 0; }
+};
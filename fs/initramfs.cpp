@@ -0,0 +1,309 @@
+#include "fs/initramfs.h"
+
+#include <string.h>
+
+#include "api/dirent.h"
+#include "api/errno.h"
+#include "api/fcntl.h"
+#include "estd/new.h"  // IWYU pragma: keep
+#include "estd/print.h"
+#include "file.h"
+#include "klibc.h"
+#include "mm.h"
+
+// Physical location of the archive, which is loaded along with the kernel image.
+// create_disk_image.py fills these in when it appends the archive, so they stay zero
+// (from .bss) for a kernel without one.
+extern "C" {
+uint32_t initramfsStart;
+uint32_t initramfsSize;
+}
+
+class InitramFile : public File {
+public:
+    InitramFile(const InitramFileSystem& fs, uint32_t ino) : _fs(fs), _ino(ino) {}
+
+    ssize_t read(OpenFileDescription& fd, void* buffer, size_t count) override {
+        const InitramFileSystem::Entry* entry = _fs.getEntry(_ino);
+        if (!entry) {
+            return -EISDIR;
+        }
+
+        if (static_cast<size_t>(fd.offset) >= entry->size) {
+            return 0;
+        }
+
+        count = min(count, entry->size - fd.offset);
+        memcpy(buffer, entry->data + fd.offset, count);
+
+        // TODO: file descriptor needs locking
+        fd.offset += count;
+        return count;
+    }
+
+    ssize_t write(OpenFileDescription&, const void*, size_t) override { return -EBADF; }
+
+    // The whole file is already in memory, so it can be handed over in one piece
+    ssize_t sendTo(uint64_t offset, size_t count, File& out,
+                   OpenFileDescription& outFd) override {
+        const InitramFileSystem::Entry* entry = _fs.getEntry(_ino);
+        if (!entry) {
+            return -EISDIR;
+        }
+
+        if (offset >= entry->size) {
+            return 0;
+        }
+
+        iovec iov;
+        iov.iov_base = const_cast<uint8_t*>(entry->data + offset);
+        iov.iov_len = min(count, entry->size - offset);
+        return out.writev(outFd, &iov, 1);
+    }
+
+    ssize_t readDir(OpenFileDescription&, void* buffer, size_t count) override {
+        if (_ino != InitramFileSystem::ROOT_INO) {
+            return -ENOTDIR;
+        }
+
+        return _fs.readDir(buffer, count);
+    }
+
+    // Nothing to write back
+    int sync() override { return 0; }
+
+private:
+    const InitramFileSystem& _fs;
+    uint32_t _ino;
+};
+
+// cpio "newc" headers are ASCII, with each number as eight hex digits
+static constexpr char CPIO_MAGIC[] = "070701";
+static constexpr size_t CPIO_HEADER_SIZE = 110;
+static constexpr size_t CPIO_MODE_OFFSET = 14;
+static constexpr size_t CPIO_FILESIZE_OFFSET = 54;
+static constexpr size_t CPIO_NAMESIZE_OFFSET = 94;
+static constexpr uint32_t CPIO_S_IFMT = 0170000;
+static constexpr uint32_t CPIO_S_IFREG = 0100000;
+
+static const char* strnchr(const char* s, size_t n, char c) {
+    for (size_t i = 0; i < n; ++i) {
+        if (s[i] == c) {
+            return s + i;
+        }
+    }
+
+    return nullptr;
+}
+
+static bool parseHex(const uint8_t* p, uint32_t& value) {
+    value = 0;
+    for (size_t i = 0; i < 8; ++i) {
+        uint8_t c = p[i];
+        uint32_t digit;
+        if (c >= '0' && c <= '9') {
+            digit = c - '0';
+        } else if (c >= 'A' && c <= 'F') {
+            digit = c - 'A' + 10;
+        } else if (c >= 'a' && c <= 'f') {
+            digit = c - 'a' + 10;
+        } else {
+            return false;
+        }
+
+        value = (value << 4) | digit;
+    }
+
+    return true;
+}
+
+bool InitramFileSystem::parse(const uint8_t* archive, size_t size) {
+    size_t offset = 0;
+    while (true) {
+        const uint8_t* header = archive + offset;
+        if (offset + CPIO_HEADER_SIZE > size || memcmp(header, CPIO_MAGIC, 6) != 0) {
+            println("initramfs: bad header at offset {}", offset);
+            return false;
+        }
+
+        uint32_t mode, fileSize, nameSize;
+        if (!parseHex(header + CPIO_MODE_OFFSET, mode) ||
+            !parseHex(header + CPIO_FILESIZE_OFFSET, fileSize) ||
+            !parseHex(header + CPIO_NAMESIZE_OFFSET, nameSize) || nameSize == 0) {
+            println("initramfs: bad header at offset {}", offset);
+            return false;
+        }
+
+        // The name (including its terminator) and the data are each padded to a multiple
+        // of four bytes
+        size_t nameOffset = offset + CPIO_HEADER_SIZE;
+        size_t dataOffset = roundUp(nameOffset + nameSize, 4);
+        if (dataOffset + fileSize > size) {
+            println("initramfs: truncated archive");
+            return false;
+        }
+
+        const char* name = reinterpret_cast<const char*>(archive + nameOffset);
+        size_t nameLen = nameSize - 1;
+        if (nameLen == 10 && memcmp(name, "TRAILER!!!", 10) == 0) {
+            return true;
+        }
+
+        if (nameLen > 2 && name[0] == '.' && name[1] == '/') {
+            name += 2;
+            nameLen -= 2;
+        }
+
+        if ((mode & CPIO_S_IFMT) != CPIO_S_IFREG) {
+            // Directories (like ".") are implied
+        } else if (strnchr(name, nameLen, '/')) {
+            println("initramfs: skipping '{}': subdirectories aren't supported", name);
+        } else {
+            _entries.push_back(Entry{name, nameLen, archive + dataOffset, fileSize});
+        }
+
+        offset = roundUp(dataOffset + fileSize, 4);
+    }
+}
+
+estd::unique_ptr<InitramFileSystem> InitramFileSystem::create() {
+    if (initramfsSize == 0) {
+        return {};
+    }
+
+    const uint8_t* archive = mm.physicalToVirtual(initramfsStart).ptr<uint8_t>();
+
+    estd::unique_ptr<InitramFileSystem> fs(new InitramFileSystem);
+    if (!fs->parse(archive, initramfsSize)) {
+        return {};
+    }
+
+    println("initramfs: {} files, {} KiB at {:X}", fs->_entries.size(),
+            initramfsSize / KiB, initramfsStart);
+    return fs;
+}
+
+const InitramFileSystem::Entry* InitramFileSystem::getEntry(uint32_t ino) const {
+    if (ino <= ROOT_INO || ino - ROOT_INO > _entries.size()) {
+        return nullptr;
+    }
+
+    return &_entries[ino - ROOT_INO - 1];
+}
+
+uint32_t InitramFileSystem::lookupChild(uint32_t dirIno, const char* name,
+                                        size_t nameLen) {
+    if (dirIno != ROOT_INO) {
+        return NO_INO;
+    }
+
+    // The root is its own parent, and the VFS handles leaving through the mount point
+    if ((nameLen == 1 && name[0] == '.') ||
+        (nameLen == 2 && name[0] == '.' && name[1] == '.')) {
+        return ROOT_INO;
+    }
+
+    for (size_t i = 0; i < _entries.size(); ++i) {
+        const Entry& entry = _entries[i];
+        if (entry.nameLen == nameLen && memcmp(entry.name, name, nameLen) == 0) {
+            return ROOT_INO + 1 + i;
+        }
+    }
+
+    return NO_INO;
+}
+
+int InitramFileSystem::stat(uint32_t ino, FileInfo& info) {
+    if (ino == ROOT_INO) {
+        info.isDirectory = true;
+        info.size = 0;
+        info.version = 0;
+        return 0;
+    }
+
+    const Entry* entry = getEntry(ino);
+    if (!entry) {
+        return -ENOENT;
+    }
+
+    info.isDirectory = false;
+    info.size = entry->size;
+
+    // Never changes
+    info.version = 0;
+    return 0;
+}
+
+int InitramFileSystem::getPath(uint32_t ino, char* path, size_t pathSize) {
+    const char* name = "";
+    size_t nameLen = 0;
+    if (ino != ROOT_INO) {
+        const Entry* entry = getEntry(ino);
+        if (!entry) {
+            return -ENOENT;
+        }
+
+        name = entry->name;
+        nameLen = entry->nameLen;
+    }
+
+    if (nameLen + 2 > pathSize) {
+        return -ENAMETOOLONG;
+    }
+
+    path[0] = '/';
+    memcpy(path + 1, name, nameLen);
+    path[nameLen + 1] = '\0';
+    return 0;
+}
+
+int64_t InitramFileSystem::createFile(uint32_t, const char*, size_t) { return -EROFS; }
+
+int InitramFileSystem::open(uint32_t ino, int flags, estd::shared_ptr<File>& file) {
+    if (ino != ROOT_INO && !getEntry(ino)) {
+        return -ENOENT;
+    }
+
+    if ((flags & O_ACCMODE) != O_RDONLY) {
+        return ino == ROOT_INO ? -EISDIR : -EROFS;
+    }
+
+    file = estd::shared_ptr<File>(new InitramFile(*this, ino));
+    return 0;
+}
+
+ssize_t InitramFileSystem::readDir(void* buffer, size_t count) const {
+    uint8_t* pbuffer = reinterpret_cast<uint8_t*>(buffer);
+    size_t outOffset = 0;
+
+    auto emit = [&](uint32_t ino, const char* name, size_t nameLen, uint8_t type) {
+        size_t outEntrySize = sizeof(dirent) + nameLen + 1;
+        if (outOffset + outEntrySize > count) {
+            return false;
+        }
+
+        dirent* outEntry = new (&pbuffer[outOffset]) dirent;
+        outEntry->d_ino = ino;
+        outEntry->d_reclen = outEntrySize;
+        outEntry->d_type = type;
+        memcpy(outEntry->d_name, name, nameLen);
+        outEntry->d_name[nameLen] = '\0';
+
+        outOffset += outEntrySize;
+        return true;
+    };
+
+    // EINVAL tells the caller that the buffer was too small
+    if (!emit(ROOT_INO, ".", 1, DT_DIR) || !emit(ROOT_INO, "..", 2, DT_DIR)) {
+        return -EINVAL;
+    }
+
+    for (size_t i = 0; i < _entries.size(); ++i) {
+        const Entry& entry = _entries[i];
+        if (!emit(ROOT_INO + 1 + i, entry.name, entry.nameLen, DT_REG)) {
+            return -EINVAL;
+        }
+    }
+
+    return outOffset;
+}
@@ -0,0 +1,47 @@
+// Read-only filesystem holding the archive which the bootloader loads with the kernel
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "estd/memory.h"
+#include "estd/vector.h"
+#include "fs/file_system.h"
+
+// The archive is in the cpio "newc" format, and contains a flat list of regular files
+// (the userland binaries). File contents are served straight out of the archive, which
+// stays in the memory below 1MiB where the bootloader put it, so nothing here ever
+// touches a disk.
+class InitramFileSystem : public FileSystem {
+public:
+    // Returns nullptr if no archive was loaded, or it's malformed
+    static estd::unique_ptr<InitramFileSystem> create();
+
+    uint32_t rootIno() const override { return ROOT_INO; }
+    uint32_t lookupChild(uint32_t dirIno, const char* name, size_t nameLen) override;
+    int stat(uint32_t ino, FileInfo& info) override;
+    int getPath(uint32_t ino, char* path, size_t pathSize) override;
+    int64_t createFile(uint32_t dirIno, const char* name, size_t nameLen) override;
+    int open(uint32_t ino, int flags, estd::shared_ptr<File>& file) override;
+
+private:
+    friend class InitramFile;
+
+    static constexpr uint32_t ROOT_INO = 1;
+
+    struct Entry {
+        const char* name;
+        size_t nameLen;
+        const uint8_t* data;
+        size_t size;
+    };
+
+    InitramFileSystem() = default;
+    bool parse(const uint8_t* archive, size_t size);
+
+    // Files are numbered from 2, in archive order
+    const Entry* getEntry(uint32_t ino) const;
+    ssize_t readDir(void* buffer, size_t count) const;
+
+    estd::vector<Entry> _entries;
+};
@@ -0,0 +1,368 @@
+#include "fs/tmpfs.h"
+
+#include <string.h>
+
+#include "api/dirent.h"
+#include "api/errno.h"
+#include "api/fcntl.h"
+#include "estd/new.h"  // IWYU pragma: keep
+#include "file.h"
+#include "klibc.h"
+#include "mm.h"
+#include "scheduler.h"  // IWYU pragma: keep
+#include "units.h"
+
+class TmpFile : public File {
+public:
+    TmpFile(TmpFileSystem& fs, uint32_t ino) : _fs(fs), _ino(ino) {}
+
+    ssize_t read(OpenFileDescription& fd, void* buffer, size_t count) override {
+        ssize_t bytesRead =
+            _fs.read(_ino, reinterpret_cast<uint8_t*>(buffer), count, fd.offset);
+        if (bytesRead > 0) {
+            // TODO: file descriptor needs locking
+            fd.offset += bytesRead;
+        }
+
+        return bytesRead;
+    }
+
+    ssize_t write(OpenFileDescription& fd, const void* buffer, size_t count) override {
+        if ((fd.flags & O_ACCMODE) == O_RDONLY) {
+            return -EBADF;
+        }
+
+        // TODO: file descriptor needs locking
+        uint64_t offset = fd.offset;
+        ssize_t bytesWritten = _fs.write(_ino, reinterpret_cast<const uint8_t*>(buffer),
+                                         count, offset, fd.flags & O_APPEND);
+        if (bytesWritten > 0) {
+            fd.offset = offset + bytesWritten;
+        }
+
+        return bytesWritten;
+    }
+
+    ssize_t readDir(OpenFileDescription&, void* buffer, size_t count) override {
+        return _fs.readDir(_ino, buffer, count);
+    }
+
+    // Nothing to write back
+    int sync() override { return 0; }
+
+private:
+    TmpFileSystem& _fs;
+    uint32_t _ino;
+};
+
+TmpFileSystem::TmpFileSystem() {
+    MutexLocker locker(_lock);
+    uint32_t root = newNode(ROOT_INO, true);
+    ASSERT(root == ROOT_INO);
+}
+
+TmpFileSystem::~TmpFileSystem() {
+    for (auto& node : _nodes) {
+        truncate(*node);
+    }
+}
+
+TmpFileSystem::Node* TmpFileSystem::getNode(uint32_t ino) {
+    if (ino == NO_INO || ino > _nodes.size()) {
+        return nullptr;
+    }
+
+    return _nodes[ino - 1].get();
+}
+
+uint32_t TmpFileSystem::newNode(uint32_t parentIno, bool isDirectory) {
+    Node* node = new Node;
+    node->ino = _nodes.size() + 1;
+    node->parentIno = parentIno;
+    node->isDirectory = isDirectory;
+    _nodes.push_back(estd::unique_ptr<Node>(node));
+    return node->ino;
+}
+
+void TmpFileSystem::truncate(Node& node) {
+    for (PhysicalAddress page : node.pages) {
+        if (page.value != 0) {
+            mm.pageFree(page);
+            --_usedPages;
+        }
+    }
+
+    node.pages.clear();
+    node.size = 0;
+    node.version = ++_lastVersion;
+}
+
+uint32_t TmpFileSystem::lookupChild(uint32_t dirIno, const char* name, size_t nameLen) {
+    MutexLocker locker(_lock);
+
+    Node* dir = getNode(dirIno);
+    if (!dir || !dir->isDirectory) {
+        return NO_INO;
+    }
+
+    if (nameLen == 1 && name[0] == '.') {
+        return dir->ino;
+    } else if (nameLen == 2 && name[0] == '.' && name[1] == '.') {
+        return dir->parentIno;
+    }
+
+    for (const Entry& entry : dir->entries) {
+        if (entry.nameLen == nameLen && memcmp(entry.name, name, nameLen) == 0) {
+            return entry.ino;
+        }
+    }
+
+    return NO_INO;
+}
+
+int TmpFileSystem::stat(uint32_t ino, FileInfo& info) {
+    MutexLocker locker(_lock);
+
+    Node* node = getNode(ino);
+    if (!node) {
+        return -ENOENT;
+    }
+
+    info.isDirectory = node->isDirectory;
+    info.size = node->size;
+    info.version = node->version;
+    return 0;
+}
+
+int TmpFileSystem::getPath(uint32_t ino, char* path, size_t pathSize) {
+    MutexLocker locker(_lock);
+
+    if (pathSize < 2) {
+        return -ENAMETOOLONG;
+    }
+
+    // Build the path backwards from the end of the buffer, and then move it to the front
+    size_t start = pathSize - 1;
+    path[start] = '\0';
+
+    Node* node = getNode(ino);
+    if (!node) {
+        return -ENOENT;
+    }
+
+    while (node->ino != ROOT_INO) {
+        Node* parent = getNode(node->parentIno);
+
+        const Entry* found = nullptr;
+        for (const Entry& entry : parent->entries) {
+            if (entry.ino == node->ino) {
+                found = &entry;
+                break;
+            }
+        }
+
+        ASSERT(found);
+        if (static_cast<size_t>(found->nameLen) + 1 > start) {
+            return -ENAMETOOLONG;
+        }
+
+        start -= found->nameLen;
+        memcpy(path + start, found->name, found->nameLen);
+        path[--start] = '/';
+        node = parent;
+    }
+
+    if (start == pathSize - 1) {
+        path[--start] = '/';
+    }
+
+    memmove(path, path + start, pathSize - start);
+    return 0;
+}
+
+int64_t TmpFileSystem::createFile(uint32_t dirIno, const char* name, size_t nameLen) {
+    if (nameLen == 0) {
+        return -EISDIR;
+    } else if (nameLen > MAX_NAME_LENGTH) {
+        return -ENAMETOOLONG;
+    }
+
+    MutexLocker locker(_lock);
+
+    Node* dir = getNode(dirIno);
+    if (!dir) {
+        return -ENOENT;
+    } else if (!dir->isDirectory) {
+        return -ENOTDIR;
+    }
+
+    for (const Entry& entry : dir->entries) {
+        if (entry.nameLen == nameLen && memcmp(entry.name, name, nameLen) == 0) {
+            return -EEXIST;
+        }
+    }
+
+    uint32_t ino = newNode(dirIno, false);
+
+    Entry entry;
+    entry.ino = ino;
+    entry.nameLen = nameLen;
+    memcpy(entry.name, name, nameLen);
+    entry.name[nameLen] = '\0';
+
+    // newNode may have reallocated _nodes, but the nodes themselves don't move
+    getNode(dirIno)->entries.push_back(entry);
+    return ino;
+}
+
+int TmpFileSystem::open(uint32_t ino, int flags, estd::shared_ptr<File>& file) {
+    MutexLocker locker(_lock);
+
+    Node* node = getNode(ino);
+    if (!node) {
+        return -ENOENT;
+    }
+
+    if ((flags & O_ACCMODE) != O_RDONLY && (flags & O_TRUNC) && !node->isDirectory) {
+        truncate(*node);
+    }
+
+    file = estd::shared_ptr<File>(new TmpFile(*this, ino));
+    return 0;
+}
+
+ssize_t TmpFileSystem::read(uint32_t ino, uint8_t* dest, size_t count, uint64_t offset) {
+    MutexLocker locker(_lock);
+
+    Node* node = getNode(ino);
+    if (!node) {
+        return -EBADF;
+    } else if (node->isDirectory) {
+        return -EISDIR;
+    }
+
+    if (offset >= node->size) {
+        return 0;
+    }
+
+    count = min(count, node->size - offset);
+
+    size_t done = 0;
+    while (done < count) {
+        size_t pageIndex = (offset + done) / PAGE_SIZE;
+        size_t pageOffset = (offset + done) % PAGE_SIZE;
+        size_t length = min(count - done, PAGE_SIZE - pageOffset);
+
+        PhysicalAddress page = node->pages[pageIndex];
+        if (page.value == 0) {
+            memset(dest + done, 0, length);
+        } else {
+            memcpy(dest + done, mm.physicalToVirtual(page).ptr<uint8_t>() + pageOffset,
+                   length);
+        }
+
+        done += length;
+    }
+
+    return done;
+}
+
+ssize_t TmpFileSystem::write(uint32_t ino, const uint8_t* src, size_t count,
+                             uint64_t& offset, bool append) {
+    MutexLocker locker(_lock);
+
+    Node* node = getNode(ino);
+    if (!node) {
+        return -EBADF;
+    } else if (node->isDirectory) {
+        return -EISDIR;
+    }
+
+    if (append) {
+        offset = node->size;
+    }
+
+    size_t done = 0;
+    while (done < count) {
+        size_t pageIndex = (offset + done) / PAGE_SIZE;
+        size_t pageOffset = (offset + done) % PAGE_SIZE;
+        size_t length = min(count - done, PAGE_SIZE - pageOffset);
+
+        while (node->pages.size() <= pageIndex) {
+            node->pages.push_back(PhysicalAddress(0));
+        }
+
+        PhysicalAddress& page = node->pages[pageIndex];
+        if (page.value == 0) {
+            if (_usedPages == MAX_PAGES) {
+                break;
+            }
+
+            page = mm.pageAlloc();
+            ++_usedPages;
+
+            // Only the parts we don't overwrite need to be cleared
+            uint8_t* ptr = mm.physicalToVirtual(page).ptr<uint8_t>();
+            memset(ptr, 0, pageOffset);
+            memset(ptr + pageOffset + length, 0, PAGE_SIZE - pageOffset - length);
+        }
+
+        memcpy(mm.physicalToVirtual(page).ptr<uint8_t>() + pageOffset, src + done,
+               length);
+        done += length;
+    }
+
+    if (done == 0) {
+        return count > 0 ? -ENOSPC : 0;
+    }
+
+    node->size = max(node->size, offset + done);
+    node->version = ++_lastVersion;
+    return done;
+}
+
+ssize_t TmpFileSystem::readDir(uint32_t ino, void* buffer, size_t count) {
+    MutexLocker locker(_lock);
+
+    Node* dir = getNode(ino);
+    if (!dir) {
+        return -EBADF;
+    } else if (!dir->isDirectory) {
+        return -ENOTDIR;
+    }
+
+    uint8_t* pbuffer = reinterpret_cast<uint8_t*>(buffer);
+    size_t outOffset = 0;
+
+    auto emit = [&](uint32_t entryIno, const char* name, size_t nameLen,
+                    uint8_t type) -> bool {
+        size_t outEntrySize = sizeof(dirent) + nameLen + 1;
+        if (outOffset + outEntrySize > count) {
+            return false;
+        }
+
+        dirent* outEntry = new (&pbuffer[outOffset]) dirent;
+        outEntry->d_ino = entryIno;
+        outEntry->d_reclen = outEntrySize;
+        outEntry->d_type = type;
+        memcpy(outEntry->d_name, name, nameLen);
+        outEntry->d_name[nameLen] = '\0';
+
+        outOffset += outEntrySize;
+        return true;
+    };
+
+    // EINVAL tells the caller that the buffer was too small
+    if (!emit(dir->ino, ".", 1, DT_DIR) || !emit(dir->parentIno, "..", 2, DT_DIR)) {
+        return -EINVAL;
+    }
+
+    for (const Entry& entry : dir->entries) {
+        uint8_t type = getNode(entry.ino)->isDirectory ? DT_DIR : DT_REG;
+        if (!emit(entry.ino, entry.name, entry.nameLen, type)) {
+            return -EINVAL;
+        }
+    }
+
+    return outOffset;
+}
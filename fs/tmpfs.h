@@ -0,0 +1,70 @@
+// RAM-backed filesystem for scratch files which never need to reach a disk
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "address.h"
+#include "estd/memory.h"
+#include "estd/vector.h"
+#include "fs/file_system.h"
+#include "mutex.h"
+
+// File contents are kept in whole pages straight from the page allocator, so reads and
+// writes are just copies. Everything is lost at shutdown.
+class TmpFileSystem : public FileSystem {
+public:
+    TmpFileSystem();
+    ~TmpFileSystem();
+
+    uint32_t rootIno() const override { return ROOT_INO; }
+    uint32_t lookupChild(uint32_t dirIno, const char* name, size_t nameLen) override;
+    int stat(uint32_t ino, FileInfo& info) override;
+    int getPath(uint32_t ino, char* path, size_t pathSize) override;
+    int64_t createFile(uint32_t dirIno, const char* name, size_t nameLen) override;
+    int open(uint32_t ino, int flags, estd::shared_ptr<File>& file) override;
+
+private:
+    friend class TmpFile;
+
+    static constexpr uint32_t ROOT_INO = 1;
+    static constexpr size_t MAX_NAME_LENGTH = 255;
+
+    // Upper limit on the memory used for file contents
+    static constexpr size_t MAX_PAGES = 16384;
+
+    struct Entry {
+        uint32_t ino;
+        uint8_t nameLen;
+        char name[MAX_NAME_LENGTH + 1];
+    };
+
+    struct Node {
+        uint32_t ino;
+        uint32_t parentIno;
+        bool isDirectory;
+        uint64_t size = 0;
+        uint64_t version = 0;
+
+        // Regular files: the page holding each page of the file, or 0 for a hole
+        estd::vector<PhysicalAddress> pages;
+
+        // Directories
+        estd::vector<Entry> entries;
+    };
+
+    // These must be called with _lock held
+    Node* getNode(uint32_t ino);
+    uint32_t newNode(uint32_t parentIno, bool isDirectory);
+    void truncate(Node& node);
+
+    ssize_t read(uint32_t ino, uint8_t* dest, size_t count, uint64_t offset);
+    ssize_t write(uint32_t ino, const uint8_t* src, size_t count, uint64_t& offset,
+                  bool append);
+    ssize_t readDir(uint32_t ino, void* buffer, size_t count);
+
+    Mutex _lock;
+    estd::vector<estd::unique_ptr<Node>> _nodes;  // Indexed by inode number - 1
+    size_t _usedPages = 0;
+    uint64_t _lastVersion = 0;
+};
@@ -0,0 +1,169 @@
+#include "fs/vfs.h"
+
+#include <string.h>
+
+#include "api/errno.h"
+#include "estd/assertions.h"
+
+int VFS::mount(const char* path, FileSystem& fs) {
+    size_t pathLen = strlen(path);
+    if (pathLen >= MAX_MOUNT_PATH) {
+        return -ENAMETOOLONG;
+    }
+
+    Mount mount;
+    mount.fs = &fs;
+    memcpy(mount.path, path, pathLen + 1);
+
+    if (_mounts.empty()) {
+        if (strcmp(path, "/") != 0) {
+            return -EINVAL;
+        }
+    } else {
+        if (path[0] != '/' || findMount(&fs)) {
+            return -EINVAL;
+        }
+
+        Location location = lookup(root(), path);
+        if (!location) {
+            return -ENOENT;
+        }
+
+        FileInfo info;
+        int result = location.fs->stat(location.ino, info);
+        if (result < 0) {
+            return result;
+        } else if (!info.isDirectory) {
+            return -ENOTDIR;
+        } else if (location.ino == location.fs->rootIno()) {
+            // Already a mount point (or the root)
+            return -EBUSY;
+        }
+
+        mount.mountPoint = location;
+    }
+
+    _mounts.push_back(mount);
+    return 0;
+}
+
+Location VFS::root() const {
+    ASSERT(!_mounts.empty());
+    return {_mounts[0].fs, _mounts[0].fs->rootIno()};
+}
+
+const VFS::Mount* VFS::findMount(FileSystem* fs) const {
+    for (size_t i = 0; i < _mounts.size(); ++i) {
+        if (_mounts[i].fs == fs) {
+            return &_mounts[i];
+        }
+    }
+
+    return nullptr;
+}
+
+Location VFS::crossMountPoint(Location location) const {
+    for (size_t i = 1; i < _mounts.size(); ++i) {
+        if (_mounts[i].mountPoint == location) {
+            return {_mounts[i].fs, _mounts[i].fs->rootIno()};
+        }
+    }
+
+    return location;
+}
+
+Location VFS::resolve(Location cwd, const char* path, const char* end) {
+    // If the path is absolute, start at the root directory rather than the cwd
+    Location current = (path < end && path[0] == '/') ? root() : cwd;
+    if (!current) {
+        return {};
+    }
+
+    const char* p = path;
+    while (true) {
+        while (p < end && *p == '/') {
+            ++p;
+        }
+
+        // If we've reached the end of the path, we're done
+        if (p == end) {
+            return current;
+        }
+
+        // Find the next component of the path
+        const char* next = p;
+        while (next < end && *next != '/') {
+            ++next;
+        }
+
+        // From the root of a mounted filesystem, ".." leaves through the directory it's
+        // mounted on
+        size_t nameLen = next - p;
+        if (nameLen == 2 && p[0] == '.' && p[1] == '.' &&
+            current.ino == current.fs->rootIno()) {
+            const Mount* mount = findMount(current.fs);
+            if (mount && mount->mountPoint) {
+                current = mount->mountPoint;
+            }
+        }
+
+        uint32_t ino = current.fs->lookupChild(current.ino, p, nameLen);
+        if (ino == FileSystem::NO_INO) {
+            return {};
+        }
+
+        current = crossMountPoint({current.fs, ino});
+        p = next;
+    }
+}
+
+Location VFS::lookup(Location cwd, const char* path) {
+    // TODO: check path pointer points to valid memory
+    return resolve(cwd, path, path + strlen(path));
+}
+
+Location VFS::lookupParent(Location cwd, const char* path, const char*& name) {
+    name = path;
+    for (const char* p = strchr(path, '/'); p; p = strchr(p + 1, '/')) {
+        name = p + 1;
+    }
+
+    return resolve(cwd, path, name);
+}
+
+int VFS::getPath(Location location, char* path, size_t pathSize) {
+    const Mount* mount = findMount(location.fs);
+    if (!mount) {
+        return -EINVAL;
+    }
+
+    int result = location.fs->getPath(location.ino, path, pathSize);
+    if (result < 0 || !mount->mountPoint) {
+        return result;
+    }
+
+    // Prefix the path within the filesystem with the mount point, dropping the
+    // filesystem's own root
+    size_t prefixLen = strlen(mount->path);
+    size_t innerLen = strcmp(path, "/") == 0 ? 0 : strlen(path);
+    if (prefixLen + innerLen + 1 > pathSize) {
+        return -ENAMETOOLONG;
+    }
+
+    memmove(path + prefixLen, path, innerLen);
+    path[prefixLen + innerLen] = '\0';
+    memcpy(path, mount->path, prefixLen);
+    return 0;
+}
+
+int VFS::sync() {
+    int result = 0;
+    for (size_t i = 0; i < _mounts.size(); ++i) {
+        int fsResult = _mounts[i].fs->sync();
+        if (fsResult < 0 && result == 0) {
+            result = fsResult;
+        }
+    }
+
+    return result;
+}
@@ -0,0 +1,54 @@
+// Mount table and path lookup across mounted filesystems
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "estd/vector.h"
+#include "fs/file_system.h"
+
+// A file or directory somewhere in the tree of mounted filesystems
+struct Location {
+    FileSystem* fs = nullptr;
+    uint32_t ino = FileSystem::NO_INO;
+
+    explicit operator bool() const { return fs != nullptr; }
+    bool operator==(const Location& other) const {
+        return fs == other.fs && ino == other.ino;
+    }
+};
+
+class VFS {
+public:
+    static constexpr size_t MAX_MOUNT_PATH = 64;
+
+    // The first filesystem mounted must be at "/". Others are mounted over an existing
+    // directory.
+    int mount(const char* path, FileSystem& fs);
+
+    Location root() const;
+
+    // Resolves a path, relative to cwd if it doesn't start with a slash. Returns an
+    // empty location if it doesn't exist.
+    Location lookup(Location cwd, const char* path);
+
+    // Resolves everything but the last component of a path, and points name at the last
+    // component
+    Location lookupParent(Location cwd, const char* path, const char*& name);
+
+    int getPath(Location location, char* path, size_t pathSize);
+
+    int sync();
+
+private:
+    struct Mount {
+        FileSystem* fs;
+        Location mountPoint;  // The covered directory (empty for the root)
+        char path[MAX_MOUNT_PATH];
+    };
+
+    Location resolve(Location cwd, const char* path, const char* end);
+    Location crossMountPoint(Location location) const;
+    const Mount* findMount(FileSystem* fs) const;
+
+    estd::vector<Mount> _mounts;
+};
@@ -2,11 +2,17 @@
 
 #include <string.h>
 
-#include "estd/buffer.h"
 #include "estd/print.h"
+#include "interrupts.h"
 #include "io.h"
+#include "klibc.h"
+#include "mm.h"
 #include "pci.h"
+#include "processor.h"
+#include "scheduler.h"
+#include "spinlock.h"
 #include "system.h"
+#include "timer.h"
 #include "units.h"
 
 // ATA-6 spec:
@@ -64,14 +70,79 @@ private:
     uint8_t _raw;
 };
 
+enum ControlFlags : uint8_t {
+    CONTROL_NIEN = 1 << 1,  // Disables interrupts
+    CONTROL_SRST = 1 << 2,  // Software reset of both drives on the channel
+};
+
 enum class DriveSelector {
     Master,
     Slave,
 };
 
+// Bus master IDE registers, relative to the base of each channel's block of BAR4
+// https://web.archive.org/web/20070110063133/http://www.t13.org/Documents/UploadedDocuments/project/d1510r1-Host-Adapter.pdf
+enum BusMasterRegister {
+    BMCommand = 0,
+    BMStatus = 2,
+    BMPRDTable = 4,
+};
+
+enum BusMasterFlags : uint8_t {
+    // BMCommand
+    BM_START = 1 << 0,
+    BM_READ = 1 << 3,  // Transfer from the device to memory
+
+    // BMStatus
+    BM_ACTIVE = 1 << 0,
+    BM_ERROR = 1 << 1,
+    BM_INTERRUPT = 1 << 2,
+};
+
+// Physical Region Descriptor: one physically-contiguous piece of a DMA transfer
+struct __attribute__((packed)) PRDEntry {
+    uint32_t physAddr;
+    uint16_t byteCount;  // Zero means 64KiB
+    uint16_t flags;      // Bit 15 marks the last entry of the table
+};
+
+static_assert(sizeof(PRDEntry) == 8);
+
+static constexpr size_t MAX_PRD_ENTRIES = PAGE_SIZE / sizeof(PRDEntry);
+static constexpr uint64_t PRD_BOUNDARY = 64 * KiB;
+
+// How long to wait for the drive to respond to a command, in timer ticks
+static constexpr uint64_t IDE_TIMEOUT = 500;
+
+// Polling is timed with the timestamp counter, since ticks don't advance while
+// interrupts are disabled. Until the counter's rate is known (early in boot), it's
+// bounded by the number of status reads instead, which take about a microsecond each.
+static constexpr uint64_t IDE_TIMEOUT_POLLS = 5000000;
+
+class PollDeadline {
+public:
+    PollDeadline() {
+        uint64_t tscPerTick = sys.timer().tscPerTick();
+        if (tscPerTick != 0) {
+            _endTsc = Processor::rdtsc() + IDE_TIMEOUT * tscPerTick;
+        }
+    }
+
+    bool expired() {
+        if (_endTsc != 0) return Processor::rdtsc() >= _endTsc;
+        return ++_polls > IDE_TIMEOUT_POLLS;
+    }
+
+private:
+    uint64_t _endTsc = 0;
+    uint64_t _polls = 0;
+};
+
 class IDEChannel {
 public:
-    IDEChannel(uint16_t commandBlock, uint16_t controlBlock);
+    // If busMaster is nonzero, it's the base port of the channel's bus master registers
+    IDEChannel(uint16_t commandBlock, uint16_t controlBlock, uint16_t busMaster = 0);
+    ~IDEChannel();
 
     uint8_t readRegister(Register reg);
     StatusFlags readStatus();
@@ -85,20 +156,61 @@ public:
     void sendCommand(CommandCode command);
 
     void readSector(void* dest);
+    void writeSector(const void* src);
 
     // Delay for ~400ns by reading from AltStatus several times
     void delay();
 
     // Wait until data is available or an error occurs. Returns true if
-    // successful
+    // successful, and false on an error or timeout
     bool waitForData();
 
+    // Wait until the device is no longer busy. Returns false if the last command failed
+    // or didn't finish in time
+    bool waitUntilDone();
+
+    // Abandons whatever command is in progress, by stopping any DMA transfer and
+    // resetting the drives on the channel, and then selects the given drive again
+    void reset(DriveSelector drive);
+
+    // Once interrupts are enabled for the channel, threads waiting for a command sleep
+    // until the drive raises its interrupt, rather than polling the status register.
+    // Interrupts are only used when the caller could be preempted: during boot or while
+    // holding a spinlock, we still poll.
+    void enableInterrupts();
+    void irqHandler();
+
+    // Sleeps until the drive raises an interrupt. Returns false on timeout. If interrupts
+    // can't be used, returns true immediately, and the caller should poll.
+    bool waitForInterrupt();
+
+    // Bus master DMA. prepareDMA fills in the PRD table for a transfer to or from
+    // buffer, and returns false if DMA can't be used for it (e.g., the buffer isn't in
+    // the linearly-mapped kernel address space). The DMA command should be sent to the
+    // drive between prepareDMA and startDMA.
+    bool hasDMA() const { return _busMaster != 0; }
+    bool prepareDMA(const void* buffer, size_t numBytes, bool read);
+    void startDMA();
+    bool finishDMA();
+
 private:
     // Indexed by Register enum
     uint16_t _ports[REGISTER_COUNT];
+
+    uint16_t _busMaster = 0;
+    PhysicalAddress _prdTable;
+
+    // TODO: the channel should be locked while a command is in progress. For now, only
+    // the root disk is used once the scheduler is running, and its BlockQueue (with a
+    // single worker) serializes access to it.
+    bool _irqEnabled = false;
+    bool _interruptReceived = false;
+    Spinlock _irqLock;
+    estd::shared_ptr<Blocker> _irqBlocker;
 };
 
-IDEChannel::IDEChannel(uint16_t commandBlock, uint16_t controlBlock) {
+IDEChannel::IDEChannel(uint16_t commandBlock, uint16_t controlBlock, uint16_t busMaster)
+: _busMaster(busMaster), _irqBlocker(new Blocker) {
     _ports[Data] = commandBlock;
     _ports[Error] = commandBlock + 1;
     _ports[Features] = commandBlock + 1;
@@ -111,6 +223,18 @@ IDEChannel::IDEChannel(uint16_t commandBlock, uint16_t controlBlock) {
     _ports[Status] = commandBlock + 7;
     _ports[AltStatus] = controlBlock + 2;
     _ports[Control] = controlBlock + 2;
+
+    if (_busMaster) {
+        // The PRD table must not cross a 64KiB boundary, which a single page never does
+        _prdTable = mm.pageAlloc();
+        ASSERT(_prdTable.value + PAGE_SIZE <= 4 * GiB);
+    }
+}
+
+IDEChannel::~IDEChannel() {
+    if (_busMaster) {
+        mm.pageFree(_prdTable);
+    }
 }
 
 uint8_t IDEChannel::readRegister(Register reg) { return inb(_ports[reg]); }
@@ -147,6 +271,11 @@ void IDEChannel::readSector(void* dest) {
     insw(dest, _ports[Data], SECTOR_SIZE / 2);
 }
 
+void IDEChannel::writeSector(const void* src) {
+    ASSERT(readStatus().dataRequestReady());
+    outsw(_ports[Data], src, SECTOR_SIZE / 2);
+}
+
 void IDEChannel::delay() {
     for (int i = 0; i < 4; ++i) {
         readAltStatus();
@@ -154,19 +283,190 @@ void IDEChannel::delay() {
 }
 
 bool IDEChannel::waitForData() {
+    PollDeadline deadline;
+    while (true) {
+        StatusFlags status = readStatus();
+
+        if (!status.busy()) {
+            if (status.dataRequestReady()) {
+                return true;
+            }
+
+            if (status.error() || status.driveFault()) {
+                return false;
+            }
+        }
+
+        if (deadline.expired()) {
+            println("ide: timed out waiting for data");
+            return false;
+        }
+    }
+}
+
+bool IDEChannel::waitUntilDone() {
+    PollDeadline deadline;
     while (true) {
         StatusFlags status = readStatus();
 
-        if (status.busy()) continue;
+        if (!status.busy()) {
+            return !status.error() && !status.driveFault();
+        }
+
+        if (deadline.expired()) {
+            println("ide: timed out waiting for the drive");
+            return false;
+        }
+    }
+}
+
+void IDEChannel::reset(DriveSelector drive) {
+    if (_busMaster) {
+        outb(_busMaster + BMCommand, inb(_busMaster + BMCommand) & ~BM_START);
+        outb(_busMaster + BMStatus, inb(_busMaster + BMStatus) | BM_ERROR | BM_INTERRUPT);
+    }
+
+    // SRST has to be held for at least 5us
+    uint8_t control = _irqEnabled ? 0 : CONTROL_NIEN;
+    writeRegister(Control, control | CONTROL_SRST);
+    for (int i = 0; i < 13; ++i) {
+        delay();
+    }
+
+    writeRegister(Control, control);
+    delay();
+
+    if (!waitUntilDone()) {
+        println("ide: drive still busy after reset");
+    }
+
+    selectDrive(drive, true);
+    delay();
+
+    SpinlockLocker locker(_irqLock);
+    _interruptReceived = false;
+}
+
+void IDEChannel::enableInterrupts() {
+    // Clearing nIEN lets the drive assert INTRQ
+    writeRegister(Control, 0);
+    _irqEnabled = true;
+}
+
+void IDEChannel::irqHandler() {
+    // Reading the status register acknowledges the interrupt
+    readStatus();
+
+    if (_busMaster) {
+        outb(_busMaster + BMStatus, inb(_busMaster + BMStatus) | BM_INTERRUPT);
+    }
+
+    SpinlockLocker locker(_irqLock);
+    _interruptReceived = true;
+    sys.scheduler().wakeThreads(_irqBlocker);
+}
+
+bool IDEChannel::waitForInterrupt() {
+    if (!_irqEnabled || !Processor::interruptsEnabled()) {
+        return true;
+    }
+
+    SpinlockLocker locker(_irqLock);
+
+    uint64_t deadline = sys.timer().tickCount() + IDE_TIMEOUT;
+    sys.timer().setTimeout(_irqBlocker, IDE_TIMEOUT);
+
+    // Woken either by the interrupt or by the timeout
+    while (!_interruptReceived && sys.timer().tickCount() < deadline) {
+        sys.scheduler().sleepThread(_irqBlocker, &_irqLock);
+    }
+
+    sys.timer().cancelTimeout(_irqBlocker);
+
+    // Consume the interrupt, so that the next one (e.g., for the next sector of a PIO
+    // transfer) can be detected
+    bool received = _interruptReceived;
+    _interruptReceived = false;
+
+    if (!received) {
+        println("ide: timed out waiting for interrupt");
+    }
+
+    return received;
+}
+
+bool IDEChannel::prepareDMA(const void* buffer, size_t numBytes, bool read) {
+    if (!_busMaster) return false;
+
+    // The buffer is physically contiguous if it's in the linear map. The controller can
+    // only address the first 4GiB, and needs word-aligned addresses.
+    PhysicalAddress physAddr = mm.virtualToPhysical(const_cast<void*>(buffer));
+    if (physAddr.value == 0 || physAddr.value % 2 != 0 ||
+        physAddr.value + numBytes > 4 * GiB) {
+        return false;
+    }
 
-        if (status.dataRequestReady()) {
-            return true;
+    // No single region may cross a 64KiB boundary
+    PRDEntry* prdTable = mm.physicalToVirtual(_prdTable).ptr<PRDEntry>();
+    size_t numEntries = 0;
+    while (numBytes > 0) {
+        if (numEntries == MAX_PRD_ENTRIES) {
+            return false;
         }
 
-        if (status.error() || status.driveFault()) {
+        uint64_t boundary = roundDown(physAddr.value, PRD_BOUNDARY) + PRD_BOUNDARY;
+        size_t chunk = min<size_t>(numBytes, boundary - physAddr.value);
+
+        PRDEntry& entry = prdTable[numEntries++];
+        entry.physAddr = physAddr.value;
+        entry.byteCount = lowBits(chunk, 16);
+        entry.flags = 0;
+
+        physAddr += chunk;
+        numBytes -= chunk;
+    }
+
+    prdTable[numEntries - 1].flags = 1 << 15;
+
+    outl(_busMaster + BMPRDTable, _prdTable.value);
+    outb(_busMaster + BMCommand, read ? BM_READ : 0);
+
+    // The error and interrupt bits are cleared by writing ones to them
+    outb(_busMaster + BMStatus, inb(_busMaster + BMStatus) | BM_ERROR | BM_INTERRUPT);
+    return true;
+}
+
+void IDEChannel::startDMA() {
+    outb(_busMaster + BMCommand, inb(_busMaster + BMCommand) | BM_START);
+}
+
+bool IDEChannel::finishDMA() {
+    // The drive raises an interrupt once the whole transfer is complete
+    if (!waitForInterrupt()) {
+        outb(_busMaster + BMCommand, inb(_busMaster + BMCommand) & ~BM_START);
+        return false;
+    }
+
+    // If polling, the controller clears the active bit once every region has been
+    // transferred
+    PollDeadline deadline;
+    uint8_t status;
+    while (true) {
+        status = inb(_busMaster + BMStatus);
+        if (!(status & BM_ACTIVE) || (status & BM_ERROR)) break;
+
+        if (deadline.expired()) {
+            println("ide: timed out waiting for dma");
+            outb(_busMaster + BMCommand, inb(_busMaster + BMCommand) & ~BM_START);
             return false;
         }
     }
+
+    outb(_busMaster + BMCommand, inb(_busMaster + BMCommand) & ~BM_START);
+
+    bool success = waitUntilDone() && !(status & BM_ERROR);
+    outb(_busMaster + BMStatus, inb(_busMaster + BMStatus) | BM_ERROR | BM_INTERRUPT);
+    return success;
 }
 
 void IDEChannel::selectDrive(DriveSelector drive, bool enableLBA) {
@@ -187,13 +487,20 @@ void IDEChannel::selectDrive(DriveSelector drive, bool enableLBA) {
 }
 
 void IDEChannel::sendCommand(CommandCode command) {
+    // Forget any interrupt left over from the previous command, before the drive can
+    // raise one for this command
+    {
+        SpinlockLocker locker(_irqLock);
+        _interruptReceived = false;
+    }
+
     writeRegister(Command, command);
 
     // The spec says that it may take up to 400ns for status to be updated
     delay();
 }
 
-bool ATADevice::readSectors(void* dest, uint64_t start, size_t count) {
+void ATADevice::setupTransfer(uint64_t start, size_t count) {
     // TODO: add support for LBA28
     ASSERT(_lba48 && _channel.isIdle());
 
@@ -201,7 +508,7 @@ bool ATADevice::readSectors(void* dest, uint64_t start, size_t count) {
     _channel.selectDrive(_drive, true);
 
     // Write high bytes of parameters
-    _channel.writeRegister(SectorCount, highBits(count, 8));
+    _channel.writeRegister(SectorCount, bitRange(count, 8, 8));
     _channel.writeRegister(LBA0, bitRange(start, 24, 8));
     _channel.writeRegister(LBA1, bitRange(start, 32, 8));
     _channel.writeRegister(LBA2, bitRange(start, 40, 8));
@@ -211,15 +518,43 @@ bool ATADevice::readSectors(void* dest, uint64_t start, size_t count) {
     _channel.writeRegister(LBA0, bitRange(start, 0, 8));
     _channel.writeRegister(LBA1, bitRange(start, 8, 8));
     _channel.writeRegister(LBA2, bitRange(start, 16, 8));
+}
+
+bool ATADevice::transferDMA(CommandCode command, uint64_t start, size_t count) {
+    setupTransfer(start, count);
+    _channel.sendCommand(command);
+    _channel.startDMA();
+    return _channel.finishDMA() || abortTransfer();
+}
+
+// The drive may still be in the middle of a command which failed (e.g., if it timed
+// out), in which case the channel is reset so that the next command can be sent.
+// Always returns false, for the caller to report an I/O error.
+bool ATADevice::abortTransfer() {
+    if (!_channel.isIdle()) {
+        println("ide: resetting channel after a failed command");
+        _channel.reset(_drive);
+    }
+
+    return false;
+}
+
+bool ATADevice::readSectors(void* dest, uint64_t start, size_t count) {
+    if (_dma && _channel.prepareDMA(dest, count * SECTOR_SIZE, true)) {
+        return transferDMA(ReadDMAExt, start, count);
+    }
+
+    setupTransfer(start, count);
 
     // Send the command
     _channel.sendCommand(ReadPIOExt);
 
-    // Each sector is read separately
+    // Each sector is read separately, and the drive raises an interrupt when each one
+    // is ready
     uint8_t* ptr = static_cast<uint8_t*>(dest);
     for (size_t sector = 0; sector < count; ++sector) {
-        if (!_channel.waitForData()) {
-            return false;
+        if (!_channel.waitForInterrupt() || !_channel.waitForData()) {
+            return abortTransfer();
         }
 
         _channel.readSector(ptr);
@@ -229,6 +564,35 @@ bool ATADevice::readSectors(void* dest, uint64_t start, size_t count) {
     return true;
 }
 
+bool ATADevice::writeSectors(const void* src, uint64_t start, size_t count) {
+    if (_dma && _channel.prepareDMA(src, count * SECTOR_SIZE, false)) {
+        return transferDMA(WriteDMAExt, start, count);
+    }
+
+    setupTransfer(start, count);
+
+    // Send the command
+    _channel.sendCommand(WritePIOExt);
+
+    // Each sector is written separately, once the drive asks for it. The drive raises an
+    // interrupt after each sector, but not before the first.
+    const uint8_t* ptr = static_cast<const uint8_t*>(src);
+    for (size_t sector = 0; sector < count; ++sector) {
+        if (sector > 0 && !_channel.waitForInterrupt()) {
+            return abortTransfer();
+        }
+
+        if (!_channel.waitForData()) {
+            return abortTransfer();
+        }
+
+        _channel.writeSector(ptr);
+        ptr += SECTOR_SIZE;
+    }
+
+    return (_channel.waitForInterrupt() && _channel.waitUntilDone()) || abortTransfer();
+}
+
 // Copies a string from the IDE config info into a standard C string, swapping
 // bytes where necessary
 static void copyString(char* dest, uint16_t* src, size_t numBytes) {
@@ -292,6 +656,9 @@ estd::unique_ptr<IDEDevice> IDEController::detectDrive(IDEChannel& channel,
         return {};
     }
 
+    // Bus master DMA needs support from both the drive and the controller
+    device->_dma = checkBit(deviceInfo[49], 8) && channel.hasDMA();
+
     // Check for 48-bit LBA support
     if (checkBit(deviceInfo[83], 10)) {
         device->_lba48 = true;
@@ -304,45 +671,18 @@ estd::unique_ptr<IDEDevice> IDEController::detectDrive(IDEChannel& channel,
     return device;
 }
 
-struct __attribute__((packed)) PartitionEntry {
-    uint8_t status;
-    uint8_t startHead;
-    uint8_t startSector : 6;
-    uint8_t startCylinderHigh : 2;
-    uint8_t startCylinderLow;
-    uint8_t partitionType;
-    uint8_t endHead;
-    uint8_t endSector : 6;
-    uint8_t endCylinderHigh : 2;
-    uint8_t endCylinderLow;
-    uint32_t lbaStart;
-    uint32_t numSectors;
-};
-
-static_assert(sizeof(PartitionEntry) == 16);
-
-void IDEController::detectPartitions(IDEDevice& device) {
+void IDEController::detectPartitions(IDEDevice& device, const char* name) {
     // TODO: support ATAPI devices (though they usually don't have partitions)
     if (device.isATAPI()) return;
 
-    Buffer firstSector(SECTOR_SIZE);
-    if (!device.readSectors(firstSector.get(), 0, 1)) {
-        println("can't read first sector of disk");
-        return;
-    }
-
-    PartitionEntry partitionTable[4];
-    memcpy(&partitionTable[0], &firstSector[0x1BE], sizeof(partitionTable));
-
-    for (size_t i = 0; i < 4; ++i) {
-        auto& entry = partitionTable[i];
-        if (entry.partitionType == 0) continue;
+    estd::unique_ptr<BlockQueue> queue(new BlockQueue(device, name));
+    estd::unique_ptr<DiskPartitionDevice> partition = findFirstPartition(*queue);
+    if (!partition) return;
 
-        // TODO: support multiple partitions across drives
-        ASSERT(!_rootPartition);
-        _rootPartition = estd::unique_ptr(
-            new DiskPartitionDevice(device, entry.lbaStart, entry.numSectors));
-    }
+    // TODO: support multiple partitions across drives
+    ASSERT(!_rootPartition);
+    _rootQueue = estd::move(queue);
+    _rootPartition = estd::move(partition);
 }
 
 IDEController::IDEController() {
@@ -357,8 +697,18 @@ IDEController::IDEController() {
     uint8_t progIf = pciDevice->progIf();
     ASSERT((progIf & ((1 << 0) | (1 << 2))) == 0);
 
-    _primary.assign(new IDEChannel(0x1F0, 0x3F4));
-    _secondary.assign(new IDEChannel(0x170, 0x374));
+    // If the controller supports bus mastering, BAR4 is the I/O port base of the bus
+    // master registers, 8 ports for each channel
+    uint16_t busMaster = 0;
+    uint32_t bar4 = pciDevice->bar4();
+    if (checkBit(progIf, 7) && bitRange(bar4, 0, 1) == 1) {
+        busMaster = clearLowBits(bar4, 2);
+        pciDevice->enableBusMastering();
+        println("ide: bus master registers at port {:X}", busMaster);
+    }
+
+    _primary.assign(new IDEChannel(0x1F0, 0x3F4, busMaster));
+    _secondary.assign(new IDEChannel(0x170, 0x374, busMaster ? busMaster + 8 : 0));
 
     // Turn off IRQs
     _primary->writeRegister(Control, 2);
@@ -368,27 +718,42 @@ IDEController::IDEController() {
     _primaryMaster = detectDrive(*_primary, DriveSelector::Master);
     if (_primaryMaster) {
         println("ide: primary master: {}", _primaryMaster->modelName());
-        detectPartitions(*_primaryMaster);
+        detectPartitions(*_primaryMaster, "hda");
     }
 
     _primarySlave = detectDrive(*_primary, DriveSelector::Slave);
     if (_primarySlave) {
         println("ide: primary slave: {}", _primarySlave->modelName());
-        detectPartitions(*_primarySlave);
+        detectPartitions(*_primarySlave, "hdb");
     }
 
     _secondaryMaster = detectDrive(*_secondary, DriveSelector::Master);
     if (_secondaryMaster) {
         println("ide: secondary master: {}", _secondaryMaster->modelName());
-        detectPartitions(*_secondaryMaster);
+        detectPartitions(*_secondaryMaster, "hdc");
     }
 
     _secondarySlave = detectDrive(*_secondary, DriveSelector::Slave);
     if (_secondarySlave) {
         println("ide: secondary slave: {}", _secondarySlave->modelName());
-        detectPartitions(*_secondarySlave);
+        detectPartitions(*_secondarySlave, "hdd");
     }
 
+    // Now that detection is finished, commands can complete by interrupt
+    registerIrqHandler(IRQ_PRIMARY_ATA, [this](uint8_t irqNo) {
+        _primary->irqHandler();
+        endOfInterrupt(irqNo);
+        return true;
+    });
+    registerIrqHandler(IRQ_SECONDARY_ATA, [this](uint8_t irqNo) {
+        _secondary->irqHandler();
+        endOfInterrupt(irqNo);
+        return true;
+    });
+
+    _primary->enableInterrupts();
+    _secondary->enableInterrupts();
+
     println("ide: init complete");
 }
 
@@ -4,12 +4,14 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include "block_queue.h"
 #include "disk.h"
 #include "estd/memory.h"
 #include "estd/print.h"
 
 class IDEChannel;
 enum class DriveSelector;
+enum CommandCode : uint8_t;
 
 // A disk device connected to an IDE controller, either standard ATA or ATAPI
 struct IDEDevice : public DiskDevice {
@@ -31,6 +33,7 @@ protected:
 
     char _modelName[41] = {0};
     bool _lba48 = false;
+    bool _dma = false;
     size_t _numSectors = 0;
 };
 
@@ -39,7 +42,13 @@ struct ATADevice : public IDEDevice {
     ATADevice(IDEChannel& channel, DriveSelector drive) : IDEDevice(channel, drive) {}
 
     bool readSectors(void* dest, uint64_t start, size_t count) override;
+    bool writeSectors(const void* src, uint64_t start, size_t count) override;
     bool isATAPI() const override { return false; }
+
+private:
+    void setupTransfer(uint64_t start, size_t count);
+    bool transferDMA(CommandCode command, uint64_t start, size_t count);
+    bool abortTransfer();
 };
 
 // An ATAPI (ATA packet interface) device, usually an optical drive
@@ -50,6 +59,10 @@ struct ATAPIDevice : public IDEDevice {
         println("ATAPIDevice::readSectors not implemented");
         return false;
     }
+    bool writeSectors(const void*, uint64_t, size_t) override {
+        println("ATAPIDevice::writeSectors not implemented");
+        return false;
+    }
     bool isATAPI() const override { return true; }
 };
 
@@ -81,7 +94,7 @@ public:
 
 private:
     estd::unique_ptr<IDEDevice> detectDrive(IDEChannel& channel, DriveSelector drive);
-    void detectPartitions(IDEDevice& device);
+    void detectPartitions(IDEDevice& device, const char* name);
 
     estd::unique_ptr<IDEChannel> _primary;
     estd::unique_ptr<IDEChannel> _secondary;
@@ -91,5 +104,7 @@ private:
     estd::unique_ptr<IDEDevice> _secondaryMaster;
     estd::unique_ptr<IDEDevice> _secondarySlave;
 
+    // Requests to the disk holding the root partition go through a queue
+    estd::unique_ptr<BlockQueue> _rootQueue;
     estd::unique_ptr<DiskPartitionDevice> _rootPartition;
 };
@@ -7,7 +7,11 @@
 #include "io.h"
 #include "mm.h"
 #include "panic.h"
+#include "process.h"
 #include "processor.h"
+#include "scheduler.h"
+#include "system.h"
+#include "thread.h"
 #include "trap.h"
 
 InterruptDescriptor::InterruptDescriptor(uint64_t addr, uint8_t flags)
@@ -46,12 +50,25 @@ IDTRegister g_idtr;
 // irq handling, but we probably want to change that in the future
 AtomicBool irqFlag;
 
-static IRQHandler irqHandlers[16] = {};
+// Set while an irq's handlers are running, including after they've signalled the end of
+// the interrupt
+static bool handlingIrq = false;
+
+// PCI devices may share an interrupt line, so each IRQ can have several handlers, which
+// are all called in turn
+static constexpr size_t MAX_SHARED_HANDLERS = 4;
+static IRQHandler irqHandlers[16][MAX_SHARED_HANDLERS] = {};
 
 void registerIrqHandler(uint8_t irqNo, IRQHandler handler) {
     ASSERT(irqNo < 16);
-    ASSERT(!irqHandlers[irqNo]);
-    irqHandlers[irqNo] = handler;
+
+    size_t i = 0;
+    while (irqHandlers[irqNo][i]) {
+        ++i;
+        ASSERT(i < MAX_SHARED_HANDLERS);
+    }
+
+    irqHandlers[irqNo][i] = handler;
 
     // Unmask this IRQ at the PIC
     uint16_t port = irqNo < 8 ? PIC1_DATA : PIC2_DATA;
@@ -61,14 +78,29 @@ void registerIrqHandler(uint8_t irqNo, IRQHandler handler) {
 
 // Called by the assembly-language IRQ entry points defined in entry.S
 extern "C" void irqEntry(uint8_t irqNo, TrapRegisters&) {
-    ASSERT(irqHandlers[irqNo]);
+    ASSERT(irqHandlers[irqNo][0]);
     ASSERT(!Processor::interruptsEnabled());
 
     irqFlag.store(true);
-    irqHandlers[irqNo](irqNo);
+    handlingIrq = true;
+    bool woke = false;
+    for (size_t i = 0; i < MAX_SHARED_HANDLERS && irqHandlers[irqNo][i]; ++i) {
+        woke = irqHandlers[irqNo][i](irqNo) || woke;
+    }
+    handlingIrq = false;
+
+    // Only once every handler has run, so that switching threads can't hold up the
+    // other devices on a shared line
+    if (woke) {
+        sys.scheduler().preempt();
+    }
 }
 
 void endOfInterrupt(uint8_t irqNo) {
+    // Every handler of a shared IRQ signals the end of the interrupt, but the PIC must
+    // only see it once
+    if (!irqFlag.load()) return;
+
     if (irqNo >= 8) outb(PIC2_COMMAND, EOI);
     outb(PIC1_COMMAND, EOI);
 
@@ -107,6 +139,21 @@ void handleException(uint8_t vector, const char* name, TrapRegisters& regs) {
         handleException(idx, name, regs);                        \
     }
 
+// User pages are mapped on first access, so page faults in user space (including those
+// from the kernel touching a user buffer) are first offered to the current process
+extern "C" void exceptionHandler14(TrapRegisters& regs) {
+    VirtualAddress addr = Processor::readCR2();
+
+    Thread* thread = currentThread;
+    if (thread && thread->process &&
+        thread->process->handlePageFault(addr, regs.errorCode)) {
+        return;
+    }
+
+    println("cr2: 0x{:X}", addr.value);
+    handleException(14, "Page Fault", regs, regs.errorCode);
+}
+
 EXCEPTION_HANDLER(0, "Division Error")
 EXCEPTION_HANDLER(1, "Debug")
 EXCEPTION_HANDLER(2, "Non-Maskable Interrupt")
@@ -121,7 +168,6 @@ EXCEPTION_HANDLER_WITH_CODE(10, "Invalid TSS")
 EXCEPTION_HANDLER_WITH_CODE(11, "Segment Not Present")
 EXCEPTION_HANDLER_WITH_CODE(12, "Stack-Segment Fault")
 EXCEPTION_HANDLER_WITH_CODE(13, "General Protection Fault")
-EXCEPTION_HANDLER_WITH_CODE(14, "Page Fault")
 EXCEPTION_HANDLER(15, "Reserved")
 EXCEPTION_HANDLER(16, "x87 Floating-Point Exception")
 EXCEPTION_HANDLER_WITH_CODE(17, "Alignment Check")
@@ -198,4 +244,4 @@ void installInterrupts() {
     println("pic: init complete");
 }
 
-bool inIrq() { return irqFlag.load(); }
+bool inIrq() { return handlingIrq; }
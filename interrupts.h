@@ -55,10 +55,12 @@ struct __attribute__((packed)) InterruptFrame {
     uint64_t ss;
 };
 
-using IRQHandler = estd::function<void(uint8_t irqNo)>;
+// Returns true if the handler woke a thread (see irqEntry)
+using IRQHandler = estd::function<bool(uint8_t irqNo)>;
 
 void installInterrupts();
 void registerIrqHandler(uint8_t irqNo, IRQHandler handler);
+// True while irq handlers are running, which mustn't sleep or use the page allocator
 bool inIrq();
 
 // For use by the irq handlers to signal the end of interrupt handling
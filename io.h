@@ -54,6 +54,13 @@ inline void insl(void* dest, uint16_t port, size_t count) {
                  : "memory");
 }
 
+inline void outsw(uint16_t port, const void* src, size_t count) {
+    asm volatile("rep outsw"
+                 : "=S"(src), "=c"(count)
+                 : "Nd"(port), "0"(src), "1"(count)
+                 : "memory");
+}
+
 inline void iowait(int rounds = 1) {
     for (int i = 0; i < rounds; ++i) {
         // This doesn't do anything, but takes a microsecond or so to do it
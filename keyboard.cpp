@@ -25,7 +25,10 @@ KeyboardDevice::KeyboardDevice() {
         _keyState[i] = false;
     }
 
-    registerIrqHandler(1, [this](uint8_t) { this->irqHandler(); });
+    registerIrqHandler(1, [this](uint8_t) {
+        this->irqHandler();
+        return false;
+    });
 
     println("kbd: init complete");
 }
@@ -0,0 +1,33 @@
+#include "mutex.h"
+
+#include "scheduler.h"
+#include "system.h"
+#include "thread.h"
+
+Mutex::Mutex() : _blocker(new Blocker) {}
+
+void Mutex::lock() {
+    SpinlockLocker locker(_spinlock);
+    ASSERT(!_locked || _owner != currentThread);
+
+    while (_locked) {
+        ++_waiters;
+        sys.scheduler().sleepThread(_blocker, &_spinlock);
+        --_waiters;
+    }
+
+    _locked = true;
+    _owner = currentThread;
+}
+
+void Mutex::unlock() {
+    SpinlockLocker locker(_spinlock);
+    ASSERT(_locked);
+
+    _locked = false;
+    _owner = nullptr;
+
+    if (_waiters > 0) {
+        sys.scheduler().wakeThreads(_blocker);
+    }
+}
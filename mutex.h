@@ -0,0 +1,48 @@
+// Defines a sleeping lock and utility classes
+#pragma once
+
+#include "estd/memory.h"
+#include "spinlock.h"
+
+struct Blocker;
+struct Thread;
+
+// Unlike a spinlock, a thread waiting for a mutex sleeps, and interrupts stay enabled
+// while it's held, so it can protect critical sections which block (e.g., on disk I/O).
+// Not recursive.
+class Mutex {
+public:
+    Mutex();
+
+    // No copy / move
+    Mutex(const Mutex&) = delete;
+    Mutex& operator=(const Mutex&) = delete;
+    Mutex(Mutex&&) = delete;
+    Mutex& operator=(Mutex&&) = delete;
+
+    void lock();
+    void unlock();
+
+    bool isLocked() const { return _locked; }
+
+private:
+    Spinlock _spinlock;
+    bool _locked = false;
+    Thread* _owner = nullptr;
+    size_t _waiters = 0;
+    estd::shared_ptr<Blocker> _blocker;
+};
+
+// Locks a mutex when created, unlocks when destroyed
+class MutexLocker {
+public:
+    MutexLocker(Mutex& mutex) : _mutex(mutex) { _mutex.lock(); }
+    ~MutexLocker() { _mutex.unlock(); }
+
+    // No copy / move
+    MutexLocker(const MutexLocker&) = delete;
+    MutexLocker& operator=(const MutexLocker&) = delete;
+
+private:
+    Mutex& _mutex;
+};
@@ -7,6 +7,7 @@
 #include "net/ethernet.h"
 #include "net/ip.h"
 #include "net/network_interface.h"
+#include "net/packet_buffer.h"
 #include "scheduler.h"
 #include "spinlock.h"
 #include "system.h"
@@ -120,32 +121,37 @@ void arpRecv(NetworkInterface* netif, uint8_t* buffer, size_t size) {
 }
 
 void arpRequest(NetworkInterface* netif, IpAddress destIp) {
-    ArpHeader arpHeader;
-    arpHeader.setHardwareType(ArpHardwareType::Ethernet);
-    arpHeader.setProtocolType(EtherType::Ipv4);
-    arpHeader.setHardwareLen(sizeof(MacAddress));
-    arpHeader.setProtocolLen(sizeof(IpAddress));
-    arpHeader.setOperation(ArpOperation::Request);
-    arpHeader.setSenderMac(netif->macAddress());
-    arpHeader.setSenderIp(netif->ipAddress());
-    arpHeader.setTargetMac(MacAddress());
-    arpHeader.setTargetIp(destIp);
-
-    ethSend(netif, MacAddress::broadcast(), EtherType::Arp, &arpHeader,
-            sizeof(ArpHeader));
+    auto packet = PacketBuffer::create();
+    if (!packet) return;
+
+    ArpHeader* arpHeader = new (packet->put(sizeof(ArpHeader))) ArpHeader;
+    arpHeader->setHardwareType(ArpHardwareType::Ethernet);
+    arpHeader->setProtocolType(EtherType::Ipv4);
+    arpHeader->setHardwareLen(sizeof(MacAddress));
+    arpHeader->setProtocolLen(sizeof(IpAddress));
+    arpHeader->setOperation(ArpOperation::Request);
+    arpHeader->setSenderMac(netif->macAddress());
+    arpHeader->setSenderIp(netif->ipAddress());
+    arpHeader->setTargetMac(MacAddress());
+    arpHeader->setTargetIp(destIp);
+
+    ethSend(netif, MacAddress::broadcast(), EtherType::Arp, estd::move(packet));
 }
 
 void arpReply(NetworkInterface* netif, MacAddress destMac, IpAddress destIp) {
-    ArpHeader arpHeader;
-    arpHeader.setHardwareType(ArpHardwareType::Ethernet);
-    arpHeader.setProtocolType(EtherType::Ipv4);
-    arpHeader.setHardwareLen(sizeof(MacAddress));
-    arpHeader.setProtocolLen(sizeof(IpAddress));
-    arpHeader.setOperation(ArpOperation::Reply);
-    arpHeader.setSenderMac(netif->macAddress());
-    arpHeader.setSenderIp(netif->ipAddress());
-    arpHeader.setTargetMac(destMac);
-    arpHeader.setTargetIp(destIp);
-
-    ethSend(netif, destMac, EtherType::Arp, &arpHeader, sizeof(ArpHeader));
+    auto packet = PacketBuffer::create();
+    if (!packet) return;
+
+    ArpHeader* arpHeader = new (packet->put(sizeof(ArpHeader))) ArpHeader;
+    arpHeader->setHardwareType(ArpHardwareType::Ethernet);
+    arpHeader->setProtocolType(EtherType::Ipv4);
+    arpHeader->setHardwareLen(sizeof(MacAddress));
+    arpHeader->setProtocolLen(sizeof(IpAddress));
+    arpHeader->setOperation(ArpOperation::Reply);
+    arpHeader->setSenderMac(netif->macAddress());
+    arpHeader->setSenderIp(netif->ipAddress());
+    arpHeader->setTargetMac(destMac);
+    arpHeader->setTargetIp(destIp);
+
+    ethSend(netif, destMac, EtherType::Arp, estd::move(packet));
 }
@@ -0,0 +1,29 @@
+// The Internet checksum (RFC 1071), shared by IP, TCP and UDP
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// Adds the bytes, as big-endian 16-bit words, to a running sum. An odd trailing byte is
+// padded with zero, so only the last range added may have an odd length. Carries aren't
+// folded in yet, so that a word which was added can still be subtracted.
+inline uint32_t checksumAdd(uint32_t sum, const void* data, size_t length) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i + 1 < length; i += 2) {
+        sum += (bytes[i] << 8) | bytes[i + 1];
+    }
+
+    if (length % 2) {
+        sum += bytes[length - 1] << 8;
+    }
+
+    return sum;
+}
+
+// Folds the carries back in, giving the 16-bit ones-complement sum
+inline uint16_t checksumFold(uint32_t sum) {
+    while (sum >> 16) {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+
+    return sum;
+}
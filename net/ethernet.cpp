@@ -7,6 +7,7 @@
 #include "net/arp.h"
 #include "net/ip.h"
 #include "net/network_interface.h"
+#include "net/packet_buffer.h"
 
 MacAddress::MacAddress(const MacAddress& other) {
     memcpy(bytes, other.bytes, sizeof(MacAddress));
@@ -46,27 +47,26 @@ void EthernetHeader::setSrcMac(MacAddress value) {
     memcpy(&_srcMac, &value, sizeof(MacAddress));
 }
 
-void ethRecv(NetworkInterface* netif, uint8_t* buffer, size_t size) {
-    if (size < sizeof(EthernetHeader)) {
+void ethRecv(NetworkInterface* netif, estd::unique_ptr<PacketBuffer> packet) {
+    if (packet->length() < sizeof(EthernetHeader)) {
         return;
     }
 
-    EthernetHeader* ethHeader = reinterpret_cast<EthernetHeader*>(buffer);
+    EthernetHeader* ethHeader = reinterpret_cast<EthernetHeader*>(packet->data());
     if ((ethHeader->destMac() != netif->macAddress()) &&
         (ethHeader->destMac() != MacAddress::broadcast())) {
         return;
     }
 
-    buffer += sizeof(EthernetHeader);
-    size -= sizeof(EthernetHeader);
+    packet->pull(sizeof(EthernetHeader));
 
     switch (ethHeader->etherType()) {
         case EtherType::Arp:
-            arpRecv(netif, buffer, size);
+            arpRecv(netif, packet->data(), packet->length());
             break;
 
         case EtherType::Ipv4:
-            ipRecv(netif, buffer, size);
+            ipRecv(netif, estd::move(packet));
             break;
 
         default:
@@ -74,16 +74,22 @@ void ethRecv(NetworkInterface* netif, uint8_t* buffer, size_t size) {
     }
 }
 
-void ethSend(NetworkInterface* netif, MacAddress destMac, EtherType ethType, void* buffer,
-             size_t size) {
-    size_t totalSize = sizeof(EthernetHeader) + size;
-    uint8_t* packet = new uint8_t[totalSize];
+void ethSend(NetworkInterface* netif, MacAddress destMac, EtherType ethType,
+             estd::unique_ptr<PacketBuffer> packet) {
+    // Do in software whatever the device can't do itself
+    uint32_t features = netif->features();
+    if (!(features & NetworkInterface::FEATURE_SCATTER_GATHER)) {
+        packet->linearize();
+    }
+
+    if (!(features & NetworkInterface::FEATURE_TX_CHECKSUM)) {
+        packet->finishChecksums();
+    }
 
-    EthernetHeader* ethHeader = new (packet) EthernetHeader;
+    EthernetHeader* ethHeader = new (packet->push(sizeof(EthernetHeader))) EthernetHeader;
     ethHeader->setDestMac(destMac);
     ethHeader->setSrcMac(netif->macAddress());
     ethHeader->setEtherType(ethType);
 
-    memcpy(packet + sizeof(EthernetHeader), buffer, size);
-    netif->sendPacket(packet, totalSize);
+    netif->sendPacket(estd::move(packet));
 }
@@ -2,9 +2,11 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include "estd/memory.h"
 #include "estd/print.h"
 
 class NetworkInterface;
+class PacketBuffer;
 
 struct MacAddress {
     uint8_t bytes[6] = {};
@@ -69,6 +71,9 @@ public:
 
 static_assert(sizeof(EthernetHeader) == 14);
 
-void ethRecv(NetworkInterface* netif, uint8_t* buffer, size_t size);
-void ethSend(NetworkInterface* netif, MacAddress destMac, EtherType ethType, void* buffer,
-             size_t size);
+// Takes ownership of a received frame, and passes it up the stack
+void ethRecv(NetworkInterface* netif, estd::unique_ptr<PacketBuffer> packet);
+
+// Prepends the Ethernet header to the packet and hands it to the device
+void ethSend(NetworkInterface* netif, MacAddress destMac, EtherType ethType,
+             estd::unique_ptr<PacketBuffer> packet);
@@ -7,8 +7,10 @@
 #include "estd/new.h"
 #include "estd/print.h"
 #include "net/arp.h"
+#include "net/checksum.h"
 #include "net/ethernet.h"
 #include "net/network_interface.h"
+#include "net/packet_buffer.h"
 #include "net/tcp.h"
 #include "net/udp.h"
 #include "spinlock.h"
@@ -19,28 +21,16 @@ IpAddress::IpAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) {
 }
 
 uint16_t IpHeader::computeChecksum() {
-    uint32_t sum = 0;
-
-    uint8_t* bytes = reinterpret_cast<uint8_t*>(this);
-    for (size_t i = 0; i < headerLen() * 4; i += 2) {
-        uint16_t word = (bytes[i] << 8) | bytes[i + 1];
-        sum += word;
-    }
+    uint32_t sum = checksumAdd(0, this, headerLen() * 4);
 
     // Subtract off the embedded checksum
     sum -= ntohs(_checksum);
 
-    // Include the overflow
-    while (sum >> 16) {
-        sum = (sum & 0xFFFF) + (sum >> 16);
-    }
-
     // Ones complement
-    return ~sum;
+    return ~checksumFold(sum);
 }
 
 bool IpHeader::verifyChecksum() { return computeChecksum() == ntohs(_checksum); }
-void IpHeader::fillChecksum() { _checksum = htons(computeChecksum()); }
 
 uint8_t IpHeader::headerLen() { return _headerLen; }
 uint8_t IpHeader::version() { return _version; }
@@ -60,31 +50,34 @@ void IpHeader::setProtocol(IpProtocol value) { _protocol = (uint8_t)value; }
 void IpHeader::setDestIp(IpAddress value) { _destIp = value; }
 void IpHeader::setSourceIp(IpAddress value) { _sourceIp = value; }
 
-void ipRecv(NetworkInterface* netif, uint8_t* buffer, size_t size) {
-    if (size < sizeof(IpHeader)) {
+void ipRecv(NetworkInterface* netif, estd::unique_ptr<PacketBuffer> packet) {
+    if (packet->length() < sizeof(IpHeader)) {
         return;
     }
 
-    IpHeader* ipHeader = reinterpret_cast<IpHeader*>(buffer);
+    IpHeader* ipHeader = reinterpret_cast<IpHeader*>(packet->data());
     if (ipHeader->version() != 4) return;
     if (ipHeader->headerLen() < 5) return;
     if (ipHeader->totalLen() < ipHeader->headerLen() * 4) return;
-    if (ipHeader->totalLen() > size) return;
-    if (!ipHeader->verifyChecksum()) return;
+    if (ipHeader->totalLen() > packet->length()) return;
+    if (!(packet->checksums() & PacketBuffer::CHECKSUM_IP) && !ipHeader->verifyChecksum())
+        return;
     if (ipHeader->destIp() != netif->ipAddress() &&
         ipHeader->destIp() != IpAddress::broadcast())
         return;
 
-    buffer += ipHeader->headerLen() * 4;
-    size = ipHeader->totalLen() - ipHeader->headerLen() * 4;
+    // The header stays where it is in front of the data, so ipHeader remains valid for as
+    // long as the packet does. Short frames are padded by the link layer.
+    packet->trim(ipHeader->totalLen());
+    packet->pull(ipHeader->headerLen() * 4);
 
     switch (ipHeader->protocol()) {
         case IpProtocol::Udp:
-            udpRecv(netif, ipHeader, buffer, size);
+            udpRecv(netif, ipHeader, packet->data(), packet->length());
             break;
 
         case IpProtocol::Tcp:
-            tcpRecv(ipHeader, buffer, size);
+            tcpRecv(ipHeader, estd::move(packet));
             break;
 
         default:
@@ -98,8 +91,7 @@ struct Route {
 };
 
 struct PendingSend {
-    uint8_t* packet;
-    size_t totalSize;
+    estd::unique_ptr<PacketBuffer> packet;
     IpAddress nextHop;
     PendingSend* next = nullptr;
 };
@@ -112,9 +104,9 @@ void ipInit() {
     sendQueue = nullptr;
 }
 
-void queueSend(uint8_t* packet, size_t totalSize, IpAddress destIp) {
+void queueSend(estd::unique_ptr<PacketBuffer> packet, IpAddress destIp) {
     ASSERT(ipLock->isLocked());
-    PendingSend* pendingSend = new PendingSend{packet, totalSize, destIp};
+    PendingSend* pendingSend = new PendingSend{estd::move(packet), destIp};
 
     pendingSend->next = sendQueue;
     sendQueue = pendingSend;
@@ -166,23 +158,21 @@ void ipRouteFound(IpAddress ip) {
     if (!route) return;
 
     PendingSend** prevNext = &sendQueue;
-    PendingSend* current = sendQueue;
-    while (current) {
-        if (current->nextHop == ip) {
-            IpHeader* ipHeader = reinterpret_cast<IpHeader*>(current->packet);
-            ipHeader->setSourceIp(route->netif->ipAddress());
-            ipHeader->fillChecksum();
-
-            ethSend(route->netif, route->destMac, EtherType::Ipv4, current->packet,
-                    current->totalSize);
-
-            // Delete the pending send and remove it from the list
-            delete[] current->packet;
-            *prevNext = current->next;
+    while (PendingSend* current = *prevNext) {
+        if (current->nextHop != ip) {
+            prevNext = &current->next;
+            continue;
         }
 
-        prevNext = &current->next;
-        current = current->next;
+        IpHeader* ipHeader = reinterpret_cast<IpHeader*>(current->packet->data());
+        ipHeader->setSourceIp(route->netif->ipAddress());
+
+        ethSend(route->netif, route->destMac, EtherType::Ipv4,
+                estd::move(current->packet));
+
+        // Remove the pending send from the list and delete it
+        *prevNext = current->next;
+        delete current;
     }
 }
 
@@ -197,15 +187,25 @@ estd::optional<IpAddress> findRouteSourceIp(IpAddress) {
     return {netif->ipAddress()};
 }
 
-bool ipSend(IpAddress destIp, IpProtocol protocol, void* buffer, size_t size) {
-    size_t totalSize = sizeof(IpHeader) + size;
-    uint8_t* packet = new uint8_t[totalSize];
+// Prepends an IP header to the packet. The header checksum is left to be filled in once
+// the packet reaches the device (see ethSend).
+static IpHeader* ipPushHeader(PacketBuffer& packet, IpProtocol protocol,
+                              IpAddress destIp) {
+    packet.setTransportHeader(packet.data());
 
-    IpHeader* ipHeader = new (packet) IpHeader;
-    ipHeader->setTotalLen(totalSize);
+    IpHeader* ipHeader = new (packet.push(sizeof(IpHeader))) IpHeader;
+    ipHeader->setTotalLen(packet.totalLength());
     ipHeader->setProtocol(protocol);
     ipHeader->setDestIp(destIp);
-    memcpy(packet + sizeof(IpHeader), buffer, size);
+
+    packet.setNetworkHeader(ipHeader);
+    packet.addChecksums(PacketBuffer::CHECKSUM_IP);
+    return ipHeader;
+}
+
+bool ipSend(IpAddress destIp, IpProtocol protocol,
+            estd::unique_ptr<PacketBuffer> packet) {
+    IpHeader* ipHeader = ipPushHeader(*packet, protocol, destIp);
 
     // This is so we don't have a race condition between findRoute returning no value
     // and the send being queued. If the ARP reply happens between those two events, then
@@ -214,35 +214,23 @@ bool ipSend(IpAddress destIp, IpProtocol protocol, void* buffer, size_t size) {
 
     if (auto route = findRoute(destIp)) {
         ipHeader->setSourceIp(route->netif->ipAddress());
-        ipHeader->fillChecksum();
 
-        ethSend(route->netif, route->destMac, EtherType::Ipv4, packet, totalSize);
-        delete[] packet;
+        ethSend(route->netif, route->destMac, EtherType::Ipv4, estd::move(packet));
     } else {
         auto nextHop = getNextHop(destIp);
         if (!nextHop) return false;
 
-        queueSend(packet, totalSize, *nextHop);
+        queueSend(estd::move(packet), *nextHop);
     }
 
     return true;
 }
 
-bool ipBroadcast(NetworkInterface* netif, IpProtocol protocol, void* buffer,
-                 size_t size) {
-    size_t totalSize = sizeof(IpHeader) + size;
-    uint8_t* packet = new uint8_t[totalSize];
-
-    IpHeader* ipHeader = new (packet) IpHeader;
-    ipHeader->setTotalLen(totalSize);
-    ipHeader->setProtocol(protocol);
+bool ipBroadcast(NetworkInterface* netif, IpProtocol protocol,
+                 estd::unique_ptr<PacketBuffer> packet) {
+    IpHeader* ipHeader = ipPushHeader(*packet, protocol, IpAddress::broadcast());
     ipHeader->setSourceIp(netif->ipAddress());
-    ipHeader->setDestIp(IpAddress::broadcast());
-    ipHeader->fillChecksum();
-
-    memcpy(packet + sizeof(IpHeader), buffer, size);
-    ethSend(netif, MacAddress::broadcast(), EtherType::Ipv4, packet, totalSize);
 
-    delete[] packet;
+    ethSend(netif, MacAddress::broadcast(), EtherType::Ipv4, estd::move(packet));
     return true;
 }
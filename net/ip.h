@@ -3,11 +3,13 @@
 #include <stdint.h>
 #include <string.h>
 
+#include "estd/memory.h"
 #include "estd/optional.h"
 #include "estd/print.h"
 #include "net/ethernet.h"
 
 class NetworkInterface;
+class PacketBuffer;
 
 struct IpAddress {
     // Network byte order
@@ -65,7 +67,7 @@ class IpHeader {
     uint16_t _flags : 3 = 0;
     uint8_t _ttl = 255;
     uint8_t _protocol;
-    uint16_t _checksum;
+    uint16_t _checksum = 0;
     uint32_t _sourceIp;
     uint32_t _destIp;
 
@@ -73,7 +75,6 @@ class IpHeader {
 
 public:
     bool verifyChecksum();
-    void fillChecksum();
 
     uint8_t headerLen();
     uint8_t version();
@@ -98,9 +99,13 @@ static_assert(sizeof(IpHeader) == 20);
 
 void ipInit();
 estd::optional<IpAddress> findRouteSourceIp(IpAddress destIp);
-void ipRecv(NetworkInterface* netif, uint8_t* buffer, size_t size);
-bool ipBroadcast(NetworkInterface* netif, IpProtocol protocol, void* buffer, size_t size);
-bool ipSend(IpAddress destIp, IpProtocol protocol, void* buffer, size_t size);
+void ipRecv(NetworkInterface* netif, estd::unique_ptr<PacketBuffer> packet);
+
+// These prepend the IP header to the packet, which holds the transport-layer header and
+// payload, and pass it down to the link layer
+bool ipBroadcast(NetworkInterface* netif, IpProtocol protocol,
+                 estd::unique_ptr<PacketBuffer> packet);
+bool ipSend(IpAddress destIp, IpProtocol protocol, estd::unique_ptr<PacketBuffer> packet);
 
 // Callback from the arp layer
 void ipRouteFound(IpAddress ip);
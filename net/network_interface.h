@@ -4,13 +4,23 @@
 #include <stdint.h>
 
 #include "estd/assertions.h"
+#include "estd/memory.h"
 #include "net/ethernet.h"
 #include "net/ip.h"
+#include "net/packet_buffer.h"
 
 class NetworkInterface {
 public:
     virtual ~NetworkInterface() = default;
 
+    // Work which the device can do on transmit, instead of the network stack
+    enum Features : uint32_t {
+        FEATURE_TX_CHECKSUM = 1 << 0,     // IP and TCP checksums
+        FEATURE_SCATTER_GATHER = 1 << 1,  // Packets with a fragment
+    };
+
+    virtual uint32_t features() const { return 0; }
+
     virtual MacAddress macAddress() const { return _macAddress; }
 
     virtual bool isConfigured() const { return _isConfigured; }
@@ -30,7 +40,13 @@ public:
         _gateway = gateway;
     }
 
-    virtual void sendPacket(uint8_t* buffer, size_t length) = 0;
+    // Queues a complete frame for transmission. The interface owns the packet from then
+    // on, and frees it once it's been sent.
+    virtual void sendPacket(estd::unique_ptr<PacketBuffer> packet) = 0;
+
+    // Called once the scheduler exists, to start any kernel threads the interface uses.
+    // Until then, received packets are handled in the irq handler.
+    virtual void startPolling() {}
 
 protected:
     MacAddress _macAddress;
@@ -0,0 +1,227 @@
+#include "net/packet_buffer.h"
+
+#include <string.h>
+
+#include "estd/new.h"
+#include "interrupts.h"
+#include "klibc.h"
+#include "mm.h"
+#include "net/checksum.h"
+#include "spinlock.h"
+
+// Free buffers are kept on an intrusive list. The pool grows a page at a time as needed,
+// up to a fixed limit, after which allocation fails and the packet is dropped: otherwise
+// a peer sending lots of tiny segments could pin any amount of memory. A page is given
+// back once all of its buffers are free, as long as enough other buffers are free too.
+//
+// Packets are freed in irq context (e.g., once a device has sent them), where the page
+// allocator can't be used. A page which empties there is set aside, and either reused
+// or given back by the next allocation or free outside of irq context.
+static constexpr size_t MAX_POOL_PAGES = 1024;
+static constexpr size_t BUFFERS_PER_PAGE = PAGE_SIZE / PacketBuffer::SIZE;
+
+// Free buffers which only createReserved may use. The pool is topped up past this
+// whenever possible, so that receive buffers can be found even in irq context, and
+// when it can't be, everything else fails first.
+static constexpr size_t RESERVED_BUFFERS = 64;
+
+// Free buffers which are kept rather than released, so that the pool isn't shrunk and
+// grown again with every burst of traffic
+static constexpr size_t MIN_FREE_BUFFERS = 128;
+static_assert(MIN_FREE_BUFFERS > RESERVED_BUFFERS);
+
+// A free buffer points to itself, which a live packet (whose first member is its _next
+// link) never does, so the free buffers in a page can be recognized
+struct FreePacket {
+    FreePacket* self;
+    FreePacket* prev;
+    FreePacket* next;
+};
+
+// A page which emptied in irq context, linked through its first bytes
+struct ReleasedPage {
+    ReleasedPage* next;
+};
+
+static Spinlock* poolLock = nullptr;
+static FreePacket* freeList = nullptr;
+static size_t freeCount = 0;
+static ReleasedPage* releasedPages = nullptr;
+
+// Including the released pages, which haven't been given back yet
+static size_t poolPages = 0;
+
+void packetPoolInit() {
+    poolLock = new Spinlock();
+    freeList = nullptr;
+    freeCount = 0;
+    releasedPages = nullptr;
+    poolPages = 0;
+}
+
+static void pushFree(FreePacket* packet) {
+    packet->self = packet;
+    packet->prev = nullptr;
+    packet->next = freeList;
+    if (freeList) freeList->prev = packet;
+    freeList = packet;
+    ++freeCount;
+}
+
+static void unlinkFree(FreePacket* packet) {
+    if (packet->prev) {
+        packet->prev->next = packet->next;
+    } else {
+        freeList = packet->next;
+    }
+
+    if (packet->next) packet->next->prev = packet->prev;
+    packet->self = nullptr;
+    --freeCount;
+}
+
+// Adds a page of free buffers: a released one if possible, otherwise (outside of irq
+// context) a new one. Returns false if neither is possible. The caller must hold
+// poolLock.
+static bool growPool() {
+    uint8_t* page;
+    if (releasedPages) {
+        page = reinterpret_cast<uint8_t*>(releasedPages);
+        releasedPages = releasedPages->next;
+    } else if (!inIrq() && poolPages < MAX_POOL_PAGES) {
+        page = mm.physicalToVirtual(mm.pageAlloc()).ptr<uint8_t>();
+        ++poolPages;
+    } else {
+        return false;
+    }
+
+    for (size_t offset = 0; offset < PAGE_SIZE; offset += PacketBuffer::SIZE) {
+        pushFree(reinterpret_cast<FreePacket*>(page + offset));
+    }
+
+    return true;
+}
+
+// Gives back the pages which were released in irq context. The caller must hold
+// poolLock, and mustn't be in irq context.
+static void freeReleasedPages() {
+    while (releasedPages) {
+        uint8_t* page = reinterpret_cast<uint8_t*>(releasedPages);
+        releasedPages = releasedPages->next;
+        mm.pageFree(mm.virtualToPhysical(page));
+        --poolPages;
+    }
+}
+
+estd::unique_ptr<PacketBuffer> PacketBuffer::allocate(size_t headroom, bool reserved) {
+    ASSERT(headroom <= sizeof(_storage));
+    SpinlockLocker locker(*poolLock);
+
+    while (freeCount <= RESERVED_BUFFERS) {
+        if (!growPool()) break;
+    }
+
+    if (!freeList || (!reserved && freeCount <= RESERVED_BUFFERS)) {
+        return {};
+    }
+
+    FreePacket* packet = freeList;
+    unlinkFree(packet);
+    return estd::unique_ptr<PacketBuffer>(new (packet) PacketBuffer(headroom));
+}
+
+void PacketBuffer::operator delete(void* ptr) {
+    if (!ptr) return;
+    SpinlockLocker locker(*poolLock);
+    pushFree(static_cast<FreePacket*>(ptr));
+
+    bool irq = inIrq();
+    if (!irq) freeReleasedPages();
+
+    if (freeCount < MIN_FREE_BUFFERS + BUFFERS_PER_PAGE) return;
+
+    uint8_t* page = reinterpret_cast<uint8_t*>(roundDown(uint64_t(ptr), PAGE_SIZE));
+    for (size_t offset = 0; offset < PAGE_SIZE; offset += SIZE) {
+        FreePacket* packet = reinterpret_cast<FreePacket*>(page + offset);
+        if (packet->self != packet) return;
+    }
+
+    for (size_t offset = 0; offset < PAGE_SIZE; offset += SIZE) {
+        unlinkFree(reinterpret_cast<FreePacket*>(page + offset));
+    }
+
+    if (irq) {
+        ReleasedPage* released = reinterpret_cast<ReleasedPage*>(page);
+        released->next = releasedPages;
+        releasedPages = released;
+    } else {
+        mm.pageFree(mm.virtualToPhysical(page));
+        --poolPages;
+    }
+}
+
+estd::unique_ptr<PacketBuffer> PacketBuffer::create(size_t headroom) {
+    return allocate(headroom, false);
+}
+
+estd::unique_ptr<PacketBuffer> PacketBuffer::createReserved(size_t headroom) {
+    return allocate(headroom, true);
+}
+
+bool PacketBuffer::lowOnBuffers() {
+    SpinlockLocker locker(*poolLock);
+    if (freeCount > RESERVED_BUFFERS || releasedPages) return false;
+    return inIrq() || poolPages == MAX_POOL_PAGES;
+}
+
+PhysicalAddress PacketBuffer::physicalAddress() { return mm.virtualToPhysical(_data); }
+
+void PacketBuffer::setFragment(const estd::shared_ptr<PacketBuffer>& buffer,
+                               const uint8_t* data, size_t length) {
+    ASSERT(data >= buffer->_storage && data + length <= buffer->_data + buffer->_length);
+    _fragment = buffer;
+    _fragmentData = data;
+    _fragmentLength = length;
+}
+
+PhysicalAddress PacketBuffer::fragmentPhysicalAddress() {
+    return mm.virtualToPhysical(const_cast<uint8_t*>(_fragmentData));
+}
+
+void PacketBuffer::linearize() {
+    if (!hasFragment()) return;
+
+    memcpy(put(_fragmentLength), _fragmentData, _fragmentLength);
+    _fragment.clear();
+    _fragmentData = nullptr;
+    _fragmentLength = 0;
+}
+
+static void storeChecksum(uint8_t* field, uint16_t checksum) {
+    field[0] = checksum >> 8;
+    field[1] = checksum & 0xFF;
+}
+
+void PacketBuffer::finishChecksums() {
+    if (_checksums & CHECKSUM_IP) {
+        uint8_t* header = networkHeader();
+        size_t headerLength = transportHeader() - header;
+        storeChecksum(header + IP_CHECKSUM_OFFSET, 0);
+        storeChecksum(header + IP_CHECKSUM_OFFSET,
+                      ~checksumFold(checksumAdd(0, header, headerLength)));
+    }
+
+    // The checksum field holds the sum of the pseudo-header, so it's enough to sum
+    // everything from the TCP header onwards
+    if (_checksums & CHECKSUM_TCP) {
+        uint8_t* header = transportHeader();
+        size_t linearLength = _data + _length - header;
+        ASSERT(!hasFragment() || linearLength % 2 == 0);
+
+        uint32_t sum = checksumAdd(0, header, linearLength);
+        sum = checksumAdd(sum, _fragmentData, _fragmentLength);
+        storeChecksum(header + TCP_CHECKSUM_OFFSET, ~checksumFold(sum));
+    }
+
+    _checksums = 0;
+}
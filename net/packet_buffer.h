@@ -0,0 +1,232 @@
+// Buffers for packets on their way through the network stack
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "address.h"
+#include "estd/assertions.h"
+#include "estd/memory.h"
+
+// A single network packet, in a fixed-size buffer from a dedicated pool. Space is
+// reserved in front of the data (headroom) so that each layer can prepend its header in
+// place on the way down the stack, rather than allocating a bigger buffer and copying
+// everything behind its header. The data never crosses a page boundary, so a device can
+// DMA it directly, in either direction.
+class PacketBuffer {
+public:
+    // One buffer is large enough for a full-sized Ethernet frame plus headroom
+    static constexpr size_t SIZE = 2048;
+
+    // Enough for Ethernet (14 bytes), IP (20) and TCP (up to 60) headers
+    static constexpr size_t MAX_HEADROOM = 128;
+
+    // Returns an empty packet with the given headroom, allocated from the pool, or
+    // nullptr if the pool has reached its limit (in which case the caller should drop
+    // whatever it was going to send or receive)
+    static estd::unique_ptr<PacketBuffer> create(size_t headroom = MAX_HEADROOM);
+
+    // The same, but may also use the buffers held in reserve, which other allocations
+    // leave alone. Only for packets which are freed again soon: fresh receive buffers
+    // (so that the ACKs which free sent data can always get in), and bare ACKs.
+    static estd::unique_ptr<PacketBuffer> createReserved(size_t headroom = MAX_HEADROOM);
+
+    // True if create would fail, in which case protocols should drop incoming data
+    // rather than hold on to it, so that the reserve isn't used up
+    static bool lowOnBuffers();
+
+    // Checksums which, on the way down the stack, are still to be filled in (by the
+    // device if it can, otherwise by finishChecksums), and on the way up, have already
+    // been verified by the device. A TCP checksum left to be filled in holds the sum of
+    // the pseudo-header.
+    enum : uint8_t {
+        CHECKSUM_IP = 1 << 0,
+        CHECKSUM_TCP = 1 << 1,
+    };
+
+    // Positions of the checksum fields within the IP and TCP headers
+    static constexpr size_t IP_CHECKSUM_OFFSET = 10;
+    static constexpr size_t TCP_CHECKSUM_OFFSET = 16;
+
+    // No copy / move
+    PacketBuffer(const PacketBuffer&) = delete;
+    PacketBuffer& operator=(const PacketBuffer&) = delete;
+
+    uint8_t* data() { return _data; }
+    size_t length() const { return _length; }
+
+    size_t headroom() const { return _data - _storage; }
+    size_t tailroom() const { return sizeof(_storage) - headroom() - _length; }
+
+    // Extends the data at the front (e.g., for a header) and returns the new start
+    uint8_t* push(size_t size) {
+        ASSERT(size <= headroom());
+        _data -= size;
+        _length += size;
+        return _data;
+    }
+
+    // Removes data from the front (e.g., a header which has been handled), and returns
+    // the new start
+    uint8_t* pull(size_t size) {
+        ASSERT(size <= _length);
+        _data += size;
+        _length -= size;
+        return _data;
+    }
+
+    // Removes data from the end (e.g., link-layer padding), leaving length bytes
+    void trim(size_t length) {
+        ASSERT(length <= _length);
+        _length = length;
+    }
+
+    // Extends the data at the end, and returns a pointer to the new space
+    uint8_t* put(size_t size) {
+        ASSERT(size <= tailroom());
+        uint8_t* result = _data + _length;
+        _length += size;
+        return result;
+    }
+
+    PhysicalAddress physicalAddress();
+
+    // Payload which is sent after the packet's own data, but lives in another packet
+    // buffer (so that, e.g., a segment's headers and payload don't have to be copied
+    // into one buffer). The fragment data must not be modified until this packet is
+    // freed, which a device does once it has been sent.
+    void setFragment(const estd::shared_ptr<PacketBuffer>& buffer, const uint8_t* data,
+                     size_t length);
+    bool hasFragment() const { return _fragmentLength > 0; }
+    const uint8_t* fragmentData() const { return _fragmentData; }
+    size_t fragmentLength() const { return _fragmentLength; }
+    PhysicalAddress fragmentPhysicalAddress();
+
+    // Including the fragment
+    size_t totalLength() const { return _length + _fragmentLength; }
+
+    // Copies the fragment into the tailroom, for devices without scatter-gather
+    void linearize();
+
+    // Where the headers start, for checksum offloads
+    uint8_t* networkHeader() { return _storage + _networkOffset; }
+    uint8_t* transportHeader() { return _storage + _transportOffset; }
+    void setNetworkHeader(void* header) { _networkOffset = offsetOf(header); }
+    void setTransportHeader(void* header) { _transportOffset = offsetOf(header); }
+
+    uint8_t checksums() const { return _checksums; }
+    void addChecksums(uint8_t flags) { _checksums |= flags; }
+
+    // Position of the data in a stream, for a protocol which has to put packets back in
+    // order (e.g., the TCP sequence number of its first byte)
+    uint32_t sequence() const { return _sequence; }
+    void setSequence(uint32_t sequence) { _sequence = sequence; }
+
+    // Fills in any pending checksums in software, for devices without checksum offload
+    void finishChecksums();
+
+    // Packets come from the pool rather than the kernel heap
+    static void operator delete(void* ptr);
+
+private:
+    friend class PacketQueue;
+
+    static estd::unique_ptr<PacketBuffer> allocate(size_t headroom, bool reserved);
+
+    PacketBuffer(size_t headroom) : _data(_storage + headroom) {}
+
+    uint16_t offsetOf(void* ptr) {
+        uint8_t* bytes = static_cast<uint8_t*>(ptr);
+        ASSERT(bytes >= _storage && bytes <= _storage + sizeof(_storage));
+        return bytes - _storage;
+    }
+
+    // Must come first: the pool relies on a live packet never pointing to itself here
+    PacketBuffer* _next = nullptr;
+    uint8_t* _data;
+
+    estd::shared_ptr<PacketBuffer> _fragment;
+    const uint8_t* _fragmentData = nullptr;
+
+    // 32 bits, to leave room in the header for everything else
+    uint32_t _length = 0;
+    uint32_t _fragmentLength = 0;
+    uint32_t _sequence = 0;
+
+    uint16_t _networkOffset = 0;
+    uint16_t _transportOffset = 0;
+    uint8_t _checksums = 0;
+
+    // Aligned for devices which receive into the start of the storage
+    alignas(16) uint8_t _storage[SIZE - 64];
+};
+
+static_assert(sizeof(PacketBuffer) == PacketBuffer::SIZE);
+static_assert(PAGE_SIZE % PacketBuffer::SIZE == 0);
+
+// A FIFO of packets, linked through the packets themselves so that queueing one never
+// allocates. The queue owns its packets.
+class PacketQueue {
+public:
+    PacketQueue() = default;
+    ~PacketQueue() { clear(); }
+
+    // No copy / move
+    PacketQueue(const PacketQueue&) = delete;
+    PacketQueue& operator=(const PacketQueue&) = delete;
+
+    bool empty() const { return _head == nullptr; }
+    PacketBuffer* front() { return _head; }
+    PacketBuffer* back() { return _tail; }
+
+    void pushBack(estd::unique_ptr<PacketBuffer> packet) {
+        PacketBuffer* ptr = packet.release();
+        ptr->_next = nullptr;
+
+        if (_tail) {
+            _tail->_next = ptr;
+        } else {
+            _head = ptr;
+        }
+
+        _tail = ptr;
+    }
+
+    estd::unique_ptr<PacketBuffer> popFront() { return removeAfter(nullptr); }
+
+    // For keeping the queue in some other order: the packet after the given one, and
+    // insertion and removal after a given packet, or at the front if it's nullptr
+    static PacketBuffer* next(PacketBuffer* packet) { return packet->_next; }
+
+    void insertAfter(PacketBuffer* prev, estd::unique_ptr<PacketBuffer> packet) {
+        PacketBuffer* ptr = packet.release();
+        PacketBuffer*& link = prev ? prev->_next : _head;
+
+        ptr->_next = link;
+        link = ptr;
+        if (_tail == prev) _tail = ptr;
+    }
+
+    estd::unique_ptr<PacketBuffer> removeAfter(PacketBuffer* prev) {
+        PacketBuffer*& link = prev ? prev->_next : _head;
+        ASSERT(link);
+
+        PacketBuffer* ptr = link;
+        link = ptr->_next;
+        if (_tail == ptr) _tail = prev;
+
+        ptr->_next = nullptr;
+        return estd::unique_ptr<PacketBuffer>(ptr);
+    }
+
+    void clear() {
+        while (!empty()) {
+            popFront();
+        }
+    }
+
+private:
+    PacketBuffer* _head = nullptr;
+    PacketBuffer* _tail = nullptr;
+};
+
+void packetPoolInit();
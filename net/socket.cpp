@@ -1,7 +1,9 @@
 #include "socket.h"
 
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 
+#include "api/fcntl.h"
 #include "klibc.h"
 #include "net/ip.h"
 
@@ -47,16 +49,16 @@ int64_t TcpSocket::listen(int backlog) {
     return 0;
 }
 
-estd::shared_ptr<Socket> TcpSocket::accept(sockaddr* addr, socklen_t* addrlen) {
+int64_t TcpSocket::accept(OpenFileDescription& fd, sockaddr* addr, socklen_t* addrlen,
+                          estd::shared_ptr<Socket>& result) {
     if (addr && !addrlen) {
-        // EINVAL
-        return {};
+        return -EINVAL;
     }
 
-    TcpHandle childHandle = tcpAccept(_handle);
-    if (childHandle == InvalidTcpHandle) {
-        // ECONNABORTED or EINVAL
-        return {};
+    TcpHandle childHandle;
+    int error = tcpAccept(_handle, childHandle, fd.flags & O_NONBLOCK);
+    if (error < 0) {
+        return error;
     }
 
     if (addr) {
@@ -69,10 +71,12 @@ estd::shared_ptr<Socket> TcpSocket::accept(sockaddr* addr, socklen_t* addrlen) {
         *addrlen = sizeof(struct sockaddr_in);
     }
 
-    return estd::shared_ptr<TcpSocket>(new TcpSocket(childHandle));
+    result = estd::shared_ptr<TcpSocket>(new TcpSocket(childHandle));
+    return 0;
 }
 
-int64_t TcpSocket::connect(const struct sockaddr* addr, socklen_t addrlen) {
+int64_t TcpSocket::connect(OpenFileDescription& fd, const struct sockaddr* addr,
+                           socklen_t addrlen) {
     if (addr->sa_family != AF_INET) {
         return -EAFNOSUPPORT;
     }
@@ -85,33 +89,65 @@ int64_t TcpSocket::connect(const struct sockaddr* addr, socklen_t addrlen) {
     IpAddress destIp(addr_in->sin_addr.s_addr);
     uint16_t destPort = ntohs(addr_in->sin_port);
 
-    if (!tcpConnect(_handle, destIp, destPort)) {
-        return -ECONNREFUSED;
+    int error = tcpConnect(_handle, destIp, destPort);
+    if (error < 0) {
+        return error;
+    }
+
+    // A non-blocking connect finishes in the background, and the socket becomes
+    // writable (see tcpPoll) when it's done
+    if (fd.flags & O_NONBLOCK) {
+        return -EINPROGRESS;
     }
 
     // Block until the handshake finishes
-    if (!tcpWaitForConnection(_handle)) {
-        return -ECONNREFUSED;
+    return tcpWaitForConnection(_handle);
+}
+
+int64_t TcpSocket::setOption(int level, int name, const void* value, socklen_t len) {
+    if (level != IPPROTO_TCP) return -ENOPROTOOPT;
+
+    switch (name) {
+        case TCP_CONGESTION:
+            return tcpSetCongestionControl(_handle, static_cast<const char*>(value), len);
+
+        case TCP_DROP_INTERVAL:
+            if (len != sizeof(int)) return -EINVAL;
+            return tcpSetDropInterval(_handle, *static_cast<const int*>(value));
+
+        default:
+            return -ENOPROTOOPT;
     }
+}
 
-    return 0;
+ssize_t TcpSocket::read(OpenFileDescription& fd, void* buffer, size_t size) {
+    return tcpRecv(_handle, buffer, size, fd.flags & O_NONBLOCK);
 }
 
-ssize_t TcpSocket::read(OpenFileDescription&, void* buffer, size_t size) {
-    return tcpRecv(_handle, buffer, size);
+ssize_t TcpSocket::write(OpenFileDescription& fd, const void* buffer, size_t size) {
+    return tcpSend(_handle, buffer, size, true, fd.flags & O_NONBLOCK);
 }
 
-ssize_t TcpSocket::write(OpenFileDescription&, const void* buffer, size_t size) {
-    if (!tcpSend(_handle, buffer, size, true)) {
-        return -EPIPE;
-    }
+// Sent as one stream, so that small buffers share segments
+ssize_t TcpSocket::writev(OpenFileDescription& fd, const iovec* iov, int iovcnt) {
+    return tcpSend(_handle, iov, iovcnt, true, fd.flags & O_NONBLOCK);
+}
 
-    return size;
+uint32_t TcpSocket::pollEvents() { return tcpPoll(_handle); }
+
+void TcpSocket::pollBlockers(estd::vector<estd::shared_ptr<Blocker>>& blockers) {
+    tcpPollBlockers(_handle, blockers);
 }
 
 int64_t UdpSocket::bind(const struct sockaddr*, socklen_t) { return -ENOSYS; }
 int64_t UdpSocket::listen(int) { return -ENOSYS; }
-estd::shared_ptr<Socket> UdpSocket::accept(sockaddr*, socklen_t*) { return {}; }
-int64_t UdpSocket::connect(const struct sockaddr*, socklen_t) { return -ENOSYS; }
+int64_t UdpSocket::accept(OpenFileDescription&, sockaddr*, socklen_t*,
+                          estd::shared_ptr<Socket>&) {
+    return -ENOSYS;
+}
+
+int64_t UdpSocket::connect(OpenFileDescription&, const struct sockaddr*, socklen_t) {
+    return -ENOSYS;
+}
 ssize_t UdpSocket::read(OpenFileDescription&, void*, size_t) { return -ENOSYS; }
 ssize_t UdpSocket::write(OpenFileDescription&, const void*, size_t) { return -ENOSYS; }
@@ -10,8 +10,18 @@ class Socket : public File {
 public:
     virtual int64_t bind(const struct sockaddr* addr, socklen_t addrlen) = 0;
     virtual int64_t listen(int backlog) = 0;
-    virtual estd::shared_ptr<Socket> accept(sockaddr* addr, socklen_t* addrlen) = 0;
-    virtual int64_t connect(const struct sockaddr* addr, socklen_t addrlen) = 0;
+
+    // These take the description so that they can honor O_NONBLOCK
+    virtual int64_t accept(OpenFileDescription& fd, sockaddr* addr, socklen_t* addrlen,
+                           estd::shared_ptr<Socket>& result) = 0;
+    virtual int64_t connect(OpenFileDescription& fd, const struct sockaddr* addr,
+                            socklen_t addrlen) = 0;
+
+    virtual int64_t setOption(int /*level*/, int /*name*/, const void* /*value*/,
+                              socklen_t /*len*/) {
+        return -ENOPROTOOPT;
+    }
+
     virtual bool isSocket() const override { return true; }
 };
 
@@ -23,10 +33,16 @@ public:
 
     int64_t bind(const struct sockaddr* addr, socklen_t addrlen) override;
     int64_t listen(int backlog) override;
-    estd::shared_ptr<Socket> accept(sockaddr* addr, socklen_t* addrlen) override;
-    int64_t connect(const struct sockaddr* addr, socklen_t addrlen) override;
+    int64_t accept(OpenFileDescription& fd, sockaddr* addr, socklen_t* addrlen,
+                   estd::shared_ptr<Socket>& result) override;
+    int64_t connect(OpenFileDescription& fd, const struct sockaddr* addr,
+                    socklen_t addrlen) override;
+    int64_t setOption(int level, int name, const void* value, socklen_t len) override;
     ssize_t read(OpenFileDescription& fd, void* buffer, size_t count) override;
     ssize_t write(OpenFileDescription& fd, const void* buffer, size_t count) override;
+    ssize_t writev(OpenFileDescription& fd, const iovec* iov, int iovcnt) override;
+    uint32_t pollEvents() override;
+    void pollBlockers(estd::vector<estd::shared_ptr<Blocker>>& blockers) override;
 
 private:
     TcpHandle _handle;
@@ -36,8 +52,10 @@ class UdpSocket : public Socket {
 public:
     int64_t bind(const struct sockaddr* addr, socklen_t addrlen) override;
     int64_t listen(int backlog) override;
-    estd::shared_ptr<Socket> accept(sockaddr* addr, socklen_t* addrlen) override;
-    int64_t connect(const struct sockaddr* addr, socklen_t addrlen) override;
+    int64_t accept(OpenFileDescription& fd, sockaddr* addr, socklen_t* addrlen,
+                   estd::shared_ptr<Socket>& result) override;
+    int64_t connect(OpenFileDescription& fd, const struct sockaddr* addr,
+                    socklen_t addrlen) override;
     ssize_t read(OpenFileDescription& fd, void* buffer, size_t count) override;
     ssize_t write(OpenFileDescription& fd, const void* buffer, size_t count) override;
 };
@@ -2,49 +2,43 @@
 
 #include <arpa/inet.h>
 #include <string.h>
+#include <sys/epoll.h>
 
+#include "api/errno.h"
 #include "estd/new.h"
 #include "klibc.h"
+#include "net/checksum.h"
 #include "net/ip.h"
+#include "net/packet_buffer.h"
+#include "net/tcp_congestion.h"
 #include "scheduler.h"
 #include "spinlock.h"
 #include "system.h"
+#include "thread.h"
 #include "timer.h"
 
-uint16_t TcpHeader::computeChecksum(IpAddress srcIp, IpAddress destIp, size_t totalLen) {
-    ASSERT(totalLen >= dataOffset() * 4);
-
+static uint32_t pseudoHeaderSum(IpAddress srcIp, IpAddress destIp, size_t totalLen) {
     uint32_t sum = 0;
-
-    uint8_t* bytes = reinterpret_cast<uint8_t*>(this);
-    for (size_t i = 0; i + 1 < totalLen; i += 2) {
-        uint16_t word = (bytes[i] << 8) | bytes[i + 1];
-        sum += word;
-    }
-
-    // Handle an odd-sized buffer by padding with a zero byte
-    if (totalLen % 2) {
-        sum += (bytes[totalLen - 1] << 8);
-    }
-
-    // Subtract off the embedded checksum
-    sum -= ntohs(_checksum);
-
-    // Add in the pseudo-header
     sum += ntohs(lowBits(srcIp, 16));
     sum += ntohs(highBits(srcIp, 16));
     sum += ntohs(lowBits(destIp, 16));
     sum += ntohs(highBits(destIp, 16));
     sum += (uint16_t)IpProtocol::Tcp;
     sum += (uint16_t)totalLen;
+    return sum;
+}
 
-    // Include the overflow
-    while (sum >> 16) {
-        sum = (sum & 0xFFFF) + (sum >> 16);
-    }
+uint16_t TcpHeader::computeChecksum(IpAddress srcIp, IpAddress destIp, size_t totalLen) {
+    ASSERT(totalLen >= dataOffset() * 4);
+
+    // The pseudo-header, then the segment (padded with a zero byte if odd-sized)
+    uint32_t sum = checksumAdd(pseudoHeaderSum(srcIp, destIp, totalLen), this, totalLen);
+
+    // Subtract off the embedded checksum
+    sum -= ntohs(_checksum);
 
     // Ones complement
-    return ~sum;
+    return ~checksumFold(sum);
 }
 
 bool TcpHeader::verifyChecksum(IpHeader* ipHeader) {
@@ -57,6 +51,79 @@ void TcpHeader::fillChecksum(IpAddress srcIp, IpAddress destIp, size_t totalLen)
     _checksum = htons(computeChecksum(srcIp, destIp, totalLen));
 }
 
+void TcpHeader::fillPseudoHeaderChecksum(IpAddress srcIp, IpAddress destIp,
+                                         size_t totalLen) {
+    _checksum = htons(checksumFold(pseudoHeaderSum(srcIp, destIp, totalLen)));
+}
+
+void TcpHeader::parseOptions(TcpOptions& result) {
+    uint8_t* ptr = options();
+    uint8_t* end = ptr + optionsLength();
+
+    while (ptr < end) {
+        uint8_t kind = ptr[0];
+        if (kind == TCP_OPTION_END) break;
+        if (kind == TCP_OPTION_NOP) {
+            ++ptr;
+            continue;
+        }
+
+        // Everything else has a length, which includes the kind and length bytes
+        if (end - ptr < 2 || ptr[1] < 2 || ptr[1] > end - ptr) break;
+        uint8_t length = ptr[1];
+
+        switch (kind) {
+            case TCP_OPTION_MSS:
+                if (length == 4) {
+                    uint16_t mss;
+                    memcpy(&mss, ptr + 2, 2);
+                    result.mss = ntohs(mss);
+                }
+                break;
+
+            case TCP_OPTION_WINDOW_SCALE:
+                if (length == 3) {
+                    result.hasWindowScale = true;
+                    result.windowScale = ptr[2];
+                }
+                break;
+
+            case TCP_OPTION_SACK_PERMITTED:
+                result.sackPermitted = true;
+                break;
+
+            case TCP_OPTION_TIMESTAMPS:
+                if (length == 10) {
+                    result.hasTimestamps = true;
+                    memcpy(&result.timestampValue, ptr + 2, 4);
+                    memcpy(&result.timestampEcho, ptr + 6, 4);
+                    result.timestampValue = ntohl(result.timestampValue);
+                    result.timestampEcho = ntohl(result.timestampEcho);
+                }
+                break;
+
+            case TCP_OPTION_SACK:
+                result.sackBlockCount = 0;
+                for (size_t i = 2; i + 8 <= length; i += 8) {
+                    if (result.sackBlockCount == TcpOptions::MAX_SACK_BLOCKS) break;
+
+                    auto& block = result.sackBlocks[result.sackBlockCount++];
+                    memcpy(&block.start, ptr + i, 4);
+                    memcpy(&block.end, ptr + i + 4, 4);
+                    block.start = ntohl(block.start);
+                    block.end = ntohl(block.end);
+                }
+                break;
+
+            default:
+                // Ignore options we don't understand
+                break;
+        }
+
+        ptr += length;
+    }
+}
+
 uint16_t TcpHeader::sourcePort() { return ntohs(_sourcePort); }
 uint16_t TcpHeader::destPort() { return ntohs(_destPort); }
 uint32_t TcpHeader::seqNum() { return ntohl(_seqNum); }
@@ -74,6 +141,8 @@ uint16_t TcpHeader::windowSize() { return ntohs(_windowSize); }
 uint16_t TcpHeader::checksum() { return ntohs(_checksum); }
 uint16_t TcpHeader::urgentPointer() { return ntohs(_urgentPointer); }
 uint8_t* TcpHeader::data() { return _data; }
+uint8_t* TcpHeader::options() { return _data; }
+size_t TcpHeader::optionsLength() { return dataOffset() * 4 - sizeof(TcpHeader); }
 
 void TcpHeader::setSourcePort(uint16_t value) { _sourcePort = htons(value); }
 void TcpHeader::setDestPort(uint16_t value) { _destPort = htons(value); }
@@ -127,25 +196,135 @@ struct TcpControlBlock {
         uint32_t unacked;  // first unacknowledged sequence number
         uint32_t next;     // next sequence number to send
         uint32_t window;   // size of the send window
+        uint32_t max;      // highest sequence number sent, even if next has gone back
+        uint8_t windowShift;  // scale of the window field in the peer's segments
     } send;
 
+    static constexpr size_t SEND_BUFFER_SIZE = 64 * KiB;
+
+    // Data written by the user which hasn't been acknowledged yet, in chunks of at most
+    // the MSS. The first chunk starts at sendQueueSeq, which is behind send.unacked if
+    // the chunk has only been partly acknowledged. Segments refer to the chunks rather
+    // than copying them, so data is sent (and resent) straight from the queue.
+    estd::vector<estd::shared_ptr<PacketBuffer>> sendQueue;
+    uint32_t sendQueueSeq;
+    uint32_t sendQueueBytes;
+    uint32_t sendQueueEnd() { return sendQueueSeq + sendQueueBytes; }
+    bool sendBufferFull() { return sendQueueBytes >= SEND_BUFFER_SIZE; }
+
+    // The last write asked for its data to be pushed (see TcpHeader::setPsh)
+    bool pushPending;
+
+    // The FIN follows the send queue, and is sent once everything before it has been
+    bool finQueued;
+    bool finSent;
+
+    // Retransmission timeout (RFC 6298), in nanoseconds. rtoDeadline is zero while the
+    // timer is stopped, and is only changed by tcpSetTimer. A connection whose timer is
+    // running is on the timer list (see TcpTimerList) until it expires.
+    uint64_t srtt;
+    uint64_t rttvar;
+    uint64_t rto;
+    uint64_t rtoDeadline;
+    bool timerQueued;
+    TcpControlBlock* timerPrev;
+    TcpControlBlock* timerNext;
+
+    // Times the SYN (or SYN-ACK) has been sent again without a reply, and why the
+    // connection was given up on, as a negative errno value (zero if it wasn't)
+    uint32_t synRetries;
+    int error;
+
+    // One segment at a time is timed to measure the round-trip time, and never one which
+    // has been retransmitted, because its ACK could be for either copy (Karn's
+    // algorithm). The measurement ends when rttSeq is acknowledged.
+    bool rttTiming;
+    uint32_t rttSeq;
+    uint64_t rttStart;
+
+    // Congestion control. Three duplicate ACKs in a row mean that a segment was lost
+    // while later ones got through: it's resent straight away, and the connection stays
+    // in recovery until everything up to recoveryPoint (send.max at the time) is
+    // acknowledged. It starts at the ISS (RFC 6582).
+    estd::unique_ptr<TcpCongestionControl> congestionControl;
+    TcpCongestionWindow congestion;
+    uint32_t dupAcks;
+    bool inRecovery;
+    uint32_t recoveryPoint;
+
+    // For testing: drop every nth outgoing data segment (never if zero)
+    uint32_t dropInterval;
+    uint32_t dataSegments;
+
     struct {
-        uint32_t next;    // next sequence number expected on an incoming segment
-        uint32_t window;  // size of the receive window
+        uint32_t next;        // next sequence number expected on an incoming segment
+        uint32_t window;      // size of the receive window
+        uint8_t windowShift;  // scale of the window field in our segments
     } recv;
 
-    static constexpr size_t RECV_BUFFER_SIZE = 64 * KiB - 1;
-
-    uint8_t recvBuffer[RECV_BUFFER_SIZE];
-    uint32_t recvBufferUsed() { return sizeof(recvBuffer) - recv.window; }
+    // The receive buffer starts small, so that idle connections don't let their peers
+    // tie up much memory, and grows to fit how fast the reader keeps up (see
+    // tcpTuneRecvBuffer). Only a window of less than 64 KiB can be advertised without
+    // window scaling.
+    static constexpr size_t RECV_BUFFER_INITIAL_SIZE = 16 * KiB;
+    static constexpr size_t RECV_BUFFER_MAX_SIZE = 256 * KiB;
+    uint32_t recvBufferSize;
+
+    // Received data which hasn't been read yet, left in the packets it arrived in. Each
+    // packet's data is pulled forward to its first unread byte.
+    PacketQueue recvQueue;
+    uint32_t recvBufferUsed() { return recvBufferSize - recv.window; }
     bool recvBufferEmpty() { return recvBufferUsed() == 0; }
 
+    // Receive buffer tuning (dynamic right-sizing). The round-trip time is estimated on
+    // the receiving side as the shortest time it's taken for a whole window of data to
+    // arrive, which the sender can't do any faster: a measurement ends when recv.next
+    // reaches recvRttSeq. The reader's progress is counted over periods of that length.
+    uint64_t recvRtt;
+    uint32_t recvRttSeq;
+    uint64_t recvRttStart;
+    uint32_t recvPeriodBytes;
+    uint64_t recvPeriodStart;
+
+    // Segments which arrived after a gap, sorted by sequence number (recorded in each
+    // packet) and trimmed so that they don't overlap. They move to recvQueue once the gap
+    // before them fills. The most recent arrival is reported first in SACK blocks.
+    static constexpr size_t MAX_OUT_OF_ORDER = 64;
+    PacketQueue outOfOrderQueue;
+    size_t outOfOrderCount;
+    uint32_t lastOutOfOrderSeq;
+
+    // Both sides sent SACK-permitted with their SYNs
+    bool sackPermitted;
+
+    // Both sides sent timestamps with their SYNs, so every segment carries one (RFC
+    // 7323). tsRecent is the peer's latest timestamp, which we echo back, and which
+    // older duplicates are checked against (PAWS). It's only updated from segments which
+    // start at or before the last ACK we sent (lastAckSent), so that we echo the
+    // timestamp of the segment which advanced the ACK, even with delayed ACKs.
+    bool timestamps;
+    uint32_t tsRecent;
+    uint32_t lastAckSent;
+
+    // Data above send.unacked which the peer has reported receiving with SACK, as sorted
+    // and merged [start, end) ranges. During recovery, the holes between them are resent
+    // in order, up to sackResendNext so far.
+    struct SackRange {
+        uint32_t start;
+        uint32_t end;
+    };
+    static constexpr size_t MAX_SACK_RANGES = 32;
+    estd::vector<SackRange> sacked;
+    uint32_t sackResendNext;
+
     // Used to wait for certain conditions to occur
     estd::shared_ptr<Blocker> connectionEstablished;
     estd::shared_ptr<Blocker> dataAvailable;
     estd::shared_ptr<Blocker> connectionPending;
+    estd::shared_ptr<Blocker> sendSpaceAvailable;
 
-    // Incoming connections for a listening socket (not yet accepted)
+    // Incoming connections for a listening socket (not yet accepted). A pending
+    // connection's parent is cleared once it's accepted.
     size_t maxBacklog;
     size_t backlogSize;
     TcpControlBlock* pendingConnections;
@@ -156,13 +335,69 @@ struct TcpControlBlock {
 
 static Spinlock* tcpLock = nullptr;
 static TcpControlBlock* tcbList = nullptr;
+
+// Connections with a running retransmission timer, in order of deadline, so that the
+// timer thread only has to look at those which have expired. The lock may be taken
+// while holding a connection's lock, but not the other way around.
+struct TcpTimerList {
+    TcpTimerList() : changed(new Blocker) {}
+
+    Spinlock lock;
+    TcpControlBlock* head = nullptr;
+    TcpControlBlock* tail = nullptr;
+
+    // Wakes the timer thread when a timer is set which expires before all the others
+    estd::shared_ptr<Blocker> changed;
+};
+
+static TcpTimerList* tcpTimers = nullptr;
 static TcpHandle nextHandle;
 static constexpr uint16_t MIN_EPHEMERAL_PORT = 1024;
 static constexpr uint16_t MAX_PORT = 65535;
 static int64_t* portMap = nullptr;
 
+// The largest payload we can receive in a single segment, which we advertise with the
+// MSS option: an Ethernet MTU, less the IP and TCP headers
+static constexpr uint16_t TCP_MSS = 1500 - sizeof(IpHeader) - sizeof(TcpHeader);
+
+// The largest segment we send to a peer which doesn't give its MSS (RFC 9293), and the
+// smallest we let a peer ask for, so that headers don't dwarf the data
+static constexpr uint16_t TCP_DEFAULT_MSS = 536;
+static constexpr uint16_t TCP_MIN_MSS = 64;
+
+// Options take up space in the segment which would otherwise be payload
+static constexpr size_t TCP_TIMESTAMPS_LENGTH = 12;  // including two NOPs for alignment
+static constexpr size_t TCP_MAX_OPTIONS_LENGTH = 40;
+
+// How far we scale our window when the peer supports it: the smallest shift which lets
+// the largest receive buffer be advertised. The peer can ask for at most 14 (RFC 7323).
+static constexpr uint8_t TCP_WINDOW_SHIFT = 3;
+static constexpr uint8_t TCP_MAX_WINDOW_SHIFT = 14;
+static_assert((TcpControlBlock::RECV_BUFFER_MAX_SIZE >> TCP_WINDOW_SHIFT) <= UINT16_MAX);
+
+// Timestamps tick once a millisecond
+static constexpr uint64_t TCP_TIMESTAMP_NS = 1000000;
+
+// Initial congestion window, in segments (RFC 6928)
+static constexpr uint32_t TCP_INITIAL_WINDOW = 10;
+
+// Bounds on the retransmission timeout, in nanoseconds. RFC 6298 suggests a minimum of
+// one second, but like most stacks we use less, so that a loss doesn't stall a
+// connection with a short round-trip time for so long.
+static constexpr uint64_t TCP_INITIAL_RTO = 1000000000;
+static constexpr uint64_t TCP_MIN_RTO = 200000000;
+static constexpr uint64_t TCP_MAX_RTO = 60000000000;
+
+// Times a SYN or SYN-ACK is sent again before giving up on the handshake. With the
+// timeout doubling from a second each time, that's about a minute.
+static constexpr uint32_t TCP_MAX_SYN_RETRIES = 5;
+
+// Resolution of the retransmission timers (one timer tick)
+static constexpr uint64_t TCP_TIMER_GRANULARITY = 10000000;
+
 void tcpInit() {
     tcpLock = new Spinlock();
+    tcpTimers = new TcpTimerList();
     nextHandle = 1;
     portMap = new int64_t[MAX_PORT + 1]{};
 }
@@ -216,11 +451,55 @@ TcpControlBlock::TcpControlBlock() {
     send.unacked = 0;
     send.next = 0;
     send.window = 0;
+    send.max = 0;
+    send.windowShift = 0;
     recv.next = 0;
-    recv.window = RECV_BUFFER_SIZE;
+    recv.window = RECV_BUFFER_INITIAL_SIZE;
+    recv.windowShift = 0;
+    recvBufferSize = RECV_BUFFER_INITIAL_SIZE;
+    recvRtt = 0;
+    recvRttSeq = 0;
+    recvRttStart = 0;
+    recvPeriodBytes = 0;
+    recvPeriodStart = 0;
+    sendQueueSeq = 0;
+    sendQueueBytes = 0;
+    pushPending = false;
+    finQueued = false;
+    finSent = false;
+    srtt = 0;
+    rttvar = 0;
+    rto = TCP_INITIAL_RTO;
+    rtoDeadline = 0;
+    timerQueued = false;
+    timerPrev = nullptr;
+    timerNext = nullptr;
+    synRetries = 0;
+    error = 0;
+    rttTiming = false;
+    rttSeq = 0;
+    rttStart = 0;
+    congestionControl = createCongestionControl(TCP_DEFAULT_CONGESTION_CONTROL,
+                                                strlen(TCP_DEFAULT_CONGESTION_CONTROL));
+    congestion.mss = TCP_DEFAULT_MSS;
+    congestion.cwnd = TCP_INITIAL_WINDOW * congestion.mss;
+    congestion.ssthresh = UINT32_MAX;
+    dupAcks = 0;
+    inRecovery = false;
+    recoveryPoint = iss;
+    dropInterval = 0;
+    dataSegments = 0;
+    outOfOrderCount = 0;
+    lastOutOfOrderSeq = 0;
+    sackPermitted = false;
+    sackResendNext = 0;
+    timestamps = false;
+    tsRecent = 0;
+    lastAckSent = 0;
     connectionEstablished.assign(new Blocker);
     dataAvailable.assign(new Blocker);
     connectionPending.assign(new Blocker);
+    sendSpaceAvailable.assign(new Blocker);
     maxBacklog = 0;
     backlogSize = 0;
     pendingConnections = 0;
@@ -228,6 +507,56 @@ TcpControlBlock::TcpControlBlock() {
     next = nullptr;
 }
 
+static void tcpUnlinkTimerLocked(TcpControlBlock* tcb) {
+    TcpTimerList& timers = *tcpTimers;
+    ASSERT(timers.lock.isLocked() && tcb->timerQueued);
+
+    if (tcb->timerPrev) {
+        tcb->timerPrev->timerNext = tcb->timerNext;
+    } else {
+        timers.head = tcb->timerNext;
+    }
+
+    if (tcb->timerNext) {
+        tcb->timerNext->timerPrev = tcb->timerPrev;
+    } else {
+        timers.tail = tcb->timerPrev;
+    }
+
+    tcb->timerQueued = false;
+    tcb->timerPrev = nullptr;
+    tcb->timerNext = nullptr;
+}
+
+// Sets the retransmission timer to expire at deadline (in nanoseconds since boot), or
+// stops it if deadline is zero. The new deadline is usually the latest, so its place in
+// the list is searched for from the back. The caller must hold the connection's lock,
+// or, for a connection which hasn't been accepted, its listening socket's.
+static void tcpSetTimer(TcpControlBlock* tcb, uint64_t deadline) {
+    TcpTimerList& timers = *tcpTimers;
+    SpinlockLocker locker(timers.lock);
+
+    if (tcb->timerQueued) tcpUnlinkTimerLocked(tcb);
+    tcb->rtoDeadline = deadline;
+    if (deadline == 0) return;
+
+    TcpControlBlock* prev = timers.tail;
+    while (prev && prev->rtoDeadline > deadline) {
+        prev = prev->timerPrev;
+    }
+
+    TcpControlBlock* next = prev ? prev->timerNext : timers.head;
+    tcb->timerPrev = prev;
+    tcb->timerNext = next;
+    (prev ? prev->timerNext : timers.head) = tcb;
+    (next ? next->timerPrev : timers.tail) = tcb;
+    tcb->timerQueued = true;
+
+    if (timers.head == tcb) {
+        sys.scheduler().wakeThreads(timers.changed);
+    }
+}
+
 void tcbInsert(TcpControlBlock* tcb) {
     SpinlockLocker locker(*tcpLock);
     SpinlockLocker tcbLocker(tcb->lock);
@@ -237,6 +566,7 @@ void tcbInsert(TcpControlBlock* tcb) {
 }
 
 void tcbRemove(TcpControlBlock* tcb) {
+    tcpSetTimer(tcb, 0);
     SpinlockLocker locker(*tcpLock);
 
     if (tcb->localPort != 0) {
@@ -316,10 +646,794 @@ TcpControlBlock* tcbLookup(uint16_t localPort, IpAddress remoteIp, uint16_t remo
     return tcbLookup(tcbList, localPort, remoteIp, remotePort);
 }
 
+// Sequence numbers wrap around, so they're compared by their distance apart
+static bool seqLess(uint32_t a, uint32_t b) {
+    return static_cast<int32_t>(a - b) < 0;
+}
+static bool seqLessEqual(uint32_t a, uint32_t b) {
+    return static_cast<int32_t>(a - b) <= 0;
+}
+
+// True if anything we've sent is unacknowledged, or is waiting to be sent
+static bool tcpSendPending(TcpControlBlock* tcb) {
+    return tcb->send.unacked != tcb->send.max ||
+           seqLess(tcb->send.next, tcb->sendQueueEnd()) ||
+           (tcb->finQueued && !tcb->finSent);
+}
+
+// True once the peer has acknowledged our FIN, and so everything we sent
+static bool tcpFinAcked(TcpControlBlock* tcb) {
+    return tcb->finQueued && tcb->send.unacked == tcb->sendQueueEnd() + 1;
+}
+
+static void tcpStartRetransmitTimer(TcpControlBlock* tcb) {
+    tcpSetTimer(tcb, sys.timer().nanoseconds() + tcb->rto);
+}
+
+// Called once the handshake is done, so the SYN no longer needs resending. Any backoff
+// from resending it is undone, since it says nothing about how long data will take.
+static void tcpStopSynTimer(TcpControlBlock* tcb) {
+    tcpSetTimer(tcb, 0);
+    tcb->rto = TCP_INITIAL_RTO;
+}
+
+static uint32_t tcpTimestamp() { return sys.timer().nanoseconds() / TCP_TIMESTAMP_NS; }
+
+// The receive window as it goes in the header of a segment after the SYN
+static uint16_t tcpAdvertisedWindow(TcpControlBlock* tcb) {
+    return min<uint32_t>(tcb->recv.window >> tcb->recv.windowShift, UINT16_MAX);
+}
+
+// The window advertised by an incoming segment after the SYN
+static uint32_t tcpPeerWindow(TcpControlBlock* tcb, TcpHeader* tcpHeader) {
+    return static_cast<uint32_t>(tcpHeader->windowSize()) << tcb->send.windowShift;
+}
+
+// Writes the timestamps option, preceded by two NOPs for alignment
+static void tcpWriteTimestamps(TcpControlBlock* tcb, uint8_t* dest) {
+    uint32_t value = htonl(tcpTimestamp());
+    uint32_t echo = htonl(tcb->tsRecent);
+    dest[0] = TCP_OPTION_NOP;
+    dest[1] = TCP_OPTION_NOP;
+    dest[2] = TCP_OPTION_TIMESTAMPS;
+    dest[3] = 10;
+    memcpy(dest + 4, &value, 4);
+    memcpy(dest + 8, &echo, 4);
+}
+
+// Appends the header of a segment sent after the handshake, which always carries an
+// ACK, along with a timestamp if they're in use. The first extraOptions bytes of the
+// options (a multiple of four) are left for the caller to fill in.
+static TcpHeader* tcpPutHeader(TcpControlBlock* tcb, PacketBuffer* packet, uint32_t seq,
+                               size_t extraOptions = 0) {
+    size_t timestampsLength = tcb->timestamps ? TCP_TIMESTAMPS_LENGTH : 0;
+    size_t headerLength = sizeof(TcpHeader) + extraOptions + timestampsLength;
+    ASSERT(headerLength <= sizeof(TcpHeader) + TCP_MAX_OPTIONS_LENGTH);
+
+    TcpHeader* header = new (packet->put(headerLength)) TcpHeader;
+    header->setDataOffset(headerLength / 4);
+    header->setSourcePort(tcb->localPort);
+    header->setDestPort(tcb->remotePort);
+    header->setSeqNum(seq);
+    header->setAckNum(tcb->recv.next);
+    header->setAck();
+    header->setWindowSize(tcpAdvertisedWindow(tcb));
+    tcb->lastAckSent = tcb->recv.next;
+
+    if (tcb->timestamps) tcpWriteTimestamps(tcb, header->options() + extraOptions);
+
+    return header;
+}
+
+// Sends the data in the send queue starting at seq, up to maxLen bytes but not past the
+// end of the chunk containing it. Returns the number of bytes sent.
+static size_t tcpSendData(TcpControlBlock* tcb, uint32_t seq, size_t maxLen) {
+    ASSERT(tcb->lock.isLocked());
+
+    size_t i = 0;
+    uint32_t chunkSeq = tcb->sendQueueSeq;
+    while (seq - chunkSeq >= tcb->sendQueue[i]->length()) {
+        chunkSeq += tcb->sendQueue[i]->length();
+        ++i;
+        ASSERT(i < tcb->sendQueue.size());
+    }
+
+    const estd::shared_ptr<PacketBuffer>& chunk = tcb->sendQueue[i];
+    size_t offset = seq - chunkSeq;
+    size_t dataLen = min(maxLen, chunk->length() - offset);
+
+    // Simulate a lossy path
+    ++tcb->dataSegments;
+    if (tcb->dropInterval && tcb->dataSegments % tcb->dropInterval == 0) {
+        return dataLen;
+    }
+
+    // Out of packet buffers: treat the segment as lost, and let retransmission handle it
+    auto packet = PacketBuffer::create();
+    if (!packet) return dataLen;
+
+    TcpHeader* header = tcpPutHeader(tcb, packet.get(), seq);
+    size_t headerLength = header->dataOffset() * 4;
+
+    if (tcb->pushPending && seq + dataLen == tcb->sendQueueEnd()) {
+        header->setPsh();
+    }
+
+    // The payload stays in the send queue, so that it's still there if the segment has to
+    // be sent again
+    packet->setFragment(chunk, chunk->data() + offset, dataLen);
+
+    // The device (or ethSend) finishes the checksum
+    header->fillPseudoHeaderChecksum(tcb->localIp, tcb->remoteIp, headerLength + dataLen);
+    packet->setTransportHeader(header);
+    packet->addChecksums(PacketBuffer::CHECKSUM_TCP);
+
+    ipSend(tcb->remoteIp, IpProtocol::Tcp, estd::move(packet));
+    return dataLen;
+}
+
+static void tcpSendFin(TcpControlBlock* tcb) {
+    auto packet = PacketBuffer::create();
+    if (!packet) return;
+
+    TcpHeader* header = tcpPutHeader(tcb, packet.get(), tcb->sendQueueEnd());
+    header->setFin();
+    header->fillChecksum(tcb->localIp, tcb->remoteIp, packet->length());
+    ipSend(tcb->remoteIp, IpProtocol::Tcp, estd::move(packet));
+}
+
+// Sends an ACK for everything received in order. If anything is being held out of
+// order, SACK blocks tell the peer which parts arrived, so that it only resends the gaps.
+static void tcpSendAck(TcpControlBlock* tcb) {
+    TcpControlBlock::SackRange blocks[TcpOptions::MAX_SACK_BLOCKS];
+    size_t maxBlocks = tcb->timestamps ? 3 : TcpOptions::MAX_SACK_BLOCKS;
+    size_t blockCount = 0;
+
+    if (tcb->sackPermitted) {
+        PacketBuffer* packet = tcb->outOfOrderQueue.front();
+        while (packet) {
+            // Adjacent packets make up one block
+            uint32_t start = packet->sequence();
+            uint32_t end = start + packet->length();
+            for (packet = PacketQueue::next(packet); packet && packet->sequence() == end;
+                 packet = PacketQueue::next(packet)) {
+                end += packet->length();
+            }
+
+            // The block holding the latest arrival goes first (RFC 2018)
+            uint32_t latest = tcb->lastOutOfOrderSeq;
+            if (seqLessEqual(start, latest) && seqLess(latest, end)) {
+                if (blockCount < maxBlocks) ++blockCount;
+                for (size_t i = blockCount - 1; i > 0; --i) {
+                    blocks[i] = blocks[i - 1];
+                }
+
+                blocks[0] = {start, end};
+            } else if (blockCount < maxBlocks) {
+                blocks[blockCount++] = {start, end};
+            }
+        }
+    }
+
+    // Two NOPs to align the blocks, then the kind and length
+    size_t sackLength = blockCount > 0 ? 4 + 8 * blockCount : 0;
+
+    // An ACK is freed as soon as it's sent, so it may use the reserve
+    auto packet = PacketBuffer::createReserved();
+    if (!packet) return;
+
+    TcpHeader* header = tcpPutHeader(tcb, packet.get(), tcb->send.next, sackLength);
+
+    if (blockCount > 0) {
+        uint8_t* options = header->options();
+        options[0] = TCP_OPTION_NOP;
+        options[1] = TCP_OPTION_NOP;
+        options[2] = TCP_OPTION_SACK;
+        options[3] = 2 + 8 * blockCount;
+
+        for (size_t i = 0; i < blockCount; ++i) {
+            uint32_t start = htonl(blocks[i].start);
+            uint32_t end = htonl(blocks[i].end);
+            memcpy(options + 4 + 8 * i, &start, 4);
+            memcpy(options + 8 + 8 * i, &end, 4);
+        }
+    }
+
+    header->fillChecksum(tcb->localIp, tcb->remoteIp, packet->length());
+    ipSend(tcb->remoteIp, IpProtocol::Tcp, estd::move(packet));
+}
+
+// Sends our SYN, or SYN-ACK if ack is set, with the MSS and whichever other options are
+// turned on for the connection. The window in a SYN is never scaled.
+static void tcpSendSyn(TcpControlBlock* tcb, bool ack) {
+    uint8_t options[TCP_MAX_OPTIONS_LENGTH];
+    size_t length = 0;
+
+    uint16_t mss = htons(TCP_MSS);
+    options[length++] = TCP_OPTION_MSS;
+    options[length++] = 4;
+    memcpy(options + length, &mss, 2);
+    length += 2;
+
+    if (tcb->sackPermitted) {
+        options[length++] = TCP_OPTION_NOP;
+        options[length++] = TCP_OPTION_NOP;
+        options[length++] = TCP_OPTION_SACK_PERMITTED;
+        options[length++] = 2;
+    }
+
+    if (tcb->timestamps) {
+        tcpWriteTimestamps(tcb, options + length);
+        length += TCP_TIMESTAMPS_LENGTH;
+    }
+
+    if (tcb->recv.windowShift != 0) {
+        options[length++] = TCP_OPTION_NOP;
+        options[length++] = TCP_OPTION_WINDOW_SCALE;
+        options[length++] = 3;
+        options[length++] = tcb->recv.windowShift;
+    }
+
+    size_t headerLength = sizeof(TcpHeader) + length;
+    auto packet = PacketBuffer::create();
+    if (!packet) return;
+
+    TcpHeader& header = *new (packet->put(headerLength)) TcpHeader;
+    memcpy(header.options(), options, length);
+    header.setDataOffset(headerLength / 4);
+    header.setSourcePort(tcb->localPort);
+    header.setDestPort(tcb->remotePort);
+    header.setSeqNum(tcb->iss);
+    header.setSyn();
+    header.setWindowSize(min<uint32_t>(tcb->recv.window, UINT16_MAX));
+
+    if (ack) {
+        header.setAckNum(tcb->recv.next);
+        header.setAck();
+        tcb->lastAckSent = tcb->recv.next;
+    }
+
+    header.fillChecksum(tcb->localIp, tcb->remoteIp, headerLength);
+    ipSend(tcb->remoteIp, IpProtocol::Tcp, estd::move(packet));
+}
+
+// Replies to a segment which acknowledges something we never sent with a RST, which
+// takes its sequence number from the segment's ACK so that the peer accepts it (RFC 793)
+static void tcpSendReset(IpHeader* ipHeader, TcpHeader* tcpHeader) {
+    auto packet = PacketBuffer::createReserved();
+    if (!packet) return;
+
+    TcpHeader& header = *new (packet->put(sizeof(TcpHeader))) TcpHeader;
+    header.setDataOffset(sizeof(TcpHeader) / 4);
+    header.setSourcePort(tcpHeader->destPort());
+    header.setDestPort(tcpHeader->sourcePort());
+    header.setSeqNum(tcpHeader->ackNum());
+    header.setRst();
+
+    header.fillChecksum(ipHeader->destIp(), ipHeader->sourceIp(), sizeof(TcpHeader));
+    ipSend(ipHeader->sourceIp(), IpProtocol::Tcp, estd::move(packet));
+}
+
+// Settles which options the connection uses, from those on the peer's SYN or SYN-ACK.
+// We offer all of them on a SYN, and a peer only puts those we offered on its SYN-ACK,
+// so on either side, an option is in use if the peer sent it.
+static void tcpNegotiateOptions(TcpControlBlock* tcb, const TcpOptions& options) {
+    tcb->sackPermitted = options.sackPermitted;
+
+    if (options.hasWindowScale) {
+        tcb->send.windowShift = min(options.windowScale, TCP_MAX_WINDOW_SHIFT);
+        tcb->recv.windowShift = TCP_WINDOW_SHIFT;
+    } else {
+        tcb->send.windowShift = 0;
+        tcb->recv.windowShift = 0;
+    }
+
+    tcb->timestamps = options.hasTimestamps;
+    tcb->tsRecent = options.timestampValue;
+
+    // Leave room in each segment for the timestamps
+    uint16_t mss = TCP_DEFAULT_MSS;
+    if (options.mss) mss = min(max(options.mss, TCP_MIN_MSS), TCP_MSS);
+    if (tcb->timestamps) mss -= TCP_TIMESTAMPS_LENGTH;
+
+    tcb->congestion.mss = mss;
+    tcb->congestion.cwnd = TCP_INITIAL_WINDOW * mss;
+}
+
+// Records the ranges reported in the SACK option of an incoming ACK, ignoring anything
+// already acknowledged, or which we haven't sent
+static void tcpAddSackBlocks(TcpControlBlock* tcb, const TcpOptions& options) {
+    using SackRange = TcpControlBlock::SackRange;
+
+    for (size_t i = 0; i < options.sackBlockCount; ++i) {
+        uint32_t start = options.sackBlocks[i].start;
+        uint32_t end = options.sackBlocks[i].end;
+        if (!seqLess(start, end) || seqLess(tcb->send.max, end) ||
+            seqLessEqual(end, tcb->send.unacked)) {
+            continue;
+        }
+
+        if (seqLess(start, tcb->send.unacked)) start = tcb->send.unacked;
+
+        // Merge it with any ranges which it overlaps or touches
+        estd::vector<SackRange> merged;
+        bool inserted = false;
+        for (size_t j = 0; j < tcb->sacked.size(); ++j) {
+            const SackRange& range = tcb->sacked[j];
+            if (seqLess(range.end, start)) {
+                merged.push_back(range);
+            } else if (seqLess(end, range.start)) {
+                if (!inserted) {
+                    merged.push_back(SackRange{start, end});
+                    inserted = true;
+                }
+
+                merged.push_back(range);
+            } else {
+                if (seqLess(range.start, start)) start = range.start;
+                if (seqLess(end, range.end)) end = range.end;
+            }
+        }
+
+        if (!inserted) merged.push_back(SackRange{start, end});
+
+        // Past this, the holes are too many to be worth tracking individually
+        if (merged.size() <= TcpControlBlock::MAX_SACK_RANGES) {
+            tcb->sacked = estd::move(merged);
+        }
+    }
+}
+
+// Forgets SACKed ranges once the cumulative ACK reaches them
+static void tcpPruneSacked(TcpControlBlock* tcb) {
+    size_t kept = 0;
+    for (size_t i = 0; i < tcb->sacked.size(); ++i) {
+        TcpControlBlock::SackRange range = tcb->sacked[i];
+        if (seqLessEqual(range.end, tcb->send.unacked)) continue;
+
+        if (seqLess(range.start, tcb->send.unacked)) range.start = tcb->send.unacked;
+        tcb->sacked[kept++] = range;
+    }
+
+    while (tcb->sacked.size() > kept) {
+        tcb->sacked.pop_back();
+    }
+}
+
+// If seq is in a range the peer has SACKed, returns the end of the range, otherwise seq
+static uint32_t tcpSkipSacked(TcpControlBlock* tcb, uint32_t seq) {
+    for (size_t i = 0; i < tcb->sacked.size(); ++i) {
+        const TcpControlBlock::SackRange& range = tcb->sacked[i];
+        if (seqLessEqual(range.start, seq) && seqLess(seq, range.end)) {
+            return range.end;
+        }
+    }
+
+    return seq;
+}
+
+// Sends as much of the send queue as the peer's window and the congestion window allow,
+// in segments of at most one MSS, followed by the FIN once all of the data has been sent
+static void tcpTransmit(TcpControlBlock* tcb) {
+    ASSERT(tcb->lock.isLocked());
+
+    uint32_t window = min(tcb->send.window, tcb->congestion.cwnd);
+    uint32_t windowEnd = tcb->send.unacked + window;
+    while (seqLess(tcb->send.next, tcb->sendQueueEnd()) &&
+           seqLess(tcb->send.next, windowEnd)) {
+        // After going back on a timeout, skip whatever the peer says it already has
+        uint32_t unsacked = tcpSkipSacked(tcb, tcb->send.next);
+        if (unsacked != tcb->send.next) {
+            tcb->send.next = unsacked;
+            continue;
+        }
+
+        size_t maxLen = min<size_t>(tcb->congestion.mss, windowEnd - tcb->send.next);
+        size_t dataLen = tcpSendData(tcb, tcb->send.next, maxLen);
+
+        // Only time new data, never a segment sent again after going back. Timestamps
+        // make this unnecessary.
+        if (!tcb->timestamps && !tcb->rttTiming &&
+            seqLessEqual(tcb->send.max, tcb->send.next)) {
+            tcb->rttTiming = true;
+            tcb->rttSeq = tcb->send.next + dataLen;
+            tcb->rttStart = sys.timer().nanoseconds();
+        }
+
+        tcb->send.next += dataLen;
+        if (seqLess(tcb->send.max, tcb->send.next)) tcb->send.max = tcb->send.next;
+    }
+
+    if (tcb->finQueued && !tcb->finSent && tcb->send.next == tcb->sendQueueEnd()) {
+        tcpSendFin(tcb);
+        tcb->finSent = true;
+        tcb->send.next++;  // FIN consumes one sequence number
+        if (seqLess(tcb->send.max, tcb->send.next)) tcb->send.max = tcb->send.next;
+    }
+
+    // If the window is closed, the timer also makes us probe it
+    if (tcb->rtoDeadline == 0 && tcpSendPending(tcb)) {
+        tcpStartRetransmitTimer(tcb);
+    }
+}
+
+// Resends the oldest unacknowledged segment, without waiting for the timer
+static void tcpResendOldest(TcpControlBlock* tcb) {
+    if (seqLess(tcb->send.unacked, tcb->sendQueueEnd())) {
+        uint32_t remaining = tcb->sendQueueEnd() - tcb->send.unacked;
+        tcpSendData(tcb, tcb->send.unacked, min<size_t>(tcb->congestion.mss, remaining));
+    } else if (tcb->finSent) {
+        tcpSendFin(tcb);
+    }
+
+    // Its ACK could be for either copy
+    tcb->rttTiming = false;
+}
+
+// Resends (up to one segment of) the first hole in the SACKed data which hasn't already
+// been resent in this recovery. Data after the last SACKed range isn't known to be lost,
+// so isn't a hole. Returns false if there are none left.
+static bool tcpResendNextHole(TcpControlBlock* tcb) {
+    uint32_t seq = tcb->sackResendNext;
+    if (seqLess(seq, tcb->send.unacked)) seq = tcb->send.unacked;
+
+    for (size_t i = 0; i < tcb->sacked.size(); ++i) {
+        const TcpControlBlock::SackRange& range = tcb->sacked[i];
+        if (seqLess(seq, range.start)) {
+            if (!seqLess(seq, tcb->sendQueueEnd())) return false;
+
+            size_t maxLen = min<size_t>(tcb->congestion.mss, range.start - seq);
+            tcb->sackResendNext = seq + tcpSendData(tcb, seq, maxLen);
+            tcb->rttTiming = false;
+            return true;
+        }
+
+        if (seqLess(seq, range.end)) seq = range.end;
+    }
+
+    return false;
+}
+
+// Updates the smoothed round-trip time and the retransmission timeout with a new
+// measurement, as in RFC 6298
+static void tcpUpdateRto(TcpControlBlock* tcb, uint64_t rtt) {
+    if (tcb->srtt == 0) {
+        tcb->srtt = rtt;
+        tcb->rttvar = rtt / 2;
+    } else {
+        uint64_t delta = tcb->srtt > rtt ? tcb->srtt - rtt : rtt - tcb->srtt;
+        tcb->rttvar = (3 * tcb->rttvar + delta) / 4;
+        tcb->srtt = (7 * tcb->srtt + rtt) / 8;
+    }
+
+    uint64_t rto = tcb->srtt + max(TCP_TIMER_GRANULARITY, 4 * tcb->rttvar);
+    tcb->rto = min(max(rto, TCP_MIN_RTO), TCP_MAX_RTO);
+}
+
+// Counts an ACK which acknowledges nothing new. The third in a row starts fast
+// retransmit and recovery (RFC 6582), and each one after that means another segment has
+// left the network, so the window is inflated to let a new one in.
+static void tcpDuplicateAck(TcpControlBlock* tcb) {
+    TcpCongestionWindow& congestion = tcb->congestion;
+
+    ++tcb->dupAcks;
+    if (tcb->inRecovery) {
+        // With SACK, use the segment which left to fill another hole, if there is one
+        if (tcb->sackPermitted && tcpResendNextHole(tcb)) return;
+
+        if (tcb->dupAcks > 3) congestion.cwnd += congestion.mss;
+        return;
+    }
+
+    // Don't react twice to losses from the same window
+    if (tcb->dupAcks != 3 || seqLess(tcb->send.unacked - 1, tcb->recoveryPoint)) {
+        return;
+    }
+
+    uint32_t flightSize = tcb->send.max - tcb->send.unacked;
+    congestion.ssthresh = tcb->congestionControl->lossThreshold(congestion, flightSize);
+    congestion.cwnd = congestion.ssthresh + 3 * congestion.mss;
+    tcb->inRecovery = true;
+    tcb->recoveryPoint = tcb->send.max;
+    tcb->sackResendNext = tcb->send.unacked;
+
+    if (!tcb->sackPermitted || !tcpResendNextHole(tcb)) {
+        tcpResendOldest(tcb);
+    }
+}
+
+// Grows the congestion window (or deflates it, during recovery) for an ACK of new data
+static void tcpNewAck(TcpControlBlock* tcb, uint32_t acked) {
+    TcpCongestionWindow& congestion = tcb->congestion;
+    tcb->dupAcks = 0;
+
+    // Outside of recovery, the recovery point follows the ACKs, so that it can't fall so
+    // far behind (2^31) that the comparison in tcpDuplicateAck wraps around. After a
+    // timeout, it stays at send.max until that's acknowledged.
+    if (!tcb->inRecovery && seqLess(tcb->recoveryPoint, tcb->send.unacked - 1)) {
+        tcb->recoveryPoint = tcb->send.unacked - 1;
+    }
+
+    if (tcb->inRecovery) {
+        if (seqLessEqual(tcb->recoveryPoint, tcb->send.unacked)) {
+            // Everything outstanding when the loss was detected has arrived
+            uint32_t flightSize = tcb->send.max - tcb->send.unacked;
+            uint32_t window = max(flightSize, congestion.mss) + congestion.mss;
+            congestion.cwnd = min(congestion.ssthresh, window);
+            tcb->inRecovery = false;
+        } else {
+            // A partial ACK: the next hole is lost as well (unless SACK has already led
+            // us to resend it)
+            if (tcb->sackPermitted) {
+                tcpResendNextHole(tcb);
+            } else {
+                tcpResendOldest(tcb);
+            }
+
+            congestion.cwnd -= min(acked, congestion.cwnd);
+            if (acked >= congestion.mss) congestion.cwnd += congestion.mss;
+        }
+    } else if (congestion.cwnd < congestion.ssthresh) {
+        // Slow start: double the window every round trip
+        congestion.cwnd += min(acked, congestion.mss);
+    } else {
+        tcb->congestionControl->congestionAvoidance(congestion, acked, tcb->srtt,
+                                                    sys.timer().nanoseconds());
+    }
+}
+
+// Handles the acknowledgment and window advertised by an incoming segment, releasing
+// acknowledged data from the send queue and sending whatever the window now allows.
+// Returns false if the segment acknowledges data we haven't sent, and should be dropped.
+static bool tcpProcessAck(TcpControlBlock* tcb, TcpHeader* tcpHeader,
+                          const TcpOptions& options, size_t dataLen) {
+    ASSERT(tcb->lock.isLocked());
+
+    if (!tcpHeader->ack()) return true;
+
+    uint32_t ackNum = tcpHeader->ackNum();
+    if (seqLess(tcb->send.max, ackNum)) return false;
+
+    // An old duplicate
+    if (seqLess(ackNum, tcb->send.unacked)) return true;
+
+    if (tcb->sackPermitted) tcpAddSackBlocks(tcb, options);
+
+    // Nothing but an ACK, repeated while data is outstanding (RFC 5681)
+    uint32_t window = tcpPeerWindow(tcb, tcpHeader);
+    if (ackNum == tcb->send.unacked && dataLen == 0 && !tcpHeader->fin() &&
+        window == tcb->send.window && tcb->send.unacked != tcb->send.max) {
+        tcpDuplicateAck(tcb);
+    }
+
+    // TODO: ignore window updates from segments older than the last one used (SND.WL1
+    // and SND.WL2 in RFC 793)
+    tcb->send.window = window;
+
+    if (ackNum != tcb->send.unacked) {
+        uint32_t acked = ackNum - tcb->send.unacked;
+        tcb->send.unacked = ackNum;
+        tcpPruneSacked(tcb);
+
+        // After going back to resend, the peer may already have what we're resending
+        if (seqLess(tcb->send.next, ackNum)) tcb->send.next = ackNum;
+
+        // Drop the chunks which have been acknowledged completely. The FIN can make the
+        // acknowledged count one more than the size of the queue.
+        uint32_t remaining = ackNum - tcb->sendQueueSeq;
+        size_t count = 0;
+        while (count < tcb->sendQueue.size()) {
+            size_t length = tcb->sendQueue[count]->length();
+            if (length > remaining) break;
+
+            remaining -= length;
+            tcb->sendQueueSeq += length;
+            tcb->sendQueueBytes -= length;
+            ++count;
+        }
+
+        if (count > 0) {
+            for (size_t i = count; i < tcb->sendQueue.size(); ++i) {
+                tcb->sendQueue[i - count] = tcb->sendQueue[i];
+            }
+
+            for (size_t i = 0; i < count; ++i) {
+                tcb->sendQueue.pop_back();
+            }
+
+            sys.scheduler().wakeThreads(tcb->sendSpaceAvailable);
+        }
+
+        if (tcb->timestamps) {
+            // The echo is of the timestamp on the segment which advanced the peer's ACK,
+            // so it measures the round trip even if that segment was a retransmission.
+            // It's only to the millisecond, so take the middle of that.
+            if (options.hasTimestamps && options.timestampEcho != 0) {
+                uint32_t elapsed = tcpTimestamp() - options.timestampEcho;
+                tcpUpdateRto(tcb, elapsed * TCP_TIMESTAMP_NS + TCP_TIMESTAMP_NS / 2);
+            }
+        } else if (tcb->rttTiming && seqLessEqual(tcb->rttSeq, ackNum)) {
+            tcpUpdateRto(tcb, sys.timer().nanoseconds() - tcb->rttStart);
+            tcb->rttTiming = false;
+        }
+
+        tcpNewAck(tcb, acked);
+
+        // Restart the timer for whatever is still outstanding
+        tcpSetTimer(tcb, 0);
+    }
+
+    tcpTransmit(tcb);
+    return true;
+}
+
+// Called when the retransmission timer expires during the handshake: sends the SYN (or
+// SYN-ACK) again, or gives up on the connection after too many tries
+// Gives up on a connection before it has been established, failing tcpWaitForConnection
+// with error
+static void tcpAbortHandshake(TcpControlBlock* tcb, int error) {
+    tcb->state = TcpState::CLOSED;
+    tcb->error = error;
+    tcpSetTimer(tcb, 0);
+    sys.scheduler().wakeThreads(tcb->connectionEstablished);
+}
+
+static void tcpRetransmitSyn(TcpControlBlock* tcb) {
+    if (tcb->synRetries == TCP_MAX_SYN_RETRIES) {
+        tcpAbortHandshake(tcb, -ETIMEDOUT);
+        return;
+    }
+
+    ++tcb->synRetries;
+    tcb->rto = min(2 * tcb->rto, TCP_MAX_RTO);
+    tcpSendSyn(tcb, tcb->state == TcpState::SYN_RECEIVED);
+    tcpStartRetransmitTimer(tcb);
+}
+
+// Called when the retransmission timer expires: goes back to the oldest unacknowledged
+// segment and sends everything again from there, starting over with slow start, or
+// probes a closed window
+static void tcpRetransmit(TcpControlBlock* tcb) {
+    ASSERT(tcb->lock.isLocked());
+
+    if (tcb->state == TcpState::SYN_SENT || tcb->state == TcpState::SYN_RECEIVED) {
+        tcpRetransmitSyn(tcb);
+        return;
+    }
+
+    if (!tcpSendPending(tcb)) {
+        tcpSetTimer(tcb, 0);
+        return;
+    }
+
+    // Back off, and don't measure the round-trip time of anything sent twice, since we
+    // can't tell which copy an ACK is for
+    tcb->rto = min(2 * tcb->rto, TCP_MAX_RTO);
+    tcb->rttTiming = false;
+
+    if (tcb->send.unacked == tcb->send.max) {
+        // Nothing is in flight, so the peer's window is closed: send it one byte past the
+        // window, which it acknowledges with its current window
+        if (seqLess(tcb->send.next, tcb->sendQueueEnd())) {
+            tcb->send.next += tcpSendData(tcb, tcb->send.next, 1);
+            tcb->send.max = tcb->send.next;
+        }
+
+        tcpStartRetransmitTimer(tcb);
+        return;
+    }
+
+    TcpCongestionWindow& congestion = tcb->congestion;
+    uint32_t flightSize = tcb->send.max - tcb->send.unacked;
+    congestion.ssthresh = tcb->congestionControl->lossThreshold(congestion, flightSize);
+    congestion.cwnd = congestion.mss;
+    tcb->dupAcks = 0;
+    tcb->inRecovery = false;
+    tcb->recoveryPoint = tcb->send.max;
+
+    tcb->send.next = tcb->send.unacked;
+    tcb->finSent = false;
+
+    tcpStartRetransmitTimer(tcb);
+    tcpTransmit(tcb);
+}
+
+// Handles a connection whose timer was due to expire at now, unless it has been stopped
+// or set again since
+static void tcpTimerExpired(TcpControlBlock* tcb, uint64_t now) {
+    // A connection which hasn't been accepted yet is on its listening socket's queue,
+    // which is locked first. It may be accepted before that.
+    TcpControlBlock* parent = tcb->parent;
+    if (parent) parent->lock.lock();
+    tcb->lock.lock();
+
+    if (parent && tcb->parent != parent) {
+        parent->lock.unlock();
+        parent = nullptr;
+    }
+
+    // A connection which hasn't been accepted is dropped if its listening socket has
+    // been closed, or if the handshake is given up on
+    bool orphaned = parent && parent->state != TcpState::LISTEN;
+    bool closed = tcb->state == TcpState::CLOSED;
+    if (!orphaned && !closed && tcb->rtoDeadline != 0 && tcb->rtoDeadline <= now) {
+        tcpRetransmit(tcb);
+    }
+
+    bool drop = parent && (orphaned || tcb->state == TcpState::CLOSED);
+    if (drop) {
+        TcpControlBlock** prev = &parent->pendingConnections;
+        while (*prev != tcb) {
+            prev = &(*prev)->next;
+        }
+
+        *prev = tcb->next;
+        --parent->backlogSize;
+        tcpSetTimer(tcb, 0);
+        tcb->state = TcpState::CLOSED;
+        releasePort(tcb->localPort);
+    }
+
+    tcb->lock.unlock();
+    if (parent) parent->lock.unlock();
+
+    // Userspace has no handle to it yet, and it can no longer be found by an incoming
+    // segment or the timer, so nothing else refers to it
+    if (drop) delete tcb;
+}
+
+// Handles the retransmission timers as they expire, in order, and otherwise sleeps until
+// the next one is due (or an earlier one is set)
+static void tcpTimerThread() {
+    TcpTimerList& timers = *tcpTimers;
+
+    while (true) {
+        TcpControlBlock* tcb;
+        uint64_t now;
+        {
+            SpinlockLocker locker(timers.lock);
+            while (true) {
+                now = sys.timer().nanoseconds();
+                tcb = timers.head;
+                if (tcb && tcb->rtoDeadline <= now) break;
+
+                if (tcb) {
+                    uint64_t ms = ceilDiv(tcb->rtoDeadline - now, 1000000UL);
+                    uint64_t ticks = Timer::millisecondsToTicks(ms);
+                    sys.timer().setTimeout(timers.changed, ticks);
+                }
+
+                sys.scheduler().sleepThread(timers.changed, &timers.lock);
+                sys.timer().cancelTimeout(timers.changed);
+            }
+
+            tcpUnlinkTimerLocked(tcb);
+        }
+
+        tcpTimerExpired(tcb, now);
+    }
+}
+
+static Thread* tcpTimer = nullptr;
+
+void tcpStartTimer() {
+    ASSERT(!tcpTimer);
+    tcpTimer = Thread::createKernelThread(bit_cast<uint64_t>(&tcpTimerThread)).release();
+    sys.scheduler().startThread(tcpTimer);
+}
+
 void tcpRecvListen(TcpControlBlock* tcb, IpHeader* ipHeader, TcpHeader* tcpHeader,
-                   uint8_t*, size_t) {
+                   const TcpOptions& options, estd::unique_ptr<PacketBuffer>&) {
     ASSERT(tcb->lock.isLocked());
-    ASSERT(tcpHeader->syn());
+
+    // Nothing has been sent on this port, so an ACK is answered with a RST, and anything
+    // other than a SYN is dropped
+    if (tcpHeader->rst()) return;
+    if (tcpHeader->ack()) {
+        tcpSendReset(ipHeader, tcpHeader);
+        return;
+    }
+    if (!tcpHeader->syn()) return;
 
     if (tcb->backlogSize >= tcb->maxBacklog) {
         // Drop the connection if the backlog is full
@@ -337,11 +1451,12 @@ void tcpRecvListen(TcpControlBlock* tcb, IpHeader* ipHeader, TcpHeader* tcpHeade
     tcbChild->iss = 0;
     tcbChild->send.unacked = tcbChild->iss;
     tcbChild->send.next = tcbChild->iss;
+    tcbChild->recoveryPoint = tcbChild->iss;
     tcbChild->send.window = tcpHeader->windowSize();
     tcbChild->irs = tcpHeader->seqNum();
     tcbChild->recv.next = tcbChild->irs + 1;  // SYN consumes one sequence number
-    tcbChild->recv.window = TcpControlBlock::RECV_BUFFER_SIZE;
     tcbChild->parent = tcb;
+    tcpNegotiateOptions(tcbChild, options);
 
     // Insert into the pending connections list (at the back)
     TcpControlBlock** prev = &tcb->pendingConnections;
@@ -355,224 +1470,473 @@ void tcpRecvListen(TcpControlBlock* tcb, IpHeader* ipHeader, TcpHeader* tcpHeade
     sys.scheduler().wakeThreads(tcb->connectionPending);
 
     // Reply with SYN-ACK
-    TcpHeader response;
-    response.setSourcePort(tcbChild->localPort);
-    response.setDestPort(tcbChild->remotePort);
-    response.setSeqNum(tcbChild->send.next);
-    response.setAckNum(tcbChild->recv.next);
-    response.setSyn();
-    response.setAck();
-    response.setWindowSize(tcbChild->recv.window);
-    response.fillChecksum(tcbChild->localIp, tcbChild->remoteIp, sizeof(TcpHeader));
-
-    ipSend(tcbChild->remoteIp, IpProtocol::Tcp, &response, sizeof(TcpHeader));
+    tcpSendSyn(tcbChild, true);
 
     // The SYN consumes one sequence number
     tcbChild->send.next++;
+    tcbChild->send.max = tcbChild->send.next;
+    tcbChild->sendQueueSeq = tcbChild->send.next;
+
+    // Sent again if the handshake doesn't finish in time (see tcpRetransmitSyn)
+    tcpStartRetransmitTimer(tcbChild);
 }
 
-void tcpRecvEstablished(TcpControlBlock* tcb, TcpHeader* tcpHeader, uint8_t* data,
-                        size_t dataLen);
+void tcpRecvEstablished(TcpControlBlock* tcb, TcpHeader* tcpHeader,
+                        const TcpOptions& options,
+                        estd::unique_ptr<PacketBuffer>& packet);
 
-void tcpRecvSynReceived(TcpControlBlock* tcb, TcpHeader* tcpHeader, uint8_t* data,
-                        size_t dataLen) {
+void tcpRecvSynReceived(TcpControlBlock* tcb, IpHeader* ipHeader, TcpHeader* tcpHeader,
+                        const TcpOptions& options,
+                        estd::unique_ptr<PacketBuffer>& packet) {
     ASSERT(tcb->lock.isLocked());
-    ASSERT(tcpHeader->ack());
-    ASSERT(tcpHeader->seqNum() == tcb->recv.next);
-    ASSERT(tcpHeader->ackNum() == tcb->send.next);
+
+    if (tcpHeader->rst()) {
+        tcpAbortHandshake(tcb, -ECONNREFUSED);
+
+        // If it hasn't been accepted, the timer takes it off its listening socket's queue
+        if (tcb->parent) tcpSetTimer(tcb, sys.timer().nanoseconds());
+        return;
+    }
+
+    if (!tcpHeader->ack()) return;
+    if (tcpHeader->ackNum() != tcb->send.next) {
+        tcpSendReset(ipHeader, tcpHeader);
+        return;
+    }
 
     tcb->state = TcpState::ESTABLISHED;
     tcb->send.unacked = tcpHeader->ackNum();
-    tcb->send.window = tcpHeader->windowSize();
+    tcb->send.window = tcpPeerWindow(tcb, tcpHeader);
+    tcpStopSynTimer(tcb);
 
     // Handle TCP Fast Open (initial data in the ACK packet)
-    if (tcpHeader->dataOffset() * 4 > sizeof(TcpHeader)) {
-        tcpRecvEstablished(tcb, tcpHeader, data, dataLen);
+    if (packet->length() > 0) {
+        tcpRecvEstablished(tcb, tcpHeader, options, packet);
     }
 
     sys.scheduler().wakeThreads(tcb->connectionEstablished);
 }
 
-void tcpRecvEstablished(TcpControlBlock* tcb, TcpHeader* tcpHeader, uint8_t* data,
-                        size_t dataLen) {
+// Adds the payload of a segment (the packet's data) to the end of the receive queue.
+// The packet itself is queued, unless the payload fits in the space left over at the end
+// of the last queued packet, so that a stream of small segments can't tie up a whole
+// packet buffer for every few bytes.
+static void tcpQueueData(TcpControlBlock* tcb, estd::unique_ptr<PacketBuffer>& packet) {
+    ASSERT(tcb->lock.isLocked());
+
+    PacketBuffer* tail = tcb->recvQueue.back();
+    if (tail && packet->length() <= tail->tailroom()) {
+        memcpy(tail->put(packet->length()), packet->data(), packet->length());
+    } else {
+        tcb->recvQueue.pushBack(estd::move(packet));
+    }
+}
+
+// Holds on to a segment which arrived after a gap, until the gap fills. Parts which
+// are already held are dropped.
+static void tcpQueueOutOfOrder(TcpControlBlock* tcb, uint32_t seq,
+                               estd::unique_ptr<PacketBuffer>& packet) {
+    ASSERT(tcb->lock.isLocked());
+    PacketQueue& queue = tcb->outOfOrderQueue;
+
+    // Find the last packet which starts before this one, and trim off what it covers
+    PacketBuffer* prev = nullptr;
+    for (PacketBuffer* p = queue.front(); p && seqLess(p->sequence(), seq);
+         p = PacketQueue::next(p)) {
+        prev = p;
+    }
+
+    uint32_t end = seq + packet->length();
+    if (prev) {
+        uint32_t prevEnd = prev->sequence() + prev->length();
+        if (seqLessEqual(end, prevEnd)) return;
+
+        if (seqLess(seq, prevEnd)) {
+            packet->pull(prevEnd - seq);
+            seq = prevEnd;
+        }
+    }
+
+    // Replace the packets after it which it covers completely, and trim off the start of
+    // the next one
+    while (PacketBuffer* next = prev ? PacketQueue::next(prev) : queue.front()) {
+        if (seqLess(end, next->sequence() + next->length())) {
+            if (seqLessEqual(end, next->sequence())) break;
+
+            if (!seqLess(seq, next->sequence())) return;
+            packet->trim(next->sequence() - seq);
+            break;
+        }
+
+        queue.removeAfter(prev);
+        --tcb->outOfOrderCount;
+    }
+
+    // Packet buffers are big, whatever they hold, so limit how many are tied up
+    if (tcb->outOfOrderCount == TcpControlBlock::MAX_OUT_OF_ORDER) return;
+
+    packet->setSequence(seq);
+    queue.insertAfter(prev, estd::move(packet));
+    ++tcb->outOfOrderCount;
+    tcb->lastOutOfOrderSeq = seq;
+}
+
+// Moves held segments to the receive queue once everything before them has arrived
+static void tcpDrainOutOfOrder(TcpControlBlock* tcb) {
+    ASSERT(tcb->lock.isLocked());
+
+    while (PacketBuffer* front = tcb->outOfOrderQueue.front()) {
+        if (seqLess(tcb->recv.next, front->sequence())) break;
+
+        auto packet = tcb->outOfOrderQueue.popFront();
+        --tcb->outOfOrderCount;
+
+        uint32_t end = packet->sequence() + packet->length();
+        if (seqLessEqual(end, tcb->recv.next)) continue;
+
+        // Everything held was inside the window when it arrived, and the right edge of
+        // the window never moves left
+        packet->pull(tcb->recv.next - packet->sequence());
+        size_t dataLen = packet->length();
+        ASSERT(dataLen <= tcb->recv.window);
+
+        tcpQueueData(tcb, packet);
+        tcb->recv.window -= dataLen;
+        tcb->recv.next += dataLen;
+    }
+}
+
+// Called as data arrives in order, to time how long it takes for a window's worth to
+// arrive. A measurement only starts while the window is mostly open, since a small one
+// would fill in less than a round trip.
+static void tcpMeasureRecvRtt(TcpControlBlock* tcb) {
+    bool measuring = tcb->recvRttStart != 0;
+    if (measuring && seqLess(tcb->recv.next, tcb->recvRttSeq)) return;
+
+    uint64_t now = sys.timer().nanoseconds();
+    if (measuring) {
+        uint64_t sample = now - tcb->recvRttStart;
+        if (tcb->recvRtt == 0) {
+            tcb->recvPeriodBytes = 0;
+            tcb->recvPeriodStart = now;
+        }
+
+        if (tcb->recvRtt == 0 || sample < tcb->recvRtt) tcb->recvRtt = sample;
+        tcb->recvRttStart = 0;
+    }
+
+    if (tcb->recv.window >= tcb->recvBufferSize / 2) {
+        tcb->recvRttSeq = tcb->recv.next + tcb->recv.window;
+        tcb->recvRttStart = now;
+    }
+}
+
+// Called as the reader consumes data. Once a round trip has gone by, the buffer grows to
+// twice what was read in it, if that's more than it is: the window may have been
+// holding the sender back, and the sender needs room to speed up. The buffer never
+// shrinks, since the window's right edge can't move back.
+static void tcpTuneRecvBuffer(TcpControlBlock* tcb, size_t readSize) {
+    tcb->recvPeriodBytes += readSize;
+    if (tcb->recvRtt == 0) return;
+
+    uint64_t now = sys.timer().nanoseconds();
+    if (now - tcb->recvPeriodStart < tcb->recvRtt) return;
+
+    size_t maxSize = tcb->recv.windowShift != 0 ? TcpControlBlock::RECV_BUFFER_MAX_SIZE
+                                                : UINT16_MAX;
+    size_t size = min<size_t>(2 * tcb->recvPeriodBytes, maxSize);
+    if (size > tcb->recvBufferSize) {
+        tcb->recv.window += size - tcb->recvBufferSize;
+        tcb->recvBufferSize = size;
+    }
+
+    tcb->recvPeriodBytes = 0;
+    tcb->recvPeriodStart = now;
+}
+
+void tcpRecvEstablished(TcpControlBlock* tcb, TcpHeader* tcpHeader,
+                        const TcpOptions& options,
+                        estd::unique_ptr<PacketBuffer>& packet) {
     ASSERT(tcb->lock.isLocked());
-    ASSERT(tcpHeader->seqNum() == tcb->recv.next);
-    ASSERT(tcpHeader->ackNum() == tcb->send.next);
 
-    // If we received more data than we can store, just truncate (and ACK only the
-    // portion that we handled)
-    size_t origDataLen = dataLen;
-    dataLen = min<size_t>(dataLen, tcb->recv.window);
+    if (!tcpProcessAck(tcb, tcpHeader, options, packet->length())) {
+        tcpSendAck(tcb);
+        return;
+    }
+
+    // Drop anything which isn't inside the receive window, or which we already have. An
+    // ACK tells the peer where we are, in case it's resending because ours was lost.
+    uint32_t seq = tcpHeader->seqNum();
+    bool fin = tcpHeader->fin();
+    uint32_t windowEnd = tcb->recv.next + tcb->recv.window;
+    uint32_t segmentEnd = seq + packet->length() + (fin ? 1 : 0);
+    if (!seqLess(seq, windowEnd) || seqLessEqual(segmentEnd, tcb->recv.next)) {
+        if (packet->length() > 0 || fin) tcpSendAck(tcb);
+        return;
+    }
+
+    // Trim off anything which we've already received...
+    if (seqLess(seq, tcb->recv.next)) {
+        packet->pull(tcb->recv.next - seq);
+        seq = tcb->recv.next;
+    }
+
+    // ...or which doesn't fit in the window (the FIN is accepted only if it fits)
+    if (packet->length() > windowEnd - seq) {
+        packet->trim(windowEnd - seq);
+        fin = false;
+    }
+
+    // When the pool runs low, data which would tie up another buffer is dropped (its ACK
+    // has been handled already) for the peer to send again. Each connection's share is
+    // bounded by its window, but the sum over many connections isn't, and otherwise
+    // sockets which nobody reads could leave no buffers for receiving ACKs.
+    size_t dataLen = packet->length();
+    if (dataLen > 0 && PacketBuffer::lowOnBuffers()) {
+        PacketBuffer* tail = tcb->recvQueue.back();
+        if (seq != tcb->recv.next || !tail || dataLen > tail->tailroom()) {
+            tcpSendAck(tcb);
+            return;
+        }
+    }
+
+    if (seq != tcb->recv.next) {
+        // It arrived after a gap. A FIN is dropped for the peer to send again, since a
+        // FIN can't be SACKed, and nothing can follow it anyway. The ACK is a duplicate,
+        // which tells the peer about the gap.
+        if (dataLen > 0) tcpQueueOutOfOrder(tcb, seq, packet);
+        tcpSendAck(tcb);
+        return;
+    }
 
+    // The header stays valid after the packet is queued, because readers can't consume
+    // it until we release the lock
     if (dataLen > 0) {
-        memcpy(tcb->recvBuffer + tcb->recvBufferUsed(), data, dataLen);
+        tcpQueueData(tcb, packet);
         tcb->recv.window -= dataLen;
+        tcb->recv.next += dataLen;
+
+        // This may fill a gap
+        tcpDrainOutOfOrder(tcb);
+        tcpMeasureRecvRtt(tcb);
         sys.scheduler().wakeThreads(tcb->dataAvailable);
     }
 
-    tcb->send.window = tcpHeader->windowSize();
-    tcb->send.unacked = tcpHeader->ackNum();
-    tcb->recv.next += dataLen;
-
     // If the other side is finished, continue acking this segment, and wait for the
     // local user to close the connection
-    if (tcpHeader->fin()) {
+    if (fin && tcb->recv.next == segmentEnd - 1) {
         tcb->state = TcpState::CLOSE_WAIT;
         tcb->recv.next++;  // ACK the FIN, which consumes one sequence number
+
+        // Readers can now see the end of the stream
+        sys.scheduler().wakeThreads(tcb->dataAvailable);
     }
 
     // If we get a simple ACK with no data and no FIN, then we don't need to reply
-    if (origDataLen == 0 && !tcpHeader->fin()) {
-        ASSERT(tcpHeader->ack());
-        return;
+    if (dataLen > 0 || fin) {
+        tcpSendAck(tcb);
     }
-
-    // Acknowledge the message
-    TcpHeader response;
-    response.setSourcePort(tcb->localPort);
-    response.setDestPort(tcb->remotePort);
-    response.setSeqNum(tcb->send.next);
-    response.setAckNum(tcb->recv.next);
-    response.setAck();
-    response.setWindowSize(tcb->recv.window);
-
-    response.fillChecksum(tcb->localIp, tcb->remoteIp, sizeof(TcpHeader));
-    ipSend(tcb->remoteIp, IpProtocol::Tcp, &response, sizeof(TcpHeader));
 }
 
-void tcpRecvFinWait2(TcpControlBlock* tcb, TcpHeader* tcpHeader, uint8_t* data,
-                     size_t dataLen);
+void tcpRecvFinWait2(TcpControlBlock* tcb, TcpHeader* tcpHeader,
+                     const TcpOptions& options, estd::unique_ptr<PacketBuffer>& packet);
 
-void tcpRecvFinWait1(TcpControlBlock* tcb, TcpHeader* tcpHeader, uint8_t* data,
-                     size_t dataLen) {
+void tcpRecvFinWait1(TcpControlBlock* tcb, TcpHeader* tcpHeader,
+                     const TcpOptions& options, estd::unique_ptr<PacketBuffer>& packet) {
     ASSERT(tcb->lock.isLocked());
-    ASSERT(tcpHeader->seqNum() == tcb->recv.next);
 
     if (tcpHeader->rst()) {
         tcbRemove(tcb);
         tcb->state = TcpState::CLOSED;
+        sys.scheduler().wakeThreads(tcb->dataAvailable);
         return;
     }
 
-    ASSERT(tcpHeader->ack());
-    ASSERT(tcpHeader->ackNum() == tcb->send.next);
+    if (!tcpProcessAck(tcb, tcpHeader, options, packet->length())) return;
 
-    tcb->state = TcpState::FIN_WAIT_2;
-    tcb->send.unacked = tcpHeader->ackNum();
-    tcb->send.window = tcpHeader->windowSize();
+    // Wait for the rest of the data and the FIN to be acknowledged
+    if (tcpFinAcked(tcb)) {
+        tcb->state = TcpState::FIN_WAIT_2;
+    }
 
     // The remote side can send the ACK and FIN in the same packet
     if (tcpHeader->fin()) {
-        tcpRecvFinWait2(tcb, tcpHeader, data, dataLen);
+        tcpRecvFinWait2(tcb, tcpHeader, options, packet);
     }
 }
 
-void tcpRecvFinWait2(TcpControlBlock* tcb, TcpHeader* tcpHeader, uint8_t*, size_t) {
+void tcpRecvFinWait2(TcpControlBlock* tcb, TcpHeader* tcpHeader,
+                     const TcpOptions&, estd::unique_ptr<PacketBuffer>&) {
     ASSERT(tcb->lock.isLocked());
-    ASSERT(tcpHeader->fin());
-    ASSERT(tcpHeader->seqNum() == tcb->recv.next);
 
-    tcb->state = TcpState::TIME_WAIT;
+    if (!tcpHeader->fin()) return;
+
+    // If the FINs crossed, ours still has to be acknowledged
+    if (tcb->state == TcpState::FIN_WAIT_2) {
+        tcb->state = TcpState::TIME_WAIT;
+    } else {
+        tcb->state = TcpState::CLOSING;
+    }
     tcb->recv.next++;  // FIN consumes one sequence number
 
+    // Nothing more is coming for anyone waiting to read
+    sys.scheduler().wakeThreads(tcb->dataAvailable);
+
     // Acknowledge the final FIN
-    TcpHeader response;
-    response.setSourcePort(tcb->localPort);
-    response.setDestPort(tcb->remotePort);
-    response.setSeqNum(tcb->send.next);
-    response.setAckNum(tcb->recv.next);
-    response.setAck();
-    response.setWindowSize(tcb->recv.window);
-    response.fillChecksum(tcb->localIp, tcb->remoteIp, sizeof(TcpHeader));
-    ipSend(tcb->remoteIp, IpProtocol::Tcp, &response, sizeof(TcpHeader));
-}
-
-void tcpRecvLastAck(TcpControlBlock* tcb, TcpHeader* tcpHeader, uint8_t*, size_t) {
+    tcpSendAck(tcb);
+}
+
+void tcpRecvClosing(TcpControlBlock* tcb, TcpHeader* tcpHeader,
+                    const TcpOptions& options, estd::unique_ptr<PacketBuffer>& packet) {
     ASSERT(tcb->lock.isLocked());
-    ASSERT(tcpHeader->ack());
-    ASSERT(tcpHeader->seqNum() == tcb->recv.next);
-    ASSERT(tcpHeader->ackNum() == tcb->send.next);
 
-    // Connection is closed, listen for a new connection
-    tcb->state = TcpState::CLOSED;
+    if (!tcpProcessAck(tcb, tcpHeader, options, packet->length())) return;
+
+    if (tcpFinAcked(tcb)) {
+        tcb->state = TcpState::TIME_WAIT;
+    }
+}
+
+void tcpRecvLastAck(TcpControlBlock* tcb, TcpHeader* tcpHeader,
+                    const TcpOptions& options, estd::unique_ptr<PacketBuffer>& packet) {
+    ASSERT(tcb->lock.isLocked());
+
+    if (!tcpProcessAck(tcb, tcpHeader, options, packet->length())) return;
+
+    // Connection is closed once our FIN is acknowledged
+    if (tcpFinAcked(tcb)) {
+        tcb->state = TcpState::CLOSED;
+        sys.scheduler().wakeThreads(tcb->sendSpaceAvailable);
+    }
 }
 
-void tcpRecvSynSent(TcpControlBlock* tcb, TcpHeader* tcpHeader, uint8_t*, size_t) {
+void tcpRecvSynSent(TcpControlBlock* tcb, IpHeader* ipHeader, TcpHeader* tcpHeader,
+                    const TcpOptions& options, estd::unique_ptr<PacketBuffer>&) {
     ASSERT(tcb->lock.isLocked());
-    ASSERT(tcpHeader->syn());
-    ASSERT(tcpHeader->ack());
-    ASSERT(tcpHeader->ackNum() == tcb->send.next);
+
+    // Only our SYN can be acknowledged so far
+    if (tcpHeader->ack() && tcpHeader->ackNum() != tcb->send.next) {
+        if (!tcpHeader->rst()) tcpSendReset(ipHeader, tcpHeader);
+        return;
+    }
+
+    // A RST is only believed if it acknowledges our SYN
+    if (tcpHeader->rst()) {
+        if (tcpHeader->ack()) tcpAbortHandshake(tcb, -ECONNREFUSED);
+        return;
+    }
+
+    // TODO: simultaneous open (a SYN without an ACK)
+    if (!tcpHeader->syn() || !tcpHeader->ack()) return;
 
     // Finish initializing the control block
     tcb->state = TcpState::SYN_RECEIVED;
-    tcb->send.window = tcpHeader->windowSize();
+    tcb->send.unacked = tcpHeader->ackNum();
+    tcb->send.window = tcpHeader->windowSize();  // not scaled in a SYN
     tcb->irs = tcpHeader->seqNum();
     tcb->recv.next = tcb->irs + 1;  // SYN consumes one sequence number
+    tcpNegotiateOptions(tcb, options);
+    tcpStopSynTimer(tcb);
 
     // Reply with ACK
-    TcpHeader response;
-    response.setSourcePort(tcb->localPort);
-    response.setDestPort(tcb->remotePort);
-    response.setSeqNum(tcb->send.next);
-    response.setAckNum(tcb->recv.next);
-    response.setAck();
-    response.setWindowSize(tcb->recv.window);
-    response.fillChecksum(tcb->localIp, tcb->remoteIp, sizeof(TcpHeader));
-    ipSend(tcb->remoteIp, IpProtocol::Tcp, &response, sizeof(TcpHeader));
+    tcpSendAck(tcb);
 
     tcb->state = TcpState::ESTABLISHED;
     sys.scheduler().wakeThreads(tcb->connectionEstablished);
 }
 
-void tcpRecv(IpHeader* ipHeader, uint8_t* buffer, size_t size) {
-    if (size < sizeof(TcpHeader)) {
+void tcpRecv(IpHeader* ipHeader, estd::unique_ptr<PacketBuffer> packet) {
+    if (packet->length() < sizeof(TcpHeader)) {
         return;
     }
 
-    TcpHeader* tcpHeader = reinterpret_cast<TcpHeader*>(buffer);
-    if (tcpHeader->dataOffset() * 4 > size) return;
-    if (!tcpHeader->verifyChecksum(ipHeader)) return;
+    TcpHeader* tcpHeader = reinterpret_cast<TcpHeader*>(packet->data());
+    if (tcpHeader->dataOffset() * 4 < sizeof(TcpHeader) ||
+        tcpHeader->dataOffset() * 4 > packet->length()) {
+        return;
+    }
+    if (!(packet->checksums() & PacketBuffer::CHECKSUM_TCP) &&
+        !tcpHeader->verifyChecksum(ipHeader))
+        return;
 
     TcpControlBlock* tcb =
         tcbLookup(tcpHeader->destPort(), ipHeader->sourceIp(), tcpHeader->sourcePort());
     if (!tcb) return;
 
-    size_t headerSize = tcpHeader->dataOffset() * 4;
-    uint8_t* data = buffer + headerSize;
-    size_t dataLen = size - headerSize;
+    // From here on, the packet's data is the payload
+    TcpOptions options;
+    tcpHeader->parseOptions(options);
+    packet->pull(tcpHeader->dataOffset() * 4);
+
+    TcpState state = tcb->state;
+    bool synchronized = state != TcpState::LISTEN && state != TcpState::SYN_SENT &&
+                        state != TcpState::CLOSED;
+
+    // A timestamp older than the last one recorded means that the segment is an old
+    // duplicate, possibly from before the sequence numbers wrapped around (PAWS). Like
+    // sequence numbers, timestamps are compared modulo 2^32.
+    // TODO: tsRecent goes stale after 24 days without a segment
+    if (synchronized && tcb->timestamps && options.hasTimestamps) {
+        if (!tcpHeader->rst() && seqLess(options.timestampValue, tcb->tsRecent)) {
+            if (state != TcpState::SYN_RECEIVED) tcpSendAck(tcb);
+            tcb->lock.unlock();
+            return;
+        }
+
+        if (seqLessEqual(tcpHeader->seqNum(), tcb->lastAckSent)) {
+            tcb->tsRecent = options.timestampValue;
+        }
+    }
+
+    // Only ESTABLISHED holds on to segments which arrive early. In the other states
+    // after the handshake, anything out of sequence is dropped, with an ACK in case it's
+    // being resent because our ACK was lost.
+    bool inOrderOnly = synchronized && state != TcpState::ESTABLISHED;
+    if (inOrderOnly && tcpHeader->seqNum() != tcb->recv.next) {
+        if (state != TcpState::SYN_RECEIVED && !tcpHeader->rst()) tcpSendAck(tcb);
+        tcb->lock.unlock();
+        return;
+    }
 
     switch (tcb->state) {
         case TcpState::LISTEN:
-            tcpRecvListen(tcb, ipHeader, tcpHeader, data, dataLen);
+            tcpRecvListen(tcb, ipHeader, tcpHeader, options, packet);
             break;
 
         case TcpState::SYN_RECEIVED:
-            tcpRecvSynReceived(tcb, tcpHeader, data, dataLen);
+            tcpRecvSynReceived(tcb, ipHeader, tcpHeader, options, packet);
             break;
 
         case TcpState::ESTABLISHED:
-            tcpRecvEstablished(tcb, tcpHeader, data, dataLen);
+            tcpRecvEstablished(tcb, tcpHeader, options, packet);
             break;
 
         case TcpState::FIN_WAIT_1:
-            tcpRecvFinWait1(tcb, tcpHeader, data, dataLen);
+            tcpRecvFinWait1(tcb, tcpHeader, options, packet);
             break;
 
         case TcpState::FIN_WAIT_2:
-            tcpRecvFinWait2(tcb, tcpHeader, data, dataLen);
+            tcpRecvFinWait2(tcb, tcpHeader, options, packet);
             break;
 
         case TcpState::LAST_ACK:
-            tcpRecvLastAck(tcb, tcpHeader, data, dataLen);
+            tcpRecvLastAck(tcb, tcpHeader, options, packet);
             break;
 
         case TcpState::SYN_SENT:
-            tcpRecvSynSent(tcb, tcpHeader, data, dataLen);
+            tcpRecvSynSent(tcb, ipHeader, tcpHeader, options, packet);
             break;
 
-        case TcpState::CLOSED:
         case TcpState::CLOSE_WAIT:
+            // Nothing more is coming, but what we send is still being acknowledged
+            tcpProcessAck(tcb, tcpHeader, options, packet->length());
+            break;
+
         case TcpState::CLOSING:
+            tcpRecvClosing(tcb, tcpHeader, options, packet);
+            break;
+
+        case TcpState::CLOSED:
         case TcpState::TIME_WAIT:
             // Ignore
             break;
@@ -582,12 +1946,11 @@ void tcpRecv(IpHeader* ipHeader, uint8_t* buffer, size_t size) {
 }
 
 //// High-level kernel-mode API
-bool tcpWaitForConnection(TcpHandle handle) {
+int tcpWaitForConnection(TcpHandle handle) {
     TcpControlBlock* tcb = tcbLookup(handle);
-    if (!tcb) return false;
+    if (!tcb) return -ENOTCONN;
 
     while (true) {
-        // TODO: add a timeout
         switch (tcb->state) {
             case TcpState::SYN_SENT:
             case TcpState::SYN_RECEIVED:
@@ -598,12 +1961,14 @@ bool tcpWaitForConnection(TcpHandle handle) {
             case TcpState::ESTABLISHED:
             case TcpState::CLOSE_WAIT:
                 tcb->lock.unlock();
-                return true;
+                return 0;
 
-            default:
+            default: {
                 // Error: connection is closed or closing
+                int error = tcb->error != 0 ? tcb->error : -ECONNREFUSED;
                 tcb->lock.unlock();
-                return false;
+                return error;
+            }
         }
     }
 }
@@ -644,16 +2009,21 @@ bool tcpBind(TcpHandle handle, IpAddress sourceIp, uint16_t sourcePort) {
     return tcb->localPort != 0;
 }
 
-TcpHandle tcpAccept(TcpHandle handle) {
+int tcpAccept(TcpHandle handle, TcpHandle& childHandle, bool nonBlocking) {
     TcpControlBlock* tcb = tcbLookup(handle);
-    if (!tcb) return InvalidTcpHandle;
+    if (!tcb) return -EINVAL;
 
     if (tcb->state != TcpState::LISTEN) {
         tcb->lock.unlock();
-        return InvalidTcpHandle;
+        return -EINVAL;
     }
 
     while (tcb->backlogSize == 0) {
+        if (nonBlocking) {
+            tcb->lock.unlock();
+            return -EAGAIN;
+        }
+
         sys.scheduler().sleepThread(tcb->connectionPending, &tcb->lock);
     }
 
@@ -661,24 +2031,38 @@ TcpHandle tcpAccept(TcpHandle handle) {
     ASSERT(tcb->pendingConnections);
     TcpControlBlock* tcbChild = tcb->pendingConnections;
     tcb->pendingConnections = tcbChild->next;
+    tcbChild->parent = nullptr;
     --tcb->backlogSize;
 
     tcb->lock.unlock();
 
     // Add the child to the main list
-    TcpHandle childHandle = tcbChild->handle;
+    childHandle = tcbChild->handle;
     tcbInsert(tcbChild);
 
-    return childHandle;
+    return 0;
 }
 
-bool tcpConnect(TcpHandle handle, IpAddress destIp, uint16_t destPort) {
+int tcpConnect(TcpHandle handle, IpAddress destIp, uint16_t destPort) {
     TcpControlBlock* tcb = tcbLookup(handle);
-    if (!tcb) return false;
+    if (!tcb) return -EINVAL;
 
-    if (tcb->state != TcpState::CLOSED) {
-        tcb->lock.unlock();
-        return false;
+    switch (tcb->state) {
+        case TcpState::CLOSED:
+            break;
+
+        case TcpState::SYN_SENT:
+        case TcpState::SYN_RECEIVED:
+            tcb->lock.unlock();
+            return -EALREADY;
+
+        case TcpState::LISTEN:
+            tcb->lock.unlock();
+            return -EINVAL;
+
+        default:
+            tcb->lock.unlock();
+            return -EISCONN;
     }
 
     // Initialize the control block
@@ -686,7 +2070,7 @@ bool tcpConnect(TcpHandle handle, IpAddress destIp, uint16_t destPort) {
         auto sourceIp = findRouteSourceIp(destIp);
         if (!sourceIp) {
             tcb->lock.unlock();
-            return false;
+            return -ENETUNREACH;
         }
 
         tcb->localIp = *sourceIp;
@@ -695,28 +2079,30 @@ bool tcpConnect(TcpHandle handle, IpAddress destIp, uint16_t destPort) {
         tcb->localPort = acquireEphemeralPort();
         if (tcb->localPort == 0) {
             tcb->lock.unlock();
-            return false;
+            return -EADDRNOTAVAIL;
         }
     }
     tcb->remoteIp = destIp;
     tcb->remotePort = destPort;
 
-    // Send the initial SYN
-    TcpHeader header;
-    header.setSourcePort(tcb->localPort);
-    header.setDestPort(tcb->remotePort);
-    header.setSeqNum(tcb->send.next);
-    header.setSyn();
-    header.setWindowSize(tcb->recv.window);
-    header.fillChecksum(tcb->localIp, tcb->remoteIp, sizeof(TcpHeader));
+    // Send the initial SYN, offering every option we support (see tcpNegotiateOptions)
+    tcb->sackPermitted = true;
+    tcb->timestamps = true;
+    tcb->recv.windowShift = TCP_WINDOW_SHIFT;
+    tcpSendSyn(tcb, false);
 
     tcb->state = TcpState::SYN_SENT;
     tcb->send.next++;  // SYN consumes one sequence number
-    tcb->lock.unlock();
+    tcb->send.max = tcb->send.next;
+    tcb->sendQueueSeq = tcb->send.next;
 
-    ipSend(destIp, IpProtocol::Tcp, &header, sizeof(TcpHeader));
+    // Sent again if there's no reply in time (see tcpRetransmitSyn)
+    tcb->synRetries = 0;
+    tcb->error = 0;
+    tcpStartRetransmitTimer(tcb);
+    tcb->lock.unlock();
 
-    return true;
+    return 0;
 }
 
 bool tcpListen(TcpHandle handle, int backlog) {
@@ -745,62 +2131,116 @@ bool tcpListen(TcpHandle handle, int backlog) {
     return true;
 }
 
-bool tcpSend(TcpHandle handle, const void* buffer, size_t size, bool push) {
+ssize_t tcpSend(TcpHandle handle, const void* buffer, size_t size, bool push,
+                bool nonBlocking) {
+    iovec iov = {const_cast<void*>(buffer), size};
+    return tcpSend(handle, &iov, 1, push, nonBlocking);
+}
+
+ssize_t tcpSend(TcpHandle handle, const iovec* iov, int iovcnt, bool push,
+                bool nonBlocking) {
+    size_t size = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+        size += iov[i].iov_len;
+    }
+
+    // Position in the iovec array of the next byte to send
+    int index = 0;
+    size_t offset = 0;
+    size_t sent = 0;
+
     TcpControlBlock* tcb = tcbLookup(handle);
-    if (!tcb) return false;
+    if (!tcb) return -EPIPE;
 
-    bool ready = false;
-    while (!ready) {
+    // Returns once the data is in the send queue, not when it's acknowledged
+    while (sent < size) {
         // TODO: add a timeout
         switch (tcb->state) {
             case TcpState::SYN_SENT:
             case TcpState::SYN_RECEIVED:
                 // Wait for the connection to be established
+                if (nonBlocking) {
+                    tcb->lock.unlock();
+                    return -EAGAIN;
+                }
+
                 sys.scheduler().sleepThread(tcb->connectionEstablished, &tcb->lock);
-                break;
+                continue;
 
             case TcpState::ESTABLISHED:
             case TcpState::CLOSE_WAIT:
-                // Send the data now
-                ready = true;
                 break;
 
             default:
                 // Error: connection is closed or closing
                 tcb->lock.unlock();
-                return false;
+                return sent > 0 ? sent : -EPIPE;
         }
-    }
 
-    size_t packetSize = sizeof(TcpHeader) + size;
-    uint8_t* packet = new uint8_t[packetSize];
+        size_t space = TcpControlBlock::SEND_BUFFER_SIZE - tcb->sendQueueBytes;
+        if (space == 0) {
+            // Get what's already queued moving before waiting for it to be acknowledged
+            tcpTransmit(tcb);
 
-    // Construct the header
-    TcpHeader* tcpHeader = new (packet) TcpHeader;
-    tcpHeader->setSourcePort(tcb->localPort);
-    tcpHeader->setDestPort(tcb->remotePort);
-    tcpHeader->setSeqNum(tcb->send.next);
-    tcpHeader->setAckNum(tcb->recv.next);
-    tcpHeader->setAck();
-    if (push) tcpHeader->setPsh();
-    tcpHeader->setWindowSize(tcb->recv.window);
+            if (nonBlocking) {
+                tcb->lock.unlock();
+                return sent > 0 ? sent : -EAGAIN;
+            }
 
-    // Copy the payload into the packet
-    memcpy(tcpHeader->data(), buffer, size);
-    tcpHeader->fillChecksum(tcb->localIp, tcb->remoteIp, packetSize);
+            sys.scheduler().sleepThread(tcb->sendSpaceAvailable, &tcb->lock);
+            continue;
+        }
 
-    tcb->send.next += size;
-    tcb->lock.unlock();
+        // Fill each chunk up to the MSS, regardless of how the data is split up between
+        // buffers or writes, so that each one can go out as a full-sized segment
+        auto& queue = tcb->sendQueue;
+        uint32_t mss = tcb->congestion.mss;
+        if (queue.empty() || queue.back()->length() >= mss) {
+            // Out of packet buffers: keep whatever has been queued so far
+            auto packet = PacketBuffer::create(0);
+            if (!packet) {
+                tcb->pushPending = push;
+                tcpTransmit(tcb);
+                tcb->lock.unlock();
+                return sent > 0 ? sent : -ENOBUFS;
+            }
 
-    // Will block until sent (may have to wait for ARP resolution)
-    ipSend(tcb->remoteIp, IpProtocol::Tcp, packet, packetSize);
+            queue.push_back(estd::shared_ptr<PacketBuffer>(packet.release()));
+        }
 
-    return true;
+        PacketBuffer* chunk = queue.back().get();
+        size_t chunkSize = min(size - sent, space);
+        chunkSize = min<size_t>(chunkSize, mss - chunk->length());
+        uint8_t* dest = chunk->put(chunkSize);
+
+        size_t copied = 0;
+        while (copied < chunkSize) {
+            size_t count = min(iov[index].iov_len - offset, chunkSize - copied);
+            memcpy(dest + copied, static_cast<uint8_t*>(iov[index].iov_base) + offset,
+                   count);
+            copied += count;
+            offset += count;
+
+            if (offset == iov[index].iov_len) {
+                ++index;
+                offset = 0;
+            }
+        }
+
+        tcb->sendQueueBytes += chunkSize;
+        sent += chunkSize;
+    }
+
+    tcb->pushPending = push;
+    tcpTransmit(tcb);
+
+    tcb->lock.unlock();
+    return sent;
 }
 
-ssize_t tcpRecv(TcpHandle handle, void* buffer, size_t size) {
+ssize_t tcpRecv(TcpHandle handle, void* buffer, size_t size, bool nonBlocking) {
     TcpControlBlock* tcb = tcbLookup(handle);
-    if (!tcb) return -1;
+    if (!tcb) return -ENOTCONN;
 
     bool ready = false;
     while (!ready) {
@@ -810,7 +2250,12 @@ ssize_t tcpRecv(TcpHandle handle, void* buffer, size_t size) {
             case TcpState::SYN_SENT:
             case TcpState::SYN_RECEIVED:
                 // Wait for the connection to be established
-                sys.timer().sleep(1, &tcb->lock);
+                if (nonBlocking) {
+                    tcb->lock.unlock();
+                    return -EAGAIN;
+                }
+
+                sys.scheduler().sleepThread(tcb->connectionEstablished, &tcb->lock);
                 break;
 
             case TcpState::ESTABLISHED:
@@ -819,8 +2264,11 @@ ssize_t tcpRecv(TcpHandle handle, void* buffer, size_t size) {
                 // Wait until we receive a push or the recv window is full
                 if (!tcb->recvBufferEmpty()) {
                     ready = true;
+                } else if (nonBlocking) {
+                    tcb->lock.unlock();
+                    return -EAGAIN;
                 } else {
-                    sys.timer().sleep(1, &tcb->lock);
+                    sys.scheduler().sleepThread(tcb->dataAvailable, &tcb->lock);
                 }
                 break;
 
@@ -837,41 +2285,93 @@ ssize_t tcpRecv(TcpHandle handle, void* buffer, size_t size) {
             default:
                 // Error: connection is closed or closing
                 tcb->lock.unlock();
-                return -1;
+                return -ENOTCONN;
         }
     }
 
-    // Copy the data from the receive buffer to the caller's buffer
-    size_t readSize = min<size_t>(size, tcb->recvBufferUsed());
-    memcpy(buffer, tcb->recvBuffer, readSize);
+    // Copy straight from the received packets to the caller's buffer, freeing each one
+    // once it's been read completely
+    uint8_t* dest = static_cast<uint8_t*>(buffer);
+    size_t readSize = 0;
+    while (readSize < size && !tcb->recvQueue.empty()) {
+        PacketBuffer* packet = tcb->recvQueue.front();
+        size_t count = min<size_t>(size - readSize, packet->length());
+        memcpy(dest + readSize, packet->data(), count);
+        packet->pull(count);
+        readSize += count;
+
+        if (packet->length() == 0) {
+            tcb->recvQueue.popFront();
+        }
+    }
 
-    // Shift the remaining data to the front of the buffer
-    memcpy(tcb->recvBuffer, tcb->recvBuffer + readSize, tcb->recvBufferUsed() - readSize);
     uint32_t prevWindow = tcb->recv.window;
     tcb->recv.window += readSize;
+    tcpTuneRecvBuffer(tcb, readSize);
 
     // If moving from a zero (or near-zero) window to a non-zero window, send a window
     // update to the remote side
-    if ((prevWindow < 1500 && tcb->recv.window >= 1500) ||
+    if ((prevWindow < TCP_MSS && tcb->recv.window >= TCP_MSS) ||
         (prevWindow == 0 && tcb->recv.window > 0)) {
-        TcpHeader header;
-        header.setSourcePort(tcb->localPort);
-        header.setDestPort(tcb->remotePort);
-        header.setSeqNum(tcb->send.next);
-        header.setAckNum(tcb->recv.next);
-        header.setAck();
-        header.setWindowSize(tcb->recv.window);
-        header.fillChecksum(tcb->localIp, tcb->remoteIp, sizeof(TcpHeader));
-        tcb->lock.unlock();
-
-        ipSend(tcb->remoteIp, IpProtocol::Tcp, &header, sizeof(TcpHeader));
-    } else {
-        tcb->lock.unlock();
+        tcpSendAck(tcb);
     }
 
+    tcb->lock.unlock();
     return readSize;
 }
 
+uint32_t tcpPoll(TcpHandle handle) {
+    TcpControlBlock* tcb = tcbLookup(handle);
+    if (!tcb) return EPOLLERR | EPOLLHUP;
+
+    uint32_t events = 0;
+    switch (tcb->state) {
+        case TcpState::LISTEN:
+            if (tcb->backlogSize > 0) events |= EPOLLIN;
+            break;
+
+        case TcpState::SYN_SENT:
+        case TcpState::SYN_RECEIVED:
+            break;
+
+        case TcpState::ESTABLISHED:
+            if (!tcb->sendBufferFull()) events |= EPOLLOUT;
+            if (!tcb->recvBufferEmpty()) events |= EPOLLIN;
+            break;
+
+        case TcpState::FIN_WAIT_1:
+        case TcpState::FIN_WAIT_2:
+            if (!tcb->recvBufferEmpty()) events |= EPOLLIN;
+            break;
+
+        case TcpState::CLOSE_WAIT:
+            // Reads return end-of-file once the buffer is drained, so never block
+            events |= EPOLLIN | EPOLLRDHUP;
+            if (!tcb->sendBufferFull()) events |= EPOLLOUT;
+            break;
+
+        default:
+            events |= EPOLLHUP;
+            break;
+    }
+
+    tcb->lock.unlock();
+    return events;
+}
+
+void tcpPollBlockers(TcpHandle handle,
+                     estd::vector<estd::shared_ptr<Blocker>>& blockers) {
+    TcpControlBlock* tcb = tcbLookup(handle);
+    if (!tcb) return;
+
+    blockers.push_back(tcb->connectionEstablished);
+    blockers.push_back(tcb->dataAvailable);
+    blockers.push_back(tcb->connectionPending);
+    blockers.push_back(tcb->sendSpaceAvailable);
+
+    tcb->lock.unlock();
+}
+
 bool tcpClose(TcpHandle handle) {
     TcpControlBlock* tcb = tcbLookup(handle);
     if (!tcb) return false;
@@ -898,26 +2398,16 @@ bool tcpClose(TcpHandle handle) {
             return false;
     }
 
-    // Send a FIN and transition state to wait for remote side
-    TcpHeader header;
-    header.setSourcePort(tcb->localPort);
-    header.setDestPort(tcb->remotePort);
-    header.setSeqNum(tcb->send.next);
-    header.setAckNum(tcb->recv.next);
-    header.setAck();
-    header.setFin();
-    header.setWindowSize(tcb->recv.window);
-    header.fillChecksum(tcb->localIp, tcb->remoteIp, sizeof(TcpHeader));
-
+    // The FIN goes out once everything queued before it has been sent
     if (tcb->state == TcpState::SYN_RECEIVED || tcb->state == TcpState::ESTABLISHED) {
         tcb->state = TcpState::FIN_WAIT_1;
     } else {
         tcb->state = TcpState::LAST_ACK;
     }
-    tcb->send.next++;  // FIN consumes one sequence number
-    tcb->lock.unlock();
 
-    ipSend(tcb->remoteIp, IpProtocol::Tcp, &header, sizeof(TcpHeader));
+    tcb->finQueued = true;
+    tcpTransmit(tcb);
+    tcb->lock.unlock();
 
     return true;
 }
@@ -932,6 +2422,32 @@ IpAddress tcpRemoteIp(TcpHandle handle) {
     return result;
 }
 
+int tcpSetCongestionControl(TcpHandle handle, const char* name, size_t nameLen) {
+    auto congestionControl = createCongestionControl(name, nameLen);
+    if (!congestionControl) return -ENOENT;
+
+    TcpControlBlock* tcb = tcbLookup(handle);
+    if (!tcb) return -ENOTCONN;
+
+    tcb->congestionControl = estd::move(congestionControl);
+
+    tcb->lock.unlock();
+    return 0;
+}
+
+int tcpSetDropInterval(TcpHandle handle, int n) {
+    if (n < 0) return -EINVAL;
+
+    TcpControlBlock* tcb = tcbLookup(handle);
+    if (!tcb) return -ENOTCONN;
+
+    tcb->dropInterval = n;
+    tcb->dataSegments = 0;
+
+    tcb->lock.unlock();
+    return 0;
+}
+
 uint16_t tcpRemotePort(TcpHandle handle) {
     TcpControlBlock* tcb = tcbLookup(handle);
     if (!tcb) return 0;
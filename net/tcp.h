@@ -1,11 +1,57 @@
 #pragma once
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include "estd/memory.h"
+#include "estd/vector.h"
+
+struct Blocker;
 struct IpAddress;
 struct IpHeader;
 class NetworkInterface;
+class PacketBuffer;
+
+// Option kinds
+enum : uint8_t {
+    TCP_OPTION_END = 0,
+    TCP_OPTION_NOP = 1,
+    TCP_OPTION_MSS = 2,
+    TCP_OPTION_WINDOW_SCALE = 3,
+    TCP_OPTION_SACK_PERMITTED = 4,
+    TCP_OPTION_SACK = 5,
+    TCP_OPTION_TIMESTAMPS = 8,
+};
+
+// The options we understand, as parsed from a header
+struct TcpOptions {
+    // Only on a SYN: the largest segment the sender can receive, or zero if not given
+    uint16_t mss = 0;
+
+    // Only on a SYN: the sender will shift the window fields of later segments left by
+    // windowScale (RFC 7323)
+    bool hasWindowScale = false;
+    uint8_t windowScale = 0;
+
+    // Sent on a SYN to say that SACK options may be used (RFC 2018)
+    bool sackPermitted = false;
+
+    // The sender's clock when it sent the segment, and the most recent value it has
+    // received from us (RFC 7323)
+    bool hasTimestamps = false;
+    uint32_t timestampValue = 0;
+    uint32_t timestampEcho = 0;
+
+    // Ranges of data the peer has received beyond the acknowledged point, as
+    // [start, end). There's only room for three alongside timestamps.
+    static constexpr size_t MAX_SACK_BLOCKS = 4;
+    struct {
+        uint32_t start;
+        uint32_t end;
+    } sackBlocks[MAX_SACK_BLOCKS];
+    size_t sackBlockCount = 0;
+};
 
 class __attribute__((packed)) TcpHeader {
     uint16_t _sourcePort;
@@ -33,6 +79,10 @@ public:
     bool verifyChecksum(IpHeader* ipHeader);
     void fillChecksum(IpAddress srcIp, IpAddress destIp, size_t totalLen);
 
+    // Stores just the sum of the pseudo-header, for the rest to be added by the device
+    // (see PacketBuffer::CHECKSUM_TCP)
+    void fillPseudoHeaderChecksum(IpAddress srcIp, IpAddress destIp, size_t totalLen);
+
     uint16_t sourcePort();
     uint16_t destPort();
     uint32_t seqNum();
@@ -51,6 +101,11 @@ public:
     uint16_t urgentPointer();
     uint8_t* data();
 
+    // The options follow the fixed part of the header, up to the data offset
+    uint8_t* options();
+    size_t optionsLength();
+    void parseOptions(TcpOptions& options);
+
     void setSourcePort(uint16_t value);
     void setDestPort(uint16_t value);
     void setSeqNum(uint32_t value);
@@ -73,22 +128,51 @@ static_assert(sizeof(TcpHeader) == 20);
 
 // Low-level API
 void tcpInit();
-void tcpRecv(IpHeader* ipHeader, uint8_t* buffer, size_t size);
+
+// Starts the kernel thread which runs the retransmission timers. Needs the scheduler and
+// the timer.
+void tcpStartTimer();
+
+// Takes ownership of the segment, so that its payload can be queued for the reader
+// without being copied
+void tcpRecv(IpHeader* ipHeader, estd::unique_ptr<PacketBuffer> packet);
 
 // High-level kernel-mode API
 using TcpHandle = uint64_t;
 static constexpr TcpHandle InvalidTcpHandle = 0;
 
-bool tcpWaitForConnection(TcpHandle handle);
+// Returns 0 once the handshake finishes, or a negative errno value if it fails (e.g.,
+// -ETIMEDOUT if the peer never replies)
+int tcpWaitForConnection(TcpHandle handle);
 
 TcpHandle tcpOpen();
 bool tcpBind(TcpHandle handle, IpAddress sourceIp, uint16_t sourcePort);
-bool tcpConnect(TcpHandle handle, IpAddress destIp, uint16_t destPort);
-TcpHandle tcpAccept(TcpHandle handle);
 bool tcpListen(TcpHandle handle, int backlog);
-bool tcpSend(TcpHandle handle, const void* buffer, size_t size, bool push = false);
-ssize_t tcpRecv(TcpHandle handle, void* buffer, size_t size);
+
+// Sends the SYN without waiting for the handshake (see tcpWaitForConnection). Returns 0
+// or a negative errno value.
+int tcpConnect(TcpHandle handle, IpAddress destIp, uint16_t destPort);
+
+// These return negative errno values on failure, and -EAGAIN instead of sleeping if
+// nonBlocking is set
+int tcpAccept(TcpHandle handle, TcpHandle& childHandle, bool nonBlocking = false);
+ssize_t tcpSend(TcpHandle handle, const void* buffer, size_t size, bool push = false,
+                bool nonBlocking = false);
+ssize_t tcpSend(TcpHandle handle, const iovec* iov, int iovcnt, bool push = false,
+                bool nonBlocking = false);
+ssize_t tcpRecv(TcpHandle handle, void* buffer, size_t size, bool nonBlocking = false);
 bool tcpClose(TcpHandle handle);
 
 IpAddress tcpRemoteIp(TcpHandle handle);
+
+// Selects the congestion control algorithm by name: "newreno" (the default) or "cubic".
+// Returns 0 or a negative errno value.
+int tcpSetCongestionControl(TcpHandle handle, const char* name, size_t nameLen);
+
+// For testing: drops every nth data segment sent on the connection, or none if n is 0
+int tcpSetDropInterval(TcpHandle handle, int n);
+
+// Readiness for epoll, as EPOLL* flags, and the blockers which are woken when it changes
+uint32_t tcpPoll(TcpHandle handle);
+void tcpPollBlockers(TcpHandle handle, estd::vector<estd::shared_ptr<Blocker>>& blockers);
 uint16_t tcpRemotePort(TcpHandle handle);
@@ -0,0 +1,147 @@
+#include "net/tcp_congestion.h"
+
+#include <string.h>
+
+#include "klibc.h"
+
+// Grows the window by one segment per round trip, and halves it on loss (RFC 5681)
+class NewRenoCongestionControl : public TcpCongestionControl {
+public:
+    const char* name() const override { return "newreno"; }
+
+    void congestionAvoidance(TcpCongestionWindow& window, uint32_t acked, uint64_t,
+                             uint64_t) override {
+        // Count acknowledged bytes, rather than ACKs, so that delayed ACKs don't slow the
+        // growth down (RFC 3465)
+        _bytesAcked += acked;
+        if (_bytesAcked >= window.cwnd) {
+            _bytesAcked -= window.cwnd;
+            window.cwnd += window.mss;
+        }
+    }
+
+    uint32_t lossThreshold(const TcpCongestionWindow& window,
+                           uint32_t flightSize) override {
+        _bytesAcked = 0;
+        return max(flightSize / 2, 2 * window.mss);
+    }
+
+private:
+    uint32_t _bytesAcked = 0;
+};
+
+// Returns the largest integer whose cube is at most x
+static uint64_t cubeRoot(uint64_t x) {
+    uint64_t low = 0;
+    uint64_t high = 1 << 21;
+    while (low < high) {
+        uint64_t mid = (low + high + 1) / 2;
+        if (mid * mid * mid <= x) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
+
+    return low;
+}
+
+// Grows the window as a cubic function of the time since the last loss, centered on the
+// window at which it happened, so that it climbs back quickly, probes carefully around
+// the old maximum, and then accelerates again (RFC 8312). The window never grows more
+// slowly than NewReno's would. Computed in integers, since the kernel doesn't use the
+// FPU: C = 0.4 and beta = 0.7 become the ratios below.
+class CubicCongestionControl : public TcpCongestionControl {
+public:
+    const char* name() const override { return "cubic"; }
+
+    void congestionAvoidance(TcpCongestionWindow& window, uint32_t acked, uint64_t srtt,
+                             uint64_t now) override {
+        if (_epochStart == 0) {
+            startEpoch(window, now);
+        }
+
+        // Aim for the value of the cubic function one round trip from now
+        uint64_t t = (now - _epochStart + srtt) / NS_PER_MS;
+        uint64_t delta = min(t > _k ? t - _k : _k - t, MAX_DELTA_MS);
+
+        // C * delta^3, converted from segments per cubic second to bytes
+        uint64_t offset = delta * delta * delta / 10000000 * 4 * window.mss / 1000;
+        uint64_t target = t > _k ? _wMax + offset : _wMax - min<uint64_t>(offset, _wMax);
+
+        // The window NewReno would have reached in the same time, given the smaller cut
+        // on loss: it grows by 3 * (1 - beta) / (1 + beta) = 9/17 segments per round trip
+        _wEst += static_cast<uint64_t>(window.mss) * acked * 9 / (17 * window.cwnd);
+        target = max(target, _wEst);
+
+        if (target > window.cwnd) {
+            _growth += (target - window.cwnd) * acked;
+        } else {
+            // Grow very slowly while at the plateau
+            _growth += window.mss * acked / 100;
+        }
+
+        // Apply the growth in whole bytes, carrying the remainder over
+        uint64_t increase = _growth / window.cwnd;
+        _growth -= increase * window.cwnd;
+        window.cwnd += increase;
+    }
+
+    uint32_t lossThreshold(const TcpCongestionWindow& window, uint32_t) override {
+        // If the window didn't get back up to the last maximum, the available bandwidth
+        // is shrinking: release some of it to other flows (fast convergence)
+        if (window.cwnd < _wMax) {
+            _wMax = window.cwnd * 17 / 20;
+        } else {
+            _wMax = window.cwnd;
+        }
+
+        _epochStart = 0;
+        return max(window.cwnd * 7 / 10, 2 * window.mss);
+    }
+
+private:
+    static constexpr uint64_t NS_PER_MS = 1000000;
+
+    // Keeps delta cubed from overflowing
+    static constexpr uint64_t MAX_DELTA_MS = 1000000;
+
+    void startEpoch(const TcpCongestionWindow& window, uint64_t now) {
+        _epochStart = now;
+        _growth = 0;
+        _wEst = window.cwnd;
+
+        // K is the time it takes to climb back to the last maximum, in ms:
+        // cbrt((wMax - cwnd) / C), with the difference in segments
+        if (window.cwnd < _wMax) {
+            uint64_t milliSegments = (_wMax - window.cwnd) * 1000 / window.mss;
+            _k = cubeRoot(milliSegments * 2500000);
+        } else {
+            _wMax = window.cwnd;
+            _k = 0;
+        }
+    }
+
+    // Window size at the last loss, in bytes
+    uint64_t _wMax = 0;
+
+    // When the current period of growth began (0 until the first ACK after a loss), and
+    // how long it takes to reach _wMax, in ms
+    uint64_t _epochStart = 0;
+    uint64_t _k = 0;
+
+    // Estimate of NewReno's window, and growth which hasn't been applied yet
+    uint64_t _wEst = 0;
+    uint64_t _growth = 0;
+};
+
+estd::unique_ptr<TcpCongestionControl> createCongestionControl(const char* name,
+                                                               size_t nameLen) {
+    if (nameLen == strlen("newreno") && strncmp(name, "newreno", nameLen) == 0) {
+        return estd::unique_ptr<TcpCongestionControl>(new NewRenoCongestionControl);
+    } else if (nameLen == strlen("cubic") && strncmp(name, "cubic", nameLen) == 0) {
+        return estd::unique_ptr<TcpCongestionControl>(new CubicCongestionControl);
+    }
+
+    return estd::unique_ptr<TcpCongestionControl>();
+}
@@ -0,0 +1,41 @@
+// Congestion avoidance algorithms for TCP
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "estd/memory.h"
+
+// The congestion state of a connection, in bytes. cwnd limits how much can be in flight,
+// along with the peer's receive window.
+struct TcpCongestionWindow {
+    uint32_t mss;
+    uint32_t cwnd;
+    uint32_t ssthresh;
+};
+
+// Slow start, fast retransmit and fast recovery (RFC 5681 and RFC 6582) are the same for
+// every algorithm, and are handled by the TCP layer. An algorithm decides how the window
+// grows once it reaches ssthresh, and how far it's cut when a segment is lost.
+class TcpCongestionControl {
+public:
+    virtual ~TcpCongestionControl() = default;
+
+    virtual const char* name() const = 0;
+
+    // Called for each ACK of new data while cwnd >= ssthresh, outside of recovery. srtt
+    // and now are in nanoseconds.
+    virtual void congestionAvoidance(TcpCongestionWindow& window, uint32_t acked,
+                                     uint64_t srtt, uint64_t now) = 0;
+
+    // Called when a loss is detected, with flightSize bytes outstanding. Returns the new
+    // ssthresh.
+    virtual uint32_t lossThreshold(const TcpCongestionWindow& window,
+                                   uint32_t flightSize) = 0;
+};
+
+// The algorithm used by new connections
+static constexpr const char* TCP_DEFAULT_CONGESTION_CONTROL = "newreno";
+
+// Returns nullptr if no algorithm has that name
+estd::unique_ptr<TcpCongestionControl> createCongestionControl(const char* name,
+                                                               size_t nameLen);
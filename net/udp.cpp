@@ -9,6 +9,7 @@
 #include "net/dns.h"
 #include "net/ip.h"
 #include "net/network_interface.h"
+#include "net/packet_buffer.h"
 
 uint16_t UdpHeader::sourcePort() { return ntohs(_sourcePort); }
 uint16_t UdpHeader::destPort() { return ntohs(_destPort); }
@@ -48,36 +49,30 @@ void udpRecv(NetworkInterface* netif, IpHeader* ipHeader, uint8_t* buffer, size_
     }
 }
 
-void udpSend(IpAddress destIp, uint16_t sourcePort, uint16_t destPort, uint8_t* buffer,
-             uint8_t size) {
-    size_t totalSize = sizeof(UdpHeader) + size;
-    uint8_t* packet = new uint8_t[totalSize];
+// Builds a datagram in a new packet buffer, with room for the lower layers' headers
+static estd::unique_ptr<PacketBuffer> udpBuild(uint16_t sourcePort, uint16_t destPort,
+                                               uint8_t* buffer, uint8_t size) {
+    auto packet = PacketBuffer::create();
+    if (!packet) return packet;
 
-    UdpHeader* udpHeader = new (packet) UdpHeader;
+    UdpHeader* udpHeader = new (packet->put(sizeof(UdpHeader) + size)) UdpHeader;
     udpHeader->setSourcePort(sourcePort);
     udpHeader->setDestPort(destPort);
-    udpHeader->setLength(totalSize);
+    udpHeader->setLength(packet->length());
     udpHeader->setChecksum(0);
 
     memcpy(udpHeader->data(), buffer, size);
-    ipSend(destIp, IpProtocol::Udp, packet, totalSize);
+    return packet;
+}
 
-    delete[] packet;
+void udpSend(IpAddress destIp, uint16_t sourcePort, uint16_t destPort, uint8_t* buffer,
+             uint8_t size) {
+    auto packet = udpBuild(sourcePort, destPort, buffer, size);
+    if (packet) ipSend(destIp, IpProtocol::Udp, estd::move(packet));
 }
 
 void udpBroadcast(NetworkInterface* netif, uint16_t sourcePort, uint16_t destPort,
                   uint8_t* buffer, uint8_t size) {
-    size_t totalSize = sizeof(UdpHeader) + size;
-    uint8_t* packet = new uint8_t[totalSize];
-
-    UdpHeader* udpHeader = new (packet) UdpHeader;
-    udpHeader->setSourcePort(sourcePort);
-    udpHeader->setDestPort(destPort);
-    udpHeader->setLength(totalSize);
-    udpHeader->setChecksum(0);
-
-    memcpy(udpHeader->data(), buffer, size);
-    ipBroadcast(netif, IpProtocol::Udp, packet, totalSize);
-
-    delete[] packet;
+    auto packet = udpBuild(sourcePort, destPort, buffer, size);
+    if (packet) ipBroadcast(netif, IpProtocol::Udp, estd::move(packet));
 }
@@ -2,15 +2,11 @@
 
 #include <string.h>
 
+#include "klibc.h"
 #include "mm.h"
+#include "processor.h"
 #include "system.h"
 
-// Page map flags
-constexpr uint64_t PAGE_PRESENT = 1 << 0;
-constexpr uint64_t PAGE_WRITABLE = 1 << 1;
-constexpr uint64_t PAGE_USER = 1 << 2;
-constexpr uint64_t PAGE_SIZE_FLAG = 1 << 7;
-
 template <typename F>
 static void mapPageImpl(MemoryManager& mm, PhysicalAddress pml4, VirtualAddress virtAddr,
                         PhysicalAddress physAddr, int pageSize, uint64_t flags,
@@ -29,6 +25,10 @@ static void mapPageImpl(MemoryManager& mm, PhysicalAddress pml4, VirtualAddress
     // The virtual address must be page-aligned
     ASSERT(virtAddr.pageOffset() == 0);
 
+    // The page tables above the final entry only restrict access to user mode. Write
+    // and execute permissions are set in the final entry.
+    uint64_t tableFlags = PAGE_PRESENT | PAGE_WRITABLE | (flags & PAGE_USER);
+
     // The pointer to the current page map level (PML4, PDP, PD, PT), starting
     // with PML4
     PageMapEntry* pml = mm.physicalToVirtual(pml4).ptr<PageMapEntry>();
@@ -47,10 +47,10 @@ static void mapPageImpl(MemoryManager& mm, PhysicalAddress pml4, VirtualAddress
 
             // Point the correct entry in the PML4 to the new PDP and mark it
             // present and writable
-            entry = PageMapEntry(pmlNextPhysAddr, PAGE_PRESENT | PAGE_WRITABLE | flags);
+            entry = PageMapEntry(pmlNextPhysAddr, tableFlags);
             pml[index] = entry;
         } else {
-            ASSERT(entry.hasFlags(PAGE_PRESENT | PAGE_WRITABLE | flags));
+            ASSERT(entry.hasFlags(tableFlags));
         }
 
         // Advance to the next level
@@ -64,7 +64,7 @@ static void mapPageImpl(MemoryManager& mm, PhysicalAddress pml4, VirtualAddress
     // We can't remap existing pages yet
     ASSERT(!pml[index]);
 
-    PageMapEntry entry(physAddr, PAGE_PRESENT | PAGE_WRITABLE | flags);
+    PageMapEntry entry(physAddr, PAGE_PRESENT | flags);
     if (pageSize > 0) {
         entry.setFlags(PAGE_SIZE_FLAG);
     }
@@ -74,7 +74,8 @@ static void mapPageImpl(MemoryManager& mm, PhysicalAddress pml4, VirtualAddress
 
 void KernelAddressSpace::mapPage(VirtualAddress virtAddr, PhysicalAddress physAddr,
                                  int pageSize, uint64_t flags) {
-    mapPageImpl(_mm, _pml4, virtAddr, physAddr, pageSize, flags, [](PhysicalAddress) {});
+    mapPageImpl(_mm, _pml4, virtAddr, physAddr, pageSize, PAGE_WRITABLE | flags,
+                [](PhysicalAddress) {});
 }
 
 VirtualAddress KernelAddressSpace::physicalToVirtual(PhysicalAddress physAddr) {
@@ -144,8 +145,15 @@ UserAddressSpace::~UserAddressSpace() {
 }
 
 void UserAddressSpace::mapPage(VirtualAddress virtAddr, PhysicalAddress physAddr,
-                               int pageSize) {
-    mapPageImpl(mm, _pml4, virtAddr, physAddr, pageSize, PAGE_USER,
+                               int pageSize, uint64_t flags) {
+    ASSERT((flags & ~(PAGE_WRITABLE | PAGE_NO_EXECUTE)) == 0);
+
+    // The NX bit is reserved unless it's been enabled
+    if (!Processor::hasNoExecute()) {
+        flags &= ~PAGE_NO_EXECUTE;
+    }
+
+    mapPageImpl(mm, _pml4, virtAddr, physAddr, pageSize, PAGE_USER | flags,
                 [this](PhysicalAddress page) { _allocatedPages.push_back(page); });
 }
 
@@ -157,6 +165,12 @@ void UserAddressSpace::mapPages(VirtualAddress virtAddr, PhysicalAddress physAdd
     }
 }
 
+void UserAddressSpace::reserve(VirtualAddress end) {
+    if (_nextUserAddress.value < end.value) {
+        _nextUserAddress = roundUp(end.value, PAGE_SIZE);
+    }
+}
+
 VirtualAddress UserAddressSpace::vmalloc(size_t pageCount) {
     VirtualAddress virtAddr = _nextUserAddress;
     _nextUserAddress += pageCount * PAGE_SIZE;
@@ -10,6 +10,13 @@
 #include "estd/vector.h"
 #include "units.h"
 
+// Page map flags
+constexpr uint64_t PAGE_PRESENT = 1 << 0;
+constexpr uint64_t PAGE_WRITABLE = 1 << 1;
+constexpr uint64_t PAGE_USER = 1 << 2;
+constexpr uint64_t PAGE_SIZE_FLAG = 1 << 7;
+constexpr uint64_t PAGE_NO_EXECUTE = 1UL << 63;  // Ignored if the CPU doesn't support NX
+
 struct PageMapEntry {
     PageMapEntry() : raw(0) {}
     PageMapEntry(PhysicalAddress addr) : raw(addr.value) {}
@@ -20,16 +27,16 @@ struct PageMapEntry {
     }
 
     operator bool() const { return raw != 0; }
-    PhysicalAddress addr() const { return clearLowBits(raw, 12); }
-    uint64_t flags() const { return lowBits(raw, 12); }
+    PhysicalAddress addr() const { return clearLowBits(lowBits(raw, 52), 12); }
+    uint64_t flags() const { return lowBits(raw, 12) | (raw & PAGE_NO_EXECUTE); }
 
     void setFlags(uint64_t flags) {
-        ASSERT(flags == lowBits(flags, 12));
+        ASSERT((flags & ~PAGE_NO_EXECUTE) == lowBits(flags, 12));
         raw |= flags;
     }
 
     bool hasFlags(uint64_t flags) {
-        ASSERT(flags == lowBits(flags, 12));
+        ASSERT((flags & ~PAGE_NO_EXECUTE) == lowBits(flags, 12));
         return (raw & flags) == flags;
     }
 
@@ -71,14 +78,23 @@ class UserAddressSpace {
 public:
     ~UserAddressSpace();
 
-    void mapPage(VirtualAddress virtAddr, PhysicalAddress physAddr, int pageSize = 0);
+    // flags may include PAGE_WRITABLE and PAGE_NO_EXECUTE. User pages are always
+    // readable.
+    void mapPage(VirtualAddress virtAddr, PhysicalAddress physAddr, int pageSize = 0,
+                 uint64_t flags = PAGE_WRITABLE);
     void mapPages(VirtualAddress virtAddr, PhysicalAddress physAddr, size_t count);
 
     PhysicalAddress pml4() const { return _pml4; }
     VirtualAddress userMapBase() const { return _userMapBase; }
 
+    // Usermode addresses all fall within a single pml4 entry, from userMapBase
+    static constexpr uint64_t USER_SPACE_SIZE = 512 * GiB;
+
     VirtualAddress vmalloc(size_t pageCount);
 
+    // Makes sure that vmalloc never hands out addresses below end
+    void reserve(VirtualAddress end);
+
 private:
     UserAddressSpace(KernelAddressSpace& kaddr, PhysicalAddress pml4);
 
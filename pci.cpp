@@ -197,6 +197,16 @@ PCIDevice* PCIDevices::findByClass(PCIDeviceClass classCode) {
     return nullptr;
 }
 
+PCIDevice* PCIDevices::findById(uint16_t vendorId, uint16_t deviceId) {
+    for (auto* device : _devices) {
+        if (device->vendorId() == vendorId && device->deviceId() == deviceId) {
+            return device;
+        }
+    }
+
+    return nullptr;
+}
+
 PCIDevices::PCIDevices() {
     findAllDevices();
     println("pci: init complete");
@@ -84,6 +84,7 @@ class PCIDevices {
 public:
     const estd::vector<PCIDevice*>& devices() { return _devices; }
     PCIDevice* findByClass(PCIDeviceClass classCode);
+    PCIDevice* findById(uint16_t vendorId, uint16_t deviceId);
 
 private:
     friend class System;
@@ -0,0 +1,103 @@
+#include "pipe.h"
+
+#include "api/errno.h"
+#include "api/fcntl.h"
+#include "system.h"
+
+using PipeRing = SpscRingBuffer<uint8_t, Pipe::CAPACITY>;
+
+Pipe::Pipe() : dataAvailable(new Blocker), spaceAvailable(new Blocker) {}
+
+void Pipe::wake(const estd::shared_ptr<Blocker>& blocker) {
+    // Taking the lock waits out a thread which has made its final check of the ring, but
+    // isn't asleep yet
+    SpinlockLocker locker(_waitLock);
+    sys.scheduler().wakeThreads(blocker);
+}
+
+ssize_t Pipe::read(OpenFileDescription& fd, void* buffer, size_t count) {
+    if (count == 0) return 0;
+
+    MutexLocker locker(_readLock);
+    uint8_t* dest = static_cast<uint8_t*>(buffer);
+
+    while (true) {
+        bool wasFull;
+        size_t bytesRead = _ring.pop(dest, count, wasFull);
+        if (bytesRead > 0) {
+            if (wasFull) wake(spaceAvailable);
+            return bytesRead;
+        }
+
+        // End of file once the writer is gone and everything it wrote has been read. The
+        // ring is checked again because the last write may have landed after the pop.
+        if (_writerClosed.load()) {
+            if (_ring.empty()) return 0;
+            continue;
+        }
+
+        if (fd.flags & O_NONBLOCK) {
+            return -EAGAIN;
+        }
+
+        SpinlockLocker waitLocker(_waitLock);
+        PipeRing::waitBarrier();
+        if (_ring.empty() && !_writerClosed.load()) {
+            sys.scheduler().sleepThread(dataAvailable, &_waitLock);
+        }
+    }
+}
+
+ssize_t Pipe::write(OpenFileDescription& fd, const void* buffer, size_t count) {
+    MutexLocker locker(_writeLock);
+    const uint8_t* src = static_cast<const uint8_t*>(buffer);
+
+    size_t written = 0;
+    while (written < count) {
+        // Report the error only if nothing was transferred
+        if (_readerClosed.load()) {
+            return written > 0 ? static_cast<ssize_t>(written) : -EPIPE;
+        }
+
+        bool wasEmpty;
+        size_t bytesWritten = _ring.push(src + written, count - written, wasEmpty);
+        written += bytesWritten;
+
+        if (wasEmpty) wake(dataAvailable);
+        if (bytesWritten > 0) continue;
+
+        if (fd.flags & O_NONBLOCK) {
+            return written > 0 ? static_cast<ssize_t>(written) : -EAGAIN;
+        }
+
+        SpinlockLocker waitLocker(_waitLock);
+        PipeRing::waitBarrier();
+        if (_ring.full() && !_readerClosed.load()) {
+            sys.scheduler().sleepThread(spaceAvailable, &_waitLock);
+        }
+    }
+
+    return written;
+}
+
+uint32_t Pipe::readEvents() {
+    uint32_t events = 0;
+    if (!_ring.empty()) events |= EPOLLIN;
+    if (_writerClosed.load()) events |= EPOLLIN | EPOLLHUP;
+    return events;
+}
+
+uint32_t Pipe::writeEvents() {
+    if (_readerClosed.load()) return EPOLLERR;
+    return _ring.full() ? 0 : EPOLLOUT;
+}
+
+void Pipe::closeReader() {
+    _readerClosed.store(true);
+    wake(spaceAvailable);
+}
+
+void Pipe::closeWriter() {
+    _writerClosed.store(true);
+    wake(dataAvailable);
+}
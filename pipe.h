@@ -0,0 +1,96 @@
+// Unidirectional byte streams between processes
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "estd/atomic.h"
+#include "estd/memory.h"
+#include "estd/ring_buffer.h"
+#include "estd/vector.h"
+#include "file.h"
+#include "mutex.h"
+#include "scheduler.h"
+#include "spinlock.h"
+#include "units.h"
+
+// The buffer shared by the two ends of a pipe. The writing end produces into a lock-free
+// ring and the reading end consumes from it, so data moves without either side taking a
+// lock. A side sleeps only when the ring is empty (for readers) or full (for writers),
+// and is woken by the other side only when it makes the transition away from that state.
+//
+// Concurrent readers are serialized by _readLock, and writers by _writeLock, so that the
+// ring only ever sees one producer and one consumer. Holding _writeLock for a whole write
+// also keeps writes from different processes from interleaving.
+class Pipe {
+public:
+    static constexpr size_t CAPACITY = PAGE_SIZE;
+
+    Pipe();
+
+    ssize_t read(OpenFileDescription& fd, void* buffer, size_t count);
+    ssize_t write(OpenFileDescription& fd, const void* buffer, size_t count);
+
+    uint32_t readEvents();
+    uint32_t writeEvents();
+
+    // Called when the last reference to either end goes away
+    void closeReader();
+    void closeWriter();
+
+    // Woken when the ring becomes non-empty or the writer closes
+    estd::shared_ptr<Blocker> dataAvailable;
+
+    // Woken when the ring becomes non-full or the reader closes
+    estd::shared_ptr<Blocker> spaceAvailable;
+
+private:
+    void wake(const estd::shared_ptr<Blocker>& blocker);
+
+    SpscRingBuffer<uint8_t, CAPACITY> _ring;
+
+    Mutex _readLock;
+    Mutex _writeLock;
+
+    // Only taken to sleep and to wake, so that a wakeup can't slip in between a final
+    // check of the ring and going to sleep
+    Spinlock _waitLock;
+
+    AtomicBool _readerClosed;
+    AtomicBool _writerClosed;
+};
+
+struct PipeReader : public File {
+    PipeReader(const estd::shared_ptr<Pipe>& pipe) : pipe(pipe) {}
+    ~PipeReader() { pipe->closeReader(); }
+
+    ssize_t read(OpenFileDescription& fd, void* buffer, size_t count) override {
+        return pipe->read(fd, buffer, count);
+    }
+
+    ssize_t write(OpenFileDescription&, const void*, size_t) override { return -EBADF; }
+
+    uint32_t pollEvents() override { return pipe->readEvents(); }
+    void pollBlockers(estd::vector<estd::shared_ptr<Blocker>>& blockers) override {
+        blockers.push_back(pipe->dataAvailable);
+    }
+
+    estd::shared_ptr<Pipe> pipe;
+};
+
+struct PipeWriter : public File {
+    PipeWriter(const estd::shared_ptr<Pipe>& pipe) : pipe(pipe) {}
+    ~PipeWriter() { pipe->closeWriter(); }
+
+    ssize_t read(OpenFileDescription&, void*, size_t) override { return -EBADF; }
+
+    ssize_t write(OpenFileDescription& fd, const void* buffer, size_t count) override {
+        return pipe->write(fd, buffer, count);
+    }
+
+    uint32_t pollEvents() override { return pipe->writeEvents(); }
+    void pollBlockers(estd::vector<estd::shared_ptr<Blocker>>& blockers) override {
+        blockers.push_back(pipe->spaceAvailable);
+    }
+
+    estd::shared_ptr<Pipe> pipe;
+};
@@ -1,9 +1,13 @@
 #include "process.h"
 
+#include <string.h>
+
 #include "api/errno.h"
+#include "api/fcntl.h"
+#include "epoll.h"
+#include "estd/print.h"
 #include "estd/utility.h"
 #include "file.h"
-#include "fs/ext2.h"
 #include "klibc.h"
 #include "mm.h"
 #include "page_map.h"
@@ -19,13 +23,77 @@ void ProcessTable::init() {
     _instance = new ProcessTable;
 }
 
-Process* ProcessTable::create(const char* path, const char* argv[],
-                              uint32_t initialCwdIno) {
-    SpinlockLocker locker(_lock);
+estd::shared_ptr<Executable> ProcessTable::loadExecutable(Location location) {
+    FileInfo info;
+    int result = location.fs->stat(location.ino, info);
+    if (result < 0) {
+        println("exec: failed to stat executable: {}", result);
+        return {};
+    } else if (info.isDirectory) {
+        println("exec: executable is a directory");
+        return {};
+    }
+
+    MutexLocker locker(_executablesLock);
+
+    for (size_t i = 0; i < _executables.size(); ++i) {
+        if (_executables[i]->location() != location) continue;
+
+        if (_executables[i]->version() == info.version) {
+            return _executables[i];
+        }
+
+        // The file has changed since it was loaded. Processes which are still running
+        // the old version keep their own reference to it.
+        estd::swap(_executables[i], _executables.back());
+        _executables.pop_back();
+        break;
+    }
+
+    estd::shared_ptr<Executable> executable = Executable::load(location, info);
+    if (!executable) {
+        return {};
+    }
+
+    if (_executables.size() >= MAX_CACHED_EXECUTABLES) {
+        for (size_t i = 0; i < _executables.size(); ++i) {
+            if (_executables[i].refCount() == 1) {
+                estd::swap(_executables[i], _executables.back());
+                _executables.pop_back();
+                break;
+            }
+        }
+    }
+
+    _executables.push_back(executable);
+    return executable;
+}
+
+Process* ProcessTable::create(Location location, const char* path, const char* argv[],
+                              Location initialCwd, Process* parent) {
+    // Loading the executable may block on disk I/O, so it can't be done while holding a
+    // spinlock
+    estd::shared_ptr<Executable> executable = loadExecutable(location);
+    if (!executable) {
+        return nullptr;
+    }
+
+    pid_t pid;
+    {
+        SpinlockLocker locker(_lock);
+        pid = _nextPid++;
+    }
 
-    Process* process = new Process(_nextPid++, path, argv, initialCwdIno);
-    // TODO: write an emplace_back function for vector
-    _processes.push_back(estd::move(estd::unique_ptr<Process>(process)));
+    Process* process = new Process(pid, executable, path, argv, initialCwd, parent);
+
+    {
+        SpinlockLocker locker(_lock);
+        // TODO: write an emplace_back function for vector
+        _processes.push_back(estd::move(estd::unique_ptr<Process>(process)));
+    }
+
+    // Don't let the process run (and possibly exit) until it's in the table
+    sys.scheduler().startThread(process->thread.get());
     return process;
 }
 
@@ -76,32 +144,26 @@ int ProcessTable::waitProcess(pid_t pid) {
     return 0;
 }
 
-Process::Process(pid_t pid, const char* path, const char* argv[], uint32_t initialCwdIno)
-: pid(pid), cwdIno(initialCwdIno), exitBlocker(new Blocker) {
-    open(sys.terminal());  // stdin
-    open(sys.terminal());  // stdout
-    open(sys.terminal());  // stderr
-
-    // Look up the executable on disk
-    uint32_t ino = sys.fs().lookup(cwdIno, path);
-    ASSERT(ino != ext2::BAD_INO);
-    auto inode = sys.fs().readInode(ino);
-    ASSERT(inode);
-
-    // Allocate a fresh piece of page-aligned physical memory to store it
-    imagePagesCount = ceilDiv(inode->size(), PAGE_SIZE);
-    imagePages = mm.pageAlloc(imagePagesCount);
-    uint8_t* ptr = mm.physicalToVirtual(imagePages).ptr<uint8_t>();
-
-    // Read the executable from disk
-    if (!sys.fs().readFullFile(*inode, ptr)) {
-        panic("failed to read file");
+Process::Process(pid_t pid, const estd::shared_ptr<Executable>& executable,
+                 const char* path, const char* argv[], Location initialCwd,
+                 Process* parent)
+: pid(pid), cwd(initialCwd), exitBlocker(new Blocker), executable(executable) {
+    if (parent) {
+        // Only the standard streams are inherited, so that pipelines can be built by
+        // pointing them elsewhere before launching
+        for (int fd = STDIN_FILENO; fd <= STDERR_FILENO; ++fd) {
+            openFiles[fd] = parent->openFiles[fd];
+        }
+    } else {
+        open(sys.terminal());  // stdin
+        open(sys.terminal());  // stdout
+        open(sys.terminal());  // stderr
     }
 
-    // Create user address space and map the executable image into it
+    // Nothing is mapped yet: pages of the executable are mapped as they're touched. Leave
+    // room for the heap above the image before any stacks.
     addressSpace = mm.kaddressSpace().makeUserAddressSpace();
-    VirtualAddress entryPoint = addressSpace->userMapBase();
-    addressSpace->mapPages(entryPoint, imagePages, imagePagesCount);
+    addressSpace->reserve(executable->end() + MAX_HEAP_SIZE);
 
     // Find the program name by taking everything after the last slash
     const char* p = path;
@@ -112,12 +174,13 @@ Process::Process(pid_t pid, const char* path, const char* argv[], uint32_t initi
     }
     const char* programName = p;
 
-    thread = Thread::createUserThread(this, entryPoint, programName, argv);
-    sys.scheduler().startThread(thread.get());
+    thread = Thread::createUserThread(this, executable->entryPoint(), programName, argv);
 }
 
 Process::~Process() {
-    mm.pageFree(imagePages, imagePagesCount);
+    for (PhysicalAddress page : imagePages) {
+        mm.pageFree(page);
+    }
 
     if (heapPagesCount > 0) {
         mm.pageFree(heapPages, heapPagesCount);
@@ -133,11 +196,33 @@ void Process::createHeap(size_t size) {
     addressSpace->mapPages(heapStart(), heapPages, heapPagesCount);
 }
 
-int Process::open(const estd::shared_ptr<File>& file) {
+bool Process::handlePageFault(VirtualAddress addr, uint64_t errorCode) {
+    // Only missing pages can be filled in. Anything else is a protection violation.
+    static constexpr uint64_t PAGE_FAULT_PRESENT = 1 << 0;
+    if (errorCode & PAGE_FAULT_PRESENT) {
+        return false;
+    }
+
+    return executable->mapPage(*addressSpace, addr, imagePages);
+}
+
+bool Process::isWritableUserRange(const void* ptr, size_t size) const {
+    if (size == 0) return true;
+
+    uint64_t start = reinterpret_cast<uint64_t>(ptr);
+    uint64_t base = addressSpace->userMapBase().value;
+    if (start < base || size > UserAddressSpace::USER_SPACE_SIZE ||
+        start - base > UserAddressSpace::USER_SPACE_SIZE - size) {
+        return false;
+    }
+
+    return !executable->overlapsReadOnly(start, start + size);
+}
+
+int Process::allocateFd() {
     // Find next available fd
-    for (size_t i = 0; i < RLIMIT_NOFILE; ++i) {
+    for (int i = 0; i < RLIMIT_NOFILE; ++i) {
         if (!openFiles[i]) {
-            openFiles[i] = OpenFileDescription::create(file);
             return i;
         }
     }
@@ -145,15 +230,73 @@ int Process::open(const estd::shared_ptr<File>& file) {
     return -EMFILE;
 }
 
+int Process::open(const estd::shared_ptr<File>& file, int flags) {
+    int fd = allocateFd();
+    if (fd >= 0) {
+        openFiles[fd] = OpenFileDescription::create(file, flags);
+    }
+
+    return fd;
+}
+
+int Process::dup(int fd) {
+    if (fd < 0 || fd >= RLIMIT_NOFILE || !openFiles[fd]) {
+        return -EBADF;
+    }
+
+    int newFd = allocateFd();
+    if (newFd >= 0) {
+        openFiles[newFd] = openFiles[fd];
+    }
+
+    return newFd;
+}
+
+int Process::dup2(int fd, int newFd) {
+    if (fd < 0 || fd >= RLIMIT_NOFILE || !openFiles[fd]) {
+        return -EBADF;
+    } else if (newFd < 0 || newFd >= RLIMIT_NOFILE) {
+        return -EBADF;
+    }
+
+    if (newFd == fd) {
+        return newFd;
+    }
+
+    if (openFiles[newFd]) {
+        close(newFd);
+    }
+
+    openFiles[newFd] = openFiles[fd];
+    return newFd;
+}
+
 int Process::close(int fd) {
     if (fd < 0 || fd >= RLIMIT_NOFILE || !openFiles[fd]) {
         return -EBADF;
     }
 
+    // Closing a descriptor removes it from any epoll instances, as on Linux. Otherwise
+    // they would keep the file open indefinitely.
+    File* file = openFiles[fd]->file.get();
+    for (int i = 0; i < RLIMIT_NOFILE; ++i) {
+        if (openFiles[i] && openFiles[i]->file->isEpoll()) {
+            static_cast<EpollFile&>(*openFiles[i]->file).remove(fd, file);
+        }
+    }
+
     openFiles[fd].clear();
     return 0;
 }
 
+void Process::closeAll() {
+    for (int fd = 0; fd < RLIMIT_NOFILE; ++fd) {
+        if (openFiles[fd]) {
+            close(fd);
+        }
+    }
+}
+
 void Process::exit() {
     SpinlockLocker locker(lock);
     ASSERT(status == ProcessStatus::Exiting);
@@ -5,8 +5,10 @@
 
 #include "estd/memory.h"
 #include "estd/vector.h"
+#include "executable.h"
 #include "file.h"
-#include "fs/ext2.h"
+#include "fs/vfs.h"
+#include "mutex.h"
 #include "page_map.h"
 #include "scheduler.h"
 #include "spinlock.h"
@@ -32,11 +34,21 @@ private:
     static ProcessTable* _instance;
 
     Process* findProcess(pid_t pid);
-    Process* create(const char* path, const char* argv[], uint32_t initialCwdIno);
+    Process* create(Location location, const char* path, const char* argv[],
+                    Location initialCwd, Process* parent);
     void destroy(Process* process);
 
+    estd::shared_ptr<Executable> loadExecutable(Location location);
+
     Spinlock _lock;
 
+    // Executables which are running, or ran recently, so that launching them again
+    // doesn't need to read anything from the file. Executables which aren't in use are
+    // evicted when there are more than MAX_CACHED_EXECUTABLES.
+    static constexpr size_t MAX_CACHED_EXECUTABLES = 8;
+    Mutex _executablesLock;
+    estd::vector<estd::shared_ptr<Executable>> _executables;
+
     // TODO: we should store processes in a hash map for faster lookup by pid
     estd::vector<estd::unique_ptr<Process>> _processes;
     pid_t _nextPid = 1;
@@ -56,24 +68,38 @@ class Process {
 public:
     ~Process();
 
-    // Actually performed by ProcessTable, but access from Process for clarity
-    static Process* create(const char* path, const char* argv[],
-                           uint32_t initialCwdIno = ext2::ROOT_INO) {
-        return ProcessTable::the().create(path, argv, initialCwdIno);
+    // Actually performed by ProcessTable, but access from Process for clarity. location
+    // is the executable, which the caller has already looked up from path. Returns
+    // nullptr if the executable can't be loaded. The standard streams are inherited from
+    // parent if there is one, or else opened on the terminal.
+    static Process* create(Location location, const char* path, const char* argv[],
+                           Location initialCwd, Process* parent = nullptr) {
+        return ProcessTable::the().create(location, path, argv, initialCwd, parent);
     }
     static void destroy(Process* process) { ProcessTable::the().destroy(process); }
 
-    VirtualAddress heapStart() const {
-        return addressSpace->userMapBase() + imagePagesCount * PAGE_SIZE;
-    }
+    // Address space set aside between the end of the executable and the first stack
+    static constexpr size_t MAX_HEAP_SIZE = 64 * MiB;
+
+    VirtualAddress heapStart() const { return executable->end(); }
 
     size_t heapSize() const { return heapPagesCount * PAGE_SIZE; }
 
     void createHeap(size_t size);
 
+    // Called for page faults on user addresses while this process is running. Returns
+    // false if the fault can't be resolved.
+    bool handlePageFault(VirtualAddress addr, uint64_t errorCode);
+
+    // Checks that the kernel may write size bytes at ptr on behalf of this process: the
+    // range has to be in user space, and can't touch the read-only pages of the image,
+    // which are shared with every other process running it. With CR0.WP set, writing
+    // there would fault in kernel mode.
+    bool isWritableUserRange(const void* ptr, size_t size) const;
+
     pid_t pid;
-    estd::unique_ptr<OpenFileDescription> openFiles[RLIMIT_NOFILE] = {};
-    uint32_t cwdIno;
+    estd::shared_ptr<OpenFileDescription> openFiles[RLIMIT_NOFILE] = {};
+    Location cwd;
 
     // This spinlock should really protect everything, but for now it only protects status
     // updates
@@ -87,16 +113,26 @@ public:
     estd::unique_ptr<Thread> thread;
 
     // TODO: more flexible handling of process memory
-    PhysicalAddress imagePages;
-    uint64_t imagePagesCount;
+    estd::shared_ptr<Executable> executable;
+
+    // Pages of the executable image which belong to this process alone
+    estd::vector<PhysicalAddress> imagePages;
 
     PhysicalAddress heapPages = 0;
     uint64_t heapPagesCount = 0;
 
-    int open(const estd::shared_ptr<File>& file);
+    int open(const estd::shared_ptr<File>& file, int flags = 0);
     int close(int fd);
+    void closeAll();
+
+    // The new descriptor shares the open file description (including the offset and
+    // flags) with the old one
+    int dup(int fd);
+    int dup2(int fd, int newFd);
     void exit();
 
 private:
-    Process(pid_t pid, const char* path, const char* argv[], uint32_t initialCwdIno);
+    Process(pid_t pid, const estd::shared_ptr<Executable>& executable, const char* path,
+            const char* argv[], Location initialCwd, Process* parent);
+    int allocateFd();
 };
@@ -90,6 +90,7 @@ static_assert(sizeof(SegmentDescriptor) == 8);
 static GDTRegister gdtr;
 static SegmentDescriptor gdt[8];
 TaskStateSegment Processor::s_tss;
+bool Processor::s_noExecute;
 
 void Processor::initDescriptors() {
     // Clear the tss, and set the IOPB base address to the end of the TSS
@@ -122,6 +123,22 @@ void Processor::initDescriptors() {
 void Processor::init() {
     initDescriptors();
     checkFeatures();
+    enableNoExecute();
+}
+
+static constexpr uint64_t IA32_EFER = 0xC0000080;
+static constexpr uint64_t EFER_NXE = 1 << 11;
+
+void Processor::enableNoExecute() {
+    // Without this, bit 63 of a page table entry is reserved, and setting it would cause
+    // a page fault
+    if (!checkBit(cpuid(0x80000001).edx, 20)) {
+        println("cpu: no-execute pages not supported");
+        return;
+    }
+
+    wrmsr(IA32_EFER, rdmsr(IA32_EFER) | EFER_NXE);
+    s_noExecute = true;
 }
 
 void Processor::checkFeatures() {
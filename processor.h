@@ -58,6 +58,12 @@ public:
     static void halt() { asm volatile("hlt"); }
     static void pause() { asm volatile("pause"); }
 
+    static uint64_t rdtsc() {
+        uint32_t low, high;
+        asm volatile("rdtsc" : "=a"(low), "=d"(high));
+        return (static_cast<uint64_t>(high) << 32) | low;
+    }
+
     static void lidt(IDTRegister& idtr) { asm volatile("lidt %0" : : "m"(idtr)); }
     static void lgdt(GDTRegister& gdtr) { asm volatile("lgdt %0" : : "m"(gdtr)); }
     static void ltr(uint16_t selector) { asm volatile("ltr %0" : : "a"(selector)); }
@@ -86,6 +92,13 @@ public:
         asm volatile("movq %0, %%cr3" : : "r"(pml4.value) : "memory");
     }
 
+    // Holds the faulting address after a page fault
+    static VirtualAddress readCR2() {
+        uint64_t cr2;
+        asm volatile("movq %%cr2, %0" : "=r"(cr2));
+        return VirtualAddress(cr2);
+    }
+
     static void flushTLB() {
         asm volatile(
             "movq  %%cr3, %%rax\n\t"
@@ -112,6 +125,12 @@ public:
 
     static TaskStateSegment& tss() { return s_tss; }
 
+    // True once no-execute page protection has been enabled
+    static bool hasNoExecute() { return s_noExecute; }
+
 private:
+    static void enableNoExecute();
+
     static TaskStateSegment s_tss;
+    static bool s_noExecute;
 };
@@ -1,5 +1,16 @@
+# Pass --virtio or --ahci to attach the disk as a virtio block device or to an AHCI
+# controller, rather than to the IDE controller
+DISK="-drive file=build/diskimg,index=0,if=ide,format=raw"
+if [ "$1" = "--virtio" ]; then
+    DISK="-drive file=build/diskimg,if=virtio,format=raw"
+    shift
+elif [ "$1" = "--ahci" ]; then
+    DISK="-drive file=build/diskimg,if=none,id=disk0,format=raw -device ahci,id=ahci0 -device ide-hd,drive=disk0,bus=ahci0.0"
+    shift
+fi
+
 qemu-system-x86_64 \
-    -drive file=build/diskimg,index=0,if=ide,format=raw \
+    $DISK \
     -debugcon stdio \
     -m 5G \
     --no-reboot \
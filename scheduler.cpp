@@ -81,7 +81,7 @@ void Scheduler::start() {
     }
 }
 
-void Scheduler::onTimerInterrupt() {
+void Scheduler::preempt() {
     SpinlockLocker locker(_schedLock);
     yield();
 }
@@ -163,8 +163,9 @@ void Scheduler::sleepThread(const estd::shared_ptr<Blocker>& blocker, Spinlock*
     ASSERT(!inIrq());
     SpinlockLocker locker(_schedLock);
 
-    // We can't hold this lock while sleeping
-    if (lock) lock->unlock();
+    // We can't hold this lock while sleeping. Interrupts stay disabled (by _schedLock)
+    // until we're on the wait queue, so that a wakeup from an irq handler can't be lost.
+    if (lock) lock->unlock(false);
 
     for (size_t i = 0; i < runQueue.size(); ++i) {
         if (runQueue[i] != currentThread) continue;
@@ -215,4 +216,28 @@ void Scheduler::wakeThreadsLocked(const estd::shared_ptr<Blocker>& blocker) {
         waitQueue.pop_back();
         runQueue.push_back(thread);
     }
+
+    for (BlockerWatcher* watcher : blocker->watchers) {
+        watcher->triggered = true;
+        wakeThreadsLocked(watcher->blocker);
+    }
+}
+
+void Scheduler::watch(const estd::shared_ptr<Blocker>& blocker, BlockerWatcher* watcher) {
+    SpinlockLocker locker(_schedLock);
+    blocker->watchers.push_back(watcher);
+}
+
+void Scheduler::unwatch(const estd::shared_ptr<Blocker>& blocker,
+                        BlockerWatcher* watcher) {
+    SpinlockLocker locker(_schedLock);
+
+    estd::vector<BlockerWatcher*>& watchers = blocker->watchers;
+    for (size_t i = 0; i < watchers.size(); ++i) {
+        if (watchers[i] == watcher) {
+            watchers[i] = watchers.back();
+            watchers.pop_back();
+            return;
+        }
+    }
 }
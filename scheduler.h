@@ -10,6 +10,18 @@ struct Thread;
 extern "C" uint64_t currentKernelStack;
 extern "C" [[noreturn]] void enterContext(Thread* toThread);
 
+struct Blocker;
+
+// Registered with Scheduler::watch to hear about wakeups of other blockers, so that a
+// thread can wait for any one of several events (see epoll)
+struct BlockerWatcher {
+    // Woken in turn whenever a watched blocker is woken
+    estd::shared_ptr<Blocker> blocker;
+
+    // Set whenever a watched blocker is woken, and cleared by the owner
+    bool triggered = false;
+};
+
 // An opaque token whose identity represents a particular state that's blocking
 // some thread
 struct Blocker {
@@ -18,6 +30,9 @@ struct Blocker {
     // No copy / move
     Blocker(const Blocker&) = delete;
     Blocker& operator=(const Blocker&) = delete;
+
+    // Protected by the scheduler lock
+    estd::vector<BlockerWatcher*> watchers;
 };
 
 struct BlockedThread {
@@ -51,7 +66,13 @@ public:
     void wakeThreads(const estd::shared_ptr<Blocker>& blocker);
     void wakeThreadsLocked(const estd::shared_ptr<Blocker>& blocker);
 
-    void onTimerInterrupt();
+    // Adds or removes a watcher which is notified along with every wakeup of blocker
+    void watch(const estd::shared_ptr<Blocker>& blocker, BlockerWatcher* watcher);
+    void unwatch(const estd::shared_ptr<Blocker>& blocker, BlockerWatcher* watcher);
+
+    // Called on the way out of an irq whose handlers woke a thread (see irqEntry), so
+    // that it can run immediately rather than at the next timer tick
+    void preempt();
 
 private:
     void yield();
@@ -55,7 +55,7 @@ with open(f"{build_dir}/boot.bin", "rb") as fh:
     boot_data = bytearray(fh.read())
 
 with open(f"{build_dir}/kernel.bin", "rb") as fh:
-    kernel_data = fh.read()
+    kernel_data = bytearray(fh.read())
 
 with open(output_filename, "rb") as fh:
     mbr_data = fh.read(512)
@@ -70,11 +70,63 @@ def pad_to_sector_size(data):
     return data + bytearray(padding)
 
 
+def make_cpio_entry(name, data, mode):
+    name_data = name.encode() + b"\0"
+    fields = [0, mode, 0, 0, 1, 0, len(data), 0, 0, 0, 0, len(name_data), 0]
+    header = b"070701" + b"".join(b"%08X" % field for field in fields)
+
+    entry = header + name_data
+    entry += bytearray(-len(entry) % 4)
+    entry += data
+    entry += bytearray(-len(entry) % 4)
+    return entry
+
+
+# Pack the userland binaries into an initramfs archive (cpio "newc" format), which the
+# kernel mounts on /bin so that programs can be launched without any disk reads
+initramfs_data = bytearray()
+for filename in user_files:
+    with open(filename, "rb") as fh:
+        name = os.path.basename(filename).removesuffix(".bin")
+        initramfs_data += make_cpio_entry(name, fh.read(), 0o100755)
+
+initramfs_data += make_cpio_entry("TRAILER!!!", b"", 0)
+
+# The kernel finds the archive through two variables, which we fill in the same way as
+# the bootloader's disk address packet below
+kernel_start = 0x7E00
+initramfs_start_offset = None
+initramfs_size_offset = None
+symbols = capture(f"nm {build_dir}/kernel.elf")
+for line in symbols.splitlines():
+    fields = line.split()
+    if len(fields) != 3:
+        continue
+
+    address, kind, name = fields
+    if name == "initramfsStart":
+        initramfs_start_offset = int(address, base=16) - kernel_start
+    elif name == "initramfsSize":
+        initramfs_size_offset = int(address, base=16) - kernel_start
+
+assert initramfs_start_offset is not None and initramfs_size_offset is not None
+
+# The bootloader reads the archive along with the kernel, right after it in memory
 kernel_data = pad_to_sector_size(kernel_data)
+initramfs_start = kernel_start + len(kernel_data)
+kernel_data[initramfs_start_offset : initramfs_start_offset + 4] = struct.pack(
+    "I", initramfs_start
+)
+kernel_data[initramfs_size_offset : initramfs_size_offset + 4] = struct.pack(
+    "I", len(initramfs_data)
+)
+
+kernel_data = pad_to_sector_size(kernel_data + initramfs_data)
 
+# Everything has to fit below the bootloader's page tables at 0x7C000
 assert len(boot_data) == 512
 assert len(kernel_data) % 512 == 0
-assert len(boot_data) + len(kernel_data) < 1024 * 1024
+assert kernel_start + len(kernel_data) <= 0x7C000
 
 # Find the offset in the bootloader which holds the offset and size of the kernel
 dap_offset = None
@@ -109,6 +161,7 @@ with tempfile.TemporaryDirectory() as tmpdir:
     runcmd(f"mount {loop_filename}p1 {tmpdir}")
     os.mkdir(f"{tmpdir}/bin")
     os.mkdir(f"{tmpdir}/etc")
+    os.mkdir(f"{tmpdir}/tmp")
 
     try:
         for filename in user_files:
@@ -1,15 +1,23 @@
 #include "syscalls.h"
 
 #include <stdint.h>
+#include <string.h>
+#include <netinet/in.h>
 #include <sys/socket.h>
+#include <time.h>
 
 #include "api/errno.h"
+#include "api/fcntl.h"
 #include "api/syscalls.h"
+#include "block_queue.h"
+#include "epoll.h"
+#include "estd/buffer.h"
 #include "estd/print.h"
 #include "file.h"
-#include "fs/ext2_file.h"
+#include "fs/vfs.h"
 #include "klibc.h"
 #include "net/socket.h"
+#include "pipe.h"
 #include "process.h"
 #include "processor.h"
 #include "scheduler.h"
@@ -17,6 +25,7 @@
 #include "thread.h"
 #include "timer.h"
 #include "trap.h"
+#include "units.h"
 
 using SyscallHandler = int64_t (*)(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t,
                                    uint64_t);
@@ -28,6 +37,10 @@ ssize_t sys_read(int fd, void* buffer, size_t count) {
         return -EBADF;
     }
 
+    if (!process.isWritableUserRange(buffer, count)) {
+        return -EFAULT;
+    }
+
     OpenFileDescription& description = *process.openFiles[fd];
     File& file = *description.file;
     return file.read(description, buffer, count);
@@ -40,6 +53,10 @@ ssize_t sys_read_dir(int fd, void* buffer, size_t count) {
         return -EBADF;
     }
 
+    if (!process.isWritableUserRange(buffer, count)) {
+        return -EFAULT;
+    }
+
     OpenFileDescription& description = *process.openFiles[fd];
     File& file = *description.file;
     return file.readDir(description, buffer, count);
@@ -57,6 +74,193 @@ ssize_t sys_write(int fd, const void* buffer, size_t count) {
     return file.write(description, buffer, count);
 }
 
+// Checks the iovec array for readv and writev, whose total size must fit in an ssize_t
+static int validateIovecs(const iovec* iov, int iovcnt) {
+    if (iovcnt < 0 || iovcnt > IOV_MAX) {
+        return -EINVAL;
+    }
+
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+        if (iov[i].iov_len > INT64_MAX - total) {
+            return -EINVAL;
+        }
+
+        total += iov[i].iov_len;
+    }
+
+    return 0;
+}
+
+ssize_t sys_readv(int fd, const iovec* iov, int iovcnt) {
+    Process& process = *currentThread->process;
+
+    if (fd < 0 || fd >= RLIMIT_NOFILE || !process.openFiles[fd]) {
+        return -EBADF;
+    }
+
+    if (int result = validateIovecs(iov, iovcnt); result < 0) {
+        return result;
+    }
+
+    for (int i = 0; i < iovcnt; ++i) {
+        if (!process.isWritableUserRange(iov[i].iov_base, iov[i].iov_len)) {
+            return -EFAULT;
+        }
+    }
+
+    OpenFileDescription& description = *process.openFiles[fd];
+    File& file = *description.file;
+    return file.readv(description, iov, iovcnt);
+}
+
+ssize_t sys_writev(int fd, const iovec* iov, int iovcnt) {
+    Process& process = *currentThread->process;
+
+    if (fd < 0 || fd >= RLIMIT_NOFILE || !process.openFiles[fd]) {
+        return -EBADF;
+    }
+
+    if (int result = validateIovecs(iov, iovcnt); result < 0) {
+        return result;
+    }
+
+    OpenFileDescription& description = *process.openFiles[fd];
+    File& file = *description.file;
+    return file.writev(description, iov, iovcnt);
+}
+
+ssize_t sys_sendfile(int outFd, int inFd, off_t* offset, size_t count) {
+    Process& process = *currentThread->process;
+
+    if (outFd < 0 || outFd >= RLIMIT_NOFILE || !process.openFiles[outFd] || inFd < 0 ||
+        inFd >= RLIMIT_NOFILE || !process.openFiles[inFd]) {
+        return -EBADF;
+    }
+
+    OpenFileDescription& out = *process.openFiles[outFd];
+    OpenFileDescription& in = *process.openFiles[inFd];
+    if ((in.flags & O_ACCMODE) == O_WRONLY) {
+        return -EBADF;
+    } else if (offset && !process.isWritableUserRange(offset, sizeof(off_t))) {
+        return -EFAULT;
+    }
+
+    // With an explicit offset, the file offset of inFd is left alone
+    off_t position = offset ? *offset : in.offset;
+    if (position < 0) {
+        return -EINVAL;
+    }
+
+    // Send straight from the file if it knows how
+    ssize_t result = in.file->sendTo(position, count, *out.file, out);
+
+    // Otherwise, copy through a kernel buffer
+    if (result == -EINVAL) {
+        static constexpr size_t BUFFER_SIZE = 16 * KiB;
+        Buffer buffer(min(count, BUFFER_SIZE));
+
+        off_t savedOffset = in.offset;
+        in.offset = position;
+
+        result = 0;
+        while (static_cast<size_t>(result) < count) {
+            size_t chunk = min(count - result, buffer.size());
+            ssize_t bytesRead = in.file->read(in, buffer.get(), chunk);
+            if (bytesRead <= 0) {
+                if (result == 0) result = bytesRead;
+                break;
+            }
+
+            ssize_t bytesWritten = out.file->write(out, buffer.get(), bytesRead);
+            if (bytesWritten < 0) {
+                if (result == 0) result = bytesWritten;
+                break;
+            }
+
+            result += bytesWritten;
+            if (bytesWritten < bytesRead) break;
+        }
+
+        in.offset = savedOffset;
+    }
+
+    if (result > 0) {
+        if (offset) {
+            *offset += result;
+        } else {
+            in.offset += result;
+        }
+    }
+
+    return result;
+}
+
+int sys_epoll_create(int size) {
+    Process& process = *currentThread->process;
+
+    // The size is only a hint, but must be positive
+    if (size <= 0) {
+        return -EINVAL;
+    }
+
+    return process.open(estd::shared_ptr<File>(new EpollFile));
+}
+
+int sys_epoll_ctl(int epfd, int op, int fd, epoll_event* event) {
+    Process& process = *currentThread->process;
+
+    if (epfd < 0 || epfd >= RLIMIT_NOFILE || !process.openFiles[epfd] || fd < 0 ||
+        fd >= RLIMIT_NOFILE || !process.openFiles[fd]) {
+        return -EBADF;
+    }
+
+    File& epollFile = *process.openFiles[epfd]->file;
+    if (!epollFile.isEpoll() || fd == epfd) {
+        return -EINVAL;
+    }
+
+    if (op != EPOLL_CTL_DEL && !event) {
+        return -EINVAL;
+    }
+
+    EpollFile& epoll = static_cast<EpollFile&>(epollFile);
+    const estd::shared_ptr<File>& file = process.openFiles[fd]->file;
+
+    switch (op) {
+        case EPOLL_CTL_ADD:
+            return epoll.add(fd, file, *event);
+
+        case EPOLL_CTL_MOD:
+            return epoll.modify(fd, file.get(), *event);
+
+        case EPOLL_CTL_DEL:
+            return epoll.remove(fd, file.get());
+
+        default:
+            return -EINVAL;
+    }
+}
+
+int sys_epoll_wait(int epfd, epoll_event* events, int maxEvents, int timeout) {
+    Process& process = *currentThread->process;
+
+    if (epfd < 0 || epfd >= RLIMIT_NOFILE || !process.openFiles[epfd]) {
+        return -EBADF;
+    }
+
+    File& epollFile = *process.openFiles[epfd]->file;
+    if (!epollFile.isEpoll() || maxEvents <= 0) {
+        return -EINVAL;
+    } else if (!process.isWritableUserRange(events, maxEvents * sizeof(epoll_event))) {
+        return -EFAULT;
+    }
+
+    // The timeout is in milliseconds, and negative means forever
+    int64_t ticks = timeout < 0 ? -1 : Timer::millisecondsToTicks(timeout);
+    return static_cast<EpollFile&>(epollFile).wait(events, maxEvents, ticks);
+}
+
 pid_t sys_getpid() {
     Process& process = *currentThread->process;
     return process.pid;
@@ -66,6 +270,11 @@ pid_t sys_getpid() {
     println("proc: user process exited with status {}", status);
 
     Process& process = *currentThread->process;
+
+    // Close files now rather than when the process is reaped, so that (for example) the
+    // reader of a pipe sees end-of-file as soon as the writer exits
+    process.closeAll();
+
     {
         SpinlockLocker locker(process.lock);
         process.status = ProcessStatus::Exiting;
@@ -84,22 +293,39 @@ int64_t sys_sleep(int ticks) {
     return 0;
 }
 
-int64_t sys_open(const char* path, int /*oflag*/) {
-    // TODO: handle flags correctly
+int64_t sys_open(const char* path, int oflag) {
     Process& process = *currentThread->process;
 
-    uint32_t ino = sys.fs().lookup(process.cwdIno, path);
-    if (ino == ext2::BAD_INO) {
-        return -ENOENT;
+    Location location = sys.vfs().lookup(process.cwd, path);
+    if (!location) {
+        if (!(oflag & O_CREAT)) {
+            return -ENOENT;
+        }
+
+        // Create the file in whichever filesystem holds its parent directory
+        const char* name;
+        Location dir = sys.vfs().lookupParent(process.cwd, path, name);
+        if (!dir) {
+            return -ENOENT;
+        }
+
+        int64_t result = dir.fs->createFile(dir.ino, name, strlen(name));
+        if (result < 0) {
+            return result;
+        }
+
+        location = {dir.fs, static_cast<uint32_t>(result)};
+    } else if ((oflag & O_CREAT) && (oflag & O_EXCL)) {
+        return -EEXIST;
     }
 
-    auto inode = sys.fs().readInode(ino);
-    if (!inode) {
-        return -EIO;
+    estd::shared_ptr<File> file;
+    int result = location.fs->open(location.ino, oflag, file);
+    if (result < 0) {
+        return result;
     }
 
-    estd::shared_ptr<Ext2File> file(new Ext2File(sys.fs(), move(inode)));
-    return process.open(file);
+    return process.open(file, oflag);
 }
 
 int64_t sys_close(int fd) {
@@ -110,7 +336,16 @@ int64_t sys_close(int fd) {
 pid_t sys_launch(const char* path, const char* argv[]) {
     Process& process = *currentThread->process;
 
-    Process* child = Process::create(path, argv, process.cwdIno);
+    Location location = sys.vfs().lookup(process.cwd, path);
+    if (!location) {
+        return -ENOENT;
+    }
+
+    Process* child = Process::create(location, path, argv, process.cwd, &process);
+    if (!child) {
+        return -ENOEXEC;
+    }
+
     return child->pid;
 }
 
@@ -119,6 +354,8 @@ VirtualAddress sys_sbrk(intptr_t incr) {
 
     if (incr < 0) {
         return -EINVAL;
+    } else if (static_cast<size_t>(incr) > Process::MAX_HEAP_SIZE) {
+        return -ENOMEM;
     }
 
     if (incr > 0) {
@@ -130,28 +367,33 @@ VirtualAddress sys_sbrk(intptr_t incr) {
 
 int64_t sys_getcwd(char* buffer, size_t size) {
     Process& process = *currentThread->process;
-    return sys.fs().getPath(process.cwdIno, buffer, size);
+    if (!process.isWritableUserRange(buffer, size)) {
+        return -EFAULT;
+    }
+
+    return sys.vfs().getPath(process.cwd, buffer, size);
 }
 
 int64_t sys_chdir(const char* path) {
     Process& process = *currentThread->process;
 
-    uint32_t ino = sys.fs().lookup(process.cwdIno, path);
-    if (ino == ext2::BAD_INO) {
+    Location location = sys.vfs().lookup(process.cwd, path);
+    if (!location) {
         return -ENOENT;
     }
 
-    auto inode = sys.fs().readInode(ino);
-    if (!inode) {
-        return -EIO;
+    FileInfo info;
+    int result = location.fs->stat(location.ino, info);
+    if (result < 0) {
+        return result;
     }
 
-    if (!inode->isDirectory()) {
+    if (!info.isDirectory) {
         return -ENOTDIR;
     }
 
     // TODO: process needs a lock
-    process.cwdIno = ino;
+    process.cwd = location;
     return 0;
 }
 
@@ -165,12 +407,17 @@ int64_t sys_wait_pid(pid_t pid) {
 }
 
 int64_t sys_socket(int domain, int type, int protocol) {
-    // TODO: handle flags correctly
     Process& process = *currentThread->process;
 
     if (domain != AF_INET) return -EAFNOSUPPORT;
     if (protocol != 0) return -EPROTONOSUPPORT;
 
+    int flags = O_RDWR;
+    if (type & SOCK_NONBLOCK) {
+        flags |= O_NONBLOCK;
+        type &= ~SOCK_NONBLOCK;
+    }
+
     estd::shared_ptr<Socket> socket;
     if (type == SOCK_STREAM) {
         socket.assign(new TcpSocket);
@@ -180,7 +427,7 @@ int64_t sys_socket(int domain, int type, int protocol) {
         return -EPROTOTYPE;
     }
 
-    return process.open(socket);
+    return process.open(socket, flags);
 }
 
 int64_t sys_connect(int sockfd, const struct sockaddr* addr, socklen_t addrlen) {
@@ -198,7 +445,7 @@ int64_t sys_connect(int sockfd, const struct sockaddr* addr, socklen_t addrlen)
     }
 
     Socket& socket = static_cast<Socket&>(file);
-    return socket.connect(addr, addrlen);
+    return socket.connect(description, addr, addrlen);
 }
 
 int64_t sys_send(int sockfd, const void* buffer, size_t length, int /*flags*/) {
@@ -236,6 +483,10 @@ int64_t sys_recv(int sockfd, void* buffer, size_t length, int /*flags*/) {
 
     // TODO: handle flags correctly
 
+    if (!process.isWritableUserRange(buffer, length)) {
+        return -EFAULT;
+    }
+
     return file.read(description, buffer, length);
 }
 
@@ -289,14 +540,143 @@ int sys_accept(int sockfd, sockaddr* address, socklen_t* address_len) {
         return -ENOTSOCK;
     }
 
+    // The address is filled in as a whole sockaddr_in, whatever its length
+    if ((address_len && !process.isWritableUserRange(address_len, sizeof(socklen_t))) ||
+        (address && !process.isWritableUserRange(address, sizeof(sockaddr_in)))) {
+        return -EFAULT;
+    }
+
     Socket& socket = static_cast<Socket&>(file);
 
-    auto childSocket = socket.accept(address, address_len);
-    if (!childSocket) {
+    estd::shared_ptr<Socket> childSocket;
+    int64_t result = socket.accept(description, address, address_len, childSocket);
+    if (result < 0) {
+        return result;
+    }
+
+    return process.open(childSocket, O_RDWR);
+}
+
+int64_t sys_setsockopt(int sockfd, int level, int name, const void* value,
+                       socklen_t len) {
+    Process& process = *currentThread->process;
+
+    if (sockfd < 0 || sockfd >= RLIMIT_NOFILE || !process.openFiles[sockfd]) {
+        return -EBADF;
+    }
+
+    File& file = *process.openFiles[sockfd]->file;
+
+    if (!file.isSocket()) {
+        return -ENOTSOCK;
+    }
+
+    Socket& socket = static_cast<Socket&>(file);
+    return socket.setOption(level, name, value, len);
+}
+
+int64_t sys_fcntl(int fd, int cmd, int arg) {
+    Process& process = *currentThread->process;
+
+    if (fd < 0 || fd >= RLIMIT_NOFILE || !process.openFiles[fd]) {
+        return -EBADF;
+    }
+
+    OpenFileDescription& description = *process.openFiles[fd];
+
+    // Only the status flags can be changed after open
+    constexpr int SETTABLE_FLAGS = O_APPEND | O_NONBLOCK;
+
+    switch (cmd) {
+        case F_GETFL:
+            return description.flags;
+
+        case F_SETFL:
+            description.flags =
+                (description.flags & ~SETTABLE_FLAGS) | (arg & SETTABLE_FLAGS);
+            return 0;
+
+        default:
+            return -EINVAL;
+    }
+}
+
+int64_t sys_pipe(int fds[2], int flags) {
+    Process& process = *currentThread->process;
+
+    if (flags & ~O_NONBLOCK) {
+        return -EINVAL;
+    } else if (!process.isWritableUserRange(fds, 2 * sizeof(int))) {
+        return -EFAULT;
+    }
+
+    estd::shared_ptr<Pipe> pipe(new Pipe);
+    estd::shared_ptr<File> reader(new PipeReader(pipe));
+    estd::shared_ptr<File> writer(new PipeWriter(pipe));
+
+    int readFd = process.open(reader, O_RDONLY | flags);
+    if (readFd < 0) {
+        return readFd;
+    }
+
+    int writeFd = process.open(writer, O_WRONLY | flags);
+    if (writeFd < 0) {
+        process.close(readFd);
+        return writeFd;
+    }
+
+    fds[0] = readFd;
+    fds[1] = writeFd;
+    return 0;
+}
+
+int64_t sys_dup(int fd) {
+    Process& process = *currentThread->process;
+    return process.dup(fd);
+}
+
+int64_t sys_dup2(int fd, int newFd) {
+    Process& process = *currentThread->process;
+    return process.dup2(fd, newFd);
+}
+
+int64_t sys_clock_gettime(clockid_t clockId, timespec* tp) {
+    Process& process = *currentThread->process;
+
+    if (clockId != CLOCK_MONOTONIC) {
         return -EINVAL;
+    } else if (!process.isWritableUserRange(tp, sizeof(timespec))) {
+        return -EFAULT;
     }
 
-    return process.open(childSocket);
+    uint64_t ns = sys.timer().nanoseconds();
+    tp->tv_sec = ns / 1000000000;
+    tp->tv_nsec = ns % 1000000000;
+    return 0;
+}
+
+int64_t sys_fsync(int fd) {
+    Process& process = *currentThread->process;
+
+    if (fd < 0 || fd >= RLIMIT_NOFILE || !process.openFiles[fd]) {
+        return -EBADF;
+    }
+
+    return process.openFiles[fd]->file->sync();
+}
+
+int64_t sys_disk_stats(int index, struct disk_stats* stats) {
+    Process& process = *currentThread->process;
+
+    BlockQueue* queue = BlockQueue::get(index);
+    if (index < 0 || !queue) {
+        return -EINVAL;
+    } else if (!process.isWritableUserRange(stats, sizeof(struct disk_stats))) {
+        return -EFAULT;
+    }
+
+    queue->getStats(*stats);
+    return 0;
 }
 
 // We don't have static initialization, so this is initialized at runtime
@@ -361,6 +741,20 @@ void initSyscalls() {
     syscallTable[SYS_bind] = bit_cast<SyscallHandler>((void*)sys_bind);
     syscallTable[SYS_listen] = bit_cast<SyscallHandler>((void*)sys_listen);
     syscallTable[SYS_accept] = bit_cast<SyscallHandler>((void*)sys_accept);
+    syscallTable[SYS_fsync] = bit_cast<SyscallHandler>((void*)sys_fsync);
+    syscallTable[SYS_disk_stats] = bit_cast<SyscallHandler>((void*)sys_disk_stats);
+    syscallTable[SYS_readv] = bit_cast<SyscallHandler>((void*)sys_readv);
+    syscallTable[SYS_writev] = bit_cast<SyscallHandler>((void*)sys_writev);
+    syscallTable[SYS_sendfile] = bit_cast<SyscallHandler>((void*)sys_sendfile);
+    syscallTable[SYS_epoll_create] = bit_cast<SyscallHandler>((void*)sys_epoll_create);
+    syscallTable[SYS_epoll_ctl] = bit_cast<SyscallHandler>((void*)sys_epoll_ctl);
+    syscallTable[SYS_epoll_wait] = bit_cast<SyscallHandler>((void*)sys_epoll_wait);
+    syscallTable[SYS_fcntl] = bit_cast<SyscallHandler>((void*)sys_fcntl);
+    syscallTable[SYS_pipe] = bit_cast<SyscallHandler>((void*)sys_pipe);
+    syscallTable[SYS_dup] = bit_cast<SyscallHandler>((void*)sys_dup);
+    syscallTable[SYS_dup2] = bit_cast<SyscallHandler>((void*)sys_dup2);
+    syscallTable[SYS_clock_gettime] = bit_cast<SyscallHandler>((void*)sys_clock_gettime);
+    syscallTable[SYS_setsockopt] = bit_cast<SyscallHandler>((void*)sys_setsockopt);
 
     println("syscall: init complete");
 }
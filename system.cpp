@@ -1,8 +1,13 @@
 #include "system.h"
 
 #include "acpi.h"
+#include "ahci.h"
 #include "e1000.h"
+#include "estd/print.h"
 #include "fs/ext2.h"
+#include "fs/initramfs.h"
+#include "fs/tmpfs.h"
+#include "fs/vfs.h"
 #include "ide.h"
 #include "interrupts.h"
 #include "keyboard.h"
@@ -11,7 +16,9 @@
 #include "net/dhcp.h"
 #include "net/dns.h"
 #include "net/ip.h"
+#include "net/packet_buffer.h"
 #include "net/tcp.h"
+#include "panic.h"
 #include "pci.h"
 #include "process.h"
 #include "processor.h"
@@ -21,12 +28,17 @@
 #include "terminal.h"
 #include "thread.h"
 #include "timer.h"
+#include "virtio_block.h"
 
 // Constructed by kmain
 System sys;
 
 void System::run() {
-    Process::create("/bin/shell", nullptr);
+    Location shell = _vfs->lookup(_vfs->root(), "/bin/shell");
+    if (!shell || !Process::create(shell, "/bin/shell", nullptr, _vfs->root())) {
+        panic("failed to launch /bin/shell");
+    }
+
     _scheduler->start();
 
     __builtin_unreachable();
@@ -43,6 +55,9 @@ System::System() {
     initSyscalls();
     _pciDevices.assign(new PCIDevices);
     _ideController.assign(new IDEController);
+    _ahciController = AHCIController::create();
+    _virtioBlock = VirtioBlockDevice::create();
+    packetPoolInit();
     _netif.assign(new E1000Device);
     arpInit();
     tcpInit();
@@ -52,9 +67,48 @@ System::System() {
     initACPI();
     _scheduler.assign(new Scheduler);
     _timer.assign(new Timer);
+    _netif->startPolling();
+    tcpStartTimer();
+
+    // Prefer virtio, then AHCI, then IDE for the root partition
+    DiskDevice* rootPartition = nullptr;
+    if (_virtioBlock) {
+        _virtioPartition = findFirstPartition(*_virtioBlock);
+        rootPartition = _virtioPartition.get();
+    }
+
+    if (!rootPartition && _ahciController) {
+        rootPartition = _ahciController->rootPartition();
+    }
+
+    if (!rootPartition) {
+        rootPartition = &_ideController->rootPartition();
+    }
+
+    _fs = Ext2FileSystem::create(*rootPartition);
 
-    _fs = Ext2FileSystem::create(_ideController->rootPartition());
     ASSERT(_fs);
+    _fs->startWriteback();
+
+    _vfs.assign(new VFS);
+    int result = _vfs->mount("/", *_fs);
+    ASSERT(result == 0);
+
+    // Serve the userland binaries from memory if the bootloader loaded an archive
+    _initramfs = InitramFileSystem::create();
+    if (_initramfs) {
+        result = _vfs->mount("/bin", *_initramfs);
+        if (result < 0) {
+            println("vfs: failed to mount /bin: {}", result);
+        }
+    }
+
+    // Scratch space which never touches the disk
+    _tmpfs.assign(new TmpFileSystem);
+    result = _vfs->mount("/tmp", *_tmpfs);
+    if (result < 0) {
+        println("vfs: failed to mount /tmp: {}", result);
+    }
 
     ProcessTable::init();
 }
@@ -7,7 +7,13 @@ class KeyboardDevice;
 class Terminal;
 class PCIDevices;
 class IDEController;
+class AHCIController;
+class VirtioBlockDevice;
+class DiskPartitionDevice;
 class Ext2FileSystem;
+class InitramFileSystem;
+class TmpFileSystem;
+class VFS;
 struct Scheduler;
 class Timer;
 class NetworkInterface;
@@ -22,6 +28,7 @@ public:
     estd::shared_ptr<Terminal> terminal();
     PCIDevices& pciDevices() { return *_pciDevices; }
     Ext2FileSystem& fs() { return *_fs; }
+    VFS& vfs() { return *_vfs; }
     NetworkInterface& netif() { return *_netif; }
     Scheduler& scheduler() { return *_scheduler; }
     Timer& timer() { return *_timer; }
@@ -32,8 +39,14 @@ private:
     estd::shared_ptr<Terminal> _terminal;
     estd::unique_ptr<PCIDevices> _pciDevices;
     estd::unique_ptr<IDEController> _ideController;
+    estd::unique_ptr<AHCIController> _ahciController;
+    estd::unique_ptr<VirtioBlockDevice> _virtioBlock;
+    estd::unique_ptr<DiskPartitionDevice> _virtioPartition;
     estd::unique_ptr<NetworkInterface> _netif;
     estd::unique_ptr<Ext2FileSystem> _fs;
+    estd::unique_ptr<InitramFileSystem> _initramfs;
+    estd::unique_ptr<TmpFileSystem> _tmpfs;
+    estd::unique_ptr<VFS> _vfs;
     estd::unique_ptr<Scheduler> _scheduler;
     estd::unique_ptr<Timer> _timer;
 };
@@ -1,5 +1,7 @@
 #include "terminal.h"
 
+#include "api/errno.h"
+#include "api/fcntl.h"
 #include "estd/vector.h"
 #include "klibc.h"
 #include "system.h"
@@ -872,15 +874,18 @@ void Terminal::backspace() {
     _screen.setCursor(_x, _y);
 }
 
-ssize_t Terminal::read(OpenFileDescription&, void* buffer, size_t count) {
+ssize_t Terminal::read(OpenFileDescription& fd, void* buffer, size_t count) {
     SpinlockLocker locker(_lock);
 
     // Block until at least one byte is available
     while (_inputLines == 0) {
+        if (fd.flags & O_NONBLOCK) {
+            return -EAGAIN;
+        }
+
         sys.scheduler().sleepThread(_inputBlocker, &_lock);
     }
 
-    // TODO: check fd mode
     size_t bytesRead = 0;
     char* dest = static_cast<char*>(buffer);
 
@@ -913,3 +918,19 @@ ssize_t Terminal::write(OpenFileDescription&, const void* buffer, size_t count)
 
     return count;
 }
+
+uint32_t Terminal::pollEvents() {
+    SpinlockLocker locker(_lock);
+
+    // Like read, input is only available a line at a time
+    uint32_t events = EPOLLOUT;
+    if (_inputLines > 0) {
+        events |= EPOLLIN;
+    }
+
+    return events;
+}
+
+void Terminal::pollBlockers(estd::vector<estd::shared_ptr<Blocker>>& blockers) {
+    blockers.push_back(_inputBlocker);
+}
@@ -19,6 +19,8 @@ public:
     // From File
     ssize_t read(OpenFileDescription& fd, void* buffer, size_t count) override;
     ssize_t write(OpenFileDescription& fd, const void* buffer, size_t count) override;
+    uint32_t pollEvents() override;
+    void pollBlockers(estd::vector<estd::shared_ptr<Blocker>>& blockers) override;
 
 private:
     friend class System;
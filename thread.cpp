@@ -109,7 +109,8 @@ estd::unique_ptr<Thread> Thread::createUserThread(Process* process,
     return estd::unique_ptr<Thread>(thread);
 }
 
-estd::unique_ptr<Thread> Thread::createKernelThread(VirtualAddress entryPoint) {
+estd::unique_ptr<Thread> Thread::createKernelThread(VirtualAddress entryPoint,
+                                                   uint64_t arg) {
     Thread* thread = new Thread;
     thread->process = nullptr;
 
@@ -131,6 +132,7 @@ estd::unique_ptr<Thread> Thread::createKernelThread(VirtualAddress entryPoint) {
 
     TrapRegisters& regs = *new (stackPtr) TrapRegisters;
     regs.rip = entryPoint.value;
+    regs.rdi = arg;
     regs.rspPrev = stackTop.value;
     regs.rflags = 0x202;  // IF + reserved bit
     regs.ss = SELECTOR_DATA0;
@@ -21,7 +21,9 @@ struct Thread {
                                                      VirtualAddress entryPoint,
                                                      const char* programName,
                                                      const char* argv[]);
-    static estd::unique_ptr<Thread> createKernelThread(VirtualAddress entryPoint);
+    // The entry point receives arg as its first argument
+    static estd::unique_ptr<Thread> createKernelThread(VirtualAddress entryPoint,
+                                                       uint64_t arg = 0);
 
     Process* process;
 
@@ -2,12 +2,17 @@
 
 #include "interrupts.h"
 #include "io.h"
+#include "klibc.h"
+#include "processor.h"
 #include "scheduler.h"
 #include "system.h"
 
 // 1.193182 MHz
 static constexpr uint32_t PIT_FREQUENCY = 1193182;
 
+static constexpr uint64_t TICKS_PER_SECOND = 100;
+static constexpr uint64_t NS_PER_TICK = 1000000000 / TICKS_PER_SECOND;
+
 // PIT I/O ports
 enum : uint16_t {
     PIT_CHANNEL0 = 0x40,
@@ -41,45 +46,111 @@ enum : uint8_t {
 
 Timer::Timer() {
     // Set the PIT to generate interrupts at 100Hz
-    uint16_t divisor = PIT_FREQUENCY / 100;
+    uint16_t divisor = PIT_FREQUENCY / TICKS_PER_SECOND;
     outb(PIT_COMMAND, PIT_CMD_CHANNEL0 | PIT_CMD_BOTH | PIT_CMD_MODE2 | PIT_CMD_BINARY);
     outb(PIT_CHANNEL0, lowBits(divisor, 8));
     outb(PIT_CHANNEL0, highBits(divisor, 8));
 
-    registerIrqHandler(IRQ_TIMER, [this](uint8_t) { this->irqHandler(); });
+    // Every tick ends the current time slice
+    registerIrqHandler(IRQ_TIMER, [this](uint8_t) {
+        this->irqHandler();
+        return true;
+    });
 }
 
 void Timer::sleep(uint64_t duration, Spinlock* lock) {
-    uint64_t endTick = tickCount() + duration;
-
-    estd::shared_ptr<TimerBlocker> blocker(new TimerBlocker{endTick});
-    _blockers.push_back(blocker);
+    estd::shared_ptr<Blocker> blocker(new Blocker);
+
+    // Interrupts have to stay disabled from adding the timeout until the thread is
+    // asleep, or the wakeup could come first and be lost. Holding any spinlock
+    // guarantees that.
+    Spinlock localLock;
+    if (!lock) {
+        localLock.lock();
+        lock = &localLock;
+    }
 
+    setTimeout(blocker, duration);
     sys.scheduler().sleepThread(blocker, lock);
+
+    if (lock == &localLock) {
+        localLock.unlock();
+    }
+}
+
+uint64_t Timer::millisecondsToTicks(uint64_t ms) {
+    return ceilDiv(ms * TICKS_PER_SECOND, 1000);
+}
+
+void Timer::setTimeout(const estd::shared_ptr<Blocker>& blocker, uint64_t duration) {
+    SpinlockLocker locker(_lock);
+    _timeouts.push_back({blocker, tickCount() + duration});
+}
+
+void Timer::cancelTimeout(const estd::shared_ptr<Blocker>& blocker) {
+    SpinlockLocker locker(_lock);
+
+    for (size_t i = 0; i < _timeouts.size(); ++i) {
+        if (_timeouts[i].blocker.get() != blocker.get()) continue;
+
+        _timeouts[i] = _timeouts.back();
+        _timeouts.pop_back();
+        return;
+    }
+}
+
+uint64_t Timer::tscToNanoseconds(uint64_t cycles) {
+    uint64_t tscPerTick = _tscPerTick;
+    if (tscPerTick == 0) return 0;
+
+    // Split to avoid overflow
+    return (cycles / tscPerTick) * NS_PER_TICK +
+           (cycles % tscPerTick) * NS_PER_TICK / tscPerTick;
+}
+
+uint64_t Timer::nanoseconds() {
+    SpinlockLocker locker(_clockLock);
+
+    // The TSC only fills in the time since the last tick, so it can never get ahead of
+    // the next one
+    uint64_t sinceTick = _lastTsc ? tscToNanoseconds(Processor::rdtsc() - _lastTsc) : 0;
+    return tickCount() * NS_PER_TICK + min(sinceTick, NS_PER_TICK - 1);
 }
 
 void Timer::increment() {
-    uint64_t newTickCount = _tickCount.increment();
+    uint64_t newTickCount;
+    {
+        SpinlockLocker locker(_clockLock);
+        newTickCount = _tickCount.increment();
+
+        // Measure the TSC rate against the PIT
+        uint64_t tsc = Processor::rdtsc();
+        if (_lastTsc != 0) {
+            _tscPerTick = tsc - _lastTsc;
+        }
+        _lastTsc = tsc;
+    }
+
+    SpinlockLocker locker(_lock);
 
     size_t i = 0;
-    while (i < _blockers.size()) {
-        auto& blocker = _blockers[i];
+    while (i < _timeouts.size()) {
+        auto& timeout = _timeouts[i];
 
-        if (newTickCount < blocker->endTick) {
+        if (newTickCount < timeout.endTick) {
             ++i;
             continue;
         }
 
-        sys.scheduler().wakeThreads(blocker);
+        sys.scheduler().wakeThreads(timeout.blocker);
 
-        // Remove the expired blocker from the list
-        _blockers[i] = _blockers.back();
-        _blockers.pop_back();
+        // Remove the expired timeout from the list
+        _timeouts[i] = _timeouts.back();
+        _timeouts.pop_back();
     }
 }
 
 void Timer::irqHandler() {
     increment();
     endOfInterrupt(IRQ_TIMER);
-    sys.scheduler().onTimerInterrupt();
 }
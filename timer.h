@@ -7,19 +7,42 @@ public:
     Timer();
 
     uint64_t tickCount() { return _tickCount.load(); }
+
+    // Converts a difference between timestamp counter values to nanoseconds, using the
+    // rate measured between timer ticks. Returns 0 until the rate is known.
+    uint64_t tscToNanoseconds(uint64_t cycles);
+    uint64_t tscPerTick() const { return _tscPerTick; }
+
+    // Time since boot, with the resolution of the timestamp counter once its rate is
+    // known, and of the timer tick before that
+    uint64_t nanoseconds();
     void sleep(uint64_t duration, Spinlock* lock = nullptr);
 
+    // Rounds up, so that a non-zero duration is never shortened to nothing
+    static uint64_t millisecondsToTicks(uint64_t ms);
+
+    // Wakes any threads sleeping on blocker after duration ticks, unless cancelled first.
+    // Used to put a time limit on waiting for some other event.
+    void setTimeout(const estd::shared_ptr<Blocker>& blocker, uint64_t duration);
+    void cancelTimeout(const estd::shared_ptr<Blocker>& blocker);
+
 private:
     AtomicInt _tickCount = 0;
     void increment();
 
+    // Protects _lastTsc, so that it's consistent with _tickCount
+    Spinlock _clockLock;
+    uint64_t _lastTsc = 0;
+    uint64_t _tscPerTick = 0;
+
     void irqHandler();
 
-    struct TimerBlocker : Blocker {
-        TimerBlocker(uint64_t endTick) : endTick(endTick) {}
+    struct Timeout {
+        estd::shared_ptr<Blocker> blocker;
         uint64_t endTick;
     };
 
     // TODO: should store these in sorted order, for efficiency
-    estd::vector<estd::shared_ptr<TimerBlocker>> _blockers;
+    Spinlock _lock;
+    estd::vector<Timeout> _timeouts;
 };
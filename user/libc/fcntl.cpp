@@ -1,6 +1,17 @@
 #include "fcntl.h"
 
+#include <stdarg.h>
+
 #include "syscall.h"
 
 int open(const char* path, int oflag) { return try_syscall(SYS_open, path, oflag); }
 int close(int fd) { return try_syscall(SYS_close, fd); }
+
+int fcntl(int fd, int cmd, ...) {
+    va_list args;
+    va_start(args, cmd);
+    int arg = (cmd == F_SETFL) ? va_arg(args, int) : 0;
+    va_end(args);
+
+    return try_syscall(SYS_fcntl, fd, cmd, arg);
+}
@@ -1,12 +1,15 @@
 // https://pubs.opengroup.org/onlinepubs/009695399/basedefs/fcntl.h.html
 #pragma once
 
+#include "api/fcntl.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 int open(const char* path, int oflag);
 int close(int fd);
+int fcntl(int fd, int cmd, ...);
 
 #ifdef __cplusplus
 }
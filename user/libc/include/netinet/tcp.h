@@ -0,0 +1,11 @@
+// https://pubs.opengroup.org/onlinepubs/9699919799/basedefs/netinet_tcp.h.html
+#pragma once
+
+// For the optname argument of setsockopt, with level IPPROTO_TCP
+#define TCP_NODELAY 1
+
+// Non-standard: the name of the congestion control algorithm, "newreno" or "cubic"
+#define TCP_CONGESTION 2
+
+// Non-standard, for testing: drop every nth outgoing data segment (an int, 0 for none)
+#define TCP_DROP_INTERVAL 3
@@ -60,6 +60,9 @@ struct linger {
 #define SOCK_SEQPACKET 3
 #define SOCK_STREAM 4
 
+// May be or'd into the type argument of socket
+#define SOCK_NONBLOCK 0x0800
+
 // For the level argument of setsockopt and getsockopt
 #define SOL_SOCKET 1
 
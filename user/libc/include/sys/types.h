@@ -6,3 +6,5 @@ typedef int32_t pid_t;
 typedef int64_t ssize_t;
 typedef int64_t off_t;
 typedef uint32_t ino_t;
+typedef int64_t time_t;
+typedef int32_t clockid_t;
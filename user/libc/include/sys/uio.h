@@ -7,6 +7,9 @@
 extern "C" {
 #endif
 
+// Maximum number of buffers accepted by readv and writev
+#define IOV_MAX 1024
+
 struct iovec {
     void* iov_base;
     size_t iov_len;
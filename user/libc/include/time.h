@@ -0,0 +1,22 @@
+// https://pubs.opengroup.org/onlinepubs/7908799/xsh/time.h.html
+#pragma once
+
+#include <sys/types.h>
+
+struct timespec {
+    time_t tv_sec;
+    long tv_nsec;
+};
+
+// Only a monotonic clock (counting from boot) is available
+#define CLOCK_MONOTONIC 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int clock_gettime(clockid_t clock_id, struct timespec* tp);
+
+#ifdef __cplusplus
+}
+#endif
@@ -4,6 +4,8 @@
 #include <stddef.h>
 #include <sys/types.h>
 
+#include "api/disk_stats.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -20,10 +22,17 @@ void* sbrk(intptr_t incr);
 
 int chdir(const char* path);
 char* getcwd(char* buffer, size_t size);
+int fsync(int fd);
+
+int pipe(int fds[2]);
+int pipe2(int fds[2], int flags);
+int dup(int fd);
+int dup2(int fd, int newFd);
 
 // Non-standard
 int sleep(int ticks);
 pid_t launch(const char* path, const char* argv[]);
+int disk_stats(int index, struct disk_stats* stats);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,13 @@
+#include <sys/epoll.h>
+
+#include "syscall.h"
+
+int epoll_create(int size) { return try_syscall(SYS_epoll_create, size); }
+
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event* event) {
+    return try_syscall(SYS_epoll_ctl, epfd, op, fd, event);
+}
+
+int epoll_wait(int epfd, struct epoll_event* events, int maxevents, int timeout) {
+    return try_syscall(SYS_epoll_wait, epfd, events, maxevents, timeout);
+}
@@ -0,0 +1,7 @@
+#include <sys/sendfile.h>
+
+#include "syscall.h"
+
+ssize_t sendfile(int out_fd, int in_fd, off_t* offset, size_t count) {
+    return try_syscall(SYS_sendfile, out_fd, in_fd, offset, count);
+}
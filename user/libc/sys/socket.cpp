@@ -24,6 +24,12 @@ int bind(int socket, const struct sockaddr *address, socklen_t address_len) {
     return try_syscall(SYS_bind, socket, address, address_len);
 }
 
+int setsockopt(int socket, int level, int option_name, const void *option_value,
+               socklen_t option_len) {
+    return try_syscall(SYS_setsockopt, socket, level, option_name, option_value,
+                       option_len);
+}
+
 int accept(int socket, struct sockaddr *__restrict address,
            socklen_t *__restrict address_len) {
     return try_syscall(SYS_accept, socket, address, address_len);
@@ -0,0 +1,11 @@
+#include <sys/uio.h>
+
+#include "syscall.h"
+
+ssize_t readv(int fd, const struct iovec* iov, int iovcnt) {
+    return try_syscall(SYS_readv, fd, iov, iovcnt);
+}
+
+ssize_t writev(int fd, const struct iovec* iov, int iovcnt) {
+    return try_syscall(SYS_writev, fd, iov, iovcnt);
+}
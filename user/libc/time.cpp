@@ -0,0 +1,7 @@
+#include <time.h>
+
+#include "syscall.h"
+
+int clock_gettime(clockid_t clock_id, struct timespec* tp) {
+    return try_syscall(SYS_clock_gettime, clock_id, tp);
+}
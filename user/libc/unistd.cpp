@@ -24,6 +24,13 @@ void* sbrk(intptr_t incr) { return try_syscall<void*>(SYS_sbrk, incr); }
 
 int chdir(const char* path) { return try_syscall(SYS_chdir, path); }
 
+int fsync(int fd) { return try_syscall(SYS_fsync, fd); }
+
+int pipe(int fds[2]) { return try_syscall(SYS_pipe, fds, 0); }
+int pipe2(int fds[2], int flags) { return try_syscall(SYS_pipe, fds, flags); }
+int dup(int fd) { return try_syscall(SYS_dup, fd); }
+int dup2(int fd, int newFd) { return try_syscall(SYS_dup2, fd, newFd); }
+
 char* getcwd(char* buffer, size_t size) {
     if (try_syscall(SYS_getcwd, buffer, size) < 0) {
         return nullptr;
@@ -38,3 +45,7 @@ int sleep(int ticks) { return syscall(SYS_sleep, ticks); }
 pid_t launch(const char* path, const char* argv[]) {
     return syscall(SYS_launch, path, argv);
 }
+
+int disk_stats(int index, struct disk_stats* stats) {
+    return try_syscall(SYS_disk_stats, index, stats);
+}
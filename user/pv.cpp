@@ -0,0 +1,66 @@
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "estd/print.h"
+
+// Measures the throughput of whatever is written to stdin, e.g. "yes | pv". Reads until
+// end-of-file, or until the given number of MiB (default 64) have been read.
+static constexpr uint64_t NS_PER_SECOND = 1000000000;
+static constexpr uint64_t MiB = 1024 * 1024;
+
+static uint64_t now() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NS_PER_SECOND + ts.tv_nsec;
+}
+
+// Prints the amount transferred, and the rate in MB/s with one decimal place
+static void report(uint64_t bytes, uint64_t elapsedNs) {
+    uint64_t tenthsMBps = elapsedNs ? bytes * 10000 / elapsedNs : 0;
+    println("{} MiB in {} ms: {}.{} MB/s", bytes / MiB, elapsedNs / 1000000,
+            tenthsMBps / 10, tenthsMBps % 10);
+}
+
+int main(int argc, char* argv[]) {
+    uint64_t limit = 64;
+    if (argc > 1) {
+        limit = 0;
+        for (const char* p = argv[1]; *p; ++p) {
+            if (*p < '0' || *p > '9') {
+                println("Usage: {} [MiB]", argv[0]);
+                return 1;
+            }
+
+            limit = limit * 10 + (*p - '0');
+        }
+    }
+    limit *= MiB;
+
+    static char buffer[64 * 1024];
+    uint64_t total = 0;
+    uint64_t start = now();
+    uint64_t lastReport = start;
+
+    while (total < limit) {
+        ssize_t bytesRead = read(STDIN_FILENO, buffer, sizeof(buffer));
+        if (bytesRead < 0) {
+            println("{}: read failed", argv[0]);
+            return 1;
+        } else if (bytesRead == 0) {
+            break;
+        }
+
+        total += bytesRead;
+
+        // Progress once per second
+        uint64_t current = now();
+        if (current - lastReport >= NS_PER_SECOND) {
+            report(total, current - start);
+            lastReport = current;
+        }
+    }
+
+    report(total, now() - start);
+    return 0;
+}
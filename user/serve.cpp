@@ -1,9 +1,80 @@
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <string.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "estd/print.h"
 
+// Static file server: answers each GET request with the file at that path, relative to
+// the root directory
+static constexpr size_t MAX_PATH = 256;
+static constexpr size_t SEND_CHUNK_SIZE = 64 * 1024;
+
+static void writeAll(int fd, const char* str) { write(fd, str, strlen(str)); }
+
+// Extracts the path from the request line of a GET request. Returns false if the request
+// is malformed or unsupported.
+static bool parseRequest(const char* request, char* path, size_t pathSize) {
+    if (strncmp(request, "GET /", 5) != 0) {
+        return false;
+    }
+
+    const char* start = request + 4;
+    const char* end = strchr(start, ' ');
+    if (!end || static_cast<size_t>(end - start) >= pathSize) {
+        return false;
+    }
+
+    memcpy(path, start, end - start);
+    path[end - start] = '\0';
+
+    // Don't serve anything outside of the root
+    return !strstr(path, "..");
+}
+
+static void serveClient(int clientFd) {
+    char request[1024];
+    ssize_t n = read(clientFd, request, sizeof(request) - 1);
+    if (n < 0) {
+        println("read failed");
+        return;
+    }
+
+    request[n] = '\0';
+
+    char path[MAX_PATH];
+    if (!parseRequest(request, path, sizeof(path))) {
+        writeAll(clientFd, "HTTP/1.0 400 Bad Request\r\n\r\n");
+        return;
+    }
+
+    int fileFd = open(path, O_RDONLY);
+    if (fileFd < 0) {
+        println("not found: {}", path);
+        writeAll(clientFd, "HTTP/1.0 404 Not Found\r\n\r\n");
+        return;
+    }
+
+    // The response ends when the connection is closed, so no Content-Length is needed
+    writeAll(clientFd, "HTTP/1.0 200 OK\r\nConnection: close\r\n\r\n");
+
+    // The file contents go straight from the kernel's cache to the socket
+    off_t offset = 0;
+    ssize_t sent;
+    while ((sent = sendfile(clientFd, fileFd, &offset, SEND_CHUNK_SIZE)) > 0) {
+    }
+
+    if (sent < 0) {
+        println("sendfile failed: {}", path);
+    }
+
+    println("served {} ({} bytes)", path, offset);
+    close(fileFd);
+}
+
 int main(int argc, char* argv[]) {
     int fd = socket(AF_INET, SOCK_STREAM, 0);
     if (fd < 0) {
@@ -11,8 +82,6 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
-    println("got socket: {}", fd);
-
     sockaddr_in addr;
     addr.sin_family = AF_INET;
     addr.sin_port = htons(80);
@@ -23,51 +92,21 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
-    println("bound");
-
     if (listen(fd, 2) < 0) {
         println("listen failed");
         return 1;
     }
 
-    println("listened");
-
-    int client_fd = accept(fd, nullptr, nullptr);
-    if (client_fd < 0) {
-        println("accept failed");
-        return 1;
-    }
-
-    println("accepted: {}", client_fd);
+    println("listening on port 80");
 
-    /*
-    char buf[1024];
-    int n = read(client_fd, buf, sizeof(buf));
-    if (n < 0) {
-        println("read failed");
-        return 1;
-    }
-
-    buf[n] = 0;
-    println("read: {}", buf);
+    while (true) {
+        int clientFd = accept(fd, nullptr, nullptr);
+        if (clientFd < 0) {
+            println("accept failed");
+            return 1;
+        }
 
-    const char* response = "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nHello";
-    n = write(client_fd, response, strlen(response));
-    if (n < 0) {
-        println("write failed");
-        return 1;
+        serveClient(clientFd);
+        close(clientFd);
     }
-
-    println("wrote: {}", n);
-    */
-
-    sleep(500);
-    close(client_fd);
-    println("closed: {}", client_fd);
-
-    // sleep(500);
-    println("closing");
-    close(fd);
-    println("closed");
-    return 0;
 }
@@ -30,6 +30,21 @@ void ls(const char* path) {
 
 void echo(const char* arg) { println("{}", arg); }
 
+void diskstats() {
+    struct disk_stats stats;
+    for (int i = 0; disk_stats(i, &stats) == 0; ++i) {
+        uint64_t averageUs =
+            stats.requests ? stats.total_latency_ns / stats.requests / 1000 : 0;
+        println("{}: {} requests ({} merged), {} dispatches, {} errors", stats.name,
+                stats.requests, stats.merged, stats.dispatches, stats.errors);
+        println("    {} sectors read, {} sectors written", stats.sectors_read,
+                stats.sectors_written);
+        println("    queue depth {} (max {}), latency avg {}us max {}us",
+                stats.queue_depth, stats.max_queue_depth, averageUs,
+                stats.max_latency_ns / 1000);
+    }
+}
+
 // Just split at the first space and return a pointer to the arguments
 const char* parseCommand(char* buffer) {
     char* space = const_cast<char*>(strchr(buffer, ' '));
@@ -41,6 +56,106 @@ const char* parseCommand(char* buffer) {
     return space + 1;
 }
 
+// Removes leading and trailing spaces in place
+char* trim(char* str) {
+    while (*str == ' ') {
+        ++str;
+    }
+
+    size_t length = strlen(str);
+    while (length > 0 && str[length - 1] == ' ') {
+        str[--length] = '\0';
+    }
+
+    return str;
+}
+
+// Runs a command line of the form "a | b | c", connecting the stdout of each program to
+// the stdin of the next. Only programs in /bin can be used, not builtins. Children
+// inherit the shell's standard streams, so each one is launched with them pointed at
+// the right pipes, and they're restored afterwards.
+void pipeline(char* line) {
+    static constexpr size_t MAX_STAGES = 8;
+    char* stages[MAX_STAGES];
+    size_t numStages = 0;
+
+    char* saveptr;
+    for (char* stage = strtok_r(line, "|", &saveptr); stage;
+         stage = strtok_r(nullptr, "|", &saveptr)) {
+        if (numStages == MAX_STAGES) {
+            println("pipeline: too many commands");
+            return;
+        }
+
+        stages[numStages++] = trim(stage);
+    }
+
+    int savedStdin = dup(STDIN_FILENO);
+    int savedStdout = dup(STDOUT_FILENO);
+
+    pid_t children[MAX_STAGES];
+    size_t numChildren = 0;
+    const char* notFound = nullptr;
+    bool pipeFailed = false;
+
+    for (size_t i = 0; i < numStages; ++i) {
+        int fds[2];
+        bool last = (i == numStages - 1);
+        if (last) {
+            dup2(savedStdout, STDOUT_FILENO);
+        } else if (pipe(fds) == 0) {
+            dup2(fds[1], STDOUT_FILENO);
+            close(fds[1]);
+        } else {
+            pipeFailed = true;
+            break;
+        }
+
+        const char* cmd = stages[i];
+        const char* args = parseCommand(stages[i]);
+
+        char path[64] = "/bin/";
+        strncat(path, cmd, sizeof(path) - strlen(path) - 1);
+
+        const char* argv[2] = {};
+        if (*args != '\0') {
+            argv[0] = args;
+        }
+
+        // A stage which fails to launch just closes its end of each pipe, so its
+        // neighbors see end-of-file or a broken pipe
+        pid_t child = launch(path, argv);
+        if (child >= 0) {
+            children[numChildren++] = child;
+        } else if (!notFound) {
+            notFound = cmd;
+        }
+
+        // The next program reads from this one's pipe
+        if (!last) {
+            dup2(fds[0], STDIN_FILENO);
+            close(fds[0]);
+        }
+    }
+
+    dup2(savedStdin, STDIN_FILENO);
+    dup2(savedStdout, STDOUT_FILENO);
+    close(savedStdin);
+    close(savedStdout);
+
+    if (pipeFailed) {
+        println("pipeline: failed to create pipe");
+    }
+
+    if (notFound) {
+        println("no such command: {}", notFound);
+    }
+
+    for (size_t i = 0; i < numChildren; ++i) {
+        waitpid(children[i], nullptr, 0);
+    }
+}
+
 int main() {
     char buffer[64];
 
@@ -76,6 +191,11 @@ int main() {
             continue;
         }
 
+        if (strchr(buffer, '|')) {
+            pipeline(buffer);
+            continue;
+        }
+
         const char* cmd = buffer;
         const char* args = parseCommand(buffer);
 
@@ -121,6 +241,8 @@ int main() {
             } else {
                 println("pwd: no such file or directory");
             }
+        } else if (strcmp(cmd, "diskstats") == 0) {
+            diskstats();
         } else if (strcmp(cmd, "echo") == 0) {
             echo(args);
         } else if (strcmp(cmd, "cat") == 0) {
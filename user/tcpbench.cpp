@@ -0,0 +1,128 @@
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "estd/print.h"
+
+// Measures TCP goodput while the stack drops outgoing segments: sends data to a sink on
+// another host (e.g. "nc -l 5001 > /dev/null") with the given congestion control, losing
+// one in every n data segments. Goodput is taken as the data the kernel accepted over
+// the time it took, which leaves out the last send buffer's worth.
+//
+// Usage: tcpbench <ip> <port> [newreno|cubic] [drop interval] [MiB]
+static constexpr uint64_t NS_PER_SECOND = 1000000000;
+static constexpr uint64_t MiB = 1024 * 1024;
+
+static uint64_t now() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NS_PER_SECOND + ts.tv_nsec;
+}
+
+static bool parseNumber(const char* str, uint64_t& result) {
+    if (!*str) return false;
+
+    result = 0;
+    for (const char* p = str; *p; ++p) {
+        if (*p < '0' || *p > '9') return false;
+        result = result * 10 + (*p - '0');
+    }
+
+    return true;
+}
+
+// Parses a dotted-quad address into network byte order
+static bool parseAddress(const char* str, uint32_t& result) {
+    uint8_t* bytes = reinterpret_cast<uint8_t*>(&result);
+    for (int i = 0; i < 4; ++i) {
+        uint64_t value = 0;
+        const char* start = str;
+        while (*str >= '0' && *str <= '9') {
+            value = value * 10 + (*str++ - '0');
+        }
+
+        if (str == start || value > 255) return false;
+        if (*str != (i < 3 ? '.' : '\0')) return false;
+
+        bytes[i] = value;
+        ++str;
+    }
+
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    uint32_t ip;
+    uint64_t port;
+    uint64_t dropInterval = 0;
+    uint64_t limit = 64;
+    const char* algorithm = "newreno";
+
+    bool valid = argc >= 3 && argc <= 6 && parseAddress(argv[1], ip) &&
+                 parseNumber(argv[2], port) &&
+                 (argc <= 4 || parseNumber(argv[4], dropInterval)) &&
+                 (argc <= 5 || parseNumber(argv[5], limit));
+    if (!valid) {
+        println("Usage: {} <ip> <port> [newreno|cubic] [drop interval] [MiB]", argv[0]);
+        return 1;
+    }
+
+    if (argc > 3) algorithm = argv[3];
+    limit *= MiB;
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        println("socket failed");
+        return 1;
+    }
+
+    if (setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, algorithm, strlen(algorithm)) < 0) {
+        println("unknown congestion control: {}", algorithm);
+        return 1;
+    }
+
+    int interval = dropInterval;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_DROP_INTERVAL, &interval, sizeof(interval)) < 0) {
+        println("setsockopt failed");
+        return 1;
+    }
+
+    sockaddr_in addr;
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = ip;
+
+    if (connect(fd, (sockaddr*)&addr, sizeof(sockaddr_in)) < 0) {
+        println("connect failed");
+        return 1;
+    }
+
+    static char buffer[64 * 1024];
+    memset(buffer, 'x', sizeof(buffer));
+
+    uint64_t total = 0;
+    uint64_t start = now();
+    while (total < limit) {
+        size_t count = limit - total < sizeof(buffer) ? limit - total : sizeof(buffer);
+        ssize_t bytesSent = send(fd, buffer, count, 0);
+        if (bytesSent < 0) {
+            println("send failed");
+            return 1;
+        }
+
+        total += bytesSent;
+    }
+
+    uint64_t elapsedNs = now() - start;
+    close(fd);
+
+    // In MB/s with one decimal place
+    uint64_t tenthsMBps = elapsedNs ? total * 10000 / elapsedNs : 0;
+    println("{}, dropping 1 in {}: {} MiB in {} ms: {}.{} MB/s", algorithm, dropInterval,
+            total / MiB, elapsedNs / 1000000, tenthsMBps / 10, tenthsMBps % 10);
+    return 0;
+}
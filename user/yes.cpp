@@ -0,0 +1,30 @@
+#include <string.h>
+#include <unistd.h>
+
+#include "estd/print.h"
+
+// Writes a line (by default "y") to stdout over and over, until the reader goes away
+int main(int argc, char* argv[]) {
+    const char* line = argc > 1 ? argv[1] : "y";
+    size_t length = strlen(line);
+
+    // Fill the buffer with as many copies of the line as fit, so that each write moves
+    // a whole buffer
+    static char buffer[4096];
+    if (length + 1 > sizeof(buffer)) {
+        println("{}: line too long", argv[0]);
+        return 1;
+    }
+
+    size_t size = 0;
+    while (size + length + 1 <= sizeof(buffer)) {
+        memcpy(buffer + size, line, length);
+        buffer[size + length] = '\n';
+        size += length + 1;
+    }
+
+    while (write(STDOUT_FILENO, buffer, size) > 0) {
+    }
+
+    return 0;
+}
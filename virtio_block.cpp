@@ -0,0 +1,390 @@
+#include "virtio_block.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#include "estd/bits.h"
+#include "estd/print.h"
+#include "interrupts.h"
+#include "io.h"
+#include "klibc.h"
+#include "mm.h"
+#include "pci.h"
+#include "processor.h"
+#include "system.h"
+#include "units.h"
+
+// Reference: Virtual I/O Device (VIRTIO) Version 1.1, sections 2.6, 4.1.4.8 and 5.2
+
+static constexpr uint16_t VIRTIO_VENDOR_ID = 0x1AF4;
+static constexpr uint16_t VIRTIO_BLOCK_DEVICE_ID = 0x1001;  // Transitional
+
+// Offsets into the legacy I/O BAR (without MSI-X)
+enum VirtioRegister : uint16_t {
+    DeviceFeatures = 0x00,
+    GuestFeatures = 0x04,
+    QueueAddress = 0x08,
+    QueueSize = 0x0C,
+    QueueSelect = 0x0E,
+    QueueNotify = 0x10,
+    DeviceStatus = 0x12,
+    ISRStatus = 0x13,
+    BlockCapacity = 0x14,  // Device-specific configuration starts here
+};
+
+enum DeviceStatusFlags : uint8_t {
+    STATUS_ACKNOWLEDGE = 1 << 0,
+    STATUS_DRIVER = 1 << 1,
+    STATUS_DRIVER_OK = 1 << 2,
+    STATUS_FAILED = 1 << 7,
+};
+
+static constexpr uint32_t VIRTIO_BLK_F_RO = 1 << 5;
+static constexpr uint32_t VIRTIO_RING_F_INDIRECT_DESC = 1 << 28;
+
+static constexpr uint16_t DESC_F_NEXT = 1 << 0;
+static constexpr uint16_t DESC_F_WRITE = 1 << 1;  // Written by the device
+static constexpr uint16_t DESC_F_INDIRECT = 1 << 2;
+
+static constexpr uint32_t VIRTIO_BLK_T_IN = 0;
+static constexpr uint32_t VIRTIO_BLK_T_OUT = 1;
+static constexpr uint8_t VIRTIO_BLK_S_OK = 0;
+
+// The legacy interface requires the used ring to be page-aligned
+static constexpr size_t QUEUE_ALIGN = 4096;
+
+struct __attribute__((packed)) VirtqDescriptor {
+    uint64_t address;
+    uint32_t length;
+    uint16_t flags;
+    uint16_t next;
+};
+
+static_assert(sizeof(VirtqDescriptor) == 16);
+
+struct __attribute__((packed)) VirtqAvailable {
+    uint16_t flags;
+    volatile uint16_t index;
+    uint16_t ring[];
+};
+
+struct __attribute__((packed)) VirtqUsedElement {
+    uint32_t id;
+    uint32_t length;
+};
+
+struct __attribute__((packed)) VirtqUsed {
+    uint16_t flags;
+    volatile uint16_t index;
+    VirtqUsedElement ring[];
+};
+
+struct __attribute__((packed)) BlockRequestHeader {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+};
+
+struct VirtioBlockDevice::Slot {
+    VirtqDescriptor table[MAX_SEGMENTS + 2];
+    BlockRequestHeader header;
+    volatile uint8_t status;
+    bool done;
+};
+
+// x86 doesn't reorder stores with other stores or loads with other loads, so we only
+// need to keep the compiler from doing it
+static inline void compilerBarrier() { asm volatile("" ::: "memory"); }
+
+estd::unique_ptr<VirtioBlockDevice> VirtioBlockDevice::create() {
+    PCIDevice* pciDevice =
+        sys.pciDevices().findById(VIRTIO_VENDOR_ID, VIRTIO_BLOCK_DEVICE_ID);
+    if (!pciDevice) {
+        return {};
+    }
+
+    estd::unique_ptr<VirtioBlockDevice> device(new VirtioBlockDevice(pciDevice));
+    if (!device->init()) {
+        return {};
+    }
+
+    return device;
+}
+
+VirtioBlockDevice::VirtioBlockDevice(PCIDevice* pciDevice)
+: _pciDevice(pciDevice), _slotAvailable(new Blocker), _completion(new Blocker) {}
+
+VirtioBlockDevice::~VirtioBlockDevice() {
+    // The interrupt handler can't be unregistered, so the device can only be destroyed
+    // if initialization failed
+    ASSERT(!_irqEnabled);
+
+    if (_ioBase) {
+        outb(_ioBase + DeviceStatus, 0);
+    }
+
+    if (_queuePages) {
+        mm.pageFree(_queueBase, _queuePages);
+    }
+
+    if (_slotPages) {
+        mm.pageFree(_slotBase, _slotPages);
+    }
+}
+
+bool VirtioBlockDevice::init() {
+    uint32_t bar0 = _pciDevice->bar0();
+    if (bitRange(bar0, 0, 1) != 1) {
+        println("virtio-blk: no legacy I/O BAR");
+        return false;
+    }
+
+    _ioBase = clearLowBits(bar0, 2);
+    _pciDevice->enableBusMastering();
+
+    // Reset, and then tell the device that we've found it and know how to drive it
+    outb(_ioBase + DeviceStatus, 0);
+    outb(_ioBase + DeviceStatus, STATUS_ACKNOWLEDGE);
+    outb(_ioBase + DeviceStatus, STATUS_ACKNOWLEDGE | STATUS_DRIVER);
+
+    uint32_t features = inl(_ioBase + DeviceFeatures);
+    if (!(features & VIRTIO_RING_F_INDIRECT_DESC)) {
+        println("virtio-blk: indirect descriptors not supported");
+        outb(_ioBase + DeviceStatus, STATUS_FAILED);
+        return false;
+    }
+
+    _readOnly = features & VIRTIO_BLK_F_RO;
+    outl(_ioBase + GuestFeatures, VIRTIO_RING_F_INDIRECT_DESC);
+
+    _numSectors = inl(_ioBase + BlockCapacity) |
+                  (static_cast<uint64_t>(inl(_ioBase + BlockCapacity + 4)) << 32);
+
+    if (!initQueue()) {
+        outb(_ioBase + DeviceStatus, STATUS_FAILED);
+        return false;
+    }
+
+    outb(_ioBase + DeviceStatus, STATUS_ACKNOWLEDGE | STATUS_DRIVER | STATUS_DRIVER_OK);
+
+    uint8_t irqNumber = _pciDevice->interruptLine();
+    registerIrqHandler(irqNumber,
+                       [this](uint8_t irqNo) { return this->irqHandler(irqNo); });
+    _irqEnabled = true;
+
+    println("virtio-blk: {} sectors{}, queue size {}, irq {}", _numSectors,
+            _readOnly ? " (read-only)" : "", _queueSize, irqNumber);
+    return true;
+}
+
+bool VirtioBlockDevice::initQueue() {
+    outw(_ioBase + QueueSelect, 0);
+    _queueSize = inw(_ioBase + QueueSize);
+    if (_queueSize == 0) {
+        println("virtio-blk: request queue not available");
+        return false;
+    }
+
+    size_t descriptorBytes = sizeof(VirtqDescriptor) * _queueSize;
+    size_t ringBytes = roundUp(descriptorBytes + sizeof(VirtqAvailable) +
+                                   sizeof(uint16_t) * (_queueSize + 1),
+                               QUEUE_ALIGN);
+    size_t usedBytes = roundUp(
+        sizeof(VirtqUsed) + sizeof(VirtqUsedElement) * _queueSize + sizeof(uint16_t),
+        QUEUE_ALIGN);
+
+    _queuePages = (ringBytes + usedBytes) / PAGE_SIZE;
+    _queueBase = mm.pageAlloc(_queuePages);
+
+    // The legacy interface takes a 32-bit page number
+    if (_queueBase.value / QUEUE_ALIGN > UINT32_MAX) {
+        println("virtio-blk: queue memory is out of range");
+        return false;
+    }
+
+    uint8_t* queue = mm.physicalToVirtual(_queueBase).ptr<uint8_t>();
+    memset(queue, 0, _queuePages * PAGE_SIZE);
+
+    _descriptors = reinterpret_cast<VirtqDescriptor*>(queue);
+    _available = reinterpret_cast<VirtqAvailable*>(queue + descriptorBytes);
+    _used = reinterpret_cast<VirtqUsed*>(queue + ringBytes);
+
+    // Each slot's ring descriptor permanently points at its indirect table
+    size_t numSlots = min(MAX_SLOTS, static_cast<size_t>(_queueSize));
+    _slotPages = ceilDiv(sizeof(Slot) * numSlots, PAGE_SIZE);
+    _slotBase = mm.pageAlloc(_slotPages);
+    _slots = mm.physicalToVirtual(_slotBase).ptr<Slot>();
+    memset(_slots, 0, _slotPages * PAGE_SIZE);
+
+    for (size_t i = 0; i < numSlots; ++i) {
+        _descriptors[i].address = mm.virtualToPhysical(&_slots[i].table[0]).value;
+        _descriptors[i].flags = DESC_F_INDIRECT;
+        _freeSlots.push_back(numSlots - 1 - i);
+    }
+
+    outl(_ioBase + QueueAddress, _queueBase.value / QUEUE_ALIGN);
+    return true;
+}
+
+void VirtioBlockDevice::buildRequest(uint16_t index, bool write, uint8_t* buffer,
+                                     uint64_t start, size_t count) {
+    Slot& slot = _slots[index];
+    slot.header.type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+    slot.header.reserved = 0;
+    slot.header.sector = start;
+    slot.status = 0xFF;
+    slot.done = false;
+
+    size_t n = 0;
+    slot.table[n++] = {mm.virtualToPhysical(&slot.header).value,
+                       sizeof(BlockRequestHeader), DESC_F_NEXT, 1};
+
+    // The buffer is virtually contiguous, but may not be physically contiguous, so add
+    // a segment for each physically contiguous run
+    uint16_t dataFlags = DESC_F_NEXT | (write ? 0 : DESC_F_WRITE);
+    size_t remaining = count * SECTOR_SIZE;
+    uint8_t* ptr = buffer;
+    while (remaining > 0) {
+        uint64_t pageOffset = reinterpret_cast<uint64_t>(ptr) % PAGE_SIZE;
+        size_t length = min(remaining, PAGE_SIZE - pageOffset);
+        PhysicalAddress physAddr = mm.virtualToPhysical(ptr);
+        ASSERT(physAddr.value != 0);
+
+        VirtqDescriptor& last = slot.table[n - 1];
+        if (n > 1 && last.address + last.length == physAddr.value) {
+            last.length += length;
+        } else {
+            ASSERT(n <= MAX_SEGMENTS);
+            slot.table[n] = {physAddr.value, static_cast<uint32_t>(length), dataFlags,
+                             static_cast<uint16_t>(n + 1)};
+            ++n;
+        }
+
+        ptr += length;
+        remaining -= length;
+    }
+
+    slot.table[n++] = {mm.virtualToPhysical(const_cast<uint8_t*>(&slot.status)).value, 1,
+                       DESC_F_WRITE, 0};
+
+    _descriptors[index].length = n * sizeof(VirtqDescriptor);
+
+    // Publish the descriptor only after it's completely written
+    _available->ring[_available->index % _queueSize] = index;
+    compilerBarrier();
+    _available->index = _available->index + 1;
+}
+
+bool VirtioBlockDevice::processCompletionsLocked() {
+    bool completed = false;
+    while (_lastUsed != _used->index) {
+        compilerBarrier();
+        uint32_t index = _used->ring[_lastUsed % _queueSize].id;
+        ASSERT(index < MAX_SLOTS);
+        _slots[index].done = true;
+        ++_lastUsed;
+        completed = true;
+    }
+
+    return completed;
+}
+
+bool VirtioBlockDevice::irqHandler(uint8_t irqNo) {
+    // Reading the ISR acknowledges the interrupt. The line may be shared with other
+    // devices, so there may be nothing for us to do.
+    uint8_t isr = inb(_ioBase + ISRStatus);
+
+    bool completed = false;
+    if (isr & 1) {
+        SpinlockLocker locker(_lock);
+        completed = processCompletionsLocked();
+        if (completed) {
+            sys.scheduler().wakeThreads(_completion);
+        }
+    }
+
+    endOfInterrupt(irqNo);
+    return completed;
+}
+
+void VirtioBlockDevice::waitLocked(const estd::shared_ptr<Blocker>& blocker,
+                                   bool canSleep) {
+    if (canSleep) {
+        sys.scheduler().sleepThread(blocker, &_lock);
+        return;
+    }
+
+    // Before the scheduler is running, poll the used ring instead
+    if (!processCompletionsLocked()) {
+        Processor::pause();
+    }
+}
+
+bool VirtioBlockDevice::transfer(bool write, uint8_t* buffer, uint64_t start,
+                                 size_t count) {
+    ASSERT(start + count <= _numSectors);
+
+    if (write && _readOnly) {
+        return false;
+    }
+
+    bool canSleep = _irqEnabled && Processor::interruptsEnabled() && !inIrq();
+    size_t maxSectors = (MAX_SEGMENTS - 1) * PAGE_SIZE / SECTOR_SIZE;
+    bool success = true;
+
+    SpinlockLocker locker(_lock);
+    while (count > 0) {
+        // Submit as many pieces as we can, and notify the device once for all of them
+        uint16_t batch[MAX_BATCH];
+        size_t batchSize = 0;
+        while (count > 0 && batchSize < MAX_BATCH) {
+            if (_freeSlots.empty()) {
+                // Don't hold on to slots while waiting for more
+                if (batchSize > 0) break;
+
+                waitLocked(_slotAvailable, canSleep);
+                continue;
+            }
+
+            uint16_t index = _freeSlots.back();
+            _freeSlots.pop_back();
+
+            size_t pieceSectors = min(count, maxSectors);
+            buildRequest(index, write, buffer, start, pieceSectors);
+            batch[batchSize++] = index;
+
+            buffer += pieceSectors * SECTOR_SIZE;
+            start += pieceSectors;
+            count -= pieceSectors;
+        }
+
+        outw(_ioBase + QueueNotify, 0);
+
+        for (size_t i = 0; i < batchSize; ++i) {
+            Slot& slot = _slots[batch[i]];
+            while (!slot.done) {
+                waitLocked(_completion, canSleep);
+            }
+
+            if (slot.status != VIRTIO_BLK_S_OK) {
+                println("virtio-blk: {} failed at sector {} (status {})",
+                        write ? "write" : "read", slot.header.sector, slot.status);
+                success = false;
+            }
+
+            _freeSlots.push_back(batch[i]);
+        }
+
+        sys.scheduler().wakeThreads(_slotAvailable);
+    }
+
+    return success;
+}
+
+bool VirtioBlockDevice::readSectors(void* dest, uint64_t start, size_t count) {
+    return transfer(false, static_cast<uint8_t*>(dest), start, count);
+}
+
+bool VirtioBlockDevice::writeSectors(const void* src, uint64_t start, size_t count) {
+    return transfer(true, static_cast<uint8_t*>(const_cast<void*>(src)), start, count);
+}
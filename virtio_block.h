@@ -0,0 +1,78 @@
+// Driver for a virtio block device, using the legacy PCI interface
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "address.h"
+#include "disk.h"
+#include "estd/memory.h"
+#include "estd/vector.h"
+#include "scheduler.h"
+#include "spinlock.h"
+
+class PCIDevice;
+struct VirtqDescriptor;
+struct VirtqAvailable;
+struct VirtqUsed;
+
+// Requests are placed on a single split virtqueue, each as one ring descriptor which
+// points to an indirect table holding the header, data segments and status byte. Several
+// requests can be outstanding at once, either from different threads or from one large
+// transfer split into pieces, and they're completed by interrupt.
+class VirtioBlockDevice : public DiskDevice {
+public:
+    // Returns nullptr if there's no device, or it can't be initialized
+    static estd::unique_ptr<VirtioBlockDevice> create();
+    ~VirtioBlockDevice();
+
+    bool readSectors(void* dest, uint64_t start, size_t count) override;
+    bool writeSectors(const void* src, uint64_t start, size_t count) override;
+    size_t numSectors() const override { return _numSectors; }
+
+private:
+    struct Slot;
+
+    // Data segments per request, so that a request of (MAX_SEGMENTS - 1) pages fits
+    // however it's aligned
+    static constexpr size_t MAX_SEGMENTS = 64;
+    static constexpr size_t MAX_SLOTS = 32;
+
+    // Pieces of a single transfer which are submitted before waiting
+    static constexpr size_t MAX_BATCH = 8;
+
+    VirtioBlockDevice(PCIDevice* pciDevice);
+    bool init();
+    bool initQueue();
+
+    bool transfer(bool write, uint8_t* buffer, uint64_t start, size_t count);
+    void buildRequest(uint16_t slot, bool write, uint8_t* buffer, uint64_t start,
+                      size_t count);
+    void waitLocked(const estd::shared_ptr<Blocker>& blocker, bool canSleep);
+    bool processCompletionsLocked();
+    bool irqHandler(uint8_t irqNo);
+
+    PCIDevice* _pciDevice;
+    uint16_t _ioBase = 0;
+    size_t _numSectors = 0;
+    bool _readOnly = false;
+    bool _irqEnabled = false;
+
+    // The virtqueue: descriptor table, available ring, and (on a separate page) used ring
+    PhysicalAddress _queueBase;
+    size_t _queuePages = 0;
+    uint16_t _queueSize = 0;
+    VirtqDescriptor* _descriptors = nullptr;
+    VirtqAvailable* _available = nullptr;
+    VirtqUsed* _used = nullptr;
+    uint16_t _lastUsed = 0;
+
+    // Per-request state. Slot i always uses ring descriptor i.
+    PhysicalAddress _slotBase;
+    size_t _slotPages = 0;
+    Slot* _slots = nullptr;
+    estd::vector<uint16_t> _freeSlots;
+
+    Spinlock _lock;
+    estd::shared_ptr<Blocker> _slotAvailable;
+    estd::shared_ptr<Blocker> _completion;
+};